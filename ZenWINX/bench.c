@@ -0,0 +1,78 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file bench.c
+ * @brief Benchmarks support.
+ * @details Benchmarks compare new routines with
+ * the former ones on synthetic data. They share
+ * a seeded generator, so the same seed reproduces
+ * the same data, and the form of the results:
+ * levels of the parameter varying between the
+ * runs, the time taken by each routine on each
+ * level and the number of mismatches.
+ * @addtogroup Benchmarks
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+/**
+ * @brief Seeds the pseudo-random number generator.
+ */
+void winx_rnd_init(winx_rnd_state *r,ULONG seed)
+{
+    r->seed = seed;
+}
+
+/**
+ * @brief Generates a pseudo-random number.
+ * @return A number in range 0 - 32767.
+ */
+ULONG winx_rnd(winx_rnd_state *r)
+{
+    return (((r->seed = r->seed * 214013 + 2531011) >> 16) & 0x7fff);
+}
+
+/**
+ * @brief Generates a wider pseudo-random number.
+ * @return A number in range 0 - 2^30 - 1.
+ */
+ULONG winx_rnd30(winx_rnd_state *r)
+{
+    ULONG high = winx_rnd(r);
+    return (high << 15) | winx_rnd(r);
+}
+
+/**
+ * @brief Prepares the results of a benchmark.
+ * @details Levels are marked as not measured
+ * by the former routine until they get measured.
+ */
+void winx_bench_init(winx_bench *b)
+{
+    ULONG i;
+
+    memset(b,0,sizeof(winx_bench));
+    for(i = 0; i < WINX_BENCH_LEVELS; i++)
+        b->reference_time[i] = WINX_BENCH_SKIPPED;
+}
+
+/** @} */
@@ -0,0 +1,316 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file catalog.c
+ * @brief Catalog of files of a few volumes.
+ * @details Volumes and disk images of the catalog
+ * get scanned at once by a pool of threads, each
+ * thread picks the next volume as soon as its scan
+ * completes. So the scan of a few disks takes about
+ * the time of the slowest one. Each volume keeps its
+ * own list of files, the walk over the catalog tags
+ * the files by the volume they belong to.
+ * @addtogroup Catalog
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+typedef struct _catalog_pool {
+    winx_catalog *c;
+    int flags;                  /* combination of WINX_FTW_xxx flags */
+    winx_mft_cache *records;    /* file records cache shared by the scans */
+    volatile LONG next;         /* the next volume to pick */
+    volatile LONG active;       /* number of threads working */
+    volatile LONG stop;         /* set when termination is requested */
+    ftw_terminator t;           /* checked by the calling thread only */
+    void *user_defined_data;
+} catalog_pool;
+
+/**
+ * @internal
+ * @brief Appends an empty entry to the catalog.
+ * @return The entry, NULL indicates failure.
+ */
+static winx_volume_scan *add_entry(winx_catalog *c)
+{
+    winx_volume_scan *v;
+
+    v = winx_tmalloc((c->n_volumes + 1) * sizeof(winx_volume_scan));
+    if(v == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            (c->n_volumes + 1) * sizeof(winx_volume_scan));
+        return NULL;
+    }
+    if(c->n_volumes)
+        memcpy(v,c->volumes,c->n_volumes * sizeof(winx_volume_scan));
+    memset(&v[c->n_volumes],0,sizeof(winx_volume_scan));
+    winx_free(c->volumes);
+    c->volumes = v;
+    return &v[c->n_volumes ++];
+}
+
+/**
+ * @brief Adds a volume to the catalog.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+int winx_catalog_add_volume(winx_catalog *c,char volume_letter)
+{
+    winx_volume_scan *v;
+
+    DbgCheck2(c,volume_letter,-1);
+
+    v = add_entry(c);
+    if(v == NULL)
+        return (-1);
+    v->volume_letter = winx_toupper(volume_letter);
+    return 0;
+}
+
+/**
+ * @brief Adds a disk image to the catalog.
+ * @param[in] path the native path of the image.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+int winx_catalog_add_image(winx_catalog *c,wchar_t *path)
+{
+    winx_volume_scan *v;
+    wchar_t *s;
+
+    DbgCheck2(c,path,-1);
+
+    s = winx_wcsdup(path);
+    if(s == NULL){
+        etrace("cannot allocate memory for %ws",path);
+        return (-1);
+    }
+    v = add_entry(c);
+    if(v == NULL){
+        winx_free(s);
+        return (-1);
+    }
+    v->path = s;
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Delivers progress of a scan,
+ * stops it when termination is requested.
+ */
+static int catalog_batch(winx_ftw_progress *p,void *user_defined_data)
+{
+    catalog_pool *pool = (catalog_pool *)user_defined_data;
+    return pool->stop ? 1 : 0;
+}
+
+/**
+ * @internal
+ * @brief catalog_batch analog for
+ * the calling thread, which checks
+ * for termination.
+ */
+static int catalog_batch_main(winx_ftw_progress *p,void *user_defined_data)
+{
+    catalog_pool *pool = (catalog_pool *)user_defined_data;
+
+    if(!pool->stop && pool->t){
+        if(pool->t(pool->user_defined_data))
+            pool->stop = 1;
+    }
+    return pool->stop ? 1 : 0;
+}
+
+/**
+ * @internal
+ * @brief Scans the volumes picked from
+ * the pool until they're over.
+ */
+static void catalog_work(catalog_pool *pool,int check_termination)
+{
+    winx_ftw_context ctx;
+    winx_volume_scan *v;
+    winx_file_info *f;
+    LONG i;
+
+    while(!pool->stop){
+        i = InterlockedIncrement(&pool->next) - 1;
+        if(i >= pool->c->n_volumes)
+            break;
+        v = &pool->c->volumes[i];
+
+        memset(&ctx,0,sizeof(ctx));
+        ctx.bcb = check_termination ? catalog_batch_main : catalog_batch;
+        ctx.records = pool->records;
+        if(v->path)
+            v->filelist = winx_scan_image_ex(v->path,pool->flags,NULL,&ctx,pool);
+        else
+            v->filelist = winx_scan_disk_ex(v->volume_letter,pool->flags,NULL,&ctx,pool);
+
+        v->progress = ctx.progress;
+        v->bytes_per_cluster = ctx.bytes_per_cluster;
+        for(f = v->filelist; f; f = f->next){
+            v->files ++;
+            if(f->next == v->filelist) break;
+        }
+        if(ctx.terminated){
+            v->result = -2;
+        } else if(v->filelist == NULL){
+            v->result = -1;
+        }
+    }
+}
+
+static DWORD WINAPI catalog_thread(LPVOID p)
+{
+    catalog_pool *pool = (catalog_pool *)p;
+
+    catalog_work(pool,0);
+    (void)InterlockedDecrement(&pool->active);
+    winx_exit_thread(0);
+    return 0;
+}
+
+/**
+ * @brief Scans all the volumes of the catalog at once.
+ * @param[in,out] c the catalog. Each volume receives
+ * its list of files, progress counters and result code.
+ * @param[in] flags combination of WINX_FTW_xxx flags,
+ * passed to winx_scan_disk_ex and winx_scan_image_ex.
+ * @param[in] n_threads the most threads scanning at
+ * once, the calling thread included; zero selects
+ * WINX_CATALOG_DEFAULT_THREADS.
+ * @param[in] records the file records cache shared
+ * by the scans, NULL selects private caches.
+ * @param[in] t the terminator, called by the
+ * calling thread only. If it returns a nonzero
+ * value, all the scans terminate.
+ * @param[in] user_defined_data data passed to
+ * the terminator.
+ * @return Zero if all the volumes got scanned,
+ * -1 if some of them failed, -2 indicates
+ * termination requested by the caller.
+ * @note Lists of files of the previous scan get released.
+ */
+int winx_scan_catalog(winx_catalog *c,int flags,int n_threads,
+    struct _winx_mft_cache *records,ftw_terminator t,void *user_defined_data)
+{
+    catalog_pool pool;
+    ULONGLONG time;
+    int i, result = 0;
+
+    DbgCheck1(c,-1);
+
+    time = winx_xtime();
+    if(n_threads <= 0)
+        n_threads = WINX_CATALOG_DEFAULT_THREADS;
+    if(n_threads > c->n_volumes)
+        n_threads = c->n_volumes;
+
+    memset(&pool,0,sizeof(pool));
+    pool.c = c;
+    pool.flags = flags;
+    pool.records = records;
+    pool.t = t;
+    pool.user_defined_data = user_defined_data;
+
+    for(i = 0; i < c->n_volumes; i++){
+        winx_ftw_release(c->volumes[i].filelist);
+        c->volumes[i].filelist = NULL;
+        c->volumes[i].files = 0;
+        c->volumes[i].result = 0;
+    }
+
+    /* the calling thread works as well */
+    for(i = 1; i < n_threads; i++){
+        (void)InterlockedIncrement(&pool.active);
+        if(winx_create_thread(catalog_thread,(PVOID)&pool) < 0){
+            (void)InterlockedDecrement(&pool.active);
+            break;
+        }
+    }
+    itrace("scanning %u volumes by %u threads",c->n_volumes,i);
+    catalog_work(&pool,1);
+    while(pool.active){
+        if(!pool.stop && t && t(user_defined_data))
+            pool.stop = 1;
+        winx_sleep(10);
+    }
+
+    c->files = 0;
+    for(i = 0; i < c->n_volumes; i++){
+        /* volumes never picked up */
+        if(pool.stop && c->volumes[i].filelist == NULL && c->volumes[i].result == 0)
+            c->volumes[i].result = -2;
+        if(c->volumes[i].result == -1 && result == 0)
+            result = -1;
+        c->files += c->volumes[i].files;
+    }
+    c->time = winx_xtime() - time;
+    return pool.stop ? (-2) : result;
+}
+
+/**
+ * @brief Walks through the files of all the volumes.
+ * @param[in] cb the callback routine called for each
+ * file with the volume it belongs to; if it returns
+ * a nonzero value, the walk stops.
+ * @return The number of files delivered to the callback.
+ */
+ULONGLONG winx_walk_catalog(winx_catalog *c,catalog_callback cb,void *user_defined_data)
+{
+    winx_file_info *f;
+    ULONGLONG n = 0;
+    int i;
+
+    DbgCheck2(c,cb,0);
+
+    for(i = 0; i < c->n_volumes; i++){
+        for(f = c->volumes[i].filelist; f; f = f->next){
+            n ++;
+            if(cb(&c->volumes[i],f,user_defined_data))
+                return n;
+            if(f->next == c->volumes[i].filelist) break;
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Releases the catalog.
+ */
+void winx_release_catalog(winx_catalog *c)
+{
+    int i;
+
+    if(c == NULL)
+        return;
+    for(i = 0; i < c->n_volumes; i++){
+        winx_ftw_release(c->volumes[i].filelist);
+        winx_free(c->volumes[i].path);
+    }
+    winx_free(c->volumes);
+    memset(c,0,sizeof(winx_catalog));
+}
+
+/** @} */
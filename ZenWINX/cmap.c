@@ -0,0 +1,207 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file cmap.c
+ * @brief Reverse cluster map.
+ * @details The map is an array of all the file
+ * blocks sorted by LCN. Each entry keeps also the
+ * largest end of all the preceding blocks, which
+ * is a nondecreasing sequence, so queries need a
+ * single binary search even when blocks overlap.
+ * Blocks of a long overlapping one, which appear
+ * on damaged volumes only, get scanned through
+ * by queries reaching that block, though.
+ * @addtogroup ClusterMap
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+/**
+ * @internal
+ * @brief Fills max_end fields of the sorted map.
+ */
+void cluster_map_complete(winx_cluster_map *m)
+{
+    ULONGLONG i, max_end = 0;
+
+    for(i = 0; i < m->n_extents; i++){
+        if(m->extents[i].lcn + m->extents[i].length > max_end)
+            max_end = m->extents[i].lcn + m->extents[i].length;
+        m->extents[i].max_end = max_end;
+    }
+}
+
+/**
+ * @internal
+ * @brief Allocates an empty map
+ * for the specified number of extents.
+ */
+winx_cluster_map *cluster_map_alloc(ULONGLONG n_extents)
+{
+    winx_cluster_map *m;
+
+    m = winx_tmalloc(sizeof(winx_cluster_map));
+    if(m == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sizeof(winx_cluster_map));
+        return NULL;
+    }
+    m->n_extents = n_extents;
+    m->extents = NULL;
+    if(n_extents == 0)
+        return m;
+
+    m->extents = winx_tmalloc((size_t)(n_extents * sizeof(winx_cluster_extent)));
+    if(m->extents == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            n_extents * sizeof(winx_cluster_extent));
+        winx_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+/**
+ * @brief Builds the reverse cluster map.
+ * @param[in] filelist the list of files
+ * returned by winx_scan_disk with
+ * WINX_FTW_DUMP_FILES flag set.
+ * @return The map, NULL indicates failure.
+ * @note The map refers to the list entries,
+ * so it must be released before the list.
+ */
+winx_cluster_map *winx_build_cluster_map(winx_file_info *filelist)
+{
+    winx_cluster_map *m;
+    winx_file_info *f;
+    winx_blockmap *b;
+    ULONGLONG n = 0;
+    ULONGLONG time;
+
+    time = winx_xtime();
+
+    /* count the blocks */
+    for(f = filelist; f; f = f->next){
+        for(b = f->disp.blockmap; b; b = b->next){
+            n ++;
+            if(b->next == f->disp.blockmap) break;
+        }
+        if(f->next == filelist) break;
+    }
+
+    m = cluster_map_alloc(n);
+    if(m == NULL)
+        return NULL;
+
+    /* collect the blocks */
+    n = 0;
+    for(f = filelist; f; f = f->next){
+        for(b = f->disp.blockmap; b; b = b->next){
+            m->extents[n].lcn = b->lcn;
+            m->extents[n].length = b->length;
+            m->extents[n].vcn = b->vcn;
+            m->extents[n].f = f;
+            n ++;
+            if(b->next == f->disp.blockmap) break;
+        }
+        if(f->next == filelist) break;
+    }
+
+    if(winx_radix_sort(m->extents,m->n_extents,sizeof(winx_cluster_extent),
+      FIELD_OFFSET(winx_cluster_extent,lcn),0) < 0){
+        winx_release_cluster_map(m);
+        return NULL;
+    }
+    cluster_map_complete(m);
+
+    itrace("%I64u extents indexed in %I64u ms",
+        m->n_extents,winx_xtime() - time);
+    return m;
+}
+
+/**
+ * @brief Enumerates blocks intersecting
+ * the specified range of clusters.
+ * @param[in] m the map.
+ * @param[in] lcn the first cluster of the range.
+ * @param[in] length the length of the range, in clusters.
+ * @param[in] cb the callback routine called for each
+ * block found; if it returns a nonzero value, the
+ * enumeration stops.
+ * @param[in] user_defined_data data passed to the callback.
+ * @return Number of blocks found.
+ * @note The blocks are enumerated in LCN order.
+ * The search takes O(log n + k) time, k being
+ * the number of blocks found, unless blocks overlap.
+ * Otherwise all the blocks from the first one reaching
+ * the range to the end of the range get scanned.
+ */
+ULONGLONG winx_query_cluster_map(winx_cluster_map *m,
+    ULONGLONG lcn,ULONGLONG length,
+    cluster_map_callback cb,void *user_defined_data)
+{
+    ULONGLONG lo, hi, mid;
+    ULONGLONG end, found = 0;
+
+    DbgCheck1(m,0);
+
+    if(length == 0 || m->n_extents == 0)
+        return 0;
+    end = lcn + length;
+
+    /* find the first extent which may reach the range */
+    lo = 0, hi = m->n_extents;
+    while(lo < hi){
+        mid = lo + (hi - lo) / 2;
+        if(m->extents[mid].max_end > lcn)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    for(; lo < m->n_extents; lo++){
+        if(m->extents[lo].lcn >= end) break;
+        if(m->extents[lo].lcn + m->extents[lo].length <= lcn)
+            continue; /* overlapped by a preceding extent */
+        found ++;
+        if(cb != NULL){
+            if(cb(&m->extents[lo],user_defined_data))
+                break;
+        }
+    }
+    return found;
+}
+
+/**
+ * @brief Releases the map built
+ * by winx_build_cluster_map.
+ */
+void winx_release_cluster_map(winx_cluster_map *m)
+{
+    if(m == NULL)
+        return;
+
+    winx_free(m->extents);
+    winx_free(m);
+}
+
+/** @} */
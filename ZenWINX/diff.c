@@ -0,0 +1,306 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file diff.c
+ * @brief Scan results comparison.
+ * @details Streams of both scans are sorted
+ * by MFT index with a radix sort, then both
+ * arrays are walked in parallel. Streams of
+ * the same record are matched by the stream
+ * name, so a file is identified by its MFT
+ * index and sequence number, not by its path:
+ * renamed and moved files are recognized and
+ * paths are never built nor compared.
+ * @addtogroup ScanDiff
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+/**
+ * @internal
+ * @brief Collects the list entries
+ * to an array sorted by MFT index.
+ * @details The sort is stable, so streams
+ * of a file keep their original order.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int sort_files(winx_file_info *filelist,
+    winx_file_info ***files,ULONGLONG *n_files)
+{
+    winx_file_info **a;
+    winx_file_info *f;
+    ULONGLONG i, n = 0;
+
+    *files = NULL, *n_files = 0;
+    for(f = filelist; f; f = f->next){
+        n ++;
+        if(f->next == filelist) break;
+    }
+    if(n == 0)
+        return 0;
+
+    a = winx_tmalloc((size_t)(n * sizeof(winx_file_info *)));
+    if(a == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            n * sizeof(winx_file_info *));
+        return (-1);
+    }
+
+    for(f = filelist, i = 0; f; f = f->next){
+        a[i++] = f;
+        if(f->next == filelist) break;
+    }
+
+    if(winx_radix_sort(a,n,sizeof(winx_file_info *),
+      FIELD_OFFSET(winx_file_info,internal.BaseMftId),WINX_SORT_POINTERS) < 0){
+        winx_free(a);
+        return (-1);
+    }
+
+    *files = a, *n_files = n;
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Returns the stream part
+ * of the name, an empty string
+ * for the default stream.
+ */
+static wchar_t *stream_part(winx_file_info *f)
+{
+    wchar_t *s;
+
+    if(f->name == NULL)
+        return L"";
+    s = wcschr(f->name,':');
+    return s ? s : L"";
+}
+
+/**
+ * @internal
+ * @brief Compares the file part of the names.
+ */
+static int same_file_name(winx_file_info *a,winx_file_info *b)
+{
+    size_t la, lb;
+
+    if(a->name == NULL || b->name == NULL)
+        return (a->name == b->name);
+    la = wcslen(a->name) - wcslen(stream_part(a));
+    lb = wcslen(b->name) - wcslen(stream_part(b));
+    return (la == lb && wcsncmp(a->name,b->name,la) == 0);
+}
+
+/**
+ * @internal
+ * @brief Compares maps of the blocks.
+ */
+static int same_blockmap(winx_file_info *a,winx_file_info *b)
+{
+    winx_blockmap *ba = a->disp.blockmap;
+    winx_blockmap *bb = b->disp.blockmap;
+
+    while(ba && bb){
+        if(ba->vcn != bb->vcn || ba->lcn != bb->lcn || ba->length != bb->length)
+            return 0;
+        ba = (ba->next == a->disp.blockmap) ? NULL : ba->next;
+        bb = (bb->next == b->disp.blockmap) ? NULL : bb->next;
+    }
+    return (ba == NULL && bb == NULL);
+}
+
+/**
+ * @internal
+ * @brief Compares two instances of a stream.
+ * @return A combination of WINX_CHANGE_xxx flags.
+ */
+static int compare_streams(winx_file_info *old_file,winx_file_info *new_file)
+{
+    int changes = 0;
+
+    if(old_file->internal.ParentDirectoryMftId != new_file->internal.ParentDirectoryMftId \
+      || !same_file_name(old_file,new_file))
+        changes |= WINX_CHANGE_RENAMED;
+    if(old_file->disp.size != new_file->disp.size \
+      || old_file->disp.clusters != new_file->disp.clusters)
+        changes |= WINX_CHANGE_RESIZED;
+    if(old_file->creation_time != new_file->creation_time \
+      || old_file->last_modification_time != new_file->last_modification_time)
+        changes |= WINX_CHANGE_RETIMED;
+    if(!same_blockmap(old_file,new_file))
+        changes |= WINX_CHANGE_RELOCATED;
+    return changes;
+}
+
+/**
+ * @internal
+ * @brief Delivers a change to the caller.
+ * @return Nonzero value if the caller
+ * requested the comparison to stop.
+ */
+static int report_change(int changes,winx_file_info *old_file,
+    winx_file_info *new_file,winx_scan_diff_callback cb,void *udd)
+{
+    winx_scan_change c;
+
+    c.changes = changes;
+    c.old_file = old_file;
+    c.new_file = new_file;
+    return cb(&c,udd);
+}
+
+/**
+ * @internal
+ * @brief Compares streams of a single MFT record.
+ * @details Groups are tiny, usually a single
+ * stream, so they're matched by a nested loop.
+ * Matched old streams are cleared in the array.
+ * @return Nonzero value if the comparison
+ * must stop.
+ */
+static int compare_records(winx_file_info **old_files,ULONGLONG n_old,
+    winx_file_info **new_files,ULONGLONG n_new,
+    winx_scan_diff_callback cb,void *udd)
+{
+    winx_file_info *f;
+    ULONGLONG i, j;
+    int changes;
+
+    /* a reused record holds a different file; zero means unknown (old snapshots) */
+    if(old_files[0]->internal.SequenceNumber && new_files[0]->internal.SequenceNumber \
+      && old_files[0]->internal.SequenceNumber != new_files[0]->internal.SequenceNumber){
+        for(i = 0; i < n_old; i++){
+            if(report_change(WINX_CHANGE_DELETED,old_files[i],NULL,cb,udd))
+                return 1;
+        }
+        for(j = 0; j < n_new; j++){
+            if(report_change(WINX_CHANGE_ADDED,NULL,new_files[j],cb,udd))
+                return 1;
+        }
+        return 0;
+    }
+
+    for(j = 0; j < n_new; j++){
+        f = NULL;
+        for(i = 0; i < n_old; i++){
+            if(old_files[i] && wcscmp(stream_part(old_files[i]),
+              stream_part(new_files[j])) == 0){
+                f = old_files[i];
+                old_files[i] = NULL;
+                break;
+            }
+        }
+        if(f == NULL){
+            if(report_change(WINX_CHANGE_ADDED,NULL,new_files[j],cb,udd))
+                return 1;
+            continue;
+        }
+        changes = compare_streams(f,new_files[j]);
+        if(changes){
+            if(report_change(changes,f,new_files[j],cb,udd))
+                return 1;
+        }
+    }
+    for(i = 0; i < n_old; i++){
+        if(old_files[i]){
+            if(report_change(WINX_CHANGE_DELETED,old_files[i],NULL,cb,udd))
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Compares two scans of a volume.
+ * @param[in] old_results the earlier scan.
+ * @param[in] new_results the later scan.
+ * @param[in] cb the callback routine called for
+ * each changed stream; if it returns a nonzero
+ * value, the comparison stops.
+ * @param[in] user_defined_data data passed to the callback.
+ * @return Zero for success, negative
+ * value indicates failure.
+ * @note Both scans must come from the NTFS
+ * scanner, since files are identified by their
+ * MFT indices. Changes are delivered in order
+ * of MFT indices. The comparison takes time
+ * linear in the number of streams.
+ */
+int winx_diff_scan_results(winx_scan_results *old_results,
+    winx_scan_results *new_results,winx_scan_diff_callback cb,
+    void *user_defined_data)
+{
+    winx_file_info **old_files = NULL, **new_files = NULL;
+    ULONGLONG n_old = 0, n_new = 0;
+    ULONGLONG i = 0, j = 0, gi, gj;
+    ULONGLONG old_id, new_id;
+    ULONGLONG time;
+    int result = -1;
+
+    DbgCheck2(old_results,new_results,-1);
+    DbgCheck1(cb,-1);
+
+    time = winx_xtime();
+    if(sort_files(old_results->filelist,&old_files,&n_old) < 0)
+        goto done;
+    if(sort_files(new_results->filelist,&new_files,&n_new) < 0)
+        goto done;
+
+    /* only $MFT has a zero index in scans of the NTFS scanner */
+    if((n_old > 1 && old_files[n_old - 1]->internal.BaseMftId == 0) \
+      || (n_new > 1 && new_files[n_new - 1]->internal.BaseMftId == 0)){
+        etrace("cannot compare scans without MFT indices");
+        goto done;
+    }
+
+    result = 0;
+    while(i < n_old || j < n_new){
+        old_id = (i < n_old) ? old_files[i]->internal.BaseMftId : (ULONGLONG)-1;
+        new_id = (j < n_new) ? new_files[j]->internal.BaseMftId : (ULONGLONG)-1;
+        if(i < n_old && (j == n_new || old_id < new_id)){
+            if(report_change(WINX_CHANGE_DELETED,old_files[i],NULL,cb,user_defined_data))
+                break;
+            i ++;
+        } else if(j < n_new && (i == n_old || new_id < old_id)){
+            if(report_change(WINX_CHANGE_ADDED,NULL,new_files[j],cb,user_defined_data))
+                break;
+            j ++;
+        } else {
+            for(gi = i; gi < n_old && old_files[gi]->internal.BaseMftId == old_id; gi++){}
+            for(gj = j; gj < n_new && new_files[gj]->internal.BaseMftId == new_id; gj++){}
+            if(compare_records(old_files + i,gi - i,new_files + j,gj - j,cb,user_defined_data))
+                break;
+            i = gi, j = gj;
+        }
+    }
+    itrace("%I64u and %I64u streams compared in %I64u ms",
+        n_old,n_new,winx_xtime() - time);
+
+done:
+    winx_free(old_files);
+    winx_free(new_files);
+    return result;
+}
+
+/** @} */
@@ -0,0 +1,358 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file du.c
+ * @brief Disk usage of directories.
+ * @details Clusters of the streams are summed up
+ * over the tree of directories formed by indices
+ * of parent directories, so neither the paths nor
+ * the names take part in the aggregation. All the
+ * steps take time linear in the number of streams:
+ * directories are found through an array indexed
+ * by MFT index, then they're ordered by depth with
+ * a counting sort and the totals are propagated
+ * from the deepest level up to the root.
+ * @addtogroup DiskUsage
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+#include "ntfs.h"
+
+#define DU_NONE        ((ULONG)-1)
+#define DU_IN_PROGRESS ((ULONGLONG)-2)
+#define DU_UNKNOWN     ((ULONGLONG)-1)
+
+/**
+ * @internal
+ * @brief Assigns depths to all the directories.
+ * @details Each directory walks up to the nearest
+ * ancestor of known depth, then walks the same way
+ * again assigning depths, so each directory gets
+ * its depth once. A cycle, which may appear in a
+ * damaged MFT, is broken by attaching the directory
+ * closing it to the root.
+ */
+static void assign_depths(winx_du_results *r)
+{
+    winx_du_dir *d = r->dirs;
+    ULONGLONG i, j, k, depth, steps;
+
+    for(i = 1; i < r->n_dirs; i++)
+        d[i].depth = DU_UNKNOWN;
+    d[0].depth = 0;
+
+    for(i = 1; i < r->n_dirs; i++){
+        if(d[i].depth != DU_UNKNOWN)
+            continue;
+        for(j = i, k = i, steps = 0; d[j].depth == DU_UNKNOWN; k = j, j = d[j].parent, steps++)
+            d[j].depth = DU_IN_PROGRESS;
+        if(d[j].depth == DU_IN_PROGRESS){
+            /* k closes the cycle */
+            etrace("cycle of directories found, mft index = %I64u",
+                d[k].f->internal.BaseMftId);
+            r->orphans ++;
+            d[k].parent = 0;
+            j = 0;
+        }
+        depth = d[j].depth + steps;
+        for(j = i; steps; j = d[j].parent, steps--)
+            d[j].depth = depth --;
+    }
+}
+
+/**
+ * @internal
+ * @brief Propagates the totals up to the root.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int sum_up(winx_du_results *r)
+{
+    winx_du_dir *d = r->dirs;
+    ULONGLONG *count, *order;
+    ULONGLONG i, j, max_depth = 0, sum, c;
+
+    for(i = 0; i < r->n_dirs; i++){
+        if(d[i].depth > max_depth)
+            max_depth = d[i].depth;
+    }
+    count = winx_tmalloc((size_t)((max_depth + 1) * sizeof(ULONGLONG)));
+    order = winx_tmalloc((size_t)(r->n_dirs * sizeof(ULONGLONG)));
+    if(count == NULL || order == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (max_depth + 1 + r->n_dirs) * sizeof(ULONGLONG));
+        winx_free(count);
+        winx_free(order);
+        return (-1);
+    }
+
+    /* counting sort by depth */
+    memset(count,0,(size_t)((max_depth + 1) * sizeof(ULONGLONG)));
+    for(i = 0; i < r->n_dirs; i++)
+        count[d[i].depth] ++;
+    for(i = 0, sum = 0; i <= max_depth; i++){
+        c = count[i]; count[i] = sum; sum += c;
+    }
+    for(i = 0; i < r->n_dirs; i++)
+        order[count[d[i].depth] ++] = i;
+
+    /* the deepest directories go first */
+    for(i = 0; i < r->n_dirs; i++){
+        d[i].total_clusters = d[i].direct_clusters;
+        d[i].total_files = d[i].direct_files;
+    }
+    for(i = r->n_dirs; i > 1; i--){
+        j = order[i - 1];
+        d[d[j].parent].total_clusters += d[j].total_clusters;
+        d[d[j].parent].total_files += d[j].total_files;
+    }
+
+    winx_free(count);
+    winx_free(order);
+    return 0;
+}
+
+/**
+ * @brief Aggregates the disk usage of directories.
+ * @param[in] filelist the list of files produced
+ * by the NTFS scanner with WINX_FTW_DUMP_FILES flag;
+ * WINX_FTW_SKIP_PATHS flag saves time and memory,
+ * since the paths aren't needed.
+ * @param[out] r the results. Directories get both the
+ * direct totals, taken by their files and by their own
+ * streams, and the recursive totals over the subtree.
+ * The root is the first directory; streams whose
+ * parents are missing are attached to the root.
+ * @return Zero for success, negative
+ * value indicates failure.
+ * @note Release the results by winx_du_release.
+ */
+int winx_du_aggregate(winx_file_info *filelist,winx_du_results *r)
+{
+    winx_file_info *f;
+    winx_du_dir *d;
+    ULONG *index;
+    ULONGLONG i, n_dirs = 1, max_id = FILE_root, zero_ids = 0;
+    ULONGLONG parent;
+    ULONGLONG time;
+
+    DbgCheck1(r,-1);
+
+    memset(r,0,sizeof(winx_du_results));
+    time = winx_xtime();
+
+    for(f = filelist; f; f = f->next){
+        if(f->internal.BaseMftId > max_id)
+            max_id = f->internal.BaseMftId;
+        if(f->internal.BaseMftId == 0)
+            zero_ids ++;
+        if(is_directory(f))
+            n_dirs ++;
+        if(f->next == filelist) break;
+    }
+    /* only $MFT has a zero index in scans of the NTFS scanner */
+    if(zero_ids > 1){
+        etrace("cannot aggregate a scan without MFT indices");
+        return (-1);
+    }
+
+    index = winx_tmalloc((size_t)((max_id + 1) * sizeof(ULONG)));
+    d = winx_tmalloc((size_t)(n_dirs * sizeof(winx_du_dir)));
+    if(index == NULL || d == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (max_id + 1) * sizeof(ULONG) + n_dirs * sizeof(winx_du_dir));
+        winx_free(index);
+        winx_free(d);
+        return (-1);
+    }
+    memset(index,0xFF,(size_t)((max_id + 1) * sizeof(ULONG)));
+    memset(d,0,(size_t)(n_dirs * sizeof(winx_du_dir)));
+    r->dirs = d;
+
+    /* the root goes first, even when it's missing in the list */
+    index[FILE_root] = 0;
+    r->n_dirs = 1;
+    for(f = filelist; f; f = f->next){
+        if(is_directory(f)){
+            i = index[f->internal.BaseMftId];
+            if(i == DU_NONE){
+                i = r->n_dirs ++;
+                index[f->internal.BaseMftId] = (ULONG)i;
+            }
+            if(d[i].f == NULL)
+                d[i].f = f;
+        }
+        if(f->next == filelist) break;
+    }
+
+    /* link the directories */
+    for(i = 1; i < r->n_dirs; i++){
+        parent = d[i].f->internal.ParentDirectoryMftId;
+        if(parent <= max_id && index[parent] != DU_NONE){
+            d[i].parent = index[parent];
+        } else {
+            r->orphans ++;
+            d[i].parent = 0;
+        }
+    }
+
+    /* account the streams */
+    for(f = filelist; f; f = f->next){
+        if(is_directory(f)){
+            i = index[f->internal.BaseMftId];
+        } else {
+            parent = f->internal.ParentDirectoryMftId;
+            i = (parent <= max_id) ? index[parent] : DU_NONE;
+            if(i == DU_NONE){
+                r->orphans ++;
+                i = 0;
+            }
+            /* named streams belong to files counted already */
+            if(f->name == NULL || wcschr(f->name,':') == NULL){
+                d[i].direct_files ++;
+                r->files ++;
+            }
+        }
+        d[i].direct_clusters += f->disp.clusters;
+        r->clusters += f->disp.clusters;
+        if(f->next == filelist) break;
+    }
+    winx_free(index);
+
+    assign_depths(r);
+    if(sum_up(r) < 0){
+        winx_du_release(r);
+        return (-1);
+    }
+
+    itrace("%I64u directories aggregated in %I64u ms",
+        r->n_dirs,winx_xtime() - time);
+    return 0;
+}
+
+/**
+ * @brief Selects the largest directories.
+ * @param[in] r the aggregated results.
+ * @param[in] max_depth the deepest level
+ * taken into account, the root is at zero.
+ * @param[out] top array receiving indices
+ * of the directories in descending order
+ * of their recursive totals.
+ * @param[in] n_top the length of the array.
+ * @return The number of directories selected.
+ */
+int winx_du_top(winx_du_results *r,ULONGLONG max_depth,
+    ULONGLONG *top,int n_top)
+{
+    ULONGLONG i, clusters;
+    int n = 0, j;
+
+    DbgCheck2(r,top,0);
+    if(n_top <= 0)
+        return 0;
+
+    /* the list is short, so the insertion is fine */
+    for(i = 0; i < r->n_dirs; i++){
+        if(r->dirs[i].depth > max_depth)
+            continue;
+        clusters = r->dirs[i].total_clusters;
+        if(n == n_top && clusters <= r->dirs[top[n - 1]].total_clusters)
+            continue;
+        j = (n < n_top) ? n ++ : n - 1;
+        for(; j > 0 && r->dirs[top[j - 1]].total_clusters < clusters; j--)
+            top[j] = top[j - 1];
+        top[j] = i;
+    }
+    return n;
+}
+
+/**
+ * @internal
+ * @brief Returns the length of the file
+ * part of the directory name.
+ */
+static size_t du_name_length(winx_du_dir *d)
+{
+    wchar_t *s;
+
+    if(d->f == NULL || d->f->name == NULL)
+        return 0;
+    s = wcschr(d->f->name,':');
+    return s ? (size_t)(s - d->f->name) : wcslen(d->f->name);
+}
+
+/**
+ * @brief Builds the path of a directory.
+ * @param[in] r the aggregated results.
+ * @param[in] i index of the directory.
+ * @param[in] root the path of the root
+ * directory without the trailing
+ * backslash, e.g. \\??\\C:
+ * @return The path, NULL indicates failure.
+ * @note Free the path by winx_free.
+ */
+wchar_t *winx_du_path(winx_du_results *r,ULONGLONG i,wchar_t *root)
+{
+    wchar_t *path;
+    size_t length, n;
+    ULONGLONG j;
+
+    DbgCheck2(r,root,NULL);
+
+    length = wcslen(root) + (i == 0 ? 1 : 0);
+    for(j = i; j != 0; j = r->dirs[j].parent)
+        length += du_name_length(&r->dirs[j]) + 1;
+
+    path = winx_tmalloc((length + 1) * sizeof(wchar_t));
+    if(path == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            (length + 1) * sizeof(wchar_t));
+        return NULL;
+    }
+
+    /* fill the path from its end */
+    path[length] = 0;
+    for(j = i; j != 0; j = r->dirs[j].parent){
+        n = du_name_length(&r->dirs[j]);
+        length -= n;
+        memcpy(path + length,r->dirs[j].f->name,n * sizeof(wchar_t));
+        path[-- length] = '\\';
+    }
+    if(i == 0)
+        path[-- length] = '\\';
+    memcpy(path,root,wcslen(root) * sizeof(wchar_t));
+    return path;
+}
+
+/**
+ * @brief Releases the results
+ * of winx_du_aggregate.
+ */
+void winx_du_release(winx_du_results *r)
+{
+    if(r == NULL)
+        return;
+    winx_free(r->dirs);
+    memset(r,0,sizeof(winx_du_results));
+}
+
+/** @} */
@@ -0,0 +1,666 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file dupes.c
+ * @brief Duplicate files search.
+ * @details Files are grouped by their size first,
+ * files of unique sizes are never read. Then first
+ * and last WINX_DUPES_PARTIAL_SIZE bytes of the rest
+ * get hashed, and only files still looking the same
+ * get hashed entirely. The hash is fast, not
+ * cryptographic, so groups found get confirmed by
+ * comparison of their members byte by byte. Contents
+ * are read directly from the volume through maps of
+ * the files, in LCN order, by a few threads having
+ * own volume handles.
+ * @addtogroup Duplicates
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+/* size of the buffer of each thread */
+#define DUPES_BUFFER_SIZE (1024 * 1024)
+
+/* multipliers of the hash, odd 64-bit constants */
+#define DUPES_HASH_P1 0x9E3779B97F4A7C15ULL
+#define DUPES_HASH_P2 0xC2B2AE3D27D4EB4FULL
+
+typedef struct _dupe_candidate {
+    winx_file_info *f;
+    ULONGLONG size;         /* logical size, in bytes */
+    ULONGLONG lcn;          /* the first cluster, to read files in LCN order */
+    ULONGLONG hash[2];      /* hash of the contents read so far */
+    int complete;           /* nonzero if the partial hash covers the whole file */
+    int failed;             /* nonzero if the file cannot be read or differs from the original */
+    struct _dupe_candidate *original; /* the file to compare with, during the verification */
+} dupe_candidate;
+
+typedef struct _dupes_pool {
+    wchar_t *path;              /* the volume or the image */
+    ULONGLONG bytes_per_cluster;
+    ULONG buffer_size;          /* a multiple of the cluster size */
+    dupe_candidate **items;     /* files to hash, sorted by LCN */
+    LONG n_items;
+    int full;                   /* hash entire contents */
+    int verify;                 /* compare files with their originals instead of hashing */
+    volatile LONG next;         /* the next item to pick */
+    volatile LONG active;       /* number of threads working */
+    volatile LONG stop;         /* set when termination is requested */
+    volatile LONGLONG bytes_read; /* summed up when threads finish */
+    ftw_terminator t;           /* checked by the calling thread only */
+    void *user_defined_data;
+} dupes_pool;
+
+/* a single thread of the pool */
+typedef struct _dupes_worker {
+    dupes_pool *pool;
+    WINX_FILE *f;
+    char *buffer;
+    char *buffer2;              /* contents of originals, during the verification */
+    ULONGLONG bytes_read;
+} dupes_worker;
+
+/* hashing state */
+typedef struct _dupes_hash {
+    ULONGLONG h1, h2;
+    ULONGLONG length;
+} dupes_hash;
+
+/*
+**************************************************
+*                    Hashing
+**************************************************
+*/
+
+/**
+ * @internal
+ * @brief Adds data to the hash.
+ * @details Data are processed in 64-bit words,
+ * so all the portions but the last one must
+ * be multiples of 8 bytes long.
+ * @note The hash is fast, not cryptographic.
+ */
+static void hash_update(dupes_hash *h,const unsigned char *p,size_t n)
+{
+    ULONGLONG w;
+    size_t i;
+
+    h->length += n;
+    for(i = 0; i + sizeof(ULONGLONG) <= n; i += sizeof(ULONGLONG)){
+        memcpy(&w,p + i,sizeof(ULONGLONG));
+        h->h1 = (h->h1 ^ w) * DUPES_HASH_P1;
+        h->h1 ^= h->h1 >> 32;
+        h->h2 = (h->h2 + w) * DUPES_HASH_P2;
+        h->h2 = (h->h2 << 27) | (h->h2 >> 37);
+    }
+    if(i < n){
+        w = 0;
+        memcpy(&w,p + i,n - i);
+        h->h1 = (h->h1 ^ w) * DUPES_HASH_P1;
+        h->h2 = (h->h2 + w) * DUPES_HASH_P2;
+    }
+}
+
+static void hash_final(dupes_hash *h,ULONGLONG *hash)
+{
+    hash[0] = (h->h1 ^ h->length) * DUPES_HASH_P2;
+    hash[0] ^= hash[0] >> 29;
+    hash[1] = (h->h2 ^ h->length) * DUPES_HASH_P1;
+    hash[1] ^= hash[1] >> 31;
+}
+
+/*
+**************************************************
+*                Reading of files
+**************************************************
+*/
+
+/**
+ * @internal
+ * @brief Reads clusters of the volume.
+ * @details winx_fread is used, so partitions
+ * of disk images and virtual disks are read
+ * at their own offsets.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int read_clusters(WINX_FILE *f,ULONGLONG lcn,ULONGLONG n,
+    ULONGLONG bytes_per_cluster,char *buffer)
+{
+    size_t length = (size_t)(n * bytes_per_cluster);
+
+    f->roffset.QuadPart = lcn * bytes_per_cluster;
+    return (winx_fread(buffer,1,length,f) == length) ? 0 : (-1);
+}
+
+/**
+ * @internal
+ * @brief Reads a range of a file.
+ * @details The range must start at a cluster
+ * boundary and fit in the buffer of the thread.
+ * Whole clusters are read, so reads stay aligned
+ * on volumes. Parts of the file missing in its map
+ * (sparse ones, or ones beyond the valid data)
+ * read as zeros.
+ * @param[in,out] b the block to start the search of
+ * the range from, receives the block reached; ranges
+ * must be read in ascending order of offsets.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int read_range(dupes_worker *w,dupe_candidate *c,winx_blockmap **b,
+    ULONGLONG offset,ULONGLONG length,char *buffer)
+{
+    ULONGLONG bpc = w->pool->bytes_per_cluster;
+    ULONGLONG vcn, n, bytes, done = 0;
+
+    while(done < length){
+        vcn = (offset + done) / bpc;
+        n = (length - done + bpc - 1) / bpc;
+
+        /* find the block containing the cluster or the next one */
+        while(*b && (*b)->vcn + (*b)->length <= vcn)
+            *b = ((*b)->next == c->f->disp.blockmap) ? NULL : (*b)->next;
+
+        if(*b == NULL || (*b)->vcn > vcn){
+            /* a gap reads as zeros */
+            if(*b && (*b)->vcn - vcn < n) n = (*b)->vcn - vcn;
+            memset(buffer + done,0,(size_t)(n * bpc));
+        } else {
+            if((*b)->vcn + (*b)->length - vcn < n) n = (*b)->vcn + (*b)->length - vcn;
+            if(read_clusters(w->f,(*b)->lcn + vcn - (*b)->vcn,n,bpc,buffer + done) < 0){
+                etrace("cannot read %ws",c->f->path);
+                return (-1);
+            }
+        }
+        bytes = n * bpc;
+        if(bytes > length - done) bytes = length - done;
+        done += bytes;
+    }
+    w->bytes_read += length;
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Hashes a range of a file.
+ * @details The range must start at a cluster
+ * boundary.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int hash_range(dupes_worker *w,dupe_candidate *c,winx_blockmap **b,
+    ULONGLONG offset,ULONGLONG length,dupes_hash *h)
+{
+    ULONGLONG n;
+
+    while(length){
+        if(w->pool->stop)
+            return (-1);
+        n = min(length,w->pool->buffer_size);
+        if(read_range(w,c,b,offset,n,w->buffer) < 0)
+            return (-1);
+        hash_update(h,(unsigned char *)w->buffer,(size_t)n);
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Hashes a file entirely or its
+ * first and last WINX_DUPES_PARTIAL_SIZE bytes.
+ */
+static void hash_file(dupes_worker *w,dupe_candidate *c)
+{
+    ULONGLONG bpc = w->pool->bytes_per_cluster;
+    winx_blockmap *b = c->f->disp.blockmap;
+    ULONGLONG head, tail;
+    dupes_hash h;
+
+    memset(&h,0,sizeof(h));
+    head = c->size;
+    if(!w->pool->full && head > WINX_DUPES_PARTIAL_SIZE)
+        head = WINX_DUPES_PARTIAL_SIZE;
+    if(hash_range(w,c,&b,0,head,&h) < 0){
+        c->failed = 1;
+        return;
+    }
+    if(head < c->size){
+        /* the tail starts at a cluster boundary too */
+        tail = c->size - WINX_DUPES_PARTIAL_SIZE;
+        tail -= tail % bpc;
+        if(tail < head) tail = head;
+        if(hash_range(w,c,&b,tail,c->size - tail,&h) < 0){
+            c->failed = 1;
+            return;
+        }
+        c->complete = (tail == head);
+    } else {
+        c->complete = 1;
+    }
+    hash_final(&h,c->hash);
+}
+
+/**
+ * @internal
+ * @brief Compares a file with its
+ * original byte by byte.
+ * @details Files differing from their originals
+ * or failed to be read get marked as failed.
+ */
+static void compare_file(dupes_worker *w,dupe_candidate *c)
+{
+    winx_blockmap *b = c->f->disp.blockmap;
+    winx_blockmap *b2 = c->original->f->disp.blockmap;
+    ULONGLONG offset, n;
+
+    for(offset = 0; offset < c->size; offset += n){
+        if(w->pool->stop){
+            c->failed = 1;
+            return;
+        }
+        n = min(c->size - offset,w->pool->buffer_size);
+        if(read_range(w,c,&b,offset,n,w->buffer) < 0 || \
+          read_range(w,c->original,&b2,offset,n,w->buffer2) < 0){
+            c->failed = 1;
+            return;
+        }
+        if(memcmp(w->buffer,w->buffer2,(size_t)n)){
+            itrace("%ws differs from %ws despite the same hash",
+                c->f->path,c->original->f->path);
+            c->failed = 1;
+            return;
+        }
+    }
+}
+
+/*
+**************************************************
+*                  Thread pool
+**************************************************
+*/
+
+/**
+ * @internal
+ * @brief Hashes or compares files picked
+ * from the pool until they're over.
+ * @note Threads failed to start leave
+ * the files to the rest of the pool.
+ */
+static void dupes_work(dupes_pool *pool,int check_termination)
+{
+    dupes_worker w;
+    size_t size;
+    LONG i;
+
+    w.pool = pool;
+    w.bytes_read = 0;
+    w.f = winx_open_image(pool->path);
+    size = pool->verify ? (size_t)pool->buffer_size * 2 : pool->buffer_size;
+    w.buffer = winx_tmalloc(size);
+    if(w.f == NULL || w.buffer == NULL){
+        if(w.buffer == NULL)
+            etrace("cannot allocate %u bytes of memory",size);
+        if(w.f) winx_fclose(w.f);
+        winx_free(w.buffer);
+        return;
+    }
+    w.buffer2 = w.buffer + pool->buffer_size;
+
+    while(!pool->stop){
+        if(check_termination && pool->t){
+            if(pool->t(pool->user_defined_data)){
+                pool->stop = 1;
+                break;
+            }
+        }
+        i = InterlockedIncrement(&pool->next) - 1;
+        if(i >= pool->n_items)
+            break;
+        if(pool->verify)
+            compare_file(&w,pool->items[i]);
+        else
+            hash_file(&w,pool->items[i]);
+    }
+
+    (void)InterlockedExchangeAdd64(&pool->bytes_read,(LONGLONG)w.bytes_read);
+    winx_fclose(w.f);
+    winx_free(w.buffer);
+}
+
+static DWORD WINAPI dupes_thread(LPVOID p)
+{
+    dupes_pool *pool = (dupes_pool *)p;
+
+    dupes_work(pool,0);
+    (void)InterlockedDecrement(&pool->active);
+    winx_exit_thread(0);
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Hashes or compares the files by a few threads.
+ * @details The calling thread works as well and
+ * it's the only one checking for termination.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller.
+ */
+static int run_pool(dupes_pool *pool,int n_threads)
+{
+    int i;
+
+    pool->next = 0;
+    pool->active = 0;
+    for(i = 1; i < n_threads; i++){
+        (void)InterlockedIncrement(&pool->active);
+        if(winx_create_thread(dupes_thread,(PVOID)pool) < 0){
+            (void)InterlockedDecrement(&pool->active);
+            break;
+        }
+    }
+    dupes_work(pool,1);
+    while(pool->active)
+        winx_sleep(10);
+    if(pool->stop)
+        return (-2);
+
+    /* files are left unread when no thread could start */
+    if(pool->next < pool->n_items){
+        etrace("cannot read %ws",pool->path);
+        return (-1);
+    }
+    return 0;
+}
+
+/*
+**************************************************
+*             Sorting and grouping
+**************************************************
+*/
+
+/**
+ * @internal
+ * @brief Sorts candidates by a 64-bit key.
+ * @details The sort is stable, so sorting by
+ * a few keys from the least significant one
+ * gives the lexicographic order.
+ * @param[in] key_offset offset of the key
+ * in the dupe_candidate structure.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int sort_candidates(dupe_candidate **a,ULONGLONG n,size_t key_offset)
+{
+    return winx_radix_sort(a,n,sizeof(dupe_candidate *),
+        key_offset,WINX_SORT_POINTERS);
+}
+
+/* sorts candidates by size, then by hash */
+static int sort_by_contents(dupe_candidate **a,ULONGLONG n)
+{
+    if(sort_candidates(a,n,FIELD_OFFSET(dupe_candidate,hash[1])) < 0)
+        return (-1);
+    if(sort_candidates(a,n,FIELD_OFFSET(dupe_candidate,hash[0])) < 0)
+        return (-1);
+    return sort_candidates(a,n,FIELD_OFFSET(dupe_candidate,size));
+}
+
+static int same_contents(dupe_candidate *a,dupe_candidate *b,int by_hash)
+{
+    if(a->size != b->size)
+        return 0;
+    if(!by_hash)
+        return 1;
+    return (a->hash[0] == b->hash[0] && a->hash[1] == b->hash[1]);
+}
+
+/**
+ * @internal
+ * @brief Removes candidates having no
+ * companions of the same contents.
+ * @details The array must be sorted by
+ * size, then by hash when by_hash is set.
+ * Files failed to be read get removed too.
+ * @return Number of remaining candidates.
+ */
+static ULONGLONG drop_unique(dupe_candidate **a,ULONGLONG n,int by_hash)
+{
+    ULONGLONG i, j, k = 0;
+
+    for(i = 0; i < n; i++){
+        if(!a[i]->failed) a[k++] = a[i];
+    }
+    n = k, k = 0;
+
+    for(i = 0; i < n; i = j){
+        for(j = i + 1; j < n && same_contents(a[i],a[j],by_hash); j++){}
+        if(j - i > 1){
+            for(; i < j; i++)
+                a[k++] = a[i];
+        }
+    }
+    return k;
+}
+
+/**
+ * @internal
+ * @brief Decides whether a file
+ * takes part in the search.
+ */
+static int is_candidate(winx_file_info *f,ULONGLONG min_size)
+{
+    if(f->flags & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT))
+        return 0;
+    /* raw clusters of compressed and encrypted files differ from their contents */
+    if(f->flags & (FILE_ATTRIBUTE_COMPRESSED | FILE_ATTRIBUTE_ENCRYPTED))
+        return 0;
+    /* alternate streams are no files */
+    if(f->name == NULL || wcschr(f->name,':'))
+        return 0;
+    /* resident files have no clusters to be read */
+    if(f->disp.blockmap == NULL)
+        return 0;
+    return (f->disp.size && f->disp.size >= min_size);
+}
+
+/**
+ * @brief Searches for duplicate files.
+ * @param[in] path the native path of the volume
+ * or of the disk image which has been scanned.
+ * @param[in] bytes_per_cluster the cluster size.
+ * @param[in] filelist the list of files returned by
+ * winx_scan_disk_ex or winx_scan_image_ex with
+ * WINX_FTW_DUMP_FILES flag set.
+ * @param[in] min_size the minimum size
+ * of files to be compared, in bytes.
+ * @param[in] n_threads number of threads reading
+ * files, zero selects WINX_DUPES_DEFAULT_THREADS.
+ * @param[in] cb the callback routine called for each
+ * group of duplicates; if it returns a nonzero value,
+ * the search stops.
+ * @param[in] t the termination callback, may be NULL.
+ * @param[in] user_defined_data data passed to the callbacks.
+ * @param[out] stats receives statistics of the search.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller.
+ * @note
+ * - Groups are delivered in order of file sizes.
+ * - Resident, compressed and encrypted files as well
+ *   as alternate data streams are skipped.
+ * - Files are grouped by 128-bit hashes of their
+ *   contents, then members of each group get compared
+ *   with its first file byte by byte. Files differing
+ *   from it are left out of the group.
+ */
+int winx_find_duplicates(wchar_t *path,ULONGLONG bytes_per_cluster,
+    winx_file_info *filelist,ULONGLONG min_size,int n_threads,
+    winx_dupes_callback cb,ftw_terminator t,void *user_defined_data,
+    winx_dupes_stats *stats)
+{
+    dupe_candidate *c = NULL, **a = NULL, **items = NULL;
+    winx_dupes_group g;
+    winx_file_info *f;
+    dupes_pool pool;
+    ULONGLONG n = 0, i, j, k, n_items;
+    ULONGLONG time;
+    int result = -1;
+
+    DbgCheck3(path,cb,stats,-1);
+    DbgCheck1(bytes_per_cluster,-1);
+
+    memset(stats,0,sizeof(winx_dupes_stats));
+    if(n_threads <= 0)
+        n_threads = WINX_DUPES_DEFAULT_THREADS;
+    time = winx_xtime();
+
+    /* collect the candidates */
+    for(f = filelist; f; f = f->next){
+        if(is_candidate(f,min_size)) n ++;
+        if(f->next == filelist) break;
+    }
+    stats->files = n;
+    if(n < 2)
+        return 0;
+
+    c = winx_tmalloc((size_t)(n * sizeof(dupe_candidate)));
+    a = winx_tmalloc((size_t)(n * sizeof(dupe_candidate *)));
+    items = winx_tmalloc((size_t)(n * sizeof(dupe_candidate *)));
+    if(c == NULL || a == NULL || items == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            n * (sizeof(dupe_candidate) + 2 * sizeof(dupe_candidate *)));
+        goto done;
+    }
+    memset(c,0,(size_t)(n * sizeof(dupe_candidate)));
+    for(f = filelist, i = 0; f; f = f->next){
+        if(is_candidate(f,min_size)){
+            c[i].f = f;
+            c[i].size = f->disp.size;
+            c[i].lcn = f->disp.blockmap->lcn;
+            a[i] = &c[i];
+            i ++;
+        }
+        if(f->next == filelist) break;
+    }
+
+    /* files of unique sizes cannot have duplicates */
+    if(sort_candidates(a,n,FIELD_OFFSET(dupe_candidate,size)) < 0)
+        goto done;
+    n = drop_unique(a,n,0);
+    stats->same_size = n;
+
+    /* hash heads and tails in LCN order */
+    memset(&pool,0,sizeof(pool));
+    pool.path = path;
+    pool.bytes_per_cluster = bytes_per_cluster;
+    pool.buffer_size = DUPES_BUFFER_SIZE;
+    if(bytes_per_cluster > DUPES_BUFFER_SIZE)
+        pool.buffer_size = (ULONG)bytes_per_cluster;
+    pool.buffer_size -= (ULONG)(pool.buffer_size % bytes_per_cluster);
+    pool.items = items;
+    pool.t = t;
+    pool.user_defined_data = user_defined_data;
+    memcpy(items,a,(size_t)(n * sizeof(dupe_candidate *)));
+    if(sort_candidates(items,n,FIELD_OFFSET(dupe_candidate,lcn)) < 0)
+        goto done;
+    pool.n_items = (LONG)n;
+    result = run_pool(&pool,n_threads);
+    stats->bytes_read = pool.bytes_read;
+    if(result < 0)
+        goto done;
+    result = -1;
+
+    if(sort_by_contents(a,n) < 0)
+        goto done;
+    n = drop_unique(a,n,1);
+    stats->same_partial_hash = n;
+
+    /* hash the rest entirely */
+    for(i = 0, n_items = 0; i < n; i++){
+        if(!a[i]->complete) items[n_items++] = a[i];
+    }
+    stats->hashed_entirely = n_items;
+    if(n_items){
+        if(sort_candidates(items,n_items,FIELD_OFFSET(dupe_candidate,lcn)) < 0)
+            goto done;
+        pool.full = 1;
+        pool.n_items = (LONG)n_items;
+        result = run_pool(&pool,n_threads);
+        stats->bytes_read = pool.bytes_read;
+        if(result < 0)
+            goto done;
+        result = -1;
+        if(sort_by_contents(a,n) < 0)
+            goto done;
+        n = drop_unique(a,n,1);
+    }
+
+    /* confirm the groups byte by byte */
+    for(i = 0, n_items = 0; i < n; i = j){
+        for(j = i + 1; j < n && same_contents(a[i],a[j],1); j++){
+            a[j]->original = a[i];
+            items[n_items++] = a[j];
+        }
+    }
+    if(n_items){
+        if(sort_candidates(items,n_items,FIELD_OFFSET(dupe_candidate,lcn)) < 0)
+            goto done;
+        pool.verify = 1;
+        pool.n_items = (LONG)n_items;
+        result = run_pool(&pool,n_threads);
+        stats->bytes_read = pool.bytes_read;
+        if(result < 0)
+            goto done;
+        result = -1;
+        n = drop_unique(a,n,1);
+    }
+
+    /* report the groups, reusing the items array */
+    for(i = 0; i < n; i = j){
+        for(j = i + 1; j < n && same_contents(a[i],a[j],1); j++){}
+        for(k = i; k < j; k++)
+            ((winx_file_info **)items)[k - i] = a[k]->f;
+        g.size = a[i]->size;
+        g.n_files = j - i;
+        g.files = (winx_file_info **)items;
+        g.wasted = g.size * (g.n_files - 1);
+        stats->groups ++;
+        stats->duplicates += g.n_files - 1;
+        stats->wasted += g.wasted;
+        if(cb(&g,user_defined_data))
+            break;
+    }
+    result = 0;
+
+    itrace("%I64u groups of duplicates found in %I64u ms",
+        stats->groups,winx_xtime() - time);
+
+done:
+    winx_free(c);
+    winx_free(a);
+    winx_free(items);
+    return result;
+}
+
+/** @} */
@@ -104,6 +104,9 @@ WINX_FILE *winx_fopen(const wchar_t *filename,const char *mode)
     f->io_buffer_size = 0;
     f->io_buffer_offset = 0;
     f->wboffset.QuadPart = 0;
+    f->base.QuadPart = 0;
+    f->length = 0;
+    f->vdisk = NULL;
     return f;
 }
 
@@ -147,11 +150,26 @@ size_t winx_fread(void *buffer,size_t size,size_t count,WINX_FILE *f)
 {
     NTSTATUS status;
     IO_STATUS_BLOCK iosb;
+    LARGE_INTEGER offset;
+    ULONG n;
     
     DbgCheck2(buffer,f,0);
 
+    /* partitions are read within their bounds */
+    offset.QuadPart = f->roffset.QuadPart + f->base.QuadPart;
+    if(f->length){
+        if((ULONGLONG)f->roffset.QuadPart >= f->length)
+            return 0;
+        if(size * count > f->length - f->roffset.QuadPart)
+            count = (size_t)((f->length - f->roffset.QuadPart) / size);
+    }
+    if(f->vdisk){
+        n = winx_vdisk_read(f->vdisk,offset.QuadPart,buffer,(ULONG)(size * count));
+        f->roffset.QuadPart += n;
+        return (n / size);
+    }
     status = NtReadFile(f->hFile,NULL,NULL,NULL,&iosb,
-             buffer,size * count,&f->roffset,NULL);
+             buffer,size * count,&offset,NULL);
     if(NT_SUCCESS(status)){
         status = NtWaitForSingleObject(f->hFile,FALSE,NULL);
         if(NT_SUCCESS(status)) status = iosb.Status;
@@ -348,6 +366,10 @@ ULONGLONG winx_fsize(WINX_FILE *f)
 
     DbgCheck1(f,0);
 
+    if(f->length)
+        return f->length;
+    if(f->vdisk)
+        return winx_vdisk_size(f->vdisk);
     memset(&fsi,0,sizeof(FILE_STANDARD_INFORMATION));
     status = NtQueryInformationFile(f->hFile,&iosb,
         &fsi,sizeof(FILE_STANDARD_INFORMATION),
@@ -374,6 +396,7 @@ void winx_fclose(WINX_FILE *f)
         winx_free(f->io_buffer);
     }
 
+    if(f->vdisk) winx_vdisk_close(f->vdisk);
     if(f->hFile) NtClose(f->hFile);
     winx_free(f);
 }
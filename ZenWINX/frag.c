@@ -0,0 +1,313 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file frag.c
+ * @brief Fragmentation analytics.
+ * @details The statistics are gathered by the disk
+ * scanners on the fly, while maps of file blocks are
+ * being built, so the report needs no second pass
+ * over the list of files.
+ * @addtogroup Fragmentation
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+/**
+ * @internal
+ * @brief Returns the histogram bucket
+ * for n fragments (or n clusters).
+ * @details Bucket 0 holds 1, bucket i holds
+ * values in range (2^(i-1), 2^i], the last
+ * bucket is open-ended.
+ */
+static int frag_bucket(ULONGLONG n)
+{
+    int i;
+
+    for(i = 0; n > 1 && i < WINX_FRAG_BUCKETS - 1; i++)
+        n = (n + 1) >> 1;
+    return i;
+}
+
+/**
+ * @internal
+ * @brief Restores the heap property
+ * moving the i-th entry to the top.
+ */
+static void frag_heap_sift_up(winx_frag_file *h,int i)
+{
+    winx_frag_file tmp;
+    int parent;
+
+    while(i > 0){
+        parent = (i - 1) / 2;
+        if(h[parent].fragments <= h[i].fragments) break;
+        tmp = h[parent]; h[parent] = h[i]; h[i] = tmp;
+        i = parent;
+    }
+}
+
+/**
+ * @internal
+ * @brief Restores the heap property
+ * moving the i-th entry to the bottom.
+ */
+static void frag_heap_sift_down(winx_frag_file *h,int n,int i)
+{
+    winx_frag_file tmp;
+    int child;
+
+    for(;;){
+        child = 2 * i + 1;
+        if(child >= n) break;
+        if(child + 1 < n && h[child + 1].fragments < h[child].fragments)
+            child ++;
+        if(h[i].fragments <= h[child].fragments) break;
+        tmp = h[child]; h[child] = h[i]; h[i] = tmp;
+        i = child;
+    }
+}
+
+/**
+ * @internal
+ * @brief Resets the statistics before the scan.
+ * @details Keeps the settings made by the caller.
+ */
+void frag_stats_reset(winx_frag_stats *fs)
+{
+    int top_n;
+
+    if(fs == NULL)
+        return;
+
+    top_n = fs->top_n;
+    if(top_n <= 0)
+        top_n = WINX_FRAG_DEFAULT_TOP;
+    if(top_n > WINX_FRAG_MAX_TOP)
+        top_n = WINX_FRAG_MAX_TOP;
+    memset(fs,0,sizeof(winx_frag_stats));
+    fs->top_n = top_n;
+}
+
+/**
+ * @internal
+ * @brief Accounts a single run just added to the map of the file.
+ * @param[in,out] fs the statistics.
+ * @param[in] f the file; its disposition must be already updated.
+ * @param[in] length the length of the run, in clusters.
+ * @param[in] new_fragment nonzero value indicates that the run
+ * has started a new fragment of the file.
+ * @note This routine is called for each run found
+ * by the scanner, so it must be as fast as possible.
+ */
+void frag_stats_add_run(winx_frag_stats *fs,winx_file_info *f,
+    ULONGLONG length,int new_fragment)
+{
+    ULONGLONG n;
+    int b;
+
+    fs->clusters += length;
+    if(new_fragment){
+        n = f->disp.fragments;
+        fs->fragments ++;
+        if(n == 1){
+            fs->files ++;
+            fs->histogram[0] ++;
+        } else {
+            /* when n - 1 is a power of two the file moves to the next bucket */
+            if(((n - 1) & (n - 2)) == 0){
+                b = frag_bucket(n - 1);
+                if(b < WINX_FRAG_BUCKETS - 1){
+                    fs->histogram[b] --;
+                    fs->histogram[b + 1] ++;
+                }
+            }
+            if(n == 2){
+                /* the file has just become fragmented */
+                fs->fragmented_files ++;
+                fs->fragmented_clusters += f->disp.clusters;
+                return;
+            }
+        }
+    }
+    if(f->disp.fragments > 1)
+        fs->fragmented_clusters += length;
+}
+
+/**
+ * @internal
+ * @brief Offers a file to the list of the most fragmented files.
+ * @details Must be called once, when the map of the file is complete.
+ * The list is a bounded min-heap, so each call costs O(log N).
+ */
+void frag_stats_commit_file(winx_frag_stats *fs,winx_file_info *f)
+{
+    winx_frag_file *h = fs->top;
+
+    if(f->disp.fragments < 2)
+        return;
+
+    if(fs->n_top < fs->top_n){
+        h[fs->n_top].fragments = f->disp.fragments;
+        h[fs->n_top].clusters = f->disp.clusters;
+        h[fs->n_top].f = f;
+        frag_heap_sift_up(h,fs->n_top);
+        fs->n_top ++;
+    } else if(f->disp.fragments > h[0].fragments){
+        h[0].fragments = f->disp.fragments;
+        h[0].clusters = f->disp.clusters;
+        h[0].f = f;
+        frag_heap_sift_down(h,fs->n_top,0);
+    }
+}
+
+/**
+ * @internal
+ * @brief Accounts a file which map
+ * has been retrieved entirely at once.
+ */
+void frag_stats_add_file(winx_frag_stats *fs,winx_file_info *f)
+{
+    if(f->disp.fragments == 0)
+        return;
+
+    fs->files ++;
+    fs->fragments += f->disp.fragments;
+    fs->clusters += f->disp.clusters;
+    fs->histogram[frag_bucket(f->disp.fragments)] ++;
+    if(f->disp.fragments > 1){
+        fs->fragmented_files ++;
+        fs->fragmented_clusters += f->disp.clusters;
+    }
+    frag_stats_commit_file(fs,f);
+}
+
+/**
+ * @internal
+ * @brief Withdraws a file removed from the list of files.
+ * @details Removals are rare, so the linear search
+ * through the list of the most fragmented files is fine.
+ */
+void frag_stats_remove_file(winx_frag_stats *fs,winx_file_info *f)
+{
+    int i;
+
+    if(f->disp.fragments == 0)
+        return;
+
+    fs->files --;
+    fs->fragments -= f->disp.fragments;
+    fs->clusters -= f->disp.clusters;
+    fs->histogram[frag_bucket(f->disp.fragments)] --;
+    if(f->disp.fragments > 1){
+        fs->fragmented_files --;
+        fs->fragmented_clusters -= f->disp.clusters;
+    }
+
+    for(i = 0; i < fs->n_top; i++){
+        if(fs->top[i].f == f){
+            fs->n_top --;
+            if(i < fs->n_top){
+                fs->top[i] = fs->top[fs->n_top];
+                frag_heap_sift_down(fs->top,fs->n_top,i);
+                frag_heap_sift_up(fs->top,i);
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * @internal
+ * @brief Accounts a free region in the
+ * free space fragmentation summary.
+ * @param[in] length the length of the region, in clusters.
+ */
+void frag_stats_add_free_region(winx_frag_stats *fs,ULONGLONG length)
+{
+    fs->free_regions ++;
+    fs->free_clusters += length;
+    if(length > fs->largest_free_region)
+        fs->largest_free_region = length;
+    fs->free_histogram[frag_bucket(length)] ++;
+}
+
+/**
+ * @internal
+ * @brief winx_get_free_volume_regions callback
+ * accumulating the free space fragmentation summary.
+ */
+static int free_region_callback(winx_volume_region *rgn,void *user_defined_data)
+{
+    frag_stats_add_free_region((winx_frag_stats *)user_defined_data,rgn->length);
+    return 0;
+}
+
+/**
+ * @brief Gathers the free space fragmentation summary.
+ * @param[in] volume_letter the volume letter.
+ * @param[in,out] fs the statistics to be updated.
+ * @return Zero for success, a negative value otherwise.
+ * @note The volume bitmap is tiny in comparison
+ * with the MFT, so the summary costs nearly nothing.
+ */
+int winx_get_free_space_stats(char volume_letter,winx_frag_stats *fs)
+{
+    winx_volume_region *rlist;
+
+    DbgCheck1(fs,-1);
+
+    fs->free_regions = 0;
+    fs->free_clusters = 0;
+    fs->largest_free_region = 0;
+    memset(fs->free_histogram,0,sizeof(fs->free_histogram));
+
+    rlist = winx_get_free_volume_regions(volume_letter,
+        WINX_GVR_ALLOW_PARTIAL_SCAN,free_region_callback,(void *)fs);
+    winx_release_free_volume_regions(rlist);
+    return 0;
+}
+
+/**
+ * @brief Sorts the list of the most fragmented
+ * files in descending order of fragments.
+ * @note The list is not a heap anymore after this
+ * call, so call it once, when the scan completes.
+ */
+void winx_frag_stats_sort(winx_frag_stats *fs)
+{
+    winx_frag_file tmp;
+    int i, j;
+
+    if(fs == NULL)
+        return;
+
+    /* the list is short, so the insertion sort is fine */
+    for(i = 1; i < fs->n_top; i++){
+        tmp = fs->top[i];
+        for(j = i; j > 0 && fs->top[j - 1].fragments < tmp.fragments; j--)
+            fs->top[j] = fs->top[j - 1];
+        fs->top[j] = tmp;
+    }
+}
+
+/** @} */
@@ -0,0 +1,387 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file fsprobe.c
+ * @brief File systems recognized by their first sectors.
+ * @details Boot sectors of NTFS, FAT, exFAT and ReFS,
+ * volume descriptors of ISO 9660 and the volume recognition
+ * sequence of UDF get checked, so the file system of a disk
+ * image or of a volume unknown to the system is known
+ * without a mount. Only a few sectors get read, all of
+ * them at offsets and of sizes aligned to 4KB, so volumes
+ * of any sector size can be probed as well as files.
+ * @addtogroup Disks
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+/* the boot sector, read along with its neighbours */
+#define PROBE_BOOT_SIZE      4096
+
+/* ISO 9660 and UDF descriptors */
+#define PROBE_VRS_OFFSET     (16 * 2048)
+#define PROBE_VRS_SIZE       (16 * 4096)
+#define PROBE_ANCHOR_SECTOR  256
+#define PROBE_ANCHOR_TAG     2
+
+/* boot sector fields */
+#define BS_OEM_ID            3
+#define BS_BYTES_PER_SECTOR  11
+#define BS_SECTORS_PER_CLUSTER 13
+#define BS_SIGNATURE         510
+
+#define get_u16(p) ((ULONG)((UCHAR *)(p))[0] | ((ULONG)((UCHAR *)(p))[1] << 8))
+#define get_u32(p) (get_u16(p) | (get_u16((UCHAR *)(p) + 2) << 16))
+#define get_u64(p) ((ULONGLONG)get_u32(p) | ((ULONGLONG)get_u32((UCHAR *)(p) + 4) << 32))
+
+/*
+**************************************************************
+*                    Low level routines
+**************************************************************
+*/
+
+/**
+ * @internal
+ * @brief Reads a range of the volume.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int read_range(WINX_FILE *f,ULONGLONG offset,void *buffer,ULONG length)
+{
+    f->roffset.QuadPart = offset;
+    return (winx_fread(buffer,1,length,f) == length) ? 0 : (-1);
+}
+
+/**
+ * @internal
+ * @brief Checks whether the number is
+ * a power of two within limits.
+ */
+static int is_power_of_two(ULONGLONG n,ULONGLONG min,ULONGLONG max)
+{
+    if(n < min || n > max)
+        return 0;
+    return (n & (n - 1)) ? 0 : 1;
+}
+
+/**
+ * @internal
+ * @brief Fills the geometry of the volume.
+ */
+static void set_geometry(winx_fs_probe *p,ULONG bytes_per_sector,
+    ULONG sectors_per_cluster,ULONGLONG total_clusters)
+{
+    p->bytes_per_sector = bytes_per_sector;
+    p->sectors_per_cluster = sectors_per_cluster;
+    p->bytes_per_cluster = (ULONGLONG)bytes_per_sector * sectors_per_cluster;
+    p->total_clusters = total_clusters;
+    p->total_bytes = total_clusters * p->bytes_per_cluster;
+}
+
+/*
+**************************************************************
+*                    Boot sectors
+**************************************************************
+*/
+
+/**
+ * @internal
+ * @brief Checks an NTFS boot sector.
+ * @return Nonzero value if it is NTFS.
+ */
+static int probe_ntfs(UCHAR *bs,winx_fs_probe *p)
+{
+    ULONG bps, spc;
+    ULONGLONG sectors;
+
+    if(memcmp(bs + BS_OEM_ID,"NTFS    ",8) || get_u16(bs + BS_SIGNATURE) != 0xAA55)
+        return 0;
+    bps = get_u16(bs + BS_BYTES_PER_SECTOR);
+    spc = bs[BS_SECTORS_PER_CLUSTER];
+    /* large clusters are stored as negative powers of two */
+    if(spc > 0x80) spc = 1 << (256 - spc);
+    sectors = get_u64(bs + 40);
+    if(!is_power_of_two(bps,512,4096) || !is_power_of_two(spc,1,65536) || sectors == 0)
+        return 0;
+    p->type = WINX_FS_NTFS;
+    strcpy(p->fs_name,"NTFS");
+    set_geometry(p,bps,spc,sectors / spc);
+    p->serial_number = get_u64(bs + 72);
+    return 1;
+}
+
+/**
+ * @internal
+ * @brief Checks an exFAT boot sector.
+ * @return Nonzero value if it is exFAT.
+ */
+static int probe_exfat(UCHAR *bs,winx_fs_probe *p)
+{
+    ULONG bps_shift, spc_shift, clusters;
+
+    if(memcmp(bs + BS_OEM_ID,"EXFAT   ",8) || get_u16(bs + BS_SIGNATURE) != 0xAA55)
+        return 0;
+    bps_shift = bs[108];
+    spc_shift = bs[109];
+    clusters = get_u32(bs + 92);
+    if(bps_shift < 9 || bps_shift > 12 || bps_shift + spc_shift > 25 || clusters == 0)
+        return 0;
+    p->type = WINX_FS_EXFAT;
+    strcpy(p->fs_name,"exFAT");
+    set_geometry(p,1 << bps_shift,1 << spc_shift,clusters);
+    p->serial_number = get_u32(bs + 100);
+    return 1;
+}
+
+/**
+ * @internal
+ * @brief Checks a ReFS boot sector.
+ * @return Nonzero value if it is ReFS.
+ */
+static int probe_refs(UCHAR *bs,winx_fs_probe *p)
+{
+    ULONG bps, spc;
+    ULONGLONG sectors;
+
+    if(memcmp(bs + BS_OEM_ID,"ReFS\0\0\0\0",8) || memcmp(bs + 16,"FSRS",4))
+        return 0;
+    sectors = get_u64(bs + 24);
+    bps = get_u32(bs + 32);
+    spc = get_u32(bs + 36);
+    if(!is_power_of_two(bps,512,4096) || !is_power_of_two(spc,1,65536) || sectors == 0)
+        return 0;
+    p->type = WINX_FS_REFS;
+    strcpy(p->fs_name,"ReFS");
+    set_geometry(p,bps,spc,sectors / spc);
+    p->serial_number = get_u64(bs + 56);
+    return 1;
+}
+
+/**
+ * @internal
+ * @brief Checks a FAT boot sector.
+ * @details The type of FAT is defined by
+ * the number of clusters, as the specification
+ * demands, not by the name stored in the sector.
+ * @return Nonzero value if it is FAT.
+ */
+static int probe_fat(UCHAR *bs,winx_fs_probe *p)
+{
+    ULONG bps, spc, reserved, fats, root_entries;
+    ULONG total, fat_size, root_sectors, meta, clusters;
+
+    if(!(bs[0] == 0xEB && bs[2] == 0x90) && bs[0] != 0xE9)
+        return 0;
+    bps = get_u16(bs + BS_BYTES_PER_SECTOR);
+    spc = bs[BS_SECTORS_PER_CLUSTER];
+    reserved = get_u16(bs + 14);
+    fats = bs[16];
+    root_entries = get_u16(bs + 17);
+    total = get_u16(bs + 19);
+    if(total == 0) total = get_u32(bs + 32);
+    fat_size = get_u16(bs + 22);
+    if(fat_size == 0) fat_size = get_u32(bs + 36);
+    if(!is_power_of_two(bps,512,4096) || !is_power_of_two(spc,1,128)
+      || reserved == 0 || fats == 0 || fats > 4 || fat_size == 0 || fat_size > total)
+        return 0;
+    root_sectors = (root_entries * 32 + bps - 1) / bps;
+    meta = reserved + fats * fat_size + root_sectors;
+    if(total <= meta)
+        return 0;
+    clusters = (total - meta) / spc;
+    if(clusters == 0)
+        return 0;
+
+    if(clusters < 4085){
+        p->type = WINX_FS_FAT12;
+    } else if(clusters < 65525){
+        p->type = WINX_FS_FAT16;
+    } else {
+        /* FAT32 has no fixed root directory */
+        if(root_entries) return 0;
+        p->type = WINX_FS_FAT32;
+    }
+    /* the names winx_get_volume_information reports */
+    strcpy(p->fs_name,(p->type == WINX_FS_FAT32) ? "FAT32" : "FAT");
+    set_geometry(p,bps,spc,clusters);
+    if(p->type == WINX_FS_FAT32){
+        if(bs[66] == 0x29) p->serial_number = get_u32(bs + 67);
+    } else {
+        if(bs[38] == 0x29) p->serial_number = get_u32(bs + 39);
+    }
+    return 1;
+}
+
+/*
+**************************************************************
+*                    Optical disc file systems
+**************************************************************
+*/
+
+/**
+ * @internal
+ * @brief Locates the anchor of UDF.
+ * @return The sector size, zero if
+ * the anchor cannot be found.
+ */
+static ULONG find_udf_anchor(WINX_FILE *f,UCHAR *buffer)
+{
+    ULONG sizes[] = { 2048, 512, 4096 };
+    int i;
+
+    for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++){
+        if(read_range(f,(ULONGLONG)PROBE_ANCHOR_SECTOR * sizes[i],buffer,PROBE_BOOT_SIZE) < 0)
+            continue;
+        /* the tag identifies the descriptor and its location */
+        if(get_u16(buffer) == PROBE_ANCHOR_TAG && get_u32(buffer + 12) == PROBE_ANCHOR_SECTOR)
+            return sizes[i];
+    }
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Checks the volume recognition sequence.
+ * @details ISO 9660 and UDF share it; UDF is
+ * preferred when both are there, as Windows does.
+ * Descriptors take 2KB, or a sector when
+ * sectors are larger.
+ * @return Nonzero value if either is found.
+ */
+static int probe_optical(WINX_FILE *f,UCHAR *buffer,UCHAR *vrs,winx_fs_probe *p)
+{
+    ULONG strides[] = { 2048, 4096 };
+    ULONG stride, i, bs = 0, blocks = 0;
+    UCHAR *d;
+    int s, udf = 0, iso = 0;
+
+    for(s = 0; s < 2 && !udf; s++){
+        stride = strides[s];
+        for(i = 0; i < PROBE_VRS_SIZE / stride; i++){
+            d = vrs + i * stride;
+            if(!memcmp(d + 1,"CD001",5)){
+                /* the primary volume descriptor holds the geometry */
+                if(d[0] == 1 && !iso && s == 0){
+                    bs = get_u16(d + 128);
+                    blocks = get_u32(d + 80);
+                    iso = is_power_of_two(bs,512,4096) && blocks;
+                }
+            } else if(!memcmp(d + 1,"NSR02",5) || !memcmp(d + 1,"NSR03",5)){
+                udf = 1;
+            } else if(memcmp(d + 1,"BEA01",5) && memcmp(d + 1,"BOOT2",5)
+              && memcmp(d + 1,"CDW02",5) && memcmp(d + 1,"TEA01",5)){
+                /* the sequence ends at the first unknown descriptor */
+                break;
+            }
+        }
+    }
+
+    if(udf){
+        bs = find_udf_anchor(f,buffer);
+        if(bs){
+            p->type = WINX_FS_UDF;
+            strcpy(p->fs_name,"UDF");
+            set_geometry(p,bs,1,winx_fsize(f) / bs);
+            return 1;
+        }
+        etrace("UDF anchor not found");
+    }
+    if(iso){
+        p->type = WINX_FS_ISO9660;
+        strcpy(p->fs_name,"CDFS");
+        set_geometry(p,bs,1,blocks);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+**************************************************************
+*                    Interface routines
+**************************************************************
+*/
+
+/**
+ * @brief Identifies the file system
+ * of a volume or of a disk image.
+ * @param[in] path the native path of the volume,
+ * like \\??\\C:, or of the image file. A suffix
+ * like #p2 selects a partition of the image.
+ * @param[out] p the structure receiving
+ * the name of the file system and its geometry.
+ * @return Zero for success, negative value
+ * indicates that the volume cannot be read.
+ * A file system not recognized is reported
+ * as WINX_FS_UNKNOWN.
+ */
+int winx_probe_file_system(wchar_t *path,winx_fs_probe *p)
+{
+    WINX_FILE *f;
+    UCHAR *buffer;
+    int result = 0;
+
+    DbgCheck2(path,p,-1);
+
+    memset(p,0,sizeof(winx_fs_probe));
+    p->type = WINX_FS_UNKNOWN;
+
+    f = winx_open_image(path);
+    if(f == NULL)
+        return (-1);
+    buffer = winx_tmalloc(PROBE_BOOT_SIZE + PROBE_VRS_SIZE);
+    if(buffer == NULL){
+        etrace("cannot allocate %u bytes of memory",PROBE_BOOT_SIZE + PROBE_VRS_SIZE);
+        winx_fclose(f);
+        return (-1);
+    }
+
+    /* tiny images may be shorter than the range read */
+    memset(buffer,0,PROBE_BOOT_SIZE);
+    f->roffset.QuadPart = 0;
+    if(winx_fread(buffer,1,PROBE_BOOT_SIZE,f) < 512){
+        etrace("cannot read the boot sector of %ws",path);
+        result = -1;
+        goto done;
+    }
+    if(probe_ntfs(buffer,p) || probe_exfat(buffer,p)
+      || probe_refs(buffer,p) || probe_fat(buffer,p))
+        goto done;
+
+    /* optical discs have nothing in the boot sector */
+    memset(buffer + PROBE_BOOT_SIZE,0,PROBE_VRS_SIZE);
+    if(read_range(f,PROBE_VRS_OFFSET,buffer + PROBE_BOOT_SIZE,PROBE_VRS_SIZE) < 0){
+        /* small images end before the descriptors */
+        dtrace("cannot read volume descriptors of %ws",path);
+    }
+    (void)probe_optical(f,buffer,buffer + PROBE_BOOT_SIZE,p);
+
+done:
+    if(p->type != WINX_FS_UNKNOWN){
+        itrace("%ws: %s, %I64u clusters of %I64u bytes",
+            path,p->fs_name,p->total_clusters,p->bytes_per_cluster);
+    }
+    winx_free(buffer);
+    winx_fclose(f);
+    return result;
+}
+
+/** @} */
@@ -51,20 +51,203 @@
  */
 #define LLINVALID ((ULONGLONG) -1)
 
+/**
+ * @internal
+ * @brief Number of progress updates
+ * between two successive clock checks.
+ * @details winx_xtime is a system call,
+ * so we avoid calling it for each record.
+ */
+#define FTW_BATCH_CLOCK_TICKS 64
+
 /* external functions prototypes */
+struct _spill;
 winx_file_info *ntfs_scan_disk(char volume_letter,
     int flags, ftw_filter_callback fcb, ftw_progress_callback pcb, 
-    ftw_terminator t, void *user_defined_data);
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data);
+int ntfs_refresh_image(wchar_t *path,int flags,winx_file_info **filelist,
+    winx_mft_state *state,winx_ftw_context *ctx,void *user_defined_data);
+winx_file_info *ntfs_scan_image(wchar_t *path,
+    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb, 
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data);
+winx_file_info *exfat_scan_disk(char volume_letter,
+    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data);
+winx_file_info *exfat_scan_image(wchar_t *path,
+    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data);
+winx_file_info *fat_scan_disk(char volume_letter,
+    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data);
+winx_file_info *fat_scan_image(wchar_t *path,
+    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data);
+int ntfs_scan_disk_bounded(char volume_letter,int flags,
+    struct _spill *spill,winx_ftw_context *ctx,void *user_defined_data);
+struct _spill *spill_create(wchar_t *scratch_path,ULONGLONG memory_limit);
+int spill_walk(struct _spill *s,wchar_t *root,ftw_filter_callback fcb,
+    winx_ftw_context *ctx,void *user_defined_data);
+void spill_destroy(struct _spill *s);
+void frag_stats_reset(winx_frag_stats *fs);
+void frag_stats_add_file(winx_frag_stats *fs,winx_file_info *f);
+void frag_stats_remove_file(winx_frag_stats *fs,winx_file_info *f);
+
+/**
+ * @internal
+ * @brief Prepares the context of
+ * the batched progress reporting.
+ */
+void ftw_batch_init(winx_ftw_context *ctx)
+{
+    if(ctx == NULL)
+        return;
+    
+    if(ctx->batch_records == 0)
+        ctx->batch_records = WINX_FTW_BATCH_RECORDS;
+    if(ctx->batch_msec == 0)
+        ctx->batch_msec = WINX_FTW_BATCH_MSEC;
+    memset(&ctx->progress,0,sizeof(winx_ftw_progress));
+    ctx->start_time = winx_xtime();
+    ctx->next_records = ctx->batch_records;
+    ctx->next_time = ctx->start_time + ctx->batch_msec;
+    ctx->ticks = 0;
+    ctx->terminated = 0;
+    memset(ctx->phases,0,sizeof(ctx->phases));
+    ctx->phase = -1;
+    frag_stats_reset(ctx->frag);
+}
+
+/**
+ * @internal
+ * @brief Delivers the batch of progress
+ * information to the caller.
+ */
+static void ftw_batch_deliver(winx_ftw_context *ctx,ULONGLONG time,void *user_defined_data)
+{
+    ctx->progress.time = time - ctx->start_time;
+    ctx->next_records = ctx->progress.records + ctx->batch_records;
+    ctx->next_time = time + ctx->batch_msec;
+    if(ctx->bcb != NULL){
+        if(ctx->bcb(&ctx->progress,user_defined_data))
+            ctx->terminated = 1;
+    }
+}
+
+/**
+ * @internal
+ * @brief Updates the progress counters and
+ * calls the batch callback when either the
+ * records threshold or the time interval
+ * is reached.
+ * @details Must be called after each record
+ * processed; the counters must be updated
+ * by the caller before this call.
+ * @return A nonzero value if termination
+ * is requested.
+ */
+int ftw_batch_update(winx_ftw_context *ctx,void *user_defined_data)
+{
+    ULONGLONG time;
+    
+    if(ctx == NULL)
+        return 0;
+    
+    if(ctx->progress.records >= ctx->next_records){
+        ctx->ticks = 0;
+        ftw_batch_deliver(ctx,winx_xtime(),user_defined_data);
+    } else if(++ctx->ticks >= FTW_BATCH_CLOCK_TICKS){
+        ctx->ticks = 0;
+        time = winx_xtime();
+        if(time >= ctx->next_time)
+            ftw_batch_deliver(ctx,time,user_defined_data);
+    }
+    return ctx->terminated;
+}
+
+/**
+ * @internal
+ * @brief Delivers the final counters
+ * when the scan completes.
+ */
+void ftw_batch_complete(winx_ftw_context *ctx,void *user_defined_data)
+{
+    if(ctx == NULL)
+        return;
+    
+    if(!ctx->terminated)
+        ftw_batch_deliver(ctx,winx_xtime(),user_defined_data);
+}
+
+/**
+ * @internal
+ * @brief Starts gathering
+ * statistics of a scan phase.
+ * @details The memory peak is the exact
+ * high-water mark of the global heap, which
+ * gets reset there; scans running concurrently
+ * share it, so their peaks may include each
+ * other's allocations.
+ */
+void ftw_phase_begin(winx_ftw_context *ctx,int phase)
+{
+    winx_ftw_phase *p;
+    winx_heap_stats hs;
+    
+    if(ctx == NULL)
+        return;
+    
+    (void)winx_get_heap_stats(&hs);
+    p = &ctx->phases[phase];
+    p->time = winx_xtime();
+    p->items = 0;
+    p->bytes_read = ctx->progress.bytes_read;
+    p->allocations = hs.allocations;
+    p->peak_memory = 0;
+    ctx->phase = phase;
+    ctx->phase_memory = winx_reset_heap_peak();
+}
+
+/**
+ * @internal
+ * @brief Completes statistics of a scan phase.
+ * @param[in] items number of items processed
+ * during the phase.
+ */
+void ftw_phase_end(winx_ftw_context *ctx,int phase,ULONGLONG items)
+{
+    winx_ftw_phase *p;
+    winx_heap_stats hs;
+    
+    if(ctx == NULL)
+        return;
+    
+    (void)winx_get_heap_stats(&hs);
+    p = &ctx->phases[phase];
+    if(hs.peak_heap_bytes > ctx->phase_memory)
+        p->peak_memory = hs.peak_heap_bytes - ctx->phase_memory;
+    p->time = winx_xtime() - p->time;
+    p->items = items;
+    p->bytes_read = ctx->progress.bytes_read - p->bytes_read;
+    p->allocations = hs.allocations - p->allocations;
+    ctx->phase = -1;
+}
 
 /**
  * @internal
  * @brief Checks whether the file
  * tree walk must be terminated or not.
+ * @details When the batched progress reporting
+ * is in use, termination is checked at the batch
+ * granularity only.
  * @return A nonzero value if termination
  * is requested.
  */
-static int ftw_check_for_termination(ftw_terminator t,void *user_defined_data)
+static int ftw_check_for_termination(ftw_terminator t,
+    winx_ftw_context *ctx,void *user_defined_data)
 {
+    if(ctx != NULL)
+        return ctx->terminated;
+    
     if(t == NULL)
         return 0;
     
@@ -181,7 +364,7 @@ int winx_ftw_dump_file(winx_file_info *f,
             goto dump_failed;
         }
 
-        if(ftw_check_for_termination(t,user_defined_data)){
+        if(ftw_check_for_termination(t,NULL,user_defined_data)){
             if(counter > MAX_COUNT)
                 etrace("%ws: infinite main loop?",f->path);
             /* reset incomplete maps */
@@ -322,6 +505,10 @@ static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
     f->last_modification_time = file_entry->LastWriteTime.QuadPart;
     f->last_access_time = file_entry->LastAccessTime.QuadPart;
     
+    /* for reparse points the directory listing keeps the tag in EaSize */
+    f->reparse_tag = (f->flags & FILE_ATTRIBUTE_REPARSE_POINT) ? file_entry->EaSize : 0;
+    f->reparse_target = NULL;
+    
     /* reset user defined flags */
     f->user_defined_flags = 0;
     
@@ -332,6 +519,7 @@ static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
     
     /* reset file disposition */
     memset(&f->disp,0,sizeof(winx_file_disposition));
+    f->disp.size = file_entry->EndOfFile.QuadPart;
 
     /* get file disposition if requested */
     if(flags & WINX_FTW_DUMP_FILES){
@@ -353,7 +541,7 @@ static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
  */
 static int ftw_add_root_directory(wchar_t *path, int flags,
     ftw_filter_callback fcb, ftw_progress_callback pcb, 
-    ftw_terminator t, void *user_defined_data,
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data,
     winx_file_info **filelist)
 {
     winx_file_info *f;
@@ -385,6 +573,9 @@ static int ftw_add_root_directory(wchar_t *path, int flags,
     f->name[0] = '.';
     f->name[1] = 0;
     
+    f->reparse_tag = 0;
+    f->reparse_target = NULL;
+    
     /* get file attributes and access times */
     f->flags = FILE_ATTRIBUTE_DIRECTORY;
     f->creation_time = 0;
@@ -430,6 +621,13 @@ static int ftw_add_root_directory(wchar_t *path, int flags,
     }
     
     /* call callbacks */
+    if(ctx != NULL){
+        ctx->progress.records ++;
+        ctx->progress.files ++;
+        if(ctx->frag && (flags & WINX_FTW_DUMP_FILES))
+            frag_stats_add_file(ctx->frag,f);
+        (void)ftw_batch_update(ctx,user_defined_data);
+    }
     if(pcb != NULL)
         pcb(f,user_defined_data);
     if(fcb != NULL)
@@ -478,7 +676,7 @@ static HANDLE ftw_open_directory(wchar_t *path)
  */
 static int ftw_helper(wchar_t *path, int flags,
         ftw_filter_callback fcb, ftw_progress_callback pcb,
-        ftw_terminator t, void *user_defined_data,
+        ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data,
         winx_file_info **filelist)
 {
     FILE_BOTH_DIR_INFORMATION *file_listing, *file_entry;
@@ -501,7 +699,7 @@ static int ftw_helper(wchar_t *path, int flags,
     file_entry = file_listing;
 
     /* list directory entries */
-    while(!ftw_check_for_termination(t,user_defined_data)){
+    while(!ftw_check_for_termination(t,ctx,user_defined_data)){
         /* get a directory entry */
         if(file_entry->NextEntryOffset){
             /* go to the next directory entry */
@@ -525,9 +723,14 @@ static int ftw_helper(wchar_t *path, int flags,
                 NtClose(hDir);
                 return 0;
             }
+            if(ctx != NULL)
+                ctx->progress.bytes_read += iosb.Information;
             file_entry = file_listing;
         }
         
+        if(ctx != NULL)
+            ctx->progress.records ++;
+        
         /* skip . and .. entries */
         if(file_entry->FileNameLength == sizeof(wchar_t)){
             if(file_entry->FileName[0] == '.')
@@ -554,7 +757,13 @@ static int ftw_helper(wchar_t *path, int flags,
         //trace(D"%ws\n%ws",f->name,f->path);
         
         /* check for termination */
-        if(ftw_check_for_termination(t,user_defined_data)){
+        if(ctx != NULL){
+            ctx->progress.files ++;
+            if(ctx->frag && (flags & WINX_FTW_DUMP_FILES))
+                frag_stats_add_file(ctx->frag,f);
+            (void)ftw_batch_update(ctx,user_defined_data);
+        }
+        if(ftw_check_for_termination(t,ctx,user_defined_data)){
             itrace("terminated by user");
             winx_free(file_listing);
             NtClose(hDir);
@@ -573,7 +782,7 @@ static int ftw_helper(wchar_t *path, int flags,
         if(is_directory(f) && (flags & WINX_FTW_RECURSIVE) && !skip_children){
             /* don't follow reparse points! */
             if(!is_reparse_point(f)){
-                result = ftw_helper(f->path,flags,fcb,pcb,t,user_defined_data,filelist);
+                result = ftw_helper(f->path,flags,fcb,pcb,t,ctx,user_defined_data,filelist);
                 if(result < 0){
                     winx_free(file_listing);
                     NtClose(hDir);
@@ -593,7 +802,7 @@ static int ftw_helper(wchar_t *path, int flags,
  * @internal
  * @brief Removes resident streams from the file list.
  */
-static void ftw_remove_resident_streams(winx_file_info **filelist)
+static void ftw_remove_resident_streams(winx_file_info **filelist,winx_ftw_context *ctx)
 {
     winx_file_info *f, *head, *next = NULL;
 
@@ -601,8 +810,11 @@ static void ftw_remove_resident_streams(winx_file_info **filelist)
         head = *filelist;
         next = f->next;
         if(f->disp.fragments == 0){
+            if(ctx && ctx->frag)
+                frag_stats_remove_file(ctx->frag,f);
             winx_free(f->name);
             winx_free(f->path);
+            winx_free(f->reparse_target);
             winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
             winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
         }
@@ -615,7 +827,7 @@ static void ftw_remove_resident_streams(winx_file_info **filelist)
  * @internal
  * @brief Removes invalid streams from the file list.
  */
-static void ftw_remove_invalid_streams(winx_file_info **filelist)
+static void ftw_remove_invalid_streams(winx_file_info **filelist,winx_ftw_context *ctx)
 {
     winx_file_info *f, *head, *next = NULL;
     int invalid_entry;
@@ -630,8 +842,11 @@ static void ftw_remove_invalid_streams(winx_file_info **filelist)
             invalid_entry = 1;
         }
         if(invalid_entry){
+            if(ctx && ctx->frag)
+                frag_stats_remove_file(ctx->frag,f);
             winx_free(f->name);
             winx_free(f->path);
+            winx_free(f->reparse_target);
             winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
             winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
         }
@@ -640,6 +855,41 @@ static void ftw_remove_invalid_streams(winx_file_info **filelist)
     }
 }
 
+/**
+ * @internal
+ * @brief winx_ftw and winx_ftw_ex common code.
+ */
+static winx_file_info *ftw_walk(wchar_t *path, int flags,
+        ftw_filter_callback fcb, ftw_progress_callback pcb,
+        ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data)
+{
+    winx_file_info *filelist = NULL;
+    
+    if(flags & WINX_FTW_SKIP_RESIDENT_STREAMS){
+        if(!(flags & WINX_FTW_DUMP_FILES)){
+            etrace("WINX_FTW_DUMP_FILES flag must be set"
+                " to accept WINX_FTW_SKIP_RESIDENT_STREAMS");
+            flags &= ~WINX_FTW_SKIP_RESIDENT_STREAMS;
+        }
+    }
+    
+    ftw_batch_init(ctx);
+    if(ftw_helper(path,flags,fcb,pcb,t,ctx,user_defined_data,&filelist) == (-1) && \
+      !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
+        /* destroy the list */
+        winx_ftw_release(filelist);
+        return NULL;
+    }
+      
+    if(flags & WINX_FTW_SKIP_RESIDENT_STREAMS)
+        ftw_remove_resident_streams(&filelist,ctx);
+    
+    /* get rid of invalid entries */
+    ftw_remove_invalid_streams(&filelist,ctx);
+    ftw_batch_complete(ctx,user_defined_data);
+    return filelist;
+}
+
 /**
  * @brief Enumerates files inside of the specified directory, and
  * all its subdirectories when WINX_FTW_RECURSIVE flag is passed.
@@ -713,55 +963,100 @@ winx_file_info *winx_ftw(wchar_t *path, int flags,
         ftw_filter_callback fcb, ftw_progress_callback pcb,
         ftw_terminator t, void *user_defined_data)
 {
-    winx_file_info *filelist = NULL;
-    
     DbgCheck1(path,NULL);
     
-    if(flags & WINX_FTW_SKIP_RESIDENT_STREAMS){
-        if(!(flags & WINX_FTW_DUMP_FILES)){
-            etrace("WINX_FTW_DUMP_FILES flag must be set"
-                " to accept WINX_FTW_SKIP_RESIDENT_STREAMS");
-            flags &= ~WINX_FTW_SKIP_RESIDENT_STREAMS;
-        }
-    }
+    return ftw_walk(path,flags,fcb,pcb,t,NULL,user_defined_data);
+}
+
+/**
+ * @brief winx_ftw analog, but delivers progress
+ * information and checks for termination in batches.
+ * @param[in] path the native path of the directory to be scanned.
+ * @param[in] flags a combination of WINX_FTW_xxx flags, defined in zenwinx.h
+ * @param[in] fcb the address of the filter callback, the same as for winx_ftw.
+ * @param[in,out] ctx the batched progress reporting context. The caller sets
+ * the batch callback and the batch granularity (every N records or every T
+ * milliseconds, whichever comes first), the scan maintains the counters.
+ * If the batch callback returns a nonzero value the scan terminates.
+ * @param[in] user_defined_data pointer to data to be passed to all the
+ * registered callbacks.
+ * @return The list of files, NULL indicates failure.
+ * @note
+ * - The batch callback receives counters instead of
+ *   individual files, so the scan avoids an indirect
+ *   call per file.
+ * - The batch callback is called once more when
+ *   the scan completes, to deliver the final counters.
+ * @par Example:
+ * @code
+ * int progress(winx_ftw_progress *p, void *user_defined_data)
+ * {
+ *     winx_printf("\r%I64u files found",p->files);
+ *     return stop_event ? 1 : 0;
+ * }
+ *
+ * winx_ftw_context ctx = { 0 };
+ * ctx.bcb = progress;
+ * ctx.batch_msec = 1000;
+ * filelist = winx_ftw_ex(L"\\??\\c:\\",WINX_FTW_RECURSIVE,NULL,&ctx,NULL);
+ * @endcode
+ */
+winx_file_info *winx_ftw_ex(wchar_t *path, int flags,
+        ftw_filter_callback fcb, winx_ftw_context *ctx, void *user_defined_data)
+{
+    DbgCheck2(path,ctx,NULL);
     
-    if(ftw_helper(path,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
-      !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
-        /* destroy the list */
-        winx_ftw_release(filelist);
-        return NULL;
+    return ftw_walk(path,flags,fcb,NULL,NULL,ctx,user_defined_data);
+}
+
+/**
+ * @internal
+ * @brief Retrieves the file system of a volume.
+ * @details When the system reports a file system
+ * none of the direct scanners reads, like RAW on
+ * volumes it failed to mount, the boot sector
+ * gets checked, so the fastest scanner is still
+ * chosen when the volume is readable.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int get_file_system(char volume_letter,winx_volume_information *v)
+{
+    wchar_t path[] = L"\\??\\A:";
+    winx_fs_probe p;
+    int result;
+
+    result = winx_get_volume_information(volume_letter,v);
+    if(result >= 0){
+        if(!strcmp(v->fs_name,"NTFS") || !strcmp(v->fs_name,"FAT")
+          || !strcmp(v->fs_name,"FAT32") || !strcmp(v->fs_name,"exFAT"))
+            return 0;
     }
-      
-    if(flags & WINX_FTW_SKIP_RESIDENT_STREAMS)
-        ftw_remove_resident_streams(&filelist);
-    
-    /* get rid of invalid entries */
-    ftw_remove_invalid_streams(&filelist);
-    return filelist;
+
+    path[4] = (wchar_t)volume_letter;
+    if(winx_probe_file_system(path,&p) < 0 || p.type == WINX_FS_UNKNOWN)
+        return result;
+    itrace("%s found in the boot sector of %c:",p.fs_name,volume_letter);
+    strcpy(v->fs_name,p.fs_name);
+    if(result < 0 || v->bytes_per_cluster == 0)
+        v->bytes_per_cluster = p.bytes_per_cluster;
+    return 0;
 }
 
 /**
- * @brief winx_ftw analog, but optimized
- * to scan entire disks faster.
- * @details On NTFS-formatted disks this
- * routine analyzes MFT records directly
- * to speed up the scan (up to 25 times).
- * On FAT disks, however, general purpose
- * system API work faster as they benifit
- * from the Windows file caching. We never
- * tried to analyze UDF-formatted disks
- * directly because of high complexity
- * of UDF standards, so we use general
- * purpose API for them as well.
+ * @internal
+ * @brief winx_scan_disk and
+ * winx_scan_disk_ex common code.
  */
-winx_file_info *winx_scan_disk(char volume_letter, int flags,
+static winx_file_info *scan_disk(char volume_letter, int flags,
         ftw_filter_callback fcb, ftw_progress_callback pcb, ftw_terminator t,
-        void *user_defined_data)
+        winx_ftw_context *ctx, void *user_defined_data)
 {
     winx_file_info *filelist = NULL;
     wchar_t rootpath[] = L"\\??\\A:\\";
     winx_volume_information v;
     ULONGLONG time;
+    int free_space_counted = 0;
     
     /* ensure that it will work on w2k */
     volume_letter = winx_toupper(volume_letter);
@@ -777,17 +1072,40 @@ winx_file_info *winx_scan_disk(char volume_letter, int flags,
         }
     }
     
-    if(winx_get_volume_information(volume_letter,&v) >= 0){
+    ftw_batch_init(ctx);
+    if(get_file_system(volume_letter,&v) >= 0){
         itrace("file system is %s",v.fs_name);
+        if(ctx){
+            ctx->bytes_per_cluster = v.bytes_per_cluster;
+            if(ctx->frag)
+                ctx->frag->bytes_per_cluster = v.bytes_per_cluster;
+        }
         if(!strcmp(v.fs_name,"NTFS")){
-            filelist = ntfs_scan_disk(volume_letter,flags,fcb,pcb,t,user_defined_data);
+            filelist = ntfs_scan_disk(volume_letter,flags,fcb,pcb,t,ctx,user_defined_data);
             goto cleanup;
         }
+        if(!strcmp(v.fs_name,"FAT") || !strcmp(v.fs_name,"FAT32")){
+            filelist = fat_scan_disk(volume_letter,flags,fcb,pcb,t,ctx,user_defined_data);
+            if(filelist != NULL || (ctx && ctx->terminated))
+                goto cleanup;
+            /* the volume is damaged or locked, try the system API then */
+            itrace("direct FAT scan failed, falling back to the system API");
+        }
+        if(!strcmp(v.fs_name,"exFAT")){
+            filelist = exfat_scan_disk(volume_letter,flags,fcb,pcb,t,ctx,user_defined_data);
+            if(filelist != NULL || (ctx && ctx->terminated)){
+                /* the allocation bitmap is parsed already */
+                free_space_counted = 1;
+                goto cleanup;
+            }
+            itrace("direct exFAT scan failed, falling back to the system API");
+        }
     }
     
     /* collect information about the root directory */
+    ftw_phase_begin(ctx,WINX_FTW_PHASE_SCAN);
     rootpath[4] = (wchar_t)volume_letter;
-    if(ftw_add_root_directory(rootpath,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
+    if(ftw_add_root_directory(rootpath,flags,fcb,pcb,t,ctx,user_defined_data,&filelist) == (-1) && \
       !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
         /* destroy the list */
         winx_ftw_release(filelist);
@@ -797,19 +1115,25 @@ winx_file_info *winx_scan_disk(char volume_letter, int flags,
 
     /* collect information about the entire directory tree */
     flags |= WINX_FTW_RECURSIVE;
-    if(ftw_helper(rootpath,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
+    if(ftw_helper(rootpath,flags,fcb,pcb,t,ctx,user_defined_data,&filelist) == (-1) && \
       !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
         /* destroy the list */
         winx_ftw_release(filelist);
         filelist = NULL;
         goto done;
     }
+    if(ctx)
+        ftw_phase_end(ctx,WINX_FTW_PHASE_SCAN,ctx->progress.records);
 
 cleanup:
     if(flags & WINX_FTW_SKIP_RESIDENT_STREAMS)
-        ftw_remove_resident_streams(&filelist);
+        ftw_remove_resident_streams(&filelist,ctx);
     /* get rid of invalid entries */
-    ftw_remove_invalid_streams(&filelist);
+    ftw_remove_invalid_streams(&filelist,ctx);
+    /* complete the fragmentation report by the free space summary */
+    if(ctx && ctx->frag && !ctx->terminated && !free_space_counted)
+        (void)winx_get_free_space_stats(volume_letter,ctx->frag);
+    ftw_batch_complete(ctx,user_defined_data);
         
 done:
     winx_dbg_print_header(0,0,I"winx_scan_disk completed in %I64u ms",
@@ -817,6 +1141,289 @@ done:
     return filelist;
 }
 
+/**
+ * @brief winx_ftw analog, but optimized
+ * to scan entire disks faster.
+ * @details On NTFS-formatted disks this
+ * routine analyzes MFT records directly
+ * to speed up the scan (up to 25 times).
+ * On FAT disks it loads the file allocation
+ * table once and reads directories in the
+ * order of their clusters, so maps of files
+ * cost no requests to the file system; exFAT
+ * disks are scanned directly as well. Volumes
+ * the system failed to mount are recognized by
+ * their boot sectors. We never
+ * tried to analyze UDF-formatted disks
+ * directly because of high complexity
+ * of UDF standards, so we use general
+ * purpose API for them as well.
+ */
+winx_file_info *winx_scan_disk(char volume_letter, int flags,
+        ftw_filter_callback fcb, ftw_progress_callback pcb, ftw_terminator t,
+        void *user_defined_data)
+{
+    return scan_disk(volume_letter,flags,fcb,pcb,t,NULL,user_defined_data);
+}
+
+/**
+ * @brief winx_scan_disk analog, but delivers
+ * progress information and checks for termination
+ * in batches, like winx_ftw_ex does.
+ * @details On NTFS-formatted disks the records
+ * counter counts MFT records, on other disks it
+ * counts directory entries.
+ */
+winx_file_info *winx_scan_disk_ex(char volume_letter, int flags,
+        ftw_filter_callback fcb, winx_ftw_context *ctx, void *user_defined_data)
+{
+    DbgCheck2(volume_letter,ctx,NULL);
+    
+    return scan_disk(volume_letter,flags,fcb,NULL,NULL,ctx,user_defined_data);
+}
+
+/**
+ * @brief winx_scan_disk_ex analog for disk images.
+ * @param[in] path the native path of the image file.
+ * A suffix like #p2 selects a partition of the image.
+ * @details Reads the MFT or directories of FAT and exFAT
+ * directly from the image, without mounting it. Paths of
+ * the files found are prefixed by the path of the image
+ * and a colon, like \??\C:\images\ntfs.img:\dir\file.
+ * On exFAT the free space summary is gathered as well,
+ * when ctx->frag is set.
+ * The file system is recognized by its boot sector,
+ * see winx_probe_file_system.
+ * @note Only NTFS, FAT and exFAT images are supported.
+ */
+winx_file_info *winx_scan_image_ex(wchar_t *path, int flags,
+        ftw_filter_callback fcb, winx_ftw_context *ctx, void *user_defined_data)
+{
+    winx_file_info *filelist;
+    winx_fs_probe p;
+    ULONGLONG time;
+    
+    DbgCheck2(path,ctx,NULL);
+    
+    time = winx_xtime();
+    winx_dbg_print_header(0,0,I"winx_scan_image started");
+    
+    if(flags & WINX_FTW_SKIP_RESIDENT_STREAMS){
+        if(!(flags & WINX_FTW_DUMP_FILES)){
+            etrace("WINX_FTW_DUMP_FILES flag must be set"
+                " to accept WINX_FTW_SKIP_RESIDENT_STREAMS");
+            flags &= ~WINX_FTW_SKIP_RESIDENT_STREAMS;
+        }
+    }
+    
+    ftw_batch_init(ctx);
+    (void)winx_probe_file_system(path,&p);
+    switch(p.type){
+    case WINX_FS_NTFS:
+        filelist = ntfs_scan_image(path,flags,fcb,NULL,NULL,ctx,user_defined_data);
+        break;
+    case WINX_FS_FAT12:
+    case WINX_FS_FAT16:
+    case WINX_FS_FAT32:
+        filelist = fat_scan_image(path,flags,fcb,NULL,NULL,ctx,user_defined_data);
+        break;
+    case WINX_FS_EXFAT:
+        filelist = exfat_scan_image(path,flags,fcb,NULL,NULL,ctx,user_defined_data);
+        break;
+    case WINX_FS_UNKNOWN:
+        etrace("file system of %ws is not recognized",path);
+        filelist = NULL;
+        break;
+    default:
+        etrace("%s file system is not supported",p.fs_name);
+        filelist = NULL;
+        break;
+    }
+    if(flags & WINX_FTW_SKIP_RESIDENT_STREAMS)
+        ftw_remove_resident_streams(&filelist,ctx);
+    ftw_remove_invalid_streams(&filelist,ctx);
+    ftw_batch_complete(ctx,user_defined_data);
+    
+    winx_dbg_print_header(0,0,I"winx_scan_image completed in %I64u ms",
+        winx_xtime() - time);
+    return filelist;
+}
+
+/**
+ * @brief winx_scan_disk_ex analog for volumes
+ * which have too many files to keep them in memory.
+ * @param[in] volume_letter the volume letter.
+ * @param[in] flags combination of WINX_FTW_xxx flags.
+ * @param[in] memory_limit the amount of memory
+ * allowed to use, in bytes; 4 MB at least.
+ * @param[in] scratch_path the native path of a directory
+ * for temporary files, on another volume preferably.
+ * @param[in] fcb the filter callback called for each
+ * file found, with its full path. If it returns
+ * a nonzero value, children of the directory
+ * will be skipped.
+ * @param[in] ctx the scan context.
+ * @param[in] user_defined_data pointer to data passed
+ * to all the registered callbacks.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller.
+ * @details Files found leave memory as soon as their
+ * records are analyzed: they get sorted by the parent
+ * directory in portions which fit into the memory limit,
+ * then the portions get merged in a single file on the
+ * scratch volume and the directory tree is walked through
+ * it from the root. The file structures passed to the
+ * callback are temporary, so the callback must copy
+ * everything it needs.
+ * @note
+ * - Only NTFS volumes are supported.
+ * - Maps of the files are never kept, so the callback
+ *   receives the number of clusters and fragments only.
+ * - Files unreachable from the root directory are skipped.
+ */
+int winx_scan_disk_bounded(char volume_letter, int flags,
+        ULONGLONG memory_limit, wchar_t *scratch_path,
+        ftw_filter_callback fcb, winx_ftw_context *ctx, void *user_defined_data)
+{
+    wchar_t root[] = L"\\??\\A:";
+    winx_volume_information v;
+    struct _spill *s;
+    ULONGLONG time;
+    int result;
+    
+    DbgCheck2(scratch_path,ctx,-1);
+    
+    volume_letter = winx_toupper(volume_letter);
+    time = winx_xtime();
+    winx_dbg_print_header(0,0,I"winx_scan_disk_bounded started");
+    
+    if(winx_get_volume_information(volume_letter,&v) < 0)
+        return (-1);
+    if(strcmp(v.fs_name,"NTFS")){
+        etrace("%s file system is not supported",v.fs_name);
+        return (-1);
+    }
+    
+    s = spill_create(scratch_path,memory_limit);
+    if(s == NULL)
+        return (-1);
+    
+    ftw_batch_init(ctx);
+    ctx->bytes_per_cluster = v.bytes_per_cluster;
+    if(ctx->frag)
+        ctx->frag->bytes_per_cluster = v.bytes_per_cluster;
+    flags &= ~WINX_FTW_SKIP_RESIDENT_STREAMS;
+    result = ntfs_scan_disk_bounded(volume_letter,flags,s,ctx,user_defined_data);
+    if(result == 0){
+        ftw_phase_begin(ctx,WINX_FTW_PHASE_PATHS);
+        root[4] = (wchar_t)volume_letter;
+        result = spill_walk(s,root,fcb,ctx,user_defined_data);
+        ftw_phase_end(ctx,WINX_FTW_PHASE_PATHS,ctx->progress.files);
+    }
+    spill_destroy(s);
+    ftw_batch_complete(ctx,user_defined_data);
+    
+    winx_dbg_print_header(0,0,I"winx_scan_disk_bounded completed in %I64u ms",
+        winx_xtime() - time);
+    return result;
+}
+
+/**
+ * @brief Refreshes the scan of an NTFS disk image.
+ * @param[in] path the native path of the image.
+ * @param[in] flags combination of WINX_FTW_xxx flags,
+ * the same for all the refreshes of the results.
+ * @param[in,out] r the scan results. When they have
+ * no saved headers of the file records, the image
+ * gets scanned entirely. Otherwise only records
+ * whose sequence number or LSN changed since the
+ * last refresh get parsed again.
+ * @param[in] ctx the scan context.
+ * @param[in] user_defined_data pointer to data passed
+ * to all the registered callbacks.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller.
+ * The results get released in case of errors.
+ * @details Useful when the change journal is disabled
+ * or wrapped, since every change of a file record
+ * advances its LSN anyway. The headers are compared
+ * in a single sequential pass over the $Mft.
+ * @note The cluster map and the indices of the results, if
+ * any, get released, since they refer to entries of the list.
+ */
+int winx_refresh_image_scan(wchar_t *path, int flags,
+        winx_scan_results *r, winx_ftw_context *ctx, void *user_defined_data)
+{
+    ULONGLONG time;
+    int result;
+    
+    DbgCheck3(path,r,ctx,-1);
+    
+    time = winx_xtime();
+    winx_dbg_print_header(0,0,I"winx_refresh_image_scan started");
+    
+    winx_release_cluster_map(r->cmap);
+    r->cmap = NULL;
+    winx_release_time_index(r->times);
+    r->times = NULL;
+    winx_release_name_index(r->names);
+    r->names = NULL;
+    if(r->mft == NULL){
+        r->mft = winx_tmalloc(sizeof(winx_mft_state));
+        if(r->mft == NULL){
+            etrace("cannot allocate %u bytes of memory",
+                sizeof(winx_mft_state));
+            return (-1);
+        }
+        memset(r->mft,0,sizeof(winx_mft_state));
+    }
+    /* a list without headers cannot be refreshed */
+    if(r->mft->n_records == 0 || r->filelist == NULL){
+        winx_ftw_release(r->filelist);
+        r->filelist = NULL;
+        winx_free(r->mft->lsn);
+        winx_free(r->mft->seq);
+        memset(r->mft,0,sizeof(winx_mft_state));
+    }
+    
+    if(flags & WINX_FTW_SKIP_RESIDENT_STREAMS){
+        if(!(flags & WINX_FTW_DUMP_FILES)){
+            etrace("WINX_FTW_DUMP_FILES flag must be set"
+                " to accept WINX_FTW_SKIP_RESIDENT_STREAMS");
+            flags &= ~WINX_FTW_SKIP_RESIDENT_STREAMS;
+        }
+    }
+    
+    ftw_batch_init(ctx);
+    result = ntfs_refresh_image(path,flags,&r->filelist,r->mft,ctx,user_defined_data);
+    if(result == 0){
+        if(flags & WINX_FTW_SKIP_RESIDENT_STREAMS)
+            ftw_remove_resident_streams(&r->filelist,ctx);
+        ftw_remove_invalid_streams(&r->filelist,ctx);
+    }
+    ftw_batch_complete(ctx,user_defined_data);
+    if(result < 0)
+        winx_release_scan_results(r);
+    
+    winx_dbg_print_header(0,0,I"winx_refresh_image_scan completed in %I64u ms",
+        winx_xtime() - time);
+    return result;
+}
+
+/**
+ * @brief Releases headers of the file records
+ * saved by winx_refresh_image_scan.
+ */
+void winx_release_mft_state(winx_mft_state *s)
+{
+    if(s == NULL)
+        return;
+
+    winx_free(s->lsn);
+    winx_free(s->seq);
+    winx_free(s);
+}
+
 /**
  * @brief Releases resources allocated
  * by winx_ftw or winx_scan_disk.
@@ -831,6 +1438,7 @@ void winx_ftw_release(winx_file_info *filelist)
     for(f = filelist; f != NULL; f = f->next){
         winx_free(f->name);
         winx_free(f->path);
+        winx_free(f->reparse_target);
         winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
         if(f->next == filelist) break;
     }
@@ -0,0 +1,729 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file ftw_exfat.c
+ * @brief Fast file tree walk for exFAT.
+ * @details Directories are read directly and walked
+ * breadth-first, each level in the order of clusters.
+ * Most files on exFAT are contiguous and marked so
+ * by their stream entries; maps of such files cost
+ * nothing. The allocation table gets read in small
+ * windows, for fragmented files and directories only.
+ * The allocation bitmap, found in the root directory,
+ * is parsed on the way to the free space summary, so
+ * a single pass over the metadata delivers both.
+ * @addtogroup File
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+#include "ftw_walk.h"
+
+/* the end of a cluster chain, in the table read */
+#define EXFAT_EOC ((ULONG)-1)
+
+/* a directory takes 256 MB at most */
+#define EXFAT_MAX_DIRECTORY_SIZE (256 * 1024 * 1024)
+
+/* number of table entries read at once */
+#define EXFAT_FAT_WINDOW 16384
+
+/* the bitmap is read in portions of this size */
+#define EXFAT_READ_CHUNK (1024 * 1024)
+
+/* types of directory entries */
+#define EXFAT_ENTRY_END        0x00
+#define EXFAT_ENTRY_BITMAP     0x81
+#define EXFAT_ENTRY_UPCASE     0x82
+#define EXFAT_ENTRY_FILE       0x85
+#define EXFAT_ENTRY_STREAM     0xC0
+#define EXFAT_ENTRY_NAME       0xC1
+
+/* flags of stream extension entries */
+#define EXFAT_ALLOCATION_POSSIBLE 0x01
+#define EXFAT_NO_FAT_CHAIN        0x02
+
+/* names consist of 255 characters at most, 15 per entry */
+#define EXFAT_MAX_NAME_LENGTH 255
+#define EXFAT_NAME_PART       15
+
+#define EXFAT_UPCASE_ENTRIES 65536
+
+/* internal structures */
+typedef struct _exfat_layout {
+    ULONG bytes_per_sector;
+    ULONG cluster_size;         /* in bytes */
+    ULONG clusters;             /* number of clusters of the heap */
+    ULONGLONG fat_offset;       /* the first table, in bytes */
+    ULONGLONG fat_size;         /* size of a single table, in bytes */
+    ULONGLONG heap_offset;      /* offset of cluster #2, in bytes */
+    ULONG root_cluster;
+} exfat_layout;
+
+typedef struct _exfat_scan_parameters {
+    exfat_layout el;
+    ftw_walk *w;                /* parameters of the walk */
+    UCHAR *window;              /* a window of the allocation table, as it is on disk */
+    ULONG window_start;         /* the first cluster of the window, EXFAT_EOC when empty */
+    USHORT *upcase;             /* the up-case table, NULL until it is found */
+    int bitmap_found;           /* nonzero value indicates that free space is counted */
+} exfat_scan_parameters;
+
+/* external functions prototypes */
+void validate_blockmap(winx_file_info *f);
+void ftw_phase_begin(winx_ftw_context *ctx,int phase);
+void ftw_phase_end(winx_ftw_context *ctx,int phase,ULONGLONG items);
+void frag_stats_add_free_region(winx_frag_stats *fs,ULONGLONG length);
+
+/*
+**************************************************
+*              Layout of the volume
+**************************************************
+*/
+
+/**
+ * @brief Retrieves the layout from the boot sector.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int get_exfat_layout(UCHAR *bs,exfat_layout *el)
+{
+    ULONG sector_shift, cluster_shift, i;
+    ULONGLONG volume_size;
+
+    memset(el,0,sizeof(exfat_layout));
+    if(bs[510] != 0x55 || bs[511] != 0xAA)
+        return (-1);
+    if(memcmp(bs + 3,"EXFAT   ",8))
+        return (-1);
+    /* the old BIOS parameter block must be zeroed */
+    for(i = 11; i < 64; i++){
+        if(bs[i]) return (-1);
+    }
+
+    sector_shift = bs[108];
+    cluster_shift = bs[109];
+    if(sector_shift < 9 || sector_shift > 12 || cluster_shift > 25 - sector_shift)
+        return (-1);
+
+    el->bytes_per_sector = 1 << sector_shift;
+    el->cluster_size = el->bytes_per_sector << cluster_shift;
+    el->fat_offset = (ULONGLONG)get_u32(bs + 80) << sector_shift;
+    el->fat_size = (ULONGLONG)get_u32(bs + 84) << sector_shift;
+    el->heap_offset = (ULONGLONG)get_u32(bs + 88) << sector_shift;
+    el->clusters = get_u32(bs + 92);
+    el->root_cluster = get_u32(bs + 96);
+    volume_size = get_u64(bs + 72) << sector_shift;
+
+    if(el->clusters == 0 || el->clusters > 0xFFFFFFF5)
+        return (-1);
+    if(el->fat_size < ((ULONGLONG)el->clusters + 2) * 4)
+        return (-1);
+    if(el->heap_offset + (ULONGLONG)el->clusters * el->cluster_size > volume_size)
+        return (-1);
+    if(el->root_cluster < 2 || el->root_cluster >= el->clusters + 2)
+        return (-1);
+    return 0;
+}
+
+/*
+**************************************************
+*                Cluster chains
+**************************************************
+*/
+
+#define is_valid_cluster(c,sp) ((c) >= 2 && (c) < (sp)->el.clusters + 2)
+
+/**
+ * @brief Returns the cluster following
+ * a cluster in the allocation table.
+ * @return EXFAT_EOC at the end of the chain,
+ * as well as for invalid entries and read errors.
+ */
+static ULONG get_next_cluster(ULONG cluster,exfat_scan_parameters *sp)
+{
+    ULONG start, length, next;
+
+    start = cluster / EXFAT_FAT_WINDOW * EXFAT_FAT_WINDOW;
+    if(start != sp->window_start){
+        length = (ULONG)min(EXFAT_FAT_WINDOW * 4,sp->el.fat_size - (ULONGLONG)start * 4);
+        if(ftw_walk_read(sp->el.fat_offset + (ULONGLONG)start * 4,sp->window,length,sp->w) < 0){
+            sp->window_start = EXFAT_EOC;
+            sp->w->errors ++;
+            return EXFAT_EOC;
+        }
+        sp->window_start = start;
+    }
+    next = get_u32(sp->window + (cluster - start) * 4);
+    return is_valid_cluster(next,sp) ? next : EXFAT_EOC;
+}
+
+/**
+ * @brief Returns the length of the block of
+ * consecutive clusters starting at a cluster
+ * of a chain, the cluster itself included.
+ * @param[in] contiguous nonzero value indicates
+ * that the chain isn't kept in the table.
+ * @param[in] max_length the most clusters to take.
+ * @param[out] next receives the cluster
+ * following the block, EXFAT_EOC at the end.
+ */
+static ULONG get_block(ULONG cluster,int contiguous,ULONGLONG max_length,
+    ULONG *next,exfat_scan_parameters *sp)
+{
+    ULONG length = 1;
+
+    if(contiguous){
+        /* stay inside the heap */
+        max_length = min(max_length,sp->el.clusters + 2 - cluster);
+        *next = EXFAT_EOC;
+        return (ULONG)max_length;
+    }
+
+    while(1){
+        *next = get_next_cluster(cluster,sp);
+        if(*next != cluster + 1 || length >= max_length)
+            return length;
+        cluster ++;
+        length ++;
+    }
+}
+
+/**
+ * @brief Builds the map of blocks of a file.
+ * @param[in] n_clusters the number of clusters
+ * the size of the file takes. Longer chains, which
+ * appear in damaged tables, get truncated.
+ */
+static void build_blockmap(winx_file_info *f,ULONG cluster,int contiguous,
+    ULONGLONG n_clusters,exfat_scan_parameters *sp)
+{
+    winx_blockmap *block = NULL;
+    ULONG length, next;
+
+    while(is_valid_cluster(cluster,sp) && f->disp.clusters < n_clusters){
+        length = get_block(cluster,contiguous,n_clusters - f->disp.clusters,&next,sp);
+        block = (winx_blockmap *)winx_list_insert((list_entry **)(void *)&f->disp.blockmap,
+            (list_entry *)block,sizeof(winx_blockmap));
+        block->vcn = f->disp.clusters;
+        /* cluster #2 is the first one of the heap */
+        block->lcn = cluster - 2;
+        block->length = length;
+        f->disp.clusters += length;
+        if(block == f->disp.blockmap || \
+          block->lcn != (block->prev->lcn + block->prev->length)){
+            f->disp.fragments ++;
+        }
+        cluster = next;
+    }
+}
+
+/**
+ * @brief Reads a chain of clusters.
+ * @details Blocks of consecutive clusters
+ * are read by a single request each.
+ * @param[in] max_size the most bytes to read.
+ * @param[in,out] buffer the buffer, grown as needed.
+ * @param[in,out] buffer_size size of the buffer.
+ * @return Number of bytes read, negative
+ * value indicates failure.
+ */
+static LONG read_chain(ULONG cluster,int contiguous,ULONG max_size,
+    char **buffer,ULONG *buffer_size,exfat_scan_parameters *sp)
+{
+    ULONG count, next, length, size = 0;
+
+    while(is_valid_cluster(cluster,sp) && size < max_size){
+        count = get_block(cluster,contiguous,(max_size - size + \
+            sp->el.cluster_size - 1) / sp->el.cluster_size,&next,sp);
+        length = count * sp->el.cluster_size;
+        if(size + length > *buffer_size){
+            if(ftw_walk_grow_buffer(buffer,buffer_size,
+              max(size + length,*buffer_size * 2),size) < 0)
+                return (-1);
+        }
+        if(ftw_walk_read(sp->el.heap_offset + (ULONGLONG)(cluster - 2) * sp->el.cluster_size,
+          *buffer + size,length,sp->w) < 0)
+            return (-1);
+        size += length;
+        cluster = next;
+    }
+    return (LONG)min(size,max_size);
+}
+
+/*
+**************************************************
+*        The allocation bitmap and up-cases
+**************************************************
+*/
+
+/**
+ * @brief Adds free regions found in the allocation
+ * bitmap to the free space summary.
+ * @details The bitmap is read in portions; runs of
+ * free or used clusters skip whole bytes at once.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int count_free_space(ULONG cluster,ULONGLONG size,exfat_scan_parameters *sp)
+{
+    winx_frag_stats *fs = sp->w->ctx->frag;
+    ULONGLONG i, n = sp->el.clusters, free_start = n, chunk_start;
+    ULONG next, count, chunk;
+    UCHAR *bitmap, b;
+    LONG length;
+
+    if(size < (n + 7) / 8){
+        etrace("the allocation bitmap is too small");
+        return (-1);
+    }
+
+    /* clusters may be larger than the portion */
+    chunk = max(EXFAT_READ_CHUNK,sp->el.cluster_size);
+    bitmap = winx_tmalloc(chunk);
+    if(bitmap == NULL){
+        etrace("cannot allocate %u bytes of memory",chunk);
+        return (-1);
+    }
+
+    /* the bitmap is kept in a chain, like files are */
+    for(i = 0; i < n && is_valid_cluster(cluster,sp); ){
+        count = get_block(cluster,0,chunk / sp->el.cluster_size,&next,sp);
+        length = (LONG)min(count * sp->el.cluster_size,(n - i + 7) / 8);
+        if(ftw_walk_read(sp->el.heap_offset + (ULONGLONG)(cluster - 2) * sp->el.cluster_size,
+          bitmap,count * sp->el.cluster_size,sp->w) < 0){
+            winx_free(bitmap);
+            return (-1);
+        }
+        chunk_start = i;
+        for(; i < n && i < chunk_start + (ULONGLONG)length * 8; i++){
+            b = bitmap[(i - chunk_start) >> 3];
+            if((i & 7) == 0 && (b == 0 || b == 0xFF) && i + 8 <= n){
+                /* the whole byte is either free or used */
+                if(b == 0 && free_start == n) free_start = i;
+                if(b == 0xFF && free_start != n){
+                    frag_stats_add_free_region(fs,i - free_start);
+                    free_start = n;
+                }
+                i += 7;
+                continue;
+            }
+            if(!(b & (1 << (i & 7)))){
+                if(free_start == n) free_start = i;
+            } else if(free_start != n){
+                frag_stats_add_free_region(fs,i - free_start);
+                free_start = n;
+            }
+        }
+        cluster = next;
+    }
+    if(free_start != n)
+        frag_stats_add_free_region(fs,n - free_start);
+
+    winx_free(bitmap);
+    if(i < n){
+        etrace("the allocation bitmap is truncated");
+        return (-1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Loads the up-case table, which
+ * defines hashes of the names of files.
+ * @details The table is compressed: 0xFFFF
+ * followed by a number N stands for N
+ * characters mapped to themselves.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int load_upcase_table(ULONG cluster,ULONGLONG size,ULONG checksum,exfat_scan_parameters *sp)
+{
+    ULONG sum = 0, i, j, c = 0, n, table_size = 0;
+    UCHAR *table = NULL;
+    LONG length;
+
+    if(size == 0 || size > EXFAT_UPCASE_ENTRIES * 2 * 2)
+        return (-1);
+    length = read_chain(cluster,0,(ULONG)size,(char **)&table,&table_size,sp);
+    if(length != (LONG)size){
+        winx_free(table);
+        return (-1);
+    }
+    for(i = 0; i < (ULONG)length; i++)
+        sum = ((sum & 1) ? 0x80000000 : 0) + (sum >> 1) + table[i];
+    if(sum != checksum){
+        etrace("the up-case table is damaged");
+        winx_free(table);
+        return (-1);
+    }
+
+    sp->upcase = winx_tmalloc(EXFAT_UPCASE_ENTRIES * sizeof(USHORT));
+    if(sp->upcase == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            EXFAT_UPCASE_ENTRIES * sizeof(USHORT));
+        winx_free(table);
+        return (-1);
+    }
+    for(i = 0; i + 1 < (ULONG)length && c < EXFAT_UPCASE_ENTRIES; i += 2){
+        n = get_u16(table + i);
+        if(n == 0xFFFF && i + 3 < (ULONG)length){
+            /* a run of identity mappings */
+            n = get_u16(table + i + 2);
+            for(j = 0; j < n && c < EXFAT_UPCASE_ENTRIES; j++, c++)
+                sp->upcase[c] = (USHORT)c;
+            i += 2;
+            continue;
+        }
+        sp->upcase[c++] = (USHORT)n;
+    }
+    for(; c < EXFAT_UPCASE_ENTRIES; c++)
+        sp->upcase[c] = (USHORT)c;
+    winx_free(table);
+    return 0;
+}
+
+/*
+**************************************************
+*              Directory entries
+**************************************************
+*/
+
+/**
+ * @brief Checks the checksum of a directory entry set.
+ */
+static int is_valid_entry_set(UCHAR *e,ULONG n_entries)
+{
+    USHORT sum = 0;
+    ULONG i;
+
+    for(i = 0; i < n_entries * 32; i++){
+        /* skip the checksum itself */
+        if(i == 2 || i == 3) continue;
+        sum = (USHORT)(((sum & 1) ? 0x8000 : 0) + (sum >> 1) + e[i]);
+    }
+    return (sum == get_u16(e + 2)) ? 1 : 0;
+}
+
+/**
+ * @brief Calculates the hash of a name,
+ * kept by stream extension entries.
+ */
+static USHORT get_name_hash(wchar_t *name,int length,exfat_scan_parameters *sp)
+{
+    USHORT sum = 0, c;
+    int i;
+
+    for(i = 0; i < length; i++){
+        c = sp->upcase[(USHORT)name[i]];
+        sum = (USHORT)(((sum & 1) ? 0x8000 : 0) + (sum >> 1) + (c & 0xFF));
+        sum = (USHORT)(((sum & 1) ? 0x8000 : 0) + (sum >> 1) + (c >> 8));
+    }
+    return sum;
+}
+
+/**
+ * @brief Converts a timestamp kept
+ * by a file entry to the system time.
+ * @param[in] utc_offset the offset from UTC in
+ * 15-minute units; unless the high bit is set,
+ * the time is local and the bias in effect at
+ * the moment is applied, like on FAT.
+ */
+static ULONGLONG convert_time(UCHAR *timestamp,UCHAR centiseconds,UCHAR utc_offset,exfat_scan_parameters *sp)
+{
+    ULONGLONG t;
+    LONGLONG offset;
+
+    t = winx_dos2time((unsigned short)get_u16(timestamp + 2),
+        (unsigned short)get_u16(timestamp),centiseconds);
+    if(t == 0)
+        return 0;
+    if(utc_offset & 0x80){
+        /* a signed 7-bit number */
+        offset = (utc_offset & 0x40) ? (LONGLONG)(utc_offset & 0x7F) - 0x80 : (utc_offset & 0x7F);
+        return t - offset * 15 * 60 * 10000000;
+    }
+    return t - sp->w->time_bias;
+}
+
+/*
+**************************************************
+*               The tree walk
+**************************************************
+*/
+
+/**
+ * @brief Adds the root directory to the file list.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int add_root_directory(exfat_scan_parameters *sp)
+{
+    winx_file_info *f;
+
+    f = ftw_walk_add_entry(L".",winx_swprintf(L"%ws\\",sp->w->root),sp->w);
+    if(f == NULL)
+        return (-1);
+    f->flags = FILE_ATTRIBUTE_DIRECTORY;
+    if(sp->w->flags & WINX_FTW_DUMP_FILES){
+        build_blockmap(f,sp->el.root_cluster,0,
+            EXFAT_MAX_DIRECTORY_SIZE / sp->el.cluster_size,sp);
+        validate_blockmap(f);
+    }
+
+    if(sp->w->ctx != NULL)
+        sp->w->ctx->progress.records ++;
+    (void)ftw_walk_report_file(f,sp->w);
+    return ftw_walk_push_directory(f,sp->el.root_cluster,0,0,sp->w);
+}
+
+/**
+ * @brief Handles entries of the root directory
+ * describing the allocation bitmap and the up-case table.
+ */
+static void add_system_entry(UCHAR *e,exfat_scan_parameters *sp)
+{
+    ULONG cluster = get_u32(e + 20);
+    ULONGLONG size = get_u64(e + 24);
+
+    if(e[0] == EXFAT_ENTRY_BITMAP){
+        /* the second bitmap belongs to the second table, which is not used */
+        if(sp->bitmap_found || (e[1] & 1))
+            return;
+        sp->bitmap_found = 1;
+        if(sp->w->ctx && sp->w->ctx->frag){
+            if(count_free_space(cluster,size,sp) < 0)
+                sp->w->errors ++;
+        }
+    } else if(e[0] == EXFAT_ENTRY_UPCASE && sp->upcase == NULL){
+        if(load_upcase_table(cluster,size,get_u32(e + 4),sp) < 0)
+            etrace("the up-case table is not available, names will be left unchecked");
+    }
+}
+
+/**
+ * @brief Adds files of a directory to the file list,
+ * subdirectories go to the next level of the walk.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller.
+ */
+static int list_directory(ftw_directory *d,void *p)
+{
+    exfat_scan_parameters *sp = (exfat_scan_parameters *)p;
+    wchar_t name[EXFAT_MAX_NAME_LENGTH + 1];
+    winx_file_info *f;
+    UCHAR *e, *stream;
+    ULONG offset, cluster, size, n, i, j, k;
+    ULONGLONG data_length;
+    ULONG max_size;
+    int is_root, contiguous, length;
+    int skip_children;
+
+    is_root = (d->cluster == sp->el.root_cluster) ? 1 : 0;
+    max_size = d->size ? (ULONG)min(d->size,EXFAT_MAX_DIRECTORY_SIZE) : EXFAT_MAX_DIRECTORY_SIZE;
+    size = (ULONG)read_chain(d->cluster,d->contiguous,max_size,&sp->w->buffer,&sp->w->buffer_size,sp);
+    if((LONG)size < 0){
+        /* skip the directory, like ftw does */
+        sp->w->errors ++;
+        return 0;
+    }
+
+    /* the up-case table is needed before the names */
+    if(is_root){
+        for(offset = 0; offset + 32 <= size; offset += 32){
+            e = (UCHAR *)sp->w->buffer + offset;
+            if(e[0] == EXFAT_ENTRY_END) break;
+            if(e[0] == EXFAT_ENTRY_BITMAP || e[0] == EXFAT_ENTRY_UPCASE)
+                add_system_entry(e,sp);
+        }
+    }
+
+    for(offset = 0; offset + 32 <= size; offset += 32){
+        e = (UCHAR *)sp->w->buffer + offset;
+
+        /* zero marks the end of the directory */
+        if(e[0] == EXFAT_ENTRY_END) break;
+        if(sp->w->ctx != NULL)
+            sp->w->ctx->progress.records ++;
+
+        /* skip unused entries and everything but files */
+        if(e[0] != EXFAT_ENTRY_FILE)
+            continue;
+
+        /* the set includes the stream extension and the name */
+        n = e[1];
+        if(n < 2 || n > 18 || offset + (n + 1) * 32 > size){
+            etrace("%ws: invalid entry set at %u",d->f->path,offset);
+            sp->w->errors ++;
+            continue;
+        }
+        if(!is_valid_entry_set(e,n + 1)){
+            etrace("%ws: entry set at %u is damaged",d->f->path,offset);
+            sp->w->errors ++;
+            continue;
+        }
+        stream = e + 32;
+        length = stream[3];
+        if(stream[0] != EXFAT_ENTRY_STREAM || length == 0 || \
+          (ULONG)(length + EXFAT_NAME_PART - 1) / EXFAT_NAME_PART > n - 1){
+            etrace("%ws: invalid entry set at %u",d->f->path,offset);
+            sp->w->errors ++;
+            continue;
+        }
+
+        /* gather the name */
+        for(i = 1, k = 0; i < n && k < (ULONG)length; i++){
+            if(stream[i * 32] != EXFAT_ENTRY_NAME) break;
+            for(j = 0; j < EXFAT_NAME_PART && k < (ULONG)length; j++, k++)
+                name[k] = (wchar_t)get_u16(stream + i * 32 + 2 + j * 2);
+        }
+        if(k < (ULONG)length){
+            etrace("%ws: incomplete name at %u",d->f->path,offset);
+            sp->w->errors ++;
+            continue;
+        }
+        name[length] = 0;
+        if(sp->upcase && get_name_hash(name,length,sp) != get_u16(stream + 4))
+            etrace("%ws: hash of %ws mismatch",d->f->path,name);
+
+        /* the entry set is complete */
+        offset += n * 32;
+
+        f = ftw_walk_add_entry(name,ftw_walk_build_path(d->f->path,name),sp->w);
+        if(f == NULL)
+            return (-1);
+
+        /* save file attributes and access times */
+        f->flags = get_u16(e + 4);
+        if(f->flags == 0) f->flags = FILE_ATTRIBUTE_NORMAL;
+        f->creation_time = convert_time(e + 8,e[20],e[22],sp);
+        f->last_modification_time = convert_time(e + 12,e[21],e[23],sp);
+        f->last_access_time = convert_time(e + 16,0,e[24],sp);
+
+        cluster = get_u32(stream + 20);
+        data_length = get_u64(stream + 24);
+        contiguous = (stream[1] & EXFAT_NO_FAT_CHAIN) ? 1 : 0;
+        if(!(stream[1] & EXFAT_ALLOCATION_POSSIBLE))
+            cluster = 0;
+        f->disp.size = is_directory(f) ? 0 : data_length;
+        if(sp->w->flags & WINX_FTW_DUMP_FILES){
+            build_blockmap(f,cluster,contiguous,(data_length + \
+                sp->el.cluster_size - 1) / sp->el.cluster_size,sp);
+            validate_blockmap(f);
+        }
+
+        skip_children = ftw_walk_report_file(f,sp->w);
+        if(ftw_walk_check_for_termination(sp->w)){
+            itrace("terminated by user");
+            return (-2);
+        }
+
+        /* scan subdirectories */
+        if(is_directory(f) && !skip_children && is_valid_cluster(cluster,sp) && data_length){
+            if(ftw_walk_push_directory(f,cluster,data_length,contiguous,sp->w) < 0)
+                return (-1);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Scans an exFAT-formatted volume.
+ * @param[in] bs the boot sector.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller.
+ */
+static int exfat_scan(UCHAR *bs,ftw_walk *w)
+{
+    exfat_scan_parameters sp;
+    int result;
+
+    memset(&sp,0,sizeof(exfat_scan_parameters));
+    sp.w = w;
+    sp.window_start = EXFAT_EOC;
+
+    if(get_exfat_layout(bs,&sp.el) < 0){
+        etrace("%ws: the boot sector is not recognized",w->path);
+        return (-1);
+    }
+    itrace("exFAT, %u clusters of %u bytes",
+        sp.el.clusters,sp.el.cluster_size);
+
+    ftw_phase_begin(w->ctx,WINX_FTW_PHASE_SCAN);
+    result = ftw_walk_prepare(w,sp.el.cluster_size,sp.el.clusters);
+    if(result == 0){
+        sp.window = winx_tmalloc(EXFAT_FAT_WINDOW * 4);
+        if(sp.window == NULL){
+            etrace("cannot allocate %u bytes of memory",
+                EXFAT_FAT_WINDOW * 4);
+            result = -1;
+        }
+    }
+    if(result == 0){
+        result = add_root_directory(&sp);
+        if(result == 0)
+            result = ftw_walk_directories(w,list_directory,&sp);
+        if(w->ctx)
+            ftw_phase_end(w->ctx,WINX_FTW_PHASE_SCAN,w->ctx->progress.records);
+        if(result == 0 && !sp.bitmap_found){
+            etrace("the allocation bitmap is missing");
+            w->errors ++;
+        }
+    }
+
+    winx_free(sp.window);
+    winx_free(sp.upcase);
+    return result;
+}
+
+/**
+ * @internal
+ * @brief winx_scan_disk analog, but optimized
+ * to scan exFAT-formatted volumes faster.
+ * @details When ctx->frag is set, the free space
+ * summary gets gathered from the allocation bitmap
+ * during the scan.
+ * @return The list of files, NULL indicates failure.
+ */
+winx_file_info *exfat_scan_disk(char volume_letter,
+    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data)
+{
+    return ftw_walk_scan_disk(exfat_scan,volume_letter,
+        flags,fcb,pcb,t,ctx,user_defined_data);
+}
+
+/**
+ * @internal
+ * @brief exfat_scan_disk analog for disk images.
+ * @details Paths of the files look like
+ * \\??\\C:\\images\\exfat.img:\\dir\\file.
+ */
+winx_file_info *exfat_scan_image(wchar_t *path,
+    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data)
+{
+    return ftw_walk_scan_image(exfat_scan,path,
+        flags,fcb,pcb,t,ctx,user_defined_data);
+}
+
+/** @} */
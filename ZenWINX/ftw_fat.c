@@ -0,0 +1,625 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file ftw_fat.c
+ * @brief Fast file tree walk for FAT.
+ * @details The file allocation table is loaded
+ * into memory once, so cluster chains of all the
+ * files cost no reads; consecutive clusters of
+ * the chains are coalesced into blocks. The tree
+ * is walked breadth-first, directories of each
+ * level are read in the order of their clusters.
+ * The scanner reads the volume only through
+ * ftw_walk_read, so it works for volumes and disk
+ * images alike; images get scanned without mounting
+ * them, on Windows and, through POSIX reads, elsewhere.
+ * @addtogroup File
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+#include "ftw_walk.h"
+
+/* the end of a cluster chain, in the table loaded */
+#define FAT_EOC ((ULONG)-1)
+
+/* FAT12/16 volumes have fewer clusters */
+#define FAT12_MAX_CLUSTERS 4084
+#define FAT16_MAX_CLUSTERS 65524
+
+/* a directory holds 65536 entries at most */
+#define FAT_MAX_DIRECTORY_SIZE (65536 * 32)
+
+/* the table is read in portions of this size */
+#define FAT_READ_CHUNK (1024 * 1024)
+
+/* attributes of directory entries */
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT_ATTR_LONG_NAME 0x0F
+#define FAT_ATTR_MASK      0x3F
+
+/* long names consist of 20 parts of 13 characters at most */
+#define FAT_LONG_NAME_PART  13
+#define FAT_LONG_NAME_PARTS 20
+
+/* flags of short names having lowercase letters */
+#define FAT_LOWERCASE_BASE 0x08
+#define FAT_LOWERCASE_EXT  0x10
+
+/* internal structures */
+typedef struct _fat_layout {
+    int type;                   /* 12, 16 or 32 */
+    ULONG bytes_per_sector;
+    ULONG cluster_size;         /* in bytes */
+    ULONG clusters;             /* number of data clusters */
+    ULONGLONG fat_offset;       /* the first table, in bytes */
+    ULONG fat_size;             /* size of a single table, in bytes */
+    ULONGLONG root_offset;      /* the fixed root directory of FAT12/16, in bytes */
+    ULONG root_size;
+    ULONG root_cluster;         /* the root directory of FAT32 */
+    ULONGLONG data_offset;      /* offset of cluster #2, in bytes */
+} fat_layout;
+
+typedef struct _fat_scan_parameters {
+    fat_layout fl;
+    ftw_walk *w;                /* parameters of the walk */
+    ULONG *fat;                 /* next cluster of each cluster, FAT_EOC ends chains */
+} fat_scan_parameters;
+
+/* external functions prototypes */
+void validate_blockmap(winx_file_info *f);
+void ftw_phase_begin(winx_ftw_context *ctx,int phase);
+void ftw_phase_end(winx_ftw_context *ctx,int phase,ULONGLONG items);
+
+/*
+**************************************************
+*             Layout and the table
+**************************************************
+*/
+
+/**
+ * @brief Retrieves the layout from the boot sector.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int get_fat_layout(UCHAR *bs,fat_layout *fl)
+{
+    ULONG spc, reserved, n_fats, root_entries;
+    ULONG fat_sectors, total_sectors, root_sectors;
+    ULONGLONG data_sectors;
+
+    memset(fl,0,sizeof(fat_layout));
+    if(bs[510] != 0x55 || bs[511] != 0xAA)
+        return (-1);
+
+    fl->bytes_per_sector = get_u16(bs + 11);
+    spc = bs[13];
+    reserved = get_u16(bs + 14);
+    n_fats = bs[16];
+    root_entries = get_u16(bs + 17);
+    total_sectors = get_u16(bs + 19);
+    if(total_sectors == 0) total_sectors = get_u32(bs + 32);
+    fat_sectors = get_u16(bs + 22);
+    if(fat_sectors == 0) fat_sectors = get_u32(bs + 36);
+
+    if(fl->bytes_per_sector < 512 || fl->bytes_per_sector > 4096 || \
+      (fl->bytes_per_sector & (fl->bytes_per_sector - 1)) || \
+      spc == 0 || (spc & (spc - 1)) || reserved == 0 || n_fats == 0 || \
+      fat_sectors == 0 || total_sectors == 0)
+        return (-1);
+
+    fl->cluster_size = spc * fl->bytes_per_sector;
+    root_sectors = (root_entries * 32 + fl->bytes_per_sector - 1) / fl->bytes_per_sector;
+    data_sectors = (ULONGLONG)reserved + (ULONGLONG)n_fats * fat_sectors + root_sectors;
+    if(data_sectors >= total_sectors)
+        return (-1);
+    fl->clusters = (ULONG)((total_sectors - data_sectors) / spc);
+
+    if(fl->clusters <= FAT12_MAX_CLUSTERS)
+        fl->type = 12;
+    else if(fl->clusters <= FAT16_MAX_CLUSTERS)
+        fl->type = 16;
+    else
+        fl->type = 32;
+    if((fl->type == 32) != (root_entries == 0))
+        return (-1);
+
+    fl->fat_offset = (ULONGLONG)reserved * fl->bytes_per_sector;
+    fl->fat_size = fat_sectors * fl->bytes_per_sector;
+    fl->root_offset = fl->fat_offset + (ULONGLONG)n_fats * fl->fat_size;
+    fl->root_size = root_entries * 32;
+    fl->root_cluster = (fl->type == 32) ? get_u32(bs + 44) : 0;
+    fl->data_offset = data_sectors * fl->bytes_per_sector;
+
+    /* the table must cover all the clusters */
+    if((ULONGLONG)fl->fat_size * 8 / fl->type < (ULONGLONG)fl->clusters + 2)
+        return (-1);
+    if(fl->type == 32 && (fl->root_cluster < 2 || fl->root_cluster >= fl->clusters + 2))
+        return (-1);
+    return 0;
+}
+
+/**
+ * @brief Loads the first table into memory.
+ * @details Entries get normalized: anything
+ * which isn't a valid cluster number, including
+ * end of chain and bad cluster marks, becomes
+ * FAT_EOC, so the chains never leave the volume.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int load_fat(fat_scan_parameters *sp)
+{
+    fat_layout *fl = &sp->fl;
+    ULONG n = fl->clusters + 2, i, v;
+    ULONG offset, length, chunk, first;
+    UCHAR *raw;
+
+    sp->fat = winx_tmalloc(n * sizeof(ULONG));
+    if(sp->fat == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            n * sizeof(ULONG));
+        return (-1);
+    }
+
+    /* FAT12/16 tables are small, FAT32 ones get read in portions */
+    if(fl->type == 32)
+        length = n * 4;
+    else if(fl->type == 16)
+        length = n * 2;
+    else
+        length = (n * 3 + 1) / 2;
+    length = (length + fl->bytes_per_sector - 1) / fl->bytes_per_sector * fl->bytes_per_sector;
+    chunk = (fl->type == 32) ? min(length,FAT_READ_CHUNK) : length;
+
+    raw = winx_tmalloc(chunk);
+    if(raw == NULL){
+        etrace("cannot allocate %u bytes of memory",chunk);
+        return (-1);
+    }
+
+    for(offset = 0; offset < length; offset += chunk){
+        chunk = min(chunk,length - offset);
+        if(ftw_walk_read(fl->fat_offset + offset,raw,chunk,sp->w) < 0){
+            winx_free(raw);
+            return (-1);
+        }
+        if(fl->type == 32){
+            first = offset / 4;
+            for(i = first; i < n && i < first + chunk / 4; i++){
+                v = get_u32(raw + (i - first) * 4) & 0x0FFFFFFF;
+                sp->fat[i] = (v < 2 || v >= n) ? FAT_EOC : v;
+            }
+            continue;
+        }
+        for(i = 0; i < n; i++){
+            if(fl->type == 16){
+                v = get_u16(raw + i * 2);
+            } else {
+                v = get_u16(raw + i * 3 / 2);
+                v = (i & 1) ? (v >> 4) : (v & 0xFFF);
+            }
+            sp->fat[i] = (v < 2 || v >= n) ? FAT_EOC : v;
+        }
+    }
+
+    winx_free(raw);
+    return 0;
+}
+
+/*
+**************************************************
+*                Cluster chains
+**************************************************
+*/
+
+#define is_valid_cluster(c,sp) ((c) >= 2 && (c) < (sp)->fl.clusters + 2)
+
+/**
+ * @brief Returns the length of the block of
+ * consecutive clusters starting at a cluster
+ * of a chain, the cluster itself included.
+ * @param[out] next receives the cluster
+ * following the block, FAT_EOC at the end.
+ */
+static ULONG get_block(ULONG cluster,ULONG *next,fat_scan_parameters *sp)
+{
+    ULONG length = 1;
+
+    while(sp->fat[cluster] == cluster + 1){
+        cluster ++;
+        length ++;
+    }
+    *next = sp->fat[cluster];
+    return length;
+}
+
+/**
+ * @brief Builds the map of blocks of a file.
+ * @details Files need as many clusters as their
+ * size takes, directories are limited in size as
+ * well. Longer chains, which appear in damaged
+ * tables, get truncated, looped ones included.
+ */
+static void build_blockmap(winx_file_info *f,ULONG cluster,fat_scan_parameters *sp)
+{
+    winx_blockmap *block = NULL;
+    ULONGLONG max_clusters;
+    ULONG length, next;
+
+    if(is_directory(f))
+        max_clusters = FAT_MAX_DIRECTORY_SIZE / sp->fl.cluster_size;
+    else
+        max_clusters = (f->disp.size + sp->fl.cluster_size - 1) / sp->fl.cluster_size;
+
+    while(is_valid_cluster(cluster,sp) && f->disp.clusters < max_clusters){
+        length = get_block(cluster,&next,sp);
+        length = (ULONG)min(length,max_clusters - f->disp.clusters);
+        block = (winx_blockmap *)winx_list_insert((list_entry **)(void *)&f->disp.blockmap,
+            (list_entry *)block,sizeof(winx_blockmap));
+        block->vcn = f->disp.clusters;
+        /* cluster #2 is the first one, like the system reports */
+        block->lcn = cluster - 2;
+        block->length = length;
+        f->disp.clusters += length;
+        if(block == f->disp.blockmap || \
+          block->lcn != (block->prev->lcn + block->prev->length)){
+            f->disp.fragments ++;
+        }
+        cluster = next;
+    }
+}
+
+/**
+ * @brief Reads a directory into the buffer.
+ * @details Blocks of consecutive clusters
+ * are read by a single request each.
+ * @return Number of bytes read, negative
+ * value indicates failure.
+ */
+static LONG read_directory(ftw_directory *d,fat_scan_parameters *sp)
+{
+    ULONG cluster, next, count, length, size = 0;
+
+    if(d->cluster == 0){
+        /* the fixed root directory of FAT12/16 */
+        length = sp->fl.root_size;
+        length = (length + sp->fl.bytes_per_sector - 1) / sp->fl.bytes_per_sector * sp->fl.bytes_per_sector;
+        if(ftw_walk_grow_buffer(&sp->w->buffer,&sp->w->buffer_size,length,0) < 0)
+            return (-1);
+        if(ftw_walk_read(sp->fl.root_offset,sp->w->buffer,length,sp->w) < 0)
+            return (-1);
+        return (LONG)sp->fl.root_size;
+    }
+
+    for(cluster = d->cluster; is_valid_cluster(cluster,sp); cluster = next){
+        if(size >= FAT_MAX_DIRECTORY_SIZE){
+            etrace("%ws: directory is too long",d->f->path);
+            break;
+        }
+        count = get_block(cluster,&next,sp);
+        count = min(count,(FAT_MAX_DIRECTORY_SIZE - size + \
+            sp->fl.cluster_size - 1) / sp->fl.cluster_size);
+        length = count * sp->fl.cluster_size;
+        if(size + length > sp->w->buffer_size){
+            if(ftw_walk_grow_buffer(&sp->w->buffer,&sp->w->buffer_size,
+              max(size + length,sp->w->buffer_size * 2),size) < 0)
+                return (-1);
+        }
+        if(ftw_walk_read(sp->fl.data_offset + (ULONGLONG)(cluster - 2) * sp->fl.cluster_size,
+          sp->w->buffer + size,length,sp->w) < 0)
+            return (-1);
+        size += length;
+    }
+    return (LONG)size;
+}
+
+/*
+**************************************************
+*              Directory entries
+**************************************************
+*/
+
+/**
+ * @brief Returns the checksum of a short name,
+ * kept by long name entries referring to it.
+ */
+static UCHAR short_name_checksum(UCHAR *name)
+{
+    UCHAR sum = 0;
+    int i;
+
+    for(i = 0; i < 11; i++)
+        sum = (UCHAR)(((sum & 1) << 7) + (sum >> 1) + name[i]);
+    return sum;
+}
+
+/**
+ * @brief Gathers a part of a long name.
+ * @details Parts precede the short name entry
+ * in descending order, the last part goes first.
+ * @param[in,out] ordinal the number of the part
+ * gathered last, zero when the sequence breaks.
+ */
+static void add_long_name_part(UCHAR *e,wchar_t *name,int *ordinal,UCHAR *checksum)
+{
+    static const int offsets[FAT_LONG_NAME_PART] = {
+        1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30
+    };
+    int n = e[0] & 0x3F, i;
+
+    if(e[0] & 0x40){
+        if(n < 1 || n > FAT_LONG_NAME_PARTS){
+            *ordinal = 0;
+            return;
+        }
+        *checksum = e[13];
+        name[n * FAT_LONG_NAME_PART] = 0;
+    } else if(n == 0 || *ordinal != n + 1 || *checksum != e[13]){
+        *ordinal = 0;
+        return;
+    }
+
+    /* the name is terminated by zero, unless it fills the part */
+    for(i = 0; i < FAT_LONG_NAME_PART; i++)
+        name[(n - 1) * FAT_LONG_NAME_PART + i] = (wchar_t)get_u16(e + offsets[i]);
+    *ordinal = n;
+}
+
+/**
+ * @brief Converts a short name to wide characters.
+ * @note Characters of the OEM code page above 0x7F
+ * are taken as they are, since the code page of the
+ * volume is unknown.
+ */
+static void convert_short_name(UCHAR *e,wchar_t *name)
+{
+    int i, n, k = 0;
+
+    for(n = 8; n > 0 && e[n - 1] == ' '; n--);
+    for(i = 0; i < n; i++){
+        name[k] = (i == 0 && e[0] == 0x05) ? 0xE5 : e[i];
+        if((e[12] & FAT_LOWERCASE_BASE) && name[k] >= 'A' && name[k] <= 'Z')
+            name[k] += 'a' - 'A';
+        k ++;
+    }
+    for(n = 11; n > 8 && e[n - 1] == ' '; n--);
+    if(n > 8)
+        name[k++] = '.';
+    for(i = 8; i < n; i++){
+        name[k] = e[i];
+        if((e[12] & FAT_LOWERCASE_EXT) && name[k] >= 'A' && name[k] <= 'Z')
+            name[k] += 'a' - 'A';
+        k ++;
+    }
+    name[k] = 0;
+}
+
+/**
+ * @brief Converts a date and time kept
+ * by a directory entry to the system time.
+ * @details FAT keeps the local time, the bias
+ * in effect at the moment is applied, like
+ * the system does.
+ */
+static ULONGLONG convert_time(UCHAR *date,UCHAR *time,UCHAR centiseconds,fat_scan_parameters *sp)
+{
+    ULONGLONG t;
+
+    t = winx_dos2time((unsigned short)get_u16(date),
+        time ? (unsigned short)get_u16(time) : 0,centiseconds);
+    return t ? t - sp->w->time_bias : 0;
+}
+
+/*
+**************************************************
+*               The tree walk
+**************************************************
+*/
+
+/**
+ * @brief Adds the root directory to the file list.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int add_root_directory(fat_scan_parameters *sp)
+{
+    winx_file_info *f;
+    ULONG cluster;
+
+    f = ftw_walk_add_entry(L".",winx_swprintf(L"%ws\\",sp->w->root),sp->w);
+    if(f == NULL)
+        return (-1);
+    f->flags = FILE_ATTRIBUTE_DIRECTORY;
+
+    /* the fixed root directory of FAT12/16 has no clusters */
+    cluster = sp->fl.root_cluster;
+    if(cluster && (sp->w->flags & WINX_FTW_DUMP_FILES)){
+        build_blockmap(f,cluster,sp);
+        validate_blockmap(f);
+    }
+
+    if(sp->w->ctx != NULL)
+        sp->w->ctx->progress.records ++;
+    (void)ftw_walk_report_file(f,sp->w);
+    return ftw_walk_push_directory(f,cluster,0,0,sp->w);
+}
+
+/**
+ * @brief Adds files of a directory to the file list,
+ * subdirectories go to the next level of the walk.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller.
+ */
+static int list_directory(ftw_directory *d,void *p)
+{
+    fat_scan_parameters *sp = (fat_scan_parameters *)p;
+    wchar_t long_name[FAT_LONG_NAME_PARTS * FAT_LONG_NAME_PART + 1];
+    wchar_t short_name[13];
+    winx_file_info *f;
+    UCHAR *e, checksum = 0;
+    ULONG offset, cluster;
+    LONG size;
+    int ordinal = 0;
+    int skip_children;
+
+    size = read_directory(d,sp);
+    if(size < 0){
+        /* skip the directory, like ftw does */
+        sp->w->errors ++;
+        return 0;
+    }
+
+    for(offset = 0; offset + 32 <= (ULONG)size; offset += 32){
+        e = (UCHAR *)sp->w->buffer + offset;
+
+        /* zero marks the end of the directory */
+        if(e[0] == 0) break;
+        if(sp->w->ctx != NULL)
+            sp->w->ctx->progress.records ++;
+
+        /* skip deleted entries */
+        if(e[0] == 0xE5){
+            ordinal = 0;
+            continue;
+        }
+        if((e[11] & FAT_ATTR_MASK) == FAT_ATTR_LONG_NAME){
+            add_long_name_part(e,long_name,&ordinal,&checksum);
+            continue;
+        }
+
+        /* skip volume labels, . and .. entries */
+        if((e[11] & FAT_ATTR_VOLUME_ID) || e[0] == '.'){
+            ordinal = 0;
+            continue;
+        }
+
+        /* long names are valid when all the parts are found */
+        convert_short_name(e,short_name);
+        if(ordinal != 1 || checksum != short_name_checksum(e) || long_name[0] == 0)
+            wcscpy(long_name,short_name);
+        ordinal = 0;
+
+        f = ftw_walk_add_entry(long_name,ftw_walk_build_path(d->f->path,long_name),sp->w);
+        if(f == NULL)
+            return (-1);
+
+        /* save file attributes and access times */
+        f->flags = e[11] & FAT_ATTR_MASK;
+        if(f->flags == 0) f->flags = FILE_ATTRIBUTE_NORMAL;
+        f->creation_time = convert_time(e + 16,e + 14,e[13],sp);
+        f->last_modification_time = convert_time(e + 24,e + 22,0,sp);
+        f->last_access_time = convert_time(e + 18,NULL,0,sp);
+        f->disp.size = is_directory(f) ? 0 : get_u32(e + 28);
+
+        /* the high word of the first cluster is used by FAT32 only */
+        cluster = get_u16(e + 26);
+        if(sp->fl.type == 32)
+            cluster |= get_u16(e + 20) << 16;
+        if(sp->w->flags & WINX_FTW_DUMP_FILES){
+            build_blockmap(f,cluster,sp);
+            validate_blockmap(f);
+        }
+
+        skip_children = ftw_walk_report_file(f,sp->w);
+        if(ftw_walk_check_for_termination(sp->w)){
+            itrace("terminated by user");
+            return (-2);
+        }
+
+        /* scan subdirectories */
+        if(is_directory(f) && !skip_children && is_valid_cluster(cluster,sp)){
+            if(ftw_walk_push_directory(f,cluster,0,0,sp->w) < 0)
+                return (-1);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Scans a FAT-formatted volume.
+ * @param[in] bs the boot sector.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller.
+ */
+static int fat_scan(UCHAR *bs,ftw_walk *w)
+{
+    fat_scan_parameters sp;
+    int result;
+
+    memset(&sp,0,sizeof(fat_scan_parameters));
+    sp.w = w;
+
+    if(get_fat_layout(bs,&sp.fl) < 0){
+        etrace("%ws: the boot sector is not recognized",w->path);
+        return (-1);
+    }
+    itrace("FAT%u, %u clusters of %u bytes",
+        sp.fl.type,sp.fl.clusters,sp.fl.cluster_size);
+
+    ftw_phase_begin(w->ctx,WINX_FTW_PHASE_SCAN);
+    result = ftw_walk_prepare(w,sp.fl.cluster_size,sp.fl.clusters);
+    if(result == 0)
+        result = load_fat(&sp);
+    if(result == 0){
+        result = add_root_directory(&sp);
+        if(result == 0)
+            result = ftw_walk_directories(w,list_directory,&sp);
+        if(w->ctx)
+            ftw_phase_end(w->ctx,WINX_FTW_PHASE_SCAN,w->ctx->progress.records);
+    }
+
+    winx_free(sp.fat);
+    return result;
+}
+
+/**
+ * @internal
+ * @brief winx_scan_disk analog, but optimized
+ * to scan FAT-formatted volumes faster.
+ * @details Reads the file allocation table and
+ * directories directly. The list is the same as
+ * the general purpose walk produces.
+ * @return The list of files, NULL indicates failure.
+ */
+winx_file_info *fat_scan_disk(char volume_letter,
+    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data)
+{
+    return ftw_walk_scan_disk(fat_scan,volume_letter,
+        flags,fcb,pcb,t,ctx,user_defined_data);
+}
+
+/**
+ * @internal
+ * @brief fat_scan_disk analog for disk images.
+ * @details Paths of the files look like
+ * \\??\\C:\\images\\fat.img:\\dir\\file.
+ */
+winx_file_info *fat_scan_image(wchar_t *path,
+    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data)
+{
+    return ftw_walk_scan_image(fat_scan,path,
+        flags,fcb,pcb,t,ctx,user_defined_data);
+}
+
+/** @} */
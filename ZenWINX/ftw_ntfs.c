@@ -60,6 +60,7 @@ enum {
 
 typedef struct {
     ULONGLONG BaseMftId;             /* base mft index */
+    ULONG SequenceNumber;            /* sequence number of the base record */
     ULONGLONG ParentDirectoryMftId;  /* mft index of parent directory */
     ULONG Flags;                     /* combination of FILE_ATTRIBUTE_xxx flags defined in winnt.h */
     UCHAR NameType;                  /**/
@@ -67,22 +68,98 @@ typedef struct {
     ULONGLONG CreationTime;          /* in the standard time format */
     ULONGLONG LastWriteTime;         /**/
     ULONGLONG LastAccessTime;        /**/
+    ULONG ReparseTag;                /* the reparse point tag, zero for regular files */
+    wchar_t *ReparseTarget;          /* decoded target of the reparse point, may be NULL */
 } my_file_information;
 
+/* a single run of the $Mft data */
+typedef struct _mft_run {
+    ULONGLONG vcn;
+    ULONGLONG lcn;
+    ULONGLONG length;
+} mft_run;
+
+/* size of a block of file records read at once from disk images */
+#define MFT_IMAGE_CHUNK_SIZE (1024 * 1024)
+
+/*
+* Disk images cannot be queried by FSCTL_GET_NTFS_FILE_RECORD,
+* so file records get read through the map of the $Mft data.
+*/
+typedef struct _mft_image {
+    mft_run *runs;              /* map of the $Mft data */
+    ULONG n_runs;               /* number of entries in the map */
+    ULONGLONG next_vcn;         /* the first VCN not mapped yet */
+    ULONGLONG mapped_records;   /* number of records covered by the map */
+    char *chunk;                /* a block of file records read recently */
+    ULONGLONG chunk_first;      /* the first record in the chunk */
+    ULONGLONG chunk_records;    /* number of records in the chunk, zero if it's empty */
+} mft_image;
+
+/* number of child records kept in memory */
+#define CHILD_CACHE_SIZE 64
+
+/*
+* Attribute lists of heavily fragmented files refer
+* to the same child records many times, and the scan
+* meets child records shortly before their base records,
+* so recently seen child records are kept in memory.
+*/
+typedef struct _child_record {
+    ULONGLONG mft_id;           /* the record number, (ULONGLONG)(-1) for empty slots */
+    ULONGLONG last_use;         /* the cache clock value at the last access */
+    NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob; /* allocated on first use of the slot */
+} child_record;
+
+typedef struct _child_cache {
+    child_record slots[CHILD_CACHE_SIZE];
+    ULONGLONG clock;
+    ULONG fetched;              /* child records fetched for the current file */
+    char *attr_list;            /* nonresident attribute lists are read here */
+    ULONGLONG attr_list_size;   /* size of the buffer, in bytes */
+} child_cache;
+
+/* number of buckets in the table of stream names */
+#define STREAM_NAMES_HASH_SIZE 256
+
+/*
+* Names of streams repeat a lot (Zone.Identifier and
+* the like), so each one is stored once and entries of
+* the file list refer to the copy until the name of the
+* file gets prepended.
+*/
+typedef struct _stream_name {
+    struct _stream_name *next;  /* the next name in the bucket */
+    ULONG hash;
+    USHORT length;              /* in characters */
+    wchar_t name[1];            /* the null-terminated name */
+} stream_name;
+
 typedef struct _mft_scan_parameters {
     int mft_scan_direction;     /* mft scan direction, right to left in the current algorithm */
     mft_layout ml;              /* mft layout structure */
     char volume_letter;         /* volume letter */
+    wchar_t *root;              /* path prepended to paths of files, \??\X: for volumes */
     WINX_FILE *f_volume;        /* volume handle */
+    mft_image *image;           /* disk image specific data, NULL for volumes */
+    struct _spill *spill;       /* external sort of files found, NULL unless memory is bounded */
     unsigned long flags;        /* combination of WINX_FTW_xxx flags */
     ftw_filter_callback fcb;    /**/
     ftw_progress_callback pcb;  /**/
     ftw_terminator t;           /* termination callback */
+    winx_ftw_context *ctx;      /* batched progress reporting context, may be NULL */
     void *user_defined_data;    /* pointer to data to be passed to all callbacks */
     my_file_information mfi;    /* a structure receiving file information */
     unsigned long processed_attr_list_entries; /* just for debugging purposes */
     unsigned long errors;       /* number of critical errors preventing gathering of complete information */
     winx_file_info **filelist;  /* list of files */
+    stream_name *stream_names[STREAM_NAMES_HASH_SIZE]; /* interned names of streams */
+    child_cache cc;             /* child records and attribute lists read recently */
+    winx_mft_cache *records;    /* file records cache, NULL if it cannot be created */
+    winx_mft_cache *own_records; /* private cache, used when the context gives none */
+    int records_volume;         /* the volume slot in the cache, negative if not attached */
+    ULONG block_records;        /* number of records per block of the cache */
+    char *block;                /* a block of records being fixed up for the cache */
 } mft_scan_parameters;
 
 /* an auxiliary structure for binary search */
@@ -102,8 +179,33 @@ typedef void (*attribute_handler)(PATTRIBUTE pattr,mft_scan_parameters *sp);
 static void analyze_resident_stream(PRESIDENT_ATTRIBUTE pr_attr,mft_scan_parameters *sp);
 static void analyze_non_resident_stream(PNONRESIDENT_ATTRIBUTE pnr_attr,mft_scan_parameters *sp);
 static winx_file_info * find_filelist_entry(wchar_t *attr_name,mft_scan_parameters *sp);
+static NTSTATUS get_image_file_record(ULONGLONG mft_id,
+        NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,mft_scan_parameters *sp);
+static NTSTATUS get_image_child_record(ULONGLONG mft_id,
+        NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,mft_scan_parameters *sp);
+static NTSTATUS complete_image_file_record(ULONGLONG mft_id,
+        NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,mft_scan_parameters *sp);
+static int get_image_layout(mft_scan_parameters *sp);
+static NTSTATUS read_mft_records(ULONGLONG first,ULONGLONG count,
+    char *buffer,mft_scan_parameters *sp);
+static NTSTATUS get_cached_file_record(ULONGLONG mft_id,
+        NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,mft_scan_parameters *sp);
 
 void validate_blockmap(winx_file_info *f);
+int ftw_batch_update(winx_ftw_context *ctx,void *user_defined_data);
+void ftw_phase_begin(winx_ftw_context *ctx,int phase);
+void ftw_phase_end(winx_ftw_context *ctx,int phase,ULONGLONG items);
+void frag_stats_add_run(winx_frag_stats *fs,winx_file_info *f,
+    ULONGLONG length,int new_fragment);
+void frag_stats_commit_file(winx_frag_stats *fs,winx_file_info *f);
+int spill_add(struct _spill *s,winx_file_info *f);
+int mft_cache_attach(winx_mft_cache *c,wchar_t *name,ULONG record_size,
+    ULONG cluster_size,int flush,ULONG *block_records);
+void mft_cache_detach(winx_mft_cache *c,int volume);
+int mft_cache_lookup(winx_mft_cache *c,int volume,ULONGLONG mft_id,char *record);
+void mft_cache_store(winx_mft_cache *c,int volume,ULONGLONG first,
+    ULONG count,char *records,ULONGLONG valid);
+void mft_cache_invalidate(winx_mft_cache *c,int volume,ULONGLONG mft_id);
 
 /*
 **************************************************
@@ -113,19 +215,7 @@ void validate_blockmap(winx_file_info *f);
 
 #ifdef TEST_NTFS_SCANNER
 
-/* a simple pseudo-random number generator */
-long r = 1;
-
-static void srnd(long x)
-{
-    r = x;
-}
-
-/* generates numbers in range 0 - 32767 */
-static long rnd(void)
-{
-    return(((r = r * 214013 + 2531011) >> 16) & 0x7fff);
-}
+static winx_rnd_state test_rnd;
 
 /* corrupts a file record in random order */
 static void randomize_file_record_data(char *record, unsigned long size)
@@ -134,16 +224,16 @@ static void randomize_file_record_data(char *record, unsigned long size)
     long factor, i;
     
     /* randomize a half of records */
-    if(rnd() % 2) return;
+    if(winx_rnd(&test_rnd) % 2) return;
     
     /* set amount of data to be corrupted */
-    i = rnd() % (sizeof(factors) / sizeof(long));
+    i = winx_rnd(&test_rnd) % (sizeof(factors) / sizeof(long));
     factor = factors[i];
     
     /* randomize data, skip FileReferenceNumber and FileRecordLength */
     for(i = sizeof(ULONGLONG) + sizeof(ULONG); i < size; i++){
         if(i % factor == 0)
-            record[i] = (char)rnd();
+            record[i] = (char)winx_rnd(&test_rnd);
     }
 }
 
@@ -155,11 +245,20 @@ static void randomize_file_record_data(char *record, unsigned long size)
 **************************************************
 */
 
+/**
+ * @note This routine is called for each attribute
+ * of each record, so when the batched progress
+ * reporting is in use it just checks the flag
+ * set at the batch boundary.
+ */
 static int ftw_ntfs_check_for_termination(mft_scan_parameters *sp)
 {
     if(!(sp->flags & WINX_FTW_ALLOW_PARTIAL_SCAN) && sp->errors)
         return 1;
     
+    if(sp->ctx != NULL)
+        return sp->ctx->terminated;
+    
     if(sp->t == NULL)
         return 0;
     
@@ -168,16 +267,25 @@ static int ftw_ntfs_check_for_termination(mft_scan_parameters *sp)
 
 /**
  * @note
- * - lsn, buffer, length must be valid before this call.
- * - length must be an integral of the sector size.
+ * - offset, buffer, length must be valid before this call.
+ * - for volumes length must be an integral of the sector size.
  */
-static NTSTATUS read_sectors(ULONGLONG lsn,PVOID buffer,ULONG length,mft_scan_parameters *sp)
+static NTSTATUS read_volume(ULONGLONG byte_offset,PVOID buffer,ULONG length,mft_scan_parameters *sp)
 {
     IO_STATUS_BLOCK iosb;
     LARGE_INTEGER offset;
     NTSTATUS status;
 
-    offset.QuadPart = lsn * sp->ml.sector_size;
+    /* partitions of disk images start at their base */
+    offset.QuadPart = byte_offset + sp->f_volume->base.QuadPart;
+    if(sp->f_volume->vdisk){
+        /* virtual disks get read through their allocation tables */
+        if(winx_vdisk_read(sp->f_volume->vdisk,offset.QuadPart,buffer,length) != length){
+            etrace("cannot read %u bytes at %I64u",length,offset.QuadPart);
+            return STATUS_UNSUCCESSFUL;
+        }
+        return STATUS_SUCCESS;
+    }
     status = NtReadFile(winx_fileno(sp->f_volume),NULL,NULL,NULL,&iosb,buffer,length,&offset,NULL);
     if(NT_SUCCESS(status)){
         status = NtWaitForSingleObject(winx_fileno(sp->f_volume),FALSE,NULL);
@@ -192,6 +300,16 @@ static NTSTATUS read_sectors(ULONGLONG lsn,PVOID buffer,ULONG length,mft_scan_pa
     return status;
 }
 
+/**
+ * @note
+ * - lsn, buffer, length must be valid before this call.
+ * - length must be an integral of the sector size.
+ */
+static NTSTATUS read_sectors(ULONGLONG lsn,PVOID buffer,ULONG length,mft_scan_parameters *sp)
+{
+    return read_volume(lsn * sp->ml.sector_size,buffer,length,sp);
+}
+
 /**
  * @brief Retrieves a single file record from the MFT.
  * @note sp->f_volume and sp->ml.file_record_buffer_size
@@ -205,6 +323,9 @@ static NTSTATUS get_file_record(ULONGLONG mft_id,
     IO_STATUS_BLOCK iosb;
     NTSTATUS status;
 
+    if(sp->image)
+        return get_image_file_record(mft_id,nfrob,sp);
+
     nfrib.FileReferenceNumber = mft_id;
 
     /* required by x64 systems, otherwise it trashes stack */
@@ -230,6 +351,149 @@ static NTSTATUS get_file_record(ULONGLONG mft_id,
     return status;
 }
 
+/*
+**************************************************
+*               Child records cache
+**************************************************
+*/
+
+static void init_child_cache(mft_scan_parameters *sp)
+{
+    int i;
+    
+    memset(&sp->cc,0,sizeof(child_cache));
+    for(i = 0; i < CHILD_CACHE_SIZE; i++)
+        sp->cc.slots[i].mft_id = (ULONGLONG)(-1);
+}
+
+static void release_child_cache(mft_scan_parameters *sp)
+{
+    int i;
+    
+    for(i = 0; i < CHILD_CACHE_SIZE; i++)
+        winx_free(sp->cc.slots[i].nfrob);
+    winx_free(sp->cc.attr_list);
+    init_child_cache(sp);
+}
+
+/**
+ * @brief Looks for a child record in the cache.
+ * @return The slot, NULL if the record isn't cached.
+ */
+static child_record *find_child_record(ULONGLONG mft_id,mft_scan_parameters *sp)
+{
+    int i;
+    
+    for(i = 0; i < CHILD_CACHE_SIZE; i++){
+        if(sp->cc.slots[i].mft_id == mft_id){
+            sp->cc.slots[i].last_use = ++sp->cc.clock;
+            return &sp->cc.slots[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Checks whether a record has been
+ * fetched already as a child of its base record.
+ */
+static int is_cached_child_record(ULONGLONG mft_id,mft_scan_parameters *sp)
+{
+    child_record *c = find_child_record(mft_id,sp);
+    FILE_RECORD_HEADER *frh;
+    
+    if(c == NULL)
+        return 0;
+    frh = (FILE_RECORD_HEADER *)c->nfrob->FileRecordBuffer;
+    return (frh->BaseFileRecord != 0);
+}
+
+/**
+ * @brief Returns the least recently used slot
+ * of the cache, emptied for a new record.
+ * @return NULL if there is not enough memory.
+ */
+static child_record *get_child_slot(mft_scan_parameters *sp)
+{
+    child_record *c = &sp->cc.slots[0];
+    int i;
+    
+    for(i = 1; i < CHILD_CACHE_SIZE; i++){
+        if(sp->cc.slots[i].last_use < c->last_use)
+            c = &sp->cc.slots[i];
+    }
+    if(c->nfrob == NULL){
+        c->nfrob = winx_tmalloc(sp->ml.file_record_buffer_size);
+        if(c->nfrob == NULL){
+            etrace("cannot allocate %u bytes of memory",
+                sp->ml.file_record_buffer_size);
+            return NULL;
+        }
+    }
+    c->mft_id = (ULONGLONG)(-1);
+    c->last_use = ++sp->cc.clock;
+    return c;
+}
+
+/**
+ * @brief Keeps a child record met by
+ * the scan for its base record.
+ */
+static void cache_child_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,mft_scan_parameters *sp)
+{
+    ULONGLONG mft_id = GetMftIdFromFRN(nfrob->FileReferenceNumber);
+    child_record *c;
+    
+    if(find_child_record(mft_id,sp))
+        return;
+    c = get_child_slot(sp);
+    if(c == NULL)
+        return;
+    memcpy(c->nfrob,nfrob,sp->ml.file_record_buffer_size);
+    c->mft_id = mft_id;
+}
+
+/**
+ * @brief Retrieves a child record referred
+ * by an attribute list, using the cache.
+ * @return The record which stays valid up to
+ * the next call, NULL indicates failure.
+ */
+static NTFS_FILE_RECORD_OUTPUT_BUFFER *get_child_record(ULONGLONG mft_id,mft_scan_parameters *sp)
+{
+    child_record *c;
+    NTSTATUS status;
+    
+    c = find_child_record(mft_id,sp);
+    if(c){
+        if(sp->ctx) sp->ctx->progress.child_hits ++;
+        return c->nfrob;
+    }
+    
+    c = get_child_slot(sp);
+    if(c == NULL){
+        sp->errors ++;
+        return NULL;
+    }
+    
+    status = get_cached_file_record(mft_id,c->nfrob,sp);
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot read %I64u file record",mft_id);
+        return NULL;
+    }
+    sp->cc.fetched ++;
+    if(sp->ctx) sp->ctx->progress.child_records ++;
+    
+    /* FSCTL_GET_NTFS_FILE_RECORD may return a preceding record */
+    if(GetMftIdFromFRN(c->nfrob->FileReferenceNumber) != mft_id){
+        etrace("cannot get %I64u file record",mft_id);
+        c->mft_id = (ULONGLONG)(-1);
+        return NULL;
+    }
+    c->mft_id = mft_id;
+    return c->nfrob;
+}
+
 /**
  * @brief Enumerates attributes contained in the specified MFT record.
  * @param[in] frh pointer to the file record header.
@@ -315,11 +579,82 @@ static wchar_t * get_default_attribute_name(ATTRIBUTE_TYPE attr_type)
     return default_attribute_names[i].AttributeName;
 }
 
+/* the name used for the unnamed $DATA and $I30 streams */
+static wchar_t empty_stream_name[] = L"";
+
+/* names never appended to names of files */
+static wchar_t *hidden_stream_names[] = {
+    L"$DATA",
+    L"$I30",              /* required by get_directory_information */
+    L"$INDEX_ALLOCATION",
+    NULL
+};
+
+/**
+ * @brief Returns the interned copy of a stream name.
+ * @param[in] name the name, not null-terminated.
+ * @param[in] length length of the name, in characters.
+ * @note Memory gets allocated only when
+ * the name is encountered first time.
+ */
+static wchar_t *intern_stream_name(wchar_t *name,USHORT length,mft_scan_parameters *sp)
+{
+    stream_name *n;
+    ULONG hash = 2166136261;
+    USHORT i;
+    
+    for(i = 0; hidden_stream_names[i]; i++){
+        if(wcslen(hidden_stream_names[i]) == length && \
+          memcmp(hidden_stream_names[i],name,length * sizeof(wchar_t)) == 0)
+            return empty_stream_name;
+    }
+    
+    /* FNV-1a */
+    for(i = 0; i < length; i++)
+        hash = (hash ^ name[i]) * 16777619;
+    
+    for(n = sp->stream_names[hash % STREAM_NAMES_HASH_SIZE]; n; n = n->next){
+        if(n->hash == hash && n->length == length && \
+          memcmp(n->name,name,length * sizeof(wchar_t)) == 0)
+            return n->name;
+    }
+    
+    n = winx_malloc(sizeof(stream_name) + length * sizeof(wchar_t));
+    n->hash = hash;
+    n->length = length;
+    memcpy(n->name,name,length * sizeof(wchar_t));
+    n->name[length] = 0;
+    n->next = sp->stream_names[hash % STREAM_NAMES_HASH_SIZE];
+    sp->stream_names[hash % STREAM_NAMES_HASH_SIZE] = n;
+    return n->name;
+}
+
+static void release_stream_names(mft_scan_parameters *sp)
+{
+    stream_name *n, *next;
+    int i;
+    
+    for(i = 0; i < STREAM_NAMES_HASH_SIZE; i++){
+        for(n = sp->stream_names[i]; n; n = next){
+            next = n->next;
+            winx_free(n);
+        }
+        sp->stream_names[i] = NULL;
+    }
+}
+
+/**
+ * @brief Returns the name of a stream
+ * to be appended to the name of the file.
+ * @return The interned name which must not
+ * be released, NULL for attributes which
+ * are not streams.
+ */
 static wchar_t * get_attribute_name(ATTRIBUTE *attr,mft_scan_parameters *sp)
 {
     ATTRIBUTE_TYPE attr_type;
     wchar_t *default_attr_name = NULL;
-    wchar_t *attr_name;
+    USHORT length;
 
     /* get the default name of the attribute */
     attr_type = attr->AttributeType;
@@ -338,33 +673,21 @@ static wchar_t * get_attribute_name(ATTRIBUTE *attr,mft_scan_parameters *sp)
         return NULL;
     }
     
-    /* allocate memory */
-    attr_name = winx_malloc((MAX_PATH + 1) * sizeof(wchar_t));
-    
-    attr_name[0] = 0;
-    if(attr->NameLength){
-        /* NameLength is always less than MAX_PATH! */
-        (void)wcsncpy(attr_name,(wchar_t *)((char *)attr + attr->NameOffset),
-            attr->NameLength);
-        attr_name[attr->NameLength] = 0;
-    }
-    
-    if(attr_name[0] == 0){
-        (void)wcsncpy(attr_name,default_attr_name,MAX_PATH);
-        attr_name[MAX_PATH - 1] = 0;
+    /* the name is borrowed from the record, it's always less than MAX_PATH */
+    length = attr->NameLength;
+    if(length && (ULONG)attr->NameOffset + length * sizeof(wchar_t) > attr->Length){
+        etrace("name of attribute 0x%x is corrupted",(UINT)attr_type);
+        return NULL;
     }
-
-    /* never append the $DATA attribute name */
-    if(wcscmp(attr_name,L"$DATA") == 0) attr_name[0] = 0;
-    if(wcscmp(attr_name,L":$DATA") == 0) attr_name[0] = 0;
+    if(length && ((wchar_t *)((char *)attr + attr->NameOffset))[0] == 0)
+        length = 0;
+    if(length)
+        return intern_stream_name((wchar_t *)((char *)attr + attr->NameOffset),length,sp);
     
-    /* never append index allocation attribute names - required by get_directory_information */
-    if(wcscmp(attr_name,L"$I30") == 0) attr_name[0] = 0;
-    if(wcscmp(attr_name,L":$I30") == 0) attr_name[0] = 0;
-    if(wcscmp(attr_name,L"$INDEX_ALLOCATION") == 0) attr_name[0] = 0;
-    if(wcscmp(attr_name,L":$INDEX_ALLOCATION") == 0) attr_name[0] = 0;
-    
-    return attr_name;
+    /* never append the $DATA and index allocation attribute names */
+    if(attr_type == AttributeData || attr_type == AttributeIndexAllocation)
+        return empty_stream_name;
+    return default_attr_name;
 }
 
 /*
@@ -465,6 +788,9 @@ static int get_mft_layout(mft_scan_parameters *sp)
     if(sp == NULL)
         return (-1);
     
+    if(sp->image)
+        return get_image_layout(sp);
+    
     /* reset sp->ml structure */
     memset(&sp->ml,0,sizeof(mft_layout));
 
@@ -534,12 +860,12 @@ static int get_mft_layout(mft_scan_parameters *sp)
 */
 
 static void analyze_single_attribute(ULONGLONG mft_id,FILE_RECORD_HEADER *frh,
-                ATTRIBUTE_TYPE attr_type,wchar_t *attr_name,USHORT attr_number,mft_scan_parameters *sp)
+                ATTRIBUTE_TYPE attr_type,wchar_t *attr_name,USHORT name_length,
+                USHORT attr_number,mft_scan_parameters *sp)
 {
     ATTRIBUTE *attr;
     USHORT attr_offset;
 
-    int name_length;
     ULONG attr_length;
     wchar_t *name = NULL;
     BOOLEAN attribute_found = FALSE;
@@ -586,7 +912,6 @@ static void analyze_single_attribute(ULONGLONG mft_id,FILE_RECORD_HEADER *frh,
                     attribute_found = TRUE;
             } else {
                 if(name != NULL){
-                    name_length = (int)wcslen(attr_name);
                     if(name_length == attr->NameLength){
                         if(memcmp((void *)attr_name,(void *)name,name_length * sizeof(wchar_t)) == 0){
                             if(attr->AttributeNumber == attr_number)
@@ -597,6 +922,12 @@ static void analyze_single_attribute(ULONGLONG mft_id,FILE_RECORD_HEADER *frh,
             }
         }
         
+        /* attribute lists never reside in child records */
+        if(attribute_found && attr_type == AttributeAttributeList){
+            etrace("attribute list found in %I64u child record",mft_id);
+            return;
+        }
+        
         if(attribute_found){
             /* uncomment next lines if you need debugging information on attribute list entries */
             /*if(attr->Nonresident) resident_status = "Nonresident";
@@ -618,11 +949,10 @@ static void analyze_single_attribute(ULONGLONG mft_id,FILE_RECORD_HEADER *frh,
 }
 
 static void analyze_attribute_from_mft_record(ULONGLONG mft_id,ATTRIBUTE_TYPE attr_type,
-                wchar_t *attr_name,USHORT attr_number,mft_scan_parameters *sp)
+                wchar_t *attr_name,USHORT name_length,USHORT attr_number,mft_scan_parameters *sp)
 {
-    NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob = NULL;
+    NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob;
     FILE_RECORD_HEADER *frh;
-    NTSTATUS status;
     
     /*
     * Skip attributes stored in the base mft record,
@@ -633,28 +963,10 @@ static void analyze_attribute_from_mft_record(ULONGLONG mft_id,ATTRIBUTE_TYPE at
         return;
     }
     
-    /* allocate memory for a single mft record */
-    nfrob = winx_tmalloc(sp->ml.file_record_buffer_size);
-    if(nfrob == NULL){
-        etrace("cannot allocate %u bytes of memory",
-            sp->ml.file_record_buffer_size);
-        sp->errors ++;
-        return;
-    }
-    
     /* get the specified mft record */
-    status = get_file_record(mft_id,nfrob,sp);
-    if(!NT_SUCCESS(status)){
-        strace(status,"cannot read %I64u file record",mft_id);
-        winx_free(nfrob);
+    nfrob = get_child_record(mft_id,sp);
+    if(nfrob == NULL){
         /* file record index seems to be invalid itself */
-        /*sp->errors ++;*/
-        return;
-    }
-    if(GetMftIdFromFRN(nfrob->FileReferenceNumber) != mft_id){
-        etrace("cannot get %I64u file record",mft_id);
-        winx_free(nfrob);
-        /*sp->errors ++;*/
         return;
     }
     
@@ -663,26 +975,20 @@ static void analyze_attribute_from_mft_record(ULONGLONG mft_id,ATTRIBUTE_TYPE at
     if(!is_file_record(frh)){
         etrace("%I64u file record has invalid type %u",
             mft_id,frh->Ntfs.Type);
-        winx_free(nfrob);
         return;
     }
     if(!(frh->Flags & 0x1)){
         etrace("%I64u file record is marked as free",mft_id);
-        winx_free(nfrob);
         return;
     }
 
     if(frh->BaseFileRecord == 0){
         etrace("%I64u is not a child record",mft_id);
-        winx_free(nfrob);
         return;
     }
 
     /* search for the specified attribute */
-    analyze_single_attribute(mft_id,frh,attr_type,attr_name,attr_number,sp);
-
-    /* free allocated memory */
-    winx_free(nfrob);
+    analyze_single_attribute(mft_id,frh,attr_type,attr_name,name_length,attr_number,sp);
 }
 
 static void analyze_attribute_from_attribute_list(ATTRIBUTE_LIST *attr_list_entry,mft_scan_parameters *sp)
@@ -692,7 +998,7 @@ static void analyze_attribute_from_attribute_list(ATTRIBUTE_LIST *attr_list_entr
     USHORT attr_number;
     wchar_t *attr_name = NULL;
     wchar_t *name_src;
-    int length;
+    USHORT length;
     int empty_name = 0;
 
     /*
@@ -702,7 +1008,7 @@ static void analyze_attribute_from_attribute_list(ATTRIBUTE_LIST *attr_list_entr
     * by the attribute list entry.
     */
 
-    /* 1. save the name of the attribute */
+    /* 1. borrow the name of the attribute from the list */
     length = attr_list_entry->NameLength;
     name_src = (wchar_t *)((char *)attr_list_entry + attr_list_entry->NameOffset);
     
@@ -713,13 +1019,12 @@ static void analyze_attribute_from_attribute_list(ATTRIBUTE_LIST *attr_list_entr
     else if(name_src[0] == 0)
         empty_name = 1; /* name is empty */
     
-    if(!empty_name){
-        attr_name = winx_malloc((length + 1) * sizeof(wchar_t));
-        wcsncpy(attr_name,name_src,length);
-        attr_name[length] = 0;
-    }
+    if(!empty_name)
+        attr_name = name_src;
+    else
+        length = 0;
 
-    /* attr_name is NULL here for empty names */
+    /* attr_name is NULL here for empty names, it's not null-terminated otherwise */
     
     /* 2. save the attribute type */
     attr_type = attr_list_entry->AttributeType;
@@ -731,10 +1036,7 @@ static void analyze_attribute_from_attribute_list(ATTRIBUTE_LIST *attr_list_entr
     attr_number = attr_list_entry->AttributeNumber;
     
     /* 5. analyze a single attribute */
-    analyze_attribute_from_mft_record(child_record_mft_id,attr_type,attr_name,attr_number,sp);
-    
-    /* 6. free resources */
-    winx_free(attr_name);
+    analyze_attribute_from_mft_record(child_record_mft_id,attr_type,attr_name,length,attr_number,sp);
 }
 
 static void analyze_resident_attribute_list(PRESIDENT_ATTRIBUTE pr_attr,mft_scan_parameters *sp)
@@ -809,6 +1111,12 @@ static void update_file_name(PRESIDENT_ATTRIBUTE pr_attr,mft_scan_parameters *sp
         return;
     }
     
+    if(FIELD_OFFSET(FILENAME_ATTRIBUTE,Name) + fn->NameLength * sizeof(wchar_t) > pr_attr->ValueLength){
+        etrace("FILENAME_ATTRIBUTE is truncated, mft index = %I64u",
+            sp->mfi.BaseMftId);
+        return;
+    }
+    
     if(fn->Name[0] == 0){
         etrace("empty name found (2), mft index = %I64u",
             sp->mfi.BaseMftId);
@@ -844,17 +1152,84 @@ static void update_file_name(PRESIDENT_ATTRIBUTE pr_attr,mft_scan_parameters *sp
     }
 }
 
-static void handle_reparse_point(PRESIDENT_ATTRIBUTE pr_attr,mft_scan_parameters *sp)
+static void set_reparse_target(wchar_t *target,ULONG length,mft_scan_parameters *sp)
 {
-    REPARSE_POINT *rp;
+    winx_free(sp->mfi.ReparseTarget);
+    sp->mfi.ReparseTarget = winx_malloc((length + 1) * sizeof(wchar_t));
+    memcpy(sp->mfi.ReparseTarget,target,length * sizeof(wchar_t));
+    sp->mfi.ReparseTarget[length] = 0;
+}
 
-    rp = (REPARSE_POINT *)((char *)pr_attr + pr_attr->ValueOffset);
-    if(pr_attr->ValueLength >= sizeof(ULONG))
-        itrace("reparse tag = 0x%x",rp->ReparseTag);
-    else
-        etrace("REPARSE_POINT attribute is too short");
+/**
+ * @brief Decodes the reparse point data.
+ * @details Saves the tag of any reparse point,
+ * the target of symbolic links and junctions and
+ * the compression method of files compressed by WOF.
+ * @param[in] rp the reparse point data.
+ * @param[in] length the length of the data, in bytes.
+ */
+static void decode_reparse_point(REPARSE_POINT *rp,ULONG length,mft_scan_parameters *sp)
+{
+    MOUNT_POINT_REPARSE_DATA *mp;
+    WOF_REPARSE_DATA *wof;
+    wchar_t *wof_methods[] = { L"XPRESS4K", L"LZX", L"XPRESS8K", L"XPRESS16K" };
+    char *names;
+    ULONG data_length, header_length;
+    USHORT offset, name_length;
     
     sp->mfi.Flags |= FILE_ATTRIBUTE_REPARSE_POINT;
+    
+    header_length = FIELD_OFFSET(REPARSE_POINT,ReparseData);
+    if(length < header_length){
+        etrace("REPARSE_POINT attribute is too short");
+        return;
+    }
+    sp->mfi.ReparseTag = rp->ReparseTag;
+    data_length = min(rp->ReparseDataLength,length - header_length);
+    
+    switch(rp->ReparseTag){
+    case IO_REPARSE_TAG_MOUNT_POINT:
+    case IO_REPARSE_TAG_SYMLINK:
+        mp = (MOUNT_POINT_REPARSE_DATA *)rp->ReparseData;
+        header_length = sizeof(MOUNT_POINT_REPARSE_DATA);
+        if(rp->ReparseTag == IO_REPARSE_TAG_SYMLINK)
+            header_length += sizeof(ULONG); /* flags */
+        if(data_length < header_length)
+            break;
+        /* the substitute name is the one followed by the system */
+        offset = mp->SubstituteNameOffset;
+        name_length = mp->SubstituteNameLength;
+        if(name_length == 0){
+            offset = mp->PrintNameOffset;
+            name_length = mp->PrintNameLength;
+        }
+        if(name_length == 0 || (ULONG)offset + name_length > data_length - header_length){
+            etrace("reparse point data of %I64u record is invalid",sp->mfi.BaseMftId);
+            break;
+        }
+        names = (char *)rp->ReparseData + header_length;
+        set_reparse_target((wchar_t *)(names + offset),name_length / sizeof(wchar_t),sp);
+        break;
+    case IO_REPARSE_TAG_WOF:
+        if(data_length < sizeof(WOF_REPARSE_DATA))
+            break;
+        wof = (WOF_REPARSE_DATA *)rp->ReparseData;
+        if(wof->Provider == 1){
+            set_reparse_target(L"WIM",3,sp);
+        } else if(wof->Provider == 2 && wof->Algorithm < sizeof(wof_methods) / sizeof(wchar_t *)){
+            set_reparse_target(wof_methods[wof->Algorithm],
+                (ULONG)wcslen(wof_methods[wof->Algorithm]),sp);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void handle_reparse_point(PRESIDENT_ATTRIBUTE pr_attr,mft_scan_parameters *sp)
+{
+    decode_reparse_point((REPARSE_POINT *)((char *)pr_attr + pr_attr->ValueOffset),
+        pr_attr->ValueLength,sp);
 }
 
 static void get_volume_information(PRESIDENT_ATTRIBUTE pr_attr,mft_scan_parameters *sp)
@@ -877,13 +1252,20 @@ static void get_volume_information(PRESIDENT_ATTRIBUTE pr_attr,mft_scan_paramete
 
 static void analyze_resident_stream(PRESIDENT_ATTRIBUTE pr_attr,mft_scan_parameters *sp)
 {
+    winx_file_info *f;
     wchar_t *attr_name;
     
+    /* values reaching beyond the attribute are corrupted */
+    if((ULONGLONG)pr_attr->ValueOffset + pr_attr->ValueLength > pr_attr->Attribute.Length){
+        etrace("resident attribute of %I64u record is corrupted",sp->mfi.BaseMftId);
+        return;
+    }
+    
     /* add resident streams to sp->filelist */
     attr_name = get_attribute_name(&pr_attr->Attribute,sp);
     if(attr_name){
-        (void)find_filelist_entry(attr_name,sp);
-        winx_free(attr_name);
+        f = find_filelist_entry(attr_name,sp);
+        f->disp.size = pr_attr->ValueLength;
     }
     
     if(pr_attr->ValueOffset == 0 || pr_attr->ValueLength == 0){
@@ -930,13 +1312,13 @@ static void analyze_non_resident_attribute_list(winx_file_info *f,ULONGLONG list
 {
     ULONGLONG cluster_size;
     ULONGLONG clusters_to_read;
+    ULONGLONG n;
     char *cluster;
     char *current_cluster;
     winx_blockmap *block;
     ULONGLONG lsn;
     NTSTATUS status;
     PATTRIBUTE_LIST attr_list_entry;
-    int i;
     USHORT length;
 
 #ifdef SHOW_ATTR_LISTS_INFO
@@ -946,45 +1328,53 @@ static void analyze_non_resident_attribute_list(winx_file_info *f,ULONGLONG list
         etrace("empty nonresident attribute list found");
         return;
     }
+    if(list_size > MFT_IMAGE_CHUNK_SIZE){
+        etrace("nonresident attribute list of %I64u bytes is too large",list_size);
+        return;
+    }
     
     /*
-    * Allocate memory for an integral number of
-    * clusters to hold the entire attribute list.
+    * Use the buffer of the child records cache holding an
+    * integral number of clusters for the entire attribute list.
     */
     cluster_size = sp->ml.cluster_size;
     clusters_to_read = list_size / cluster_size;
     if(list_size % cluster_size) clusters_to_read ++;
-    cluster = (char *)winx_tmalloc((SIZE_T)(cluster_size * clusters_to_read));
-    if(!cluster){
-        etrace("cannot allocate %I64u bytes of memory",
-            cluster_size * clusters_to_read);
-        sp->errors ++;
-        return;
+    if(sp->cc.attr_list_size < cluster_size * clusters_to_read){
+        winx_free(sp->cc.attr_list);
+        sp->cc.attr_list_size = 0;
+        sp->cc.attr_list = (char *)winx_tmalloc((SIZE_T)(cluster_size * clusters_to_read));
+        if(!sp->cc.attr_list){
+            etrace("cannot allocate %I64u bytes of memory",
+                cluster_size * clusters_to_read);
+            sp->errors ++;
+            return;
+        }
+        sp->cc.attr_list_size = cluster_size * clusters_to_read;
     }
+    cluster = sp->cc.attr_list;
     
-    /* loop through all blocks of the file */
+    /* loop through all blocks of the file, each one is read at once */
     current_cluster = cluster;
     for(block = f->disp.blockmap; block != NULL; block = block->next){
-        /* loop through clusters of the current block */
-        for(i = 0; i < block->length; i++){
-            /* read the current cluster */
-            lsn = (block->lcn + i) * sp->ml.sectors_per_cluster;
-            status = read_sectors(lsn,current_cluster,(ULONG)cluster_size,sp);
-            if(!NT_SUCCESS(status)){
-                strace(status,"cannot read %I64u sector",lsn);
-                /* attribute list seems to be invalid itself, so we'll just skip it */
-                /*sp->errors ++;*/
-                goto scan_done;
-            }
-            clusters_to_read --;
-            if(clusters_to_read == 0){
-                /* is it the last cluster of the file? */
-                if(i < (block->length - 1) || block->next != f->disp.blockmap)
-                    etrace("attribute list has more clusters than expected");
-                goto analyze_list;
-            }
-            current_cluster += cluster_size;
+        n = min(block->length,clusters_to_read);
+        lsn = block->lcn * sp->ml.sectors_per_cluster;
+        status = read_sectors(lsn,current_cluster,(ULONG)(n * cluster_size),sp);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot read %I64u sector",lsn);
+            /* attribute list seems to be invalid itself, so we'll just skip it */
+            /*sp->errors ++;*/
+            return;
+        }
+        if(sp->ctx) sp->ctx->progress.bytes_read += n * cluster_size;
+        clusters_to_read -= n;
+        if(clusters_to_read == 0){
+            /* is it the last cluster of the file? */
+            if(n < block->length || block->next != f->disp.blockmap)
+                etrace("attribute list has more clusters than expected");
+            goto analyze_list;
         }
+        current_cluster += n * cluster_size;
         if(block->next == f->disp.blockmap) break;
     }
 
@@ -992,7 +1382,7 @@ analyze_list:
     if(clusters_to_read){
         etrace("attribute list has less number of clusters than expected");
         etrace("it will be skipped, because anyway we don\'t know its exact size");
-        goto scan_done;
+        return;
     }
 
 #ifdef SHOW_ATTR_LISTS_INFO
@@ -1016,10 +1406,6 @@ analyze_list:
 #ifdef SHOW_ATTR_LISTS_INFO
     dtrace("attribute list analysis completed");
 #endif
-
-scan_done:    
-    /* free allocated resources */
-    winx_free(cluster);
 }
 
 /*
@@ -1046,30 +1432,26 @@ static winx_file_info * find_filelist_entry(wchar_t *attr_name,mft_scan_paramete
         } else {
             if(f->internal.BaseMftId < sp->mfi.BaseMftId) break;
         }
-        if(!wcscmp(f->name,attr_name) && f->internal.BaseMftId == sp->mfi.BaseMftId)
-            return f; /* slow? */
+        /* names are interned, so pointers are enough to compare */
+        if(f->name == attr_name && f->internal.BaseMftId == sp->mfi.BaseMftId)
+            return f;
         //if(f->internal.BaseMftId == sp->mfi.BaseMftId) return f; /* safe? */
         if(f->next == *sp->filelist) break;
     }
     
     f = (winx_file_info *)winx_list_insert((list_entry **)(void *)sp->filelist,NULL,sizeof(winx_file_info));
 
-    /* initialize structure */
-    f->name = winx_wcsdup(attr_name);
-    if(f->name == NULL){
-        etrace("cannot allocate %u bytes of memory",
-            (wcslen(attr_name) + 1) * sizeof(wchar_t));
-        winx_list_remove((list_entry **)(void *)sp->filelist,(list_entry *)f);
-        sp->errors ++;
-        return NULL;
-    }
-    
+    /* initialize structure, the name is replaced by update_stream_name */
+    f->name = attr_name;
     f->path = NULL;
     f->flags = 0;
     f->user_defined_flags = 0;
+    f->reparse_tag = 0;
+    f->reparse_target = NULL;
     memset(&f->disp,0,sizeof(winx_file_disposition));
     f->internal.BaseMftId = sp->mfi.BaseMftId;
     f->internal.ParentDirectoryMftId = FILE_root;
+    f->internal.SequenceNumber = sp->mfi.SequenceNumber;
     f->creation_time = 0;
     f->last_modification_time = 0;
     f->last_access_time = 0;
@@ -1079,6 +1461,7 @@ static winx_file_info * find_filelist_entry(wchar_t *attr_name,mft_scan_paramete
 static void process_run(winx_file_info *f,ULONGLONG vcn,ULONGLONG lcn,ULONGLONG length,mft_scan_parameters *sp)
 {
     winx_blockmap *block, *prev_block = NULL;
+    int new_fragment = 0;
     
     /* add information to f->disp */
     if(f->disp.blockmap) prev_block = f->disp.blockmap->prev;
@@ -1099,7 +1482,12 @@ static void process_run(winx_file_info *f,ULONGLONG vcn,ULONGLONG lcn,ULONGLONG
     if(block == f->disp.blockmap || \
       block->lcn != (block->prev->lcn + block->prev->length)){
         f->disp.fragments ++;
+        new_fragment = 1;
     }
+    
+    /* gather fragmentation statistics on the fly */
+    if(sp->ctx && sp->ctx->frag)
+        frag_stats_add_run(sp->ctx->frag,f,length,new_fragment);
 }
 
 static int check_run(ULONGLONG lcn,ULONGLONG length,mft_scan_parameters *sp)
@@ -1110,46 +1498,16 @@ static int check_run(ULONGLONG lcn,ULONGLONG length,mft_scan_parameters *sp)
     return 0;
 }
 
-/**
- */
-static ULONG RunLength(PUCHAR run)
-{
-    return (*run & 0xf) + ((*run >> 4) & 0xf) + 1;
-}
-
-/**
- */
-static LONGLONG RunLCN(PUCHAR run)
-{
-    LONG i;
-    UCHAR n1 = *run & 0xf;
-    UCHAR n2 = (*run >> 4) & 0xf;
-    LONGLONG lcn = (n2 == 0) ? 0 : (LONGLONG)(((signed char *)run)[n1 + n2]);
-    
-    for(i = n1 + n2 - 1; i > n1; i--)
-        lcn = (lcn << 8) + run[i];
-    return lcn;
-}
-
-/**
- */
-static ULONGLONG RunCount(PUCHAR run)
-{
-    ULONG i;
-    UCHAR n = *run & 0xf;
-    ULONGLONG count = 0;
-    
-    for(i = n; i > 0; i--)
-        count = (count << 8) + run[i];
-    return count;
-}
+/* runs decoded at once by the mapping pairs decoder */
+#define RUN_BATCH 32
 
 static void process_run_list(wchar_t *attr_name,PNONRESIDENT_ATTRIBUTE pnr_attr,
                 mft_scan_parameters *sp,BOOLEAN is_attr_list)
 {
-    ULONGLONG lcn, vcn, length;
-    PUCHAR run;
+    winx_run_decoder d;
+    winx_run runs[RUN_BATCH];
     winx_file_info *f;
+    ULONG i, n;
     
 /*  if(pnr_attr->Attribute.Flags & 0x1)
         DbgPrint("[CMP] %ws VCN %I64u - %I64u",attr_name,pnr_attr->LowVcn,pnr_attr->HighVcn);
@@ -1165,8 +1523,12 @@ static void process_run_list(wchar_t *attr_name,PNONRESIDENT_ATTRIBUTE pnr_attr,
     if(pnr_attr->Attribute.Flags & 0x1)
         f->flags |= FILE_ATTRIBUTE_COMPRESSED;
     
+    /* the size is valid in the first portion of the attribute only */
+    if(pnr_attr->LowVcn == 0)
+        f->disp.size = pnr_attr->DataSize;
+    
     /* don't analyze $BadClus file - it often has wrong number of clusters */
-    if(winx_wcsistr(sp->mfi.Name,L"$BadClus")){
+    if(sp->mfi.BaseMftId == FILE_BadClus){
         /* this file always exists, regardless of the file system state */
         itrace("$BadClus file detected");
         return;
@@ -1174,52 +1536,112 @@ static void process_run_list(wchar_t *attr_name,PNONRESIDENT_ATTRIBUTE pnr_attr,
     
     if(is_attr_list || (sp->flags & WINX_FTW_DUMP_FILES)){
         /* loop through runs */
-        lcn = 0; vcn = pnr_attr->LowVcn;
-        run = (PUCHAR)((char *)pnr_attr + pnr_attr->RunArrayOffset);
-        while(*run){
-            lcn += RunLCN(run);
-            length = RunCount(run);
-            
-            /* skip virtual runs */
-            if(RunLCN(run)){
+        winx_run_decoder_init(&d,(char *)pnr_attr + pnr_attr->RunArrayOffset,
+            (char *)pnr_attr + pnr_attr->Attribute.Length,pnr_attr->LowVcn);
+        while((n = winx_decode_runs(&d,runs,RUN_BATCH)) != 0){
+            for(i = 0; i < n; i++){
+                /* skip virtual runs */
+                if(runs[i].lcn == WINX_RUN_SPARSE)
+                    continue;
                 /* check for data consistency */
-                if(!check_run(lcn,length,sp)){
+                if(!check_run(runs[i].lcn,runs[i].length,sp)){
                     etrace("error in MFT found, run Check Disk program!");
-                    break;
+                    goto attr_list;
                 }
-                process_run(f,vcn,lcn,length,sp);
+                process_run(f,runs[i].vcn,runs[i].lcn,runs[i].length,sp);
             }
-            
-            /* go to the next run */
-            run += RunLength(run);
-            vcn += length;
         }
+        if(d.corrupted)
+            etrace("malformed run list found, mft index = %I64u",sp->mfi.BaseMftId);
     }
     
+attr_list:
+    
     /* analyze nonresident attribute lists */
     if(is_attr_list) analyze_non_resident_attribute_list(f,pnr_attr->InitializedSize,sp);
 }
 
 /**
- * @note The filename may be not available for this routine.
+ * @brief Reads nonresident reparse point data
+ * through its run list, then decodes it.
  */
-static void analyze_non_resident_stream(PNONRESIDENT_ATTRIBUTE pnr_attr,mft_scan_parameters *sp)
+static void handle_non_resident_reparse_point(PNONRESIDENT_ATTRIBUTE pnr_attr,mft_scan_parameters *sp)
 {
-    ATTRIBUTE_TYPE attr_type;
-    wchar_t *attr_name;
-    BOOLEAN NonResidentAttrListFound = FALSE;
+    ULONGLONG size, vcn = 0, n;
+    winx_run_decoder d;
+    winx_run runs[RUN_BATCH];
+    ULONG i, k;
+    char *data;
+    NTSTATUS status;
     
-    /* handle the type of the attribute */
-    attr_type = pnr_attr->Attribute.AttributeType;
-    if(attr_type == AttributeAttributeList){
-#ifdef SHOW_ATTR_LISTS_INFO
-        dtrace("nonresident attribute list found");
-#endif
-        NonResidentAttrListFound = TRUE;
-    }
-
+    sp->mfi.Flags |= FILE_ATTRIBUTE_REPARSE_POINT;
+    
+    /* only the first portion of the attribute maps its beginning */
+    if(pnr_attr->LowVcn)
+        return;
+    
+    /* volumes are readable by whole sectors, so read whole clusters */
+    size = min(pnr_attr->DataSize,REPARSE_POINT_MAX_SIZE + FIELD_OFFSET(REPARSE_POINT,ReparseData));
+    size = (size + sp->ml.cluster_size - 1) / sp->ml.cluster_size * sp->ml.cluster_size;
+    if(size == 0)
+        return;
+    data = winx_tmalloc((SIZE_T)size);
+    if(data == NULL){
+        etrace("cannot allocate %I64u bytes of memory",size);
+        return;
+    }
+    
+    winx_run_decoder_init(&d,(char *)pnr_attr + pnr_attr->RunArrayOffset,
+        (char *)pnr_attr + pnr_attr->Attribute.Length,0);
+    while(vcn * sp->ml.cluster_size < size && (k = winx_decode_runs(&d,runs,RUN_BATCH)) != 0){
+        for(i = 0; i < k && vcn * sp->ml.cluster_size < size; i++){
+            n = min(runs[i].length,size / sp->ml.cluster_size - vcn);
+            if(runs[i].lcn != WINX_RUN_SPARSE){
+                if(!check_run(runs[i].lcn,runs[i].length,sp)){
+                    etrace("error in MFT found, run Check Disk program!");
+                    goto decode;
+                }
+                status = read_volume(runs[i].lcn * sp->ml.cluster_size,data + vcn * sp->ml.cluster_size,
+                    (ULONG)(n * sp->ml.cluster_size),sp);
+                if(!NT_SUCCESS(status)){
+                    strace(status,"cannot read reparse point data of %I64u record",sp->mfi.BaseMftId);
+                    goto decode;
+                }
+                if(sp->ctx) sp->ctx->progress.bytes_read += n * sp->ml.cluster_size;
+            } else {
+                memset(data + vcn * sp->ml.cluster_size,0,(size_t)(n * sp->ml.cluster_size));
+            }
+            vcn += n;
+        }
+    }
+    
+decode:
+    
+    if(vcn * sp->ml.cluster_size >= min(size,pnr_attr->DataSize))
+        decode_reparse_point((REPARSE_POINT *)data,(ULONG)min(size,pnr_attr->DataSize),sp);
+    winx_free(data);
+}
+
+/**
+ * @note The filename may be not available for this routine.
+ */
+static void analyze_non_resident_stream(PNONRESIDENT_ATTRIBUTE pnr_attr,mft_scan_parameters *sp)
+{
+    ATTRIBUTE_TYPE attr_type;
+    wchar_t *attr_name;
+    BOOLEAN NonResidentAttrListFound = FALSE;
+    
+    /* handle the type of the attribute */
+    attr_type = pnr_attr->Attribute.AttributeType;
+    if(attr_type == AttributeAttributeList){
+#ifdef SHOW_ATTR_LISTS_INFO
+        dtrace("nonresident attribute list found");
+#endif
+        NonResidentAttrListFound = TRUE;
+    }
+
     if(attr_type == AttributeReparsePoint)
-        sp->mfi.Flags |= FILE_ATTRIBUTE_REPARSE_POINT;
+        handle_non_resident_reparse_point(pnr_attr,sp);
     
     attr_name = get_attribute_name(&pnr_attr->Attribute,sp);
     if(attr_name == NULL)
@@ -1231,9 +1653,602 @@ static void analyze_non_resident_stream(PNONRESIDENT_ATTRIBUTE pnr_attr,mft_scan
 #endif
 
     process_run_list(attr_name,pnr_attr,sp,NonResidentAttrListFound);
+}
+
+/*
+**************************************************
+*             Disk images support
+**************************************************
+*/
+
+/**
+ * @brief Applies the update sequence array
+ * to a multisector record read from disk.
+ * @return Zero for success, -1 if the
+ * record is torn or corrupted.
+ */
+static int apply_fixups(FILE_RECORD_HEADER *frh,ULONG size)
+{
+    USHORT *usa, *p;
+    ULONG i;
+
+    if(frh->Ntfs.UsaCount == 0 || \
+      frh->Ntfs.UsaOffset + frh->Ntfs.UsaCount * sizeof(USHORT) > size || \
+      (frh->Ntfs.UsaCount - 1) * NTFS_USA_STRIDE > size)
+        return (-1);
+
+    usa = (USHORT *)((char *)frh + frh->Ntfs.UsaOffset);
+    for(i = 1; i < frh->Ntfs.UsaCount; i++){
+        p = (USHORT *)((char *)frh + i * NTFS_USA_STRIDE - sizeof(USHORT));
+        if(*p != usa[0]) return (-1);
+        *p = usa[i];
+    }
+    return 0;
+}
+
+/**
+ * @brief Collects runs of the $Mft data attribute.
+ * @details Portions of the attribute get appended
+ * in the VCN order, so the base record goes first
+ * and child records listed in the attribute list
+ * of the $Mft continue the map.
+ */
+static void get_mft_runs_callback(PATTRIBUTE pattr,mft_scan_parameters *sp)
+{
+    PNONRESIDENT_ATTRIBUTE pnr_attr;
+    mft_image *im = sp->image;
+    winx_run_decoder d;
+    winx_run runs[RUN_BATCH];
+    mft_run *map;
+    ULONGLONG vcn;
+    char *pairs, *end;
+    ULONG i, k, n;
+
+    if(!pattr->Nonresident || pattr->AttributeType != AttributeData || pattr->NameLength)
+        return;
+
+    pnr_attr = (PNONRESIDENT_ATTRIBUTE)pattr;
+    if(pnr_attr->LowVcn != im->next_vcn || (im->runs && pnr_attr->LowVcn == 0))
+        return;
+
+    /* count runs */
+    pairs = (char *)pnr_attr + pnr_attr->RunArrayOffset;
+    end = (char *)pnr_attr + pattr->Length;
+    winx_run_decoder_init(&d,pairs,end,0);
+    for(n = 0; (k = winx_decode_runs(&d,runs,RUN_BATCH)) != 0; n += k){}
+    if(n == 0)
+        return;
+
+    map = winx_tmalloc((im->n_runs + n) * sizeof(mft_run));
+    if(map == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            (im->n_runs + n) * sizeof(mft_run));
+        return;
+    }
+    if(im->runs){
+        memcpy(map,im->runs,im->n_runs * sizeof(mft_run));
+        winx_free(im->runs);
+    }
+    im->runs = map;
+
+    /* save them */
+    vcn = im->next_vcn;
+    winx_run_decoder_init(&d,pairs,end,0);
+    while((k = winx_decode_runs(&d,runs,RUN_BATCH)) != 0){
+        for(i = 0; i < k; i++){
+            if(runs[i].lcn == WINX_RUN_SPARSE || !check_run(runs[i].lcn,runs[i].length,sp)){
+                etrace("$Mft has invalid run at VCN %I64u",vcn);
+                goto done;
+            }
+            im->runs[im->n_runs].vcn = vcn;
+            im->runs[im->n_runs].lcn = runs[i].lcn;
+            im->runs[im->n_runs].length = runs[i].length;
+            im->n_runs ++;
+            vcn += runs[i].length;
+        }
+    }
+    
+done:
+    im->next_vcn = vcn;
+    im->mapped_records = vcn * sp->ml.cluster_size / sp->ml.file_record_size;
+    if(pnr_attr->HighVcn + 1 > vcn)
+        etrace("$Mft data is mapped up to VCN %I64u only",vcn);
+}
+
+/**
+ * @brief Maps a portion of the $Mft data
+ * stored in a child record of the $Mft.
+ * @details The child record must be covered
+ * by the portions mapped before; NTFS keeps
+ * them in the beginning of the $Mft for this.
+ */
+static void map_mft_child_runs(ATTRIBUTE_LIST *entry,mft_scan_parameters *sp)
+{
+    mft_image *im = sp->image;
+    FILE_RECORD_HEADER *frh;
+    ULONGLONG mft_id;
+    NTSTATUS status;
+
+    if(entry->AttributeType != AttributeData || entry->NameLength)
+        return;
+    if(entry->LowVcn == 0 || entry->LowVcn != im->next_vcn)
+        return;
+
+    mft_id = GetMftIdFromFRN(entry->FileReferenceNumber);
+    if(mft_id == 0 || mft_id >= im->mapped_records){
+        etrace("$Mft child record %I64u is not mapped",mft_id);
+        return;
+    }
+
+    frh = winx_malloc(sp->ml.file_record_size);
+    status = read_mft_records(mft_id,1,(char *)frh,sp);
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot read $Mft child record %I64u",mft_id);
+    } else if(apply_fixups(frh,sp->ml.file_record_size) < 0 || \
+      !is_file_record(frh) || !(frh->Flags & 0x1) || \
+      GetMftIdFromFRN(frh->BaseFileRecord) != 0){
+        etrace("$Mft child record %I64u is invalid",mft_id);
+    } else {
+        enumerate_attributes(frh,get_mft_runs_callback,sp);
+    }
+    winx_free(frh);
+}
+
+/**
+ * @brief Follows the attribute list of the $Mft
+ * to map portions of its data stored in child records.
+ * @details The list is read into memory at once,
+ * the child records get read through the map
+ * built so far.
+ */
+static void get_mft_attribute_list_callback(PATTRIBUTE pattr,mft_scan_parameters *sp)
+{
+    PRESIDENT_ATTRIBUTE pr_attr;
+    PNONRESIDENT_ATTRIBUTE pnr_attr;
+    ATTRIBUTE_LIST *entry;
+    winx_run_decoder d;
+    winx_run runs[RUN_BATCH];
+    char *list = NULL, *p;
+    ULONGLONG size, offset, length;
+    ULONG i, k;
+    NTSTATUS status;
+
+    if(pattr->AttributeType != AttributeAttributeList)
+        return;
+
+    if(!pattr->Nonresident){
+        pr_attr = (PRESIDENT_ATTRIBUTE)pattr;
+        if(pr_attr->ValueOffset + pr_attr->ValueLength > pattr->Length)
+            return;
+        p = (char *)pr_attr + pr_attr->ValueOffset;
+        size = pr_attr->ValueLength;
+    } else {
+        /* read the list through its own runs */
+        pnr_attr = (PNONRESIDENT_ATTRIBUTE)pattr;
+        size = pnr_attr->DataSize;
+        if(size == 0 || size > MFT_IMAGE_CHUNK_SIZE){
+            etrace("$Mft attribute list of %I64u bytes is invalid",size);
+            return;
+        }
+        list = winx_tmalloc((size_t)size);
+        if(list == NULL){
+            etrace("cannot allocate %I64u bytes of memory",size);
+            return;
+        }
+        offset = 0;
+        winx_run_decoder_init(&d,(char *)pnr_attr + pnr_attr->RunArrayOffset,
+            (char *)pnr_attr + pattr->Length,0);
+        while(offset < size && (k = winx_decode_runs(&d,runs,RUN_BATCH)) != 0){
+            for(i = 0; i < k && offset < size; i++){
+                if(runs[i].lcn == WINX_RUN_SPARSE || !check_run(runs[i].lcn,runs[i].length,sp)){
+                    etrace("$Mft attribute list has invalid run");
+                    goto done;
+                }
+                length = runs[i].length * sp->ml.cluster_size;
+                if(length > size - offset) length = size - offset;
+                status = read_volume(runs[i].lcn * sp->ml.cluster_size,
+                    list + offset,(ULONG)length,sp);
+                if(!NT_SUCCESS(status)){
+                    strace(status,"cannot read $Mft attribute list");
+                    goto done;
+                }
+                offset += length;
+            }
+        }
+        if(offset < size){
+            etrace("$Mft attribute list is truncated");
+            goto done;
+        }
+        p = list;
+    }
 
-    /* free allocated memory */
-    winx_free(attr_name);
+    /* entries go in the VCN order */
+    for(offset = 0; offset + sizeof(ATTRIBUTE_LIST) - \
+      sizeof(entry->AlignmentOrReserved) <= size; offset += entry->Length){
+        entry = (ATTRIBUTE_LIST *)(p + offset);
+        if(entry->AttributeType == 0xffffffff) break;
+        if(entry->AttributeType == 0x0) break;
+        if(entry->Length == 0) break;
+        map_mft_child_runs(entry,sp);
+    }
+
+done:
+    winx_free(list);
+}
+
+/**
+ * @brief Reads a range of file records through the map of the $Mft.
+ */
+static NTSTATUS read_mft_records(ULONGLONG first,ULONGLONG count,
+    char *buffer,mft_scan_parameters *sp)
+{
+    mft_image *im = sp->image;
+    ULONGLONG offset, left, vcn, n;
+    NTSTATUS status;
+    ULONG i;
+
+    offset = first * sp->ml.file_record_size;
+    left = count * sp->ml.file_record_size;
+    while(left){
+        vcn = offset / sp->ml.cluster_size;
+        for(i = 0; i < im->n_runs; i++){
+            if(vcn >= im->runs[i].vcn && vcn < im->runs[i].vcn + im->runs[i].length)
+                break;
+        }
+        if(i == im->n_runs)
+            return STATUS_INVALID_PARAMETER;
+        n = (im->runs[i].vcn + im->runs[i].length) * sp->ml.cluster_size - offset;
+        if(n > left) n = left;
+        status = read_volume(im->runs[i].lcn * sp->ml.cluster_size + \
+            offset - im->runs[i].vcn * sp->ml.cluster_size,buffer,(ULONG)n,sp);
+        if(!NT_SUCCESS(status))
+            return status;
+        offset += n;
+        buffer += n;
+        left -= n;
+    }
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief get_file_record equivalent for disk images.
+ * @details Records are read in blocks of MFT_IMAGE_CHUNK_SIZE
+ * bytes. Like FSCTL_GET_NTFS_FILE_RECORD it fails for records
+ * which are free, so the scan continues with the preceding one.
+ */
+static NTSTATUS get_image_file_record(ULONGLONG mft_id,
+        NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,mft_scan_parameters *sp)
+{
+    mft_image *im = sp->image;
+    FILE_RECORD_HEADER *frh;
+    ULONGLONG records_per_chunk;
+    NTSTATUS status;
+
+    if(mft_id >= im->mapped_records)
+        return STATUS_INVALID_PARAMETER;
+
+    if(im->chunk_records == 0 || mft_id < im->chunk_first || \
+      mft_id >= im->chunk_first + im->chunk_records){
+        records_per_chunk = MFT_IMAGE_CHUNK_SIZE / sp->ml.file_record_size;
+        im->chunk_first = mft_id - mft_id % records_per_chunk;
+        im->chunk_records = im->mapped_records - im->chunk_first;
+        if(im->chunk_records > records_per_chunk)
+            im->chunk_records = records_per_chunk;
+        /* truncated images must not leave stale data there */
+        memset(im->chunk,0,MFT_IMAGE_CHUNK_SIZE);
+        status = read_mft_records(im->chunk_first,im->chunk_records,im->chunk,sp);
+        if(!NT_SUCCESS(status)){
+            im->chunk_records = 0;
+            return status;
+        }
+    }
+
+    RtlZeroMemory(nfrob,sp->ml.file_record_buffer_size);
+    frh = (FILE_RECORD_HEADER *)nfrob->FileRecordBuffer;
+    memcpy(frh,im->chunk + (mft_id - im->chunk_first) * sp->ml.file_record_size,
+        sp->ml.file_record_size);
+    return complete_image_file_record(mft_id,nfrob,sp);
+}
+
+/**
+ * @brief Retrieves a child record from a disk image.
+ * @details Records outside of the current block are
+ * read alone, so the block being scanned stays in memory.
+ */
+static NTSTATUS get_image_child_record(ULONGLONG mft_id,
+        NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,mft_scan_parameters *sp)
+{
+    mft_image *im = sp->image;
+    NTSTATUS status;
+
+    if(mft_id >= im->mapped_records)
+        return STATUS_INVALID_PARAMETER;
+    if(im->chunk_records && mft_id >= im->chunk_first && \
+      mft_id < im->chunk_first + im->chunk_records)
+        return get_image_file_record(mft_id,nfrob,sp);
+
+    RtlZeroMemory(nfrob,sp->ml.file_record_buffer_size);
+    status = read_mft_records(mft_id,1,(char *)nfrob->FileRecordBuffer,sp);
+    if(!NT_SUCCESS(status))
+        return status;
+    return complete_image_file_record(mft_id,nfrob,sp);
+}
+
+/**
+ * @brief Validates a record read from a disk image
+ * and fills the rest of the output buffer.
+ */
+static NTSTATUS complete_image_file_record(ULONGLONG mft_id,
+        NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,mft_scan_parameters *sp)
+{
+    FILE_RECORD_HEADER *frh;
+
+    frh = (FILE_RECORD_HEADER *)nfrob->FileRecordBuffer;
+    if(!is_file_record(frh) || !(frh->Flags & 0x1))
+        return STATUS_INVALID_PARAMETER;
+    if(apply_fixups(frh,sp->ml.file_record_size) < 0){
+        etrace("file record %I64u is corrupted",mft_id);
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+    nfrob->FileReferenceNumber = mft_id | ((ULONGLONG)frh->SequenceNumber << 48);
+    nfrob->FileRecordLength = sp->ml.file_record_size;
+#ifdef TEST_NTFS_SCANNER
+    randomize_file_record_data((char *)(void *)nfrob,sp->ml.file_record_buffer_size);
+#endif
+    return STATUS_SUCCESS;
+}
+
+/*
+**************************************************
+*               File records cache
+**************************************************
+*/
+
+/**
+ * @brief Attaches the scan to the file records cache.
+ * @details The cache comes from the scan context, so
+ * a few scans can share it; otherwise a private cache
+ * lives up to the end of the scan. Failures leave the
+ * scan without the cache, reading the disk instead,
+ * as do all the slots of the cache held by other scans.
+ * @param[in] flush nonzero value drops the records
+ * kept since the previous scan of the same volume.
+ * @note sp->ml must be set before this call.
+ */
+static void attach_records_cache(mft_scan_parameters *sp,int flush)
+{
+    if(sp->records && sp->records_volume >= 0)
+        mft_cache_detach(sp->records,sp->records_volume);
+    winx_free(sp->block);
+    sp->block = NULL;
+    sp->records_volume = -1;
+
+    sp->records = sp->ctx ? sp->ctx->records : NULL;
+    if(sp->records == NULL){
+        if(sp->own_records == NULL)
+            sp->own_records = winx_create_mft_cache(0);
+        sp->records = sp->own_records;
+    }
+    if(sp->records == NULL)
+        return;
+
+    sp->records_volume = mft_cache_attach(sp->records,sp->root,
+        sp->ml.file_record_size,(ULONG)sp->ml.cluster_size,flush,&sp->block_records);
+    if(sp->records_volume >= 0 && sp->image){
+        sp->block = winx_tmalloc(sp->block_records * sp->ml.file_record_size);
+        if(sp->block == NULL){
+            etrace("cannot allocate %u bytes of memory",
+                sp->block_records * sp->ml.file_record_size);
+            mft_cache_detach(sp->records,sp->records_volume);
+            sp->records_volume = -1;
+        }
+    }
+}
+
+static void release_records_cache(mft_scan_parameters *sp)
+{
+    if(sp->records && sp->records_volume >= 0)
+        mft_cache_detach(sp->records,sp->records_volume);
+    winx_free(sp->block);
+    winx_destroy_mft_cache(sp->own_records);
+    sp->block = NULL;
+    sp->own_records = sp->records = NULL;
+    sp->records_volume = -1;
+}
+
+/**
+ * @brief Retrieves a file record through the cache.
+ * @details Intended for random lookups. Disk images
+ * get the whole block of the record read and fixed up
+ * on misses, so its neighbours become hits as well.
+ * Live volumes return a single record per request,
+ * which gets cached alone.
+ */
+static NTSTATUS get_cached_file_record(ULONGLONG mft_id,
+        NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,mft_scan_parameters *sp)
+{
+    mft_image *im = sp->image;
+    FILE_RECORD_HEADER *frh;
+    ULONGLONG first, count, valid, i;
+    ULONG rs = sp->ml.file_record_size;
+    NTSTATUS status;
+    int result;
+
+    if(sp->records_volume < 0)
+        return im ? get_image_child_record(mft_id,nfrob,sp) : get_file_record(mft_id,nfrob,sp);
+    if(im && im->chunk_records && mft_id >= im->chunk_first && \
+      mft_id < im->chunk_first + im->chunk_records)
+        return get_image_file_record(mft_id,nfrob,sp);
+
+    RtlZeroMemory(nfrob,sp->ml.file_record_buffer_size);
+    frh = (FILE_RECORD_HEADER *)nfrob->FileRecordBuffer;
+    result = mft_cache_lookup(sp->records,sp->records_volume,mft_id,(char *)frh);
+    if(result){
+        if(sp->ctx) sp->ctx->progress.record_hits ++;
+        if(result < 0)
+            return STATUS_INVALID_PARAMETER;
+        nfrob->FileReferenceNumber = mft_id | ((ULONGLONG)frh->SequenceNumber << 48);
+        nfrob->FileRecordLength = rs;
+        return STATUS_SUCCESS;
+    }
+    if(sp->ctx) sp->ctx->progress.record_misses ++;
+
+    if(im == NULL){
+        status = get_file_record(mft_id,nfrob,sp);
+        if(!NT_SUCCESS(status))
+            return status;
+        if(sp->ctx) sp->ctx->progress.bytes_read += rs;
+        /*
+        * FSCTL_GET_NTFS_FILE_RECORD returns the nearest record
+        * in use preceding the requested one, so all the records
+        * in between are free.
+        */
+        i = GetMftIdFromFRN(nfrob->FileReferenceNumber);
+        first = mft_id - mft_id % sp->block_records;
+        if(i > mft_id)
+            return status;
+        if(i >= first){
+            mft_cache_store(sp->records,sp->records_volume,i,
+                (ULONG)(mft_id - i + 1),(char *)frh,1);
+        } else {
+            mft_cache_store(sp->records,sp->records_volume,i,1,(char *)frh,1);
+            mft_cache_store(sp->records,sp->records_volume,first,
+                (ULONG)(mft_id - first + 1),NULL,0);
+        }
+        return status;
+    }
+
+    if(mft_id >= im->mapped_records)
+        return STATUS_INVALID_PARAMETER;
+    first = mft_id - mft_id % sp->block_records;
+    count = im->mapped_records - first;
+    if(count > sp->block_records)
+        count = sp->block_records;
+    status = read_mft_records(first,count,sp->block,sp);
+    if(!NT_SUCCESS(status))
+        return status;
+    if(sp->ctx) sp->ctx->progress.bytes_read += count * rs;
+
+    for(i = 0, valid = 0; i < count; i++){
+        frh = (FILE_RECORD_HEADER *)(sp->block + i * rs);
+        if(!is_file_record(frh) || !(frh->Flags & 0x1))
+            continue;
+        if(apply_fixups(frh,rs) < 0){
+            etrace("file record %I64u is corrupted",first + i);
+            continue;
+        }
+        valid |= (ULONGLONG)1 << i;
+    }
+    mft_cache_store(sp->records,sp->records_volume,first,(ULONG)count,sp->block,valid);
+
+    i = mft_id - first;
+    if(!(valid & ((ULONGLONG)1 << i)))
+        return STATUS_INVALID_PARAMETER;
+    memcpy(nfrob->FileRecordBuffer,sp->block + i * rs,rs);
+    frh = (FILE_RECORD_HEADER *)nfrob->FileRecordBuffer;
+    nfrob->FileReferenceNumber = mft_id | ((ULONGLONG)frh->SequenceNumber << 48);
+    nfrob->FileRecordLength = rs;
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief get_mft_layout equivalent for disk images.
+ * @details Takes the layout from the boot sector,
+ * then maps the $Mft data by its own file record.
+ */
+static int get_image_layout(mft_scan_parameters *sp)
+{
+    NTFS_BOOT_SECTOR *bs;
+    FILE_RECORD_HEADER *frh;
+    ULONG spc;
+    NTSTATUS status;
+    int result = -1;
+
+    memset(&sp->ml,0,sizeof(mft_layout));
+
+    bs = winx_malloc(sizeof(NTFS_BOOT_SECTOR));
+    status = read_volume(0,bs,sizeof(NTFS_BOOT_SECTOR),sp);
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot read the boot sector");
+        winx_free(bs);
+        return (-1);
+    }
+    if(memcmp(bs->OemId,"NTFS    ",sizeof(bs->OemId))){
+        etrace("the image is not NTFS formatted");
+        winx_free(bs);
+        return (-1);
+    }
+
+    spc = bs->SectorsPerCluster;
+    if(spc > 0x80) spc = 1 << (256 - spc);
+    sp->ml.sector_size = bs->BytesPerSector;
+    sp->ml.sectors_per_cluster = spc;
+    sp->ml.cluster_size = (ULONGLONG)spc * bs->BytesPerSector;
+    if(spc == 0 || sp->ml.sector_size < 256 || \
+      (sp->ml.sector_size & (sp->ml.sector_size - 1)) || (spc & (spc - 1))){
+        etrace("invalid geometry: %u bytes per sector, %u sectors per cluster",
+            sp->ml.sector_size,spc);
+        winx_free(bs);
+        return (-1);
+    }
+    sp->ml.total_clusters = bs->TotalSectors / spc;
+    if(bs->ClustersPerFileRecord > 0)
+        sp->ml.file_record_size = (ULONG)(bs->ClustersPerFileRecord * sp->ml.cluster_size);
+    else if(bs->ClustersPerFileRecord > -31)
+        sp->ml.file_record_size = 1 << (-bs->ClustersPerFileRecord);
+    if(sp->ml.file_record_size < sizeof(FILE_RECORD_HEADER) || \
+      sp->ml.file_record_size > MFT_IMAGE_CHUNK_SIZE || \
+      sp->ml.file_record_size % NTFS_USA_STRIDE){
+        etrace("invalid file record size %u",sp->ml.file_record_size);
+        winx_free(bs);
+        return (-1);
+    }
+    sp->ml.file_record_buffer_size = sizeof(NTFS_FILE_RECORD_OUTPUT_BUFFER) + \
+        sp->ml.file_record_size - 1;
+    itrace("mft record size = %u",sp->ml.file_record_size);
+    itrace("volume has %I64u clusters",sp->ml.total_clusters);
+    itrace("cluster size = %I64u",sp->ml.cluster_size);
+    itrace("sector size = %u",sp->ml.sector_size);
+
+    if(sp->ctx){
+        sp->ctx->bytes_per_cluster = sp->ml.cluster_size;
+        if(sp->ctx->frag)
+            sp->ctx->frag->bytes_per_cluster = sp->ml.cluster_size;
+    }
+
+    /* map the $Mft data */
+    frh = winx_malloc(sp->ml.file_record_size);
+    status = read_volume(bs->MftStartLcn * sp->ml.cluster_size,
+        frh,sp->ml.file_record_size,sp);
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot read $Mft file record");
+    } else if(bs->MftStartLcn >= sp->ml.total_clusters || \
+      apply_fixups(frh,sp->ml.file_record_size) < 0 || \
+      !is_file_record(frh) || !(frh->Flags & 0x1)){
+        etrace("$Mft file record is invalid");
+    } else {
+        enumerate_attributes(frh,get_mft_runs_callback,sp);
+        if(sp->image->runs == NULL){
+            etrace("cannot map $Mft");
+        } else {
+            enumerate_attributes(frh,get_mft_attribute_list_callback,sp);
+            result = 0;
+        }
+    }
+    winx_free(frh);
+    winx_free(bs);
+
+    /* get number of mft entries */
+    if(result == 0)
+        result = get_number_of_file_records(sp);
+
+    /* records beyond the map cannot be read anyway */
+    if(result == 0 && sp->ml.number_of_file_records > sp->image->mapped_records){
+        etrace("only %I64u of %I64u records are mapped",
+            sp->image->mapped_records,sp->ml.number_of_file_records);
+        sp->ml.number_of_file_records = sp->image->mapped_records;
+    }
+    return result;
 }
 
 /*
@@ -1242,23 +2257,30 @@ static void analyze_non_resident_stream(PNONRESIDENT_ATTRIBUTE pnr_attr,mft_scan
 **************************************************
 */
 
-static int update_stream_name(winx_file_info *f,mft_scan_parameters *sp)
+/**
+ * @brief Replaces the interned name of the stream
+ * by its full name, like filename:stream.
+ * @details This is the only allocation made
+ * for a stream during the record analysis.
+ */
+static void update_stream_name(winx_file_info *f,mft_scan_parameters *sp)
 {
     wchar_t *new_name;
-    int length;
+    size_t name_length, stream_length;
     
-    length = (int)wcslen(f->name) + (int)wcslen(sp->mfi.Name) + 1;
-    new_name = winx_malloc((length + 1) * sizeof(wchar_t));
+    name_length = wcslen(sp->mfi.Name);
+    stream_length = wcslen(f->name);
+    new_name = winx_malloc((name_length + stream_length + 2) * sizeof(wchar_t));
     
-    if(f->name[0]) /* the stream name is not empty */
-        _snwprintf(new_name,length + 1,L"%ws:%ws",sp->mfi.Name,f->name);
-    else
-        wcsncpy(new_name,sp->mfi.Name,length);
-    new_name[length] = 0;
+    memcpy(new_name,sp->mfi.Name,name_length * sizeof(wchar_t));
+    if(stream_length){ /* the stream name is not empty */
+        new_name[name_length] = ':';
+        memcpy(new_name + name_length + 1,f->name,stream_length * sizeof(wchar_t));
+        name_length += stream_length + 1;
+    }
+    new_name[name_length] = 0;
     
-    winx_free(f->name);
     f->name = new_name;
-    return 0;
 }
 
 /**
@@ -1282,6 +2304,25 @@ static void analyze_attribute_list_callback(PATTRIBUTE pattr,mft_scan_parameters
         analyze_attribute(pattr,sp);
 }
 
+/**
+ * @brief Moves all the streams from
+ * the list to the external sort.
+ */
+static void spill_file_streams(mft_scan_parameters *sp)
+{
+    winx_file_info *f;
+    
+    for(f = *sp->filelist; f != NULL; f = f->next){
+        if(spill_add(sp->spill,f) < 0){
+            sp->errors ++;
+            break;
+        }
+        if(f->next == *sp->filelist) break;
+    }
+    winx_ftw_release(*sp->filelist);
+    *sp->filelist = NULL;
+}
+
 /**
  * @brief Analyzes a base file record.
  * @details Forces all child records
@@ -1291,7 +2332,8 @@ static void analyze_file_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
                                 mft_scan_parameters *sp)
 {
     FILE_RECORD_HEADER *frh;
-    winx_file_info *f, *next, *head;
+    winx_file_info *f, *next, *old_head;
+    int target_taken = 0;
     
     /* validate header */
     frh = (FILE_RECORD_HEADER *)nfrob->FileRecordBuffer;
@@ -1304,9 +2346,11 @@ static void analyze_file_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
         dtrace("directory"); // may be wrong?
     */
     
-    /* skip child records, we'll scan them later */
-    if(frh->BaseFileRecord)
+    /* skip child records, we'll scan them later, along with the base record */
+    if(frh->BaseFileRecord){
+        cache_child_record(nfrob,sp);
         return;
+    }
     
     /*
     * Here we have found a new file, so let's explore
@@ -1322,6 +2366,7 @@ static void analyze_file_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
     
     /* initialize the sp->mfi structure */
     sp->mfi.BaseMftId = GetMftIdFromFRN(nfrob->FileReferenceNumber);
+    sp->mfi.SequenceNumber = frh->SequenceNumber;
     sp->mfi.ParentDirectoryMftId = FILE_root;
     sp->mfi.Flags = 0x0;
     if(frh->Flags & 0x2)
@@ -1331,6 +2376,12 @@ static void analyze_file_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
     sp->mfi.CreationTime = 0;
     sp->mfi.LastWriteTime = 0;
     sp->mfi.LastAccessTime = 0;
+    sp->mfi.ReparseTag = 0;
+    sp->mfi.ReparseTarget = NULL;
+    
+    /* streams of the file will be inserted before it */
+    old_head = *sp->filelist;
+    sp->cc.fetched = 0;
     
     /* skip attribute lists */
     enumerate_attributes(frh,analyze_attribute_callback,sp);
@@ -1347,46 +2398,56 @@ static void analyze_file_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
     * cluster chains. So, let's append the filename to the
     * names of the streams. Besides, sp->mfi flags are more
     * correct than those of the data streams, so let's update
-    * stream flags too.
+    * stream flags too. Streams of the file are all in front
+    * of the list, up to the former head.
     */
-    head = *sp->filelist;
-    for(f = head; f != NULL;){
-        if(sp->mft_scan_direction == MFT_SCAN_RTL){
-            if(f->internal.BaseMftId > sp->mfi.BaseMftId){
-                /* we have no chance to find the record in the list */
-                break;
-            }
-        } else {
-            if(f->internal.BaseMftId < sp->mfi.BaseMftId) break;
-        }
+    for(f = *sp->filelist; f != NULL && f != old_head; f = next){
         next = f->next;
-        if(f->internal.BaseMftId == sp->mfi.BaseMftId){
-            /* update flags, because sp->mfi contains more actual data  */
-            f->flags = sp->mfi.Flags;
-            /* update access times */
-            f->creation_time = sp->mfi.CreationTime;
-            f->last_modification_time = sp->mfi.LastWriteTime;
-            f->last_access_time = sp->mfi.LastAccessTime;
-            /* set parent directory id for the stream */
-            f->internal.ParentDirectoryMftId = sp->mfi.ParentDirectoryMftId;
-            /* add filename to the name of the stream */
-            if(update_stream_name(f,sp) < 0){
-                winx_list_remove((list_entry **)(void *)sp->filelist,(list_entry *)f);
-                if(*sp->filelist == NULL) break;
-                if(*sp->filelist != head){
-                    head = *sp->filelist;
-                    f = next;
-                    continue;
-                }
+        /* update flags, because sp->mfi contains more actual data  */
+        f->flags = sp->mfi.Flags;
+        /* update access times */
+        f->creation_time = sp->mfi.CreationTime;
+        f->last_modification_time = sp->mfi.LastWriteTime;
+        f->last_access_time = sp->mfi.LastAccessTime;
+        /* set parent directory id for the stream */
+        f->internal.ParentDirectoryMftId = sp->mfi.ParentDirectoryMftId;
+        /* the reparse point target goes to the unnamed streams */
+        f->reparse_tag = sp->mfi.ReparseTag;
+        if(sp->mfi.ReparseTarget && f->name[0] == 0){
+            if(target_taken){
+                f->reparse_target = winx_wcsdup(sp->mfi.ReparseTarget);
             } else {
-                /* call the progress callback */
-                if(sp->pcb)
-                    sp->pcb(f,sp->user_defined_data);
+                f->reparse_target = sp->mfi.ReparseTarget;
+                target_taken = 1;
             }
         }
-        f = next;
-        if(f == head) break;
+        /* add filename to the name of the stream */
+        update_stream_name(f,sp);
+        /* call the progress callback */
+        if(sp->ctx){
+            sp->ctx->progress.files ++;
+            /* the map of the stream is complete now */
+            if(sp->ctx->frag && !sp->spill)
+                frag_stats_commit_file(sp->ctx->frag,f);
+        }
+        if(sp->pcb)
+            sp->pcb(f,sp->user_defined_data);
+        if(next == *sp->filelist) break;
     }
+    
+    if(!target_taken)
+        winx_free(sp->mfi.ReparseTarget);
+    sp->mfi.ReparseTarget = NULL;
+    
+    if(sp->ctx && sp->cc.fetched > sp->ctx->progress.max_child_records)
+        sp->ctx->progress.max_child_records = sp->cc.fetched;
+    
+    /*
+    * In the bounded-memory mode streams of the file
+    * are complete now, so they leave the list at once.
+    */
+    if(sp->spill)
+        spill_file_streams(sp);
 }
 
 /*
@@ -1514,13 +2575,22 @@ static void build_file_path(winx_file_info *f,file_entry *f_array,
             _snwprintf(p->buffer,MAX_PATH,L"\\%ws",p->child);
         p->buffer[MAX_PATH - 1] = 0;
         wcscpy(p->child,p->buffer);
+        /*
+        * Each step makes the path longer, so a full
+        * buffer means either a too deep tree or a loop
+        * of parent directories on a corrupted volume.
+        */
+        if(wcslen(p->child) >= MAX_PATH - 1){
+            etrace("path of %I64u record is too long",f->internal.BaseMftId);
+            break;
+        }
     }
     
     /* append root directory path, if not appended yet */
     if(p->child[1] == '?'){
         src = p->child;
     } else {
-        _snwprintf(p->buffer,MAX_PATH,L"\\??\\%c:\\%ws",sp->volume_letter,p->child);
+        _snwprintf(p->buffer,MAX_PATH,L"%ws\\%ws",sp->root,p->child);
         p->buffer[MAX_PATH - 1] = 0;
         src = p->buffer;
     }
@@ -1591,8 +2661,11 @@ static int build_full_paths(mft_scan_parameters *sp)
     }
     
     for(f = *sp->filelist; f != NULL; f = f->next){
+        (void)ftw_batch_update(sp->ctx,sp->user_defined_data);
         if(ftw_ntfs_check_for_termination(sp)) break;
-        build_file_path(f,f_array,n_entries,p,sp);
+        /* refreshed lists keep paths of unchanged files */
+        if(f->path == NULL)
+            build_file_path(f,f_array,n_entries,p,sp);
         if(f->next == *sp->filelist) break;
     }
     
@@ -1622,14 +2695,14 @@ static int scan_mft(mft_scan_parameters *sp)
     ULONGLONG start_time;
     ULONGLONG mft_id, ret_mft_id;
     NTSTATUS status;
-    int result;
+    int result = 0;
     
     itrace("mft scan started");
     start_time = winx_xtime();
     
 #ifdef TEST_NTFS_SCANNER
     dtrace("NTFS SCANNER TEST STARTED");
-    srnd(1);
+    winx_rnd_init(&test_rnd,1);
 #endif
     
     /* get mft layout */
@@ -1638,6 +2711,7 @@ fail:
         etrace("mft scan failed");
         return (-1);
     }
+    attach_records_cache(sp,1);
 
     /* allocate memory */
     nfrob = winx_tmalloc(sp->ml.file_record_buffer_size);
@@ -1648,9 +2722,19 @@ fail:
     }
     
     /* scan all file records sequentially */
+    ftw_phase_begin(sp->ctx,WINX_FTW_PHASE_SCAN);
     mft_id = sp->ml.number_of_file_records - 1;
     sp->mft_scan_direction = MFT_SCAN_RTL;
     while(!ftw_ntfs_check_for_termination(sp)){
+        /* child records fetched for their base records are never fetched again */
+        if(mft_id && is_cached_child_record(mft_id,sp)){
+            mft_id --;
+            if(sp->ctx){
+                sp->ctx->progress.records ++;
+                (void)ftw_batch_update(sp->ctx,sp->user_defined_data);
+            }
+            continue;
+        }
         status = get_file_record(mft_id,nfrob,sp);
         if(!NT_SUCCESS(status)){
             if(mft_id == 0){
@@ -1660,6 +2744,10 @@ fail:
             }
             /* it returns 0xc000000d (invalid parameter) for non existing records */
             mft_id --; /* try to retrieve the previous record */
+            if(sp->ctx){
+                sp->ctx->progress.records ++;
+                (void)ftw_batch_update(sp->ctx,sp->user_defined_data);
+            }
             continue;
         }
 
@@ -1667,6 +2755,13 @@ fail:
         ret_mft_id = GetMftIdFromFRN(nfrob->FileReferenceNumber);
         //trace(D"NTFS record found, id = %I64u",ret_mft_id);
         analyze_file_record(nfrob,sp);
+        
+        /* update progress, free records skipped by the system count as well */
+        if(sp->ctx){
+            sp->ctx->progress.records += (ret_mft_id <= mft_id) ? (mft_id - ret_mft_id + 1) : 1;
+            sp->ctx->progress.bytes_read += sp->ml.file_record_size;
+            (void)ftw_batch_update(sp->ctx,sp->user_defined_data);
+        }
 
         /* go to the next record */
         if(ret_mft_id == 0 || mft_id == 0)
@@ -1684,9 +2779,16 @@ fail:
         sp->processed_attr_list_entries);
     itrace("file records scan completed in %I64u ms",
         winx_xtime() - start_time);
+    if(sp->ctx)
+        ftw_phase_end(sp->ctx,WINX_FTW_PHASE_SCAN,sp->ctx->progress.records);
     
-    /* build full paths */
-    result = build_full_paths(sp);
+    /* build full paths, the external sort builds them by itself */
+    if(!sp->spill && !(sp->flags & WINX_FTW_SKIP_PATHS)){
+        ftw_phase_begin(sp->ctx,WINX_FTW_PHASE_PATHS);
+        result = build_full_paths(sp);
+        if(sp->ctx)
+            ftw_phase_end(sp->ctx,WINX_FTW_PHASE_PATHS,sp->ctx->progress.files);
+    }
 
     winx_free(nfrob);
 
@@ -1699,44 +2801,386 @@ fail:
     return result;
 }
 
+/*
+**************************************************
+*       Incremental scan of disk images
+**************************************************
+*/
+
+#define set_changed(bits,id) ((bits)[(id) >> 3] |= (UCHAR)(1 << ((id) & 7)))
+#define is_changed(bits,id)  ((bits)[(id) >> 3] & (1 << ((id) & 7)))
+
+/**
+ * @brief Reads headers of all the file records
+ * and compares them against the saved ones.
+ * @details Only the sequence number and the LSN of
+ * the last change are taken from each header. Both
+ * lie in the first sector of the record, untouched
+ * by the update sequence array, so no fixups are
+ * needed. The $Mft is read in large blocks and the
+ * comparison touches a few bytes per record, so the
+ * pass runs at the speed of the disk.
+ * @param[in,out] state the saved headers, replaced by
+ * the current ones on success.
+ * @param[out] changed receives the bitmap of records
+ * to be parsed again, NULL to capture the state only.
+ * @param[out] n_bits receives the size of the bitmap.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller.
+ */
+static int read_mft_headers(mft_scan_parameters *sp,winx_mft_state *state,
+    UCHAR **changed,ULONGLONG *n_bits)
+{
+    mft_image *im = sp->image;
+    FILE_RECORD_HEADER *frh;
+    ULONGLONG *lsn;
+    USHORT *seq;
+    UCHAR *bits = NULL;
+    ULONGLONG n, first, count, i, id, base;
+    ULONGLONG records_per_chunk;
+    ULONG rs = sp->ml.file_record_size;
+    NTSTATUS status;
+    int result = -1;
+
+    n = im->mapped_records;
+    lsn = winx_tmalloc((size_t)(n * sizeof(ULONGLONG)) + 1);
+    seq = winx_tmalloc((size_t)(n * sizeof(USHORT)) + 1);
+    if(lsn == NULL || seq == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            n * (sizeof(ULONGLONG) + sizeof(USHORT)));
+        goto done;
+    }
+    if(changed){
+        *n_bits = (state->n_records > n) ? state->n_records : n;
+        bits = winx_tmalloc((size_t)(*n_bits / 8) + 1);
+        if(bits == NULL){
+            etrace("cannot allocate %I64u bytes of memory",
+                *n_bits / 8 + 1);
+            goto done;
+        }
+        memset(bits,0,(size_t)(*n_bits / 8) + 1);
+    }
+
+    /* the block read recently gets overwritten */
+    im->chunk_records = 0;
+    records_per_chunk = MFT_IMAGE_CHUNK_SIZE / rs;
+    for(first = 0; first < n; first += count){
+        if(ftw_ntfs_check_for_termination(sp)){
+            result = -2;
+            goto done;
+        }
+        count = n - first;
+        if(count > records_per_chunk)
+            count = records_per_chunk;
+        status = read_mft_records(first,count,im->chunk,sp);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot read file records %I64u-%I64u",
+                first,first + count - 1);
+            goto done;
+        }
+        for(i = 0; i < count; i++){
+            frh = (FILE_RECORD_HEADER *)(im->chunk + i * rs);
+            id = first + i;
+            if(is_file_record(frh) && (frh->Flags & 0x1)){
+                lsn[id] = (ULONGLONG)frh->Ntfs.Usn;
+                seq[id] = frh->SequenceNumber;
+            } else {
+                lsn[id] = 0;
+                seq[id] = 0;
+            }
+            if(bits == NULL)
+                continue;
+            if(id < state->n_records && lsn[id] == state->lsn[id] && seq[id] == state->seq[id])
+                continue;
+            set_changed(bits,id);
+            /* attributes of child records belong to their base records */
+            if(lsn[id] && frh->BaseFileRecord){
+                base = GetMftIdFromFRN(frh->BaseFileRecord);
+                if(base < n) set_changed(bits,base);
+            }
+        }
+        if(sp->ctx && bits){
+            sp->ctx->progress.records += count;
+            sp->ctx->progress.bytes_read += count * rs;
+            (void)ftw_batch_update(sp->ctx,sp->user_defined_data);
+        }
+    }
+
+    /* records beyond the end of the $Mft are gone */
+    for(id = n; bits && id < state->n_records; id++)
+        set_changed(bits,id);
+
+    winx_free(state->lsn);
+    winx_free(state->seq);
+    state->lsn = lsn, lsn = NULL;
+    state->seq = seq, seq = NULL;
+    state->n_records = n;
+    if(changed)
+        *changed = bits, bits = NULL;
+    result = 0;
+
+done:
+    winx_free(lsn);
+    winx_free(seq);
+    winx_free(bits);
+    return result;
+}
+
+/**
+ * @brief Appends an unlinked entry to the list.
+ */
+static void append_entry(winx_file_info **list,winx_file_info *f)
+{
+    if(*list == NULL){
+        *list = f;
+        f->next = f->prev = f;
+        return;
+    }
+    f->prev = (*list)->prev;
+    f->next = *list;
+    (*list)->prev->next = f;
+    (*list)->prev = f;
+}
+
+/**
+ * @brief Checks whether a directory parsed
+ * again got another name or parent.
+ * @details Both lists are sorted by MFT
+ * index, so a single pass is enough.
+ */
+static int directories_moved(winx_file_info *stale,winx_file_info *fresh)
+{
+    winx_file_info *f, *g = fresh;
+
+    for(f = stale; f; f = f->next){
+        if((f->flags & FILE_ATTRIBUTE_DIRECTORY) && wcsstr(f->name,L":$") == NULL){
+            for(; g; g = (g->next == fresh) ? NULL : g->next){
+                if(g->internal.BaseMftId >= f->internal.BaseMftId) break;
+            }
+            for(; g && g->internal.BaseMftId == f->internal.BaseMftId;
+              g = (g->next == fresh) ? NULL : g->next){
+                if(!(g->flags & FILE_ATTRIBUTE_DIRECTORY) || wcsstr(g->name,L":$"))
+                    continue;
+                if(g->internal.ParentDirectoryMftId != f->internal.ParentDirectoryMftId \
+                  || wcscmp(g->name,f->name))
+                    return 1;
+                break;
+            }
+        }
+        if(f->next == stale) break;
+    }
+    return 0;
+}
+
+/**
+ * @brief Refreshes the list of files of a disk image.
+ * @details Headers of all the file records get compared
+ * against the saved ones. Streams of changed records
+ * leave the list, then the changed records are parsed
+ * again and their streams merge into the list, which
+ * stays sorted by MFT index. Paths are built for the
+ * new streams only, unless a directory got renamed or
+ * moved, which makes all the paths to be built again.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller.
+ */
+static int refresh_mft(mft_scan_parameters *sp,winx_mft_state *state)
+{
+    NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob;
+    winx_file_info *kept = NULL, *stale = NULL, *fresh = NULL;
+    winx_file_info *f, *g, *next, **filelist;
+    UCHAR *changed = NULL;
+    ULONGLONG n_bits = 0, mft_id, id;
+    ULONGLONG start_time;
+    NTSTATUS status;
+    int result;
+
+    itrace("mft refresh started");
+    start_time = winx_xtime();
+
+    if(get_mft_layout(sp) < 0){
+        etrace("mft refresh failed");
+        return (-1);
+    }
+    /* records kept since the last refresh stay valid, unless changed */
+    attach_records_cache(sp,0);
+
+    nfrob = winx_tmalloc(sp->ml.file_record_buffer_size);
+    if(nfrob == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sp->ml.file_record_buffer_size);
+        return (-1);
+    }
+
+    ftw_phase_begin(sp->ctx,WINX_FTW_PHASE_SCAN);
+    result = read_mft_headers(sp,state,&changed,&n_bits);
+    if(result < 0){
+        if(sp->ctx)
+            ftw_phase_end(sp->ctx,WINX_FTW_PHASE_SCAN,sp->ctx->progress.records);
+        winx_free(nfrob);
+        return result;
+    }
+    itrace("headers of %I64u file records compared in %I64u ms",
+        state->n_records,winx_xtime() - start_time);
+    if(sp->records_volume >= 0){
+        for(mft_id = 0; mft_id < state->n_records && mft_id < n_bits; mft_id++){
+            if(is_changed(changed,mft_id))
+                mft_cache_invalidate(sp->records,sp->records_volume,mft_id);
+        }
+    }
+
+    /* streams of the changed records leave the list */
+    filelist = sp->filelist;
+    f = *filelist;
+    if(f) f->prev->next = NULL;
+    for(; f; f = next){
+        next = f->next;
+        id = f->internal.BaseMftId;
+        append_entry((id < n_bits && is_changed(changed,id)) ? &stale : &kept,f);
+    }
+    *filelist = NULL;
+
+    /* parse the changed records again, from right to left like scan_mft */
+    state->changed_records = 0;
+    sp->filelist = &fresh;
+    sp->mft_scan_direction = MFT_SCAN_RTL;
+    for(mft_id = state->n_records; mft_id-- > 0; ){
+        if(ftw_ntfs_check_for_termination(sp)){
+            result = -2;
+            break;
+        }
+        if(!is_changed(changed,mft_id) || state->lsn[mft_id] == 0)
+            continue;
+        status = get_cached_file_record(mft_id,nfrob,sp);
+        if(!NT_SUCCESS(status) || GetMftIdFromFRN(nfrob->FileReferenceNumber) != mft_id)
+            continue;
+        if(((FILE_RECORD_HEADER *)nfrob->FileRecordBuffer)->BaseFileRecord == 0)
+            state->changed_records ++;
+        analyze_file_record(nfrob,sp);
+    }
+    if(sp->ctx)
+        ftw_phase_end(sp->ctx,WINX_FTW_PHASE_SCAN,sp->ctx->progress.records);
+    itrace("%I64u changed file records parsed",state->changed_records);
+
+    /* merge the streams, both lists are sorted by MFT index */
+    if(directories_moved(stale,fresh)){
+        itrace("directories moved, all the paths will be built again");
+        for(f = kept; f; f = f->next){
+            winx_free(f->path);
+            f->path = NULL;
+            if(f->next == kept) break;
+        }
+    }
+    if(kept) kept->prev->next = NULL;
+    if(fresh) fresh->prev->next = NULL;
+    f = kept, g = fresh;
+    while(f || g){
+        if(g == NULL || (f && f->internal.BaseMftId <= g->internal.BaseMftId)){
+            next = f->next;
+            append_entry(filelist,f);
+            f = next;
+        } else {
+            next = g->next;
+            append_entry(filelist,g);
+            g = next;
+        }
+    }
+    sp->filelist = filelist;
+    winx_ftw_release(stale);
+    winx_free(changed);
+    winx_free(nfrob);
+
+    /* build the missing paths */
+    if(result == 0 && !(sp->flags & WINX_FTW_SKIP_PATHS)){
+        ftw_phase_begin(sp->ctx,WINX_FTW_PHASE_PATHS);
+        result = build_full_paths(sp);
+        if(sp->ctx)
+            ftw_phase_end(sp->ctx,WINX_FTW_PHASE_PATHS,sp->ctx->progress.files);
+    }
+
+    itrace("mft refresh completed in %I64u ms",
+        winx_xtime() - start_time);
+    return result;
+}
+
 /**
  * @brief Scans the entire disk and adds
  * all files found to the list of files.
+ * @param[in] path the native path of the volume
+ * or of the disk image.
+ * @param[in] root the path prepended to paths of files.
+ * @param[in] image nonzero value indicates that
+ * the path refers to a disk image.
+ * @param[in] spill the external sort to move files
+ * to instead of the list, NULL to keep them in the list.
+ * @param[in,out] state headers of the file records
+ * of a disk image; when they're saved already, the
+ * list gets refreshed instead of the full scan.
+ * NULL if no refresh is planned.
  * @return Zero for success, -1 indicates
  * failure, -2 indicates termination requested
  * by the caller.
  */
-static int ntfs_scan_disk_helper(char volume_letter,
+static int ntfs_scan_disk_helper(wchar_t *path,wchar_t *root,int image,
     int flags, ftw_filter_callback fcb,
     ftw_progress_callback pcb, ftw_terminator t,
-    void *user_defined_data, winx_file_info **filelist)
+    winx_ftw_context *ctx, void *user_defined_data,
+    struct _spill *spill, winx_mft_state *state,
+    winx_file_info **filelist)
 {
-    wchar_t path[] = L"\\??\\A:";
     int result;
     mft_scan_parameters sp;
+    mft_image im;
     winx_file_info *f;
     
     sp.filelist = filelist;
-    sp.volume_letter = volume_letter;
+    sp.volume_letter = image ? 0 : (char)path[4];
+    sp.root = root;
+    sp.image = NULL;
+    sp.spill = spill;
+    memset(sp.stream_names,0,sizeof(sp.stream_names));
+    init_child_cache(&sp);
+    sp.records = sp.own_records = NULL;
+    sp.records_volume = -1;
+    sp.block = NULL;
     sp.processed_attr_list_entries = 0;
     sp.errors = 0;
     sp.flags = flags;
     sp.fcb = fcb;
     sp.pcb = pcb;
     sp.t = t;
+    sp.ctx = ctx;
     sp.user_defined_data = user_defined_data;
     
+    if(image){
+        memset(&im,0,sizeof(mft_image));
+        im.chunk = winx_tmalloc(MFT_IMAGE_CHUNK_SIZE);
+        if(im.chunk == NULL){
+            etrace("cannot allocate %u bytes of memory",
+                MFT_IMAGE_CHUNK_SIZE);
+            return (-1);
+        }
+        sp.image = &im;
+    }
+    
     /* open the volume for read access */
-    path[4] = winx_toupper(volume_letter);
-    sp.f_volume = winx_fopen(path,"r");
-    if(sp.f_volume == NULL)
-        return (-1);
+    sp.f_volume = winx_open_image(path);
+    if(sp.f_volume == NULL){
+        result = -1;
+        goto done;
+    }
     
     /* scan mft directly -> add all files to the list */
-    result = scan_mft(&sp);
+    if(state && state->n_records){
+        result = refresh_mft(&sp,state);
+    } else {
+        result = scan_mft(&sp);
+        if(result == 0 && state)
+            result = read_mft_headers(&sp,state,NULL,NULL);
+    }
     if(result < 0){
         winx_fclose(sp.f_volume);
-        return result;
+        goto done;
     }
     
     /* call the filter callback for each file found */
@@ -1750,15 +3194,26 @@ static int ntfs_scan_disk_helper(char volume_letter,
     winx_fclose(sp.f_volume);
     
     if(!(sp.flags & WINX_FTW_ALLOW_PARTIAL_SCAN) && sp.errors)
-        return (-1);
-    
-    return 0;
+        result = -1;
+
+done:
+    if(sp.image){
+        winx_free(im.runs);
+        winx_free(im.chunk);
+    }
+    release_stream_names(&sp);
+    release_child_cache(&sp);
+    release_records_cache(&sp);
+    return result;
 }
 
 /**
  * @internal
  * @brief winx_scan_disk analog, but optimized
  * to scan NTFS-formatted volumes much faster.
+ * @details When ctx is not NULL, progress is
+ * delivered in batches of MFT records and
+ * termination is checked at the same granularity.
  * @note Whenever scan termination is requested
  * by the caller, file paths will be not built
  * properly because of missing information about
@@ -1766,11 +3221,13 @@ static int ntfs_scan_disk_helper(char volume_letter,
  */
 winx_file_info *ntfs_scan_disk(char volume_letter,
     int flags, ftw_filter_callback fcb, ftw_progress_callback pcb, 
-    ftw_terminator t, void *user_defined_data)
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data)
 {
     winx_file_info *filelist = NULL;
+    wchar_t path[] = L"\\??\\A:";
     
-    if(ntfs_scan_disk_helper(volume_letter,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
+    path[4] = winx_toupper(volume_letter);
+    if(ntfs_scan_disk_helper(path,path,0,flags,fcb,pcb,t,ctx,user_defined_data,NULL,NULL,&filelist) == (-1) && \
       !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
         /* destroy the list */
         winx_ftw_release(filelist);
@@ -1780,4 +3237,94 @@ winx_file_info *ntfs_scan_disk(char volume_letter,
     return filelist;
 }
 
+/**
+ * @internal
+ * @brief ntfs_scan_disk analog for disk images.
+ * @details Reads file records directly from the image,
+ * so it works for images of volumes which cannot be
+ * mounted as well. Paths of the files look like
+ * \\??\\C:\\images\\ntfs.img:\\dir\\file.
+ */
+winx_file_info *ntfs_scan_image(wchar_t *path,
+    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb, 
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data)
+{
+    winx_file_info *filelist = NULL;
+    wchar_t *root;
+    
+    root = winx_swprintf(L"%ws:",path);
+    if(root == NULL){
+        etrace("cannot allocate memory for %ws",path);
+        return NULL;
+    }
+    if(ntfs_scan_disk_helper(path,root,1,flags,fcb,pcb,t,ctx,user_defined_data,NULL,NULL,&filelist) == (-1) && \
+      !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
+        /* destroy the list */
+        winx_ftw_release(filelist);
+        filelist = NULL;
+    }
+    
+    winx_free(root);
+    return filelist;
+}
+
+/**
+ * @internal
+ * @brief ntfs_scan_disk analog for
+ * the bounded-memory mode.
+ * @details Files found are moved to the
+ * external sort as soon as their records
+ * are analyzed, so the list stays empty.
+ * @return Zero for success, -1 indicates
+ * failure, -2 indicates termination requested
+ * by the caller.
+ */
+int ntfs_scan_disk_bounded(char volume_letter,int flags,
+    struct _spill *spill,winx_ftw_context *ctx,void *user_defined_data)
+{
+    winx_file_info *filelist = NULL;
+    wchar_t path[] = L"\\??\\A:";
+    int result;
+    
+    path[4] = winx_toupper(volume_letter);
+    result = ntfs_scan_disk_helper(path,path,0,flags,NULL,NULL,NULL,
+        ctx,user_defined_data,spill,NULL,&filelist);
+    winx_ftw_release(filelist);
+    if(result == 0 && ctx && ctx->terminated)
+        result = -2;
+    return result;
+}
+
+/**
+ * @internal
+ * @brief Refreshes the list of files of a disk image.
+ * @details The first call scans the image entirely
+ * and saves headers of its file records. Subsequent
+ * calls parse again the records whose headers changed.
+ * @param[in,out] filelist the list of files, sorted
+ * by MFT index, as the NTFS scanner leaves it.
+ * @param[in,out] state headers of the file records.
+ * @return Zero for success, -1 indicates
+ * failure, -2 indicates termination requested
+ * by the caller.
+ */
+int ntfs_refresh_image(wchar_t *path,int flags,winx_file_info **filelist,
+    winx_mft_state *state,winx_ftw_context *ctx,void *user_defined_data)
+{
+    wchar_t *root;
+    int result;
+    
+    root = winx_swprintf(L"%ws:",path);
+    if(root == NULL){
+        etrace("cannot allocate memory for %ws",path);
+        return (-1);
+    }
+    result = ntfs_scan_disk_helper(path,root,1,flags,NULL,NULL,NULL,
+        ctx,user_defined_data,NULL,state,filelist);
+    if(result == 0 && ctx && ctx->terminated)
+        result = -2;
+    winx_free(root);
+    return result;
+}
+
 /** @} */
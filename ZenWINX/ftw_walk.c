@@ -0,0 +1,491 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file ftw_walk.c
+ * @brief Breadth-first tree walk for FAT and exFAT.
+ * @details The code here opens the volume, walks
+ * the directory tree level by level, each level in
+ * the order of clusters, and builds the file list.
+ * The scanners of both file systems decode their
+ * boot sectors and directory entries only, all the
+ * reads go through ftw_walk_read. On Windows it rests
+ * on the file routines of the library, elsewhere on
+ * POSIX calls, so images can be scanned there too.
+ * @addtogroup File
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+#include "ftw_walk.h"
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+/* external functions prototypes */
+int ftw_batch_update(winx_ftw_context *ctx,void *user_defined_data);
+void frag_stats_add_file(winx_frag_stats *fs,winx_file_info *f);
+
+/**
+ * @internal
+ * @brief Checks whether the caller
+ * requested termination of the walk.
+ */
+int ftw_walk_check_for_termination(ftw_walk *w)
+{
+    if(w->ctx != NULL)
+        return w->ctx->terminated;
+
+    if(w->t == NULL)
+        return 0;
+
+    return w->t(w->user_defined_data);
+}
+
+/**
+ * @internal
+ * @brief Opens the volume for read access.
+ * @details Off Windows the path is an
+ * ordinary path of the image file.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int ftw_walk_open(ftw_walk *w)
+{
+#if defined(_WIN32)
+    w->f_volume = winx_open_image(w->path);
+    return (w->f_volume == NULL) ? (-1) : 0;
+#else
+    char path[PATH_MAX];
+
+    if(wcstombs(path,w->path,sizeof(path)) >= sizeof(path)){
+        etrace("cannot convert %ws to a path",w->path);
+        return (-1);
+    }
+    w->f_volume = open(path,O_RDONLY);
+    if(w->f_volume < 0){
+        etrace("cannot open %s: error %d",path,errno);
+        return (-1);
+    }
+    return 0;
+#endif
+}
+
+/**
+ * @internal
+ * @brief Closes the volume.
+ */
+static void ftw_walk_close(ftw_walk *w)
+{
+#if defined(_WIN32)
+    winx_fclose(w->f_volume);
+#else
+    (void)close(w->f_volume);
+#endif
+}
+
+/**
+ * @internal
+ * @brief Reads the volume.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+int ftw_walk_read(ULONGLONG offset,void *buffer,ULONG length,ftw_walk *w)
+{
+#if defined(_WIN32)
+    w->f_volume->roffset.QuadPart = offset;
+    if(winx_fread(buffer,1,length,w->f_volume) != length){
+        etrace("cannot read %u bytes at %I64u",length,offset);
+        return (-1);
+    }
+#else
+    ULONG done = 0;
+    ssize_t n;
+
+    while(done < length){
+        n = pread(w->f_volume,(char *)buffer + done,
+            length - done,(off_t)(offset + done));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0){
+            etrace("cannot read %u bytes at %I64u",length,offset);
+            return (-1);
+        }
+        done += (ULONG)n;
+    }
+#endif
+    if(w->ctx) w->ctx->progress.bytes_read += length;
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Makes a buffer large enough.
+ * @param[in,out] buffer the buffer.
+ * @param[in,out] buffer_size size of the buffer.
+ * @param[in] size the size needed.
+ * @param[in] used number of bytes to keep.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+int ftw_walk_grow_buffer(char **buffer,ULONG *buffer_size,ULONG size,ULONG used)
+{
+    char *b;
+
+    if(size <= *buffer_size)
+        return 0;
+    b = winx_tmalloc(size);
+    if(b == NULL){
+        etrace("cannot allocate %u bytes of memory",size);
+        return (-1);
+    }
+    if(used)
+        memcpy(b,*buffer,used);
+    winx_free(*buffer);
+    *buffer = b;
+    *buffer_size = size;
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Prepares the walk, once
+ * the layout of the volume is known.
+ * @param[in] cluster_size the size of
+ * clusters, in bytes.
+ * @param[in] clusters the number of
+ * clusters, cluster #2 is the first one.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+int ftw_walk_prepare(ftw_walk *w,ULONG cluster_size,ULONG clusters)
+{
+    ULONG size;
+
+    if(w->ctx){
+        w->ctx->bytes_per_cluster = cluster_size;
+        if(w->ctx->frag)
+            w->ctx->frag->bytes_per_cluster = cluster_size;
+    }
+
+    size = (ULONG)(((ULONGLONG)clusters + 2 + 7) / 8);
+    w->visited = winx_tmalloc(size);
+    if(w->visited == NULL){
+        etrace("cannot allocate %u bytes of memory",size);
+        return (-1);
+    }
+    memset(w->visited,0,size);
+    w->time_bias = winx_get_time_bias();
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Builds a path of a file.
+ * @return The path, NULL indicates failure.
+ */
+wchar_t *ftw_walk_build_path(wchar_t *parent,wchar_t *name)
+{
+    wchar_t *path;
+    size_t length;
+    int is_rootdir;
+
+    length = wcslen(parent);
+    /* only the root directory contains trailing backslash */
+    is_rootdir = (length && parent[length - 1] == '\\') ? 1 : 0;
+    length += wcslen(name) + (is_rootdir ? 1 : 2);
+    path = winx_tmalloc(length * sizeof(wchar_t));
+    if(path == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            length * sizeof(wchar_t));
+        return NULL;
+    }
+    if(is_rootdir)
+        (void)_snwprintf(path,length,L"%ws%ws",parent,name);
+    else
+        (void)_snwprintf(path,length,L"%ws\\%ws",parent,name);
+    path[length - 1] = 0;
+    return path;
+}
+
+/**
+ * @internal
+ * @brief Inserts a new entry to the file list.
+ * @return Address of the inserted list entry,
+ * NULL indicates failure.
+ */
+winx_file_info *ftw_walk_add_entry(wchar_t *name,wchar_t *path,ftw_walk *w)
+{
+    winx_file_info *f;
+
+    f = (winx_file_info *)winx_list_insert((list_entry **)(void *)w->filelist,
+        NULL,sizeof(winx_file_info));
+    f->name = winx_wcsdup(name);
+    f->path = path;
+    if(f->name == NULL || f->path == NULL){
+        etrace("cannot allocate memory for %ws",name);
+        winx_free(f->name);
+        winx_free(f->path);
+        winx_list_remove((list_entry **)(void *)w->filelist,(list_entry *)f);
+        return NULL;
+    }
+    f->flags = 0;
+    f->user_defined_flags = 0;
+    f->creation_time = 0;
+    f->last_modification_time = 0;
+    f->last_access_time = 0;
+    f->reparse_tag = 0;
+    f->reparse_target = NULL;
+    memset(&f->internal,0,sizeof(winx_file_internal_info));
+    memset(&f->disp,0,sizeof(winx_file_disposition));
+    return f;
+}
+
+/**
+ * @internal
+ * @brief Delivers a file found to the callbacks.
+ * @return Nonzero value if the file's
+ * children must be skipped.
+ */
+int ftw_walk_report_file(winx_file_info *f,ftw_walk *w)
+{
+    if(w->ctx != NULL){
+        w->ctx->progress.files ++;
+        if(w->ctx->frag && (w->flags & WINX_FTW_DUMP_FILES))
+            frag_stats_add_file(w->ctx->frag,f);
+        (void)ftw_batch_update(w->ctx,w->user_defined_data);
+    }
+    if(w->pcb != NULL)
+        w->pcb(f,w->user_defined_data);
+    if(w->fcb != NULL)
+        return w->fcb(f,w->user_defined_data);
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Adds a directory to the next level of the walk.
+ * @param[in] cluster the first cluster, zero stands
+ * for the fixed root directory of FAT12/16.
+ * @param[in] size the size of the directory,
+ * zero when the chain defines it.
+ * @param[in] contiguous nonzero value indicates
+ * that the chain isn't kept in the table.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+int ftw_walk_push_directory(winx_file_info *f,ULONG cluster,
+    ULONGLONG size,int contiguous,ftw_walk *w)
+{
+    ftw_directory *level;
+    ULONG n;
+
+    /* damaged volumes may have a few entries referring to the same directory */
+    if(cluster){
+        if(w->visited[cluster >> 3] & (1 << (cluster & 7))){
+            etrace("%ws: directory listed already",f->path);
+            return 0;
+        }
+        w->visited[cluster >> 3] |= (UCHAR)(1 << (cluster & 7));
+    }
+
+    if(w->n_level == w->max_level){
+        n = w->max_level ? w->max_level * 2 : 64;
+        level = winx_tmalloc(n * sizeof(ftw_directory));
+        if(level == NULL){
+            etrace("cannot allocate %u bytes of memory",
+                n * sizeof(ftw_directory));
+            return (-1);
+        }
+        if(w->n_level)
+            memcpy(level,w->level,w->n_level * sizeof(ftw_directory));
+        winx_free(w->level);
+        w->level = level;
+        w->max_level = n;
+    }
+    w->level[w->n_level].f = f;
+    w->level[w->n_level].cluster = cluster;
+    w->level[w->n_level].size = size;
+    w->level[w->n_level].contiguous = contiguous;
+    w->n_level ++;
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Sorts directories of a level
+ * by their first clusters, so the disk
+ * head moves in a single direction.
+ */
+static void sort_directories(ftw_directory *d,ULONG n)
+{
+    /* the order affects the speed only */
+    (void)winx_radix_sort(d,n,sizeof(ftw_directory),
+        FIELD_OFFSET(ftw_directory,cluster),WINX_SORT_ULONG);
+}
+
+/**
+ * @internal
+ * @brief Walks the directory tree level by level.
+ * @param[in] list the routine listing directories.
+ * @param[in] sp parameters of the file system,
+ * passed to the routine as they are.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller.
+ */
+int ftw_walk_directories(ftw_walk *w,ftw_walk_lister list,void *sp)
+{
+    ftw_directory *level;
+    ULONG n, i;
+    int result = 0;
+
+    while(w->n_level && result == 0){
+        /* the next level gets gathered anew */
+        level = w->level, n = w->n_level;
+        w->level = NULL, w->n_level = w->max_level = 0;
+
+        sort_directories(level,n);
+        for(i = 0; i < n; i++){
+            if(ftw_walk_check_for_termination(w)){
+                result = -2;
+                break;
+            }
+            result = list(&level[i],sp);
+            if(result < 0) break;
+        }
+        winx_free(level);
+    }
+    return result;
+}
+
+/**
+ * @internal
+ * @brief ftw_walk_scan_disk and
+ * ftw_walk_scan_image common code.
+ * @param[in] path the native path of the volume or image.
+ * @param[in] root the path prepended to paths of files.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller.
+ */
+static int ftw_walk_helper(ftw_walk_scanner scan,wchar_t *path,wchar_t *root,
+    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data,
+    winx_file_info **filelist)
+{
+    ftw_walk w;
+    UCHAR *bs = NULL;
+    int result = -1;
+
+    memset(&w,0,sizeof(ftw_walk));
+    w.path = path;
+    w.root = root;
+    w.flags = flags;
+    w.fcb = fcb;
+    w.pcb = pcb;
+    w.t = t;
+    w.ctx = ctx;
+    w.user_defined_data = user_defined_data;
+    w.filelist = filelist;
+
+    /* open the volume for read access */
+    if(ftw_walk_open(&w) < 0)
+        return (-1);
+
+    bs = winx_tmalloc(FTW_WALK_BOOT_READ_SIZE);
+    if(bs == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            FTW_WALK_BOOT_READ_SIZE);
+        goto done;
+    }
+    if(ftw_walk_read(0,bs,FTW_WALK_BOOT_READ_SIZE,&w) < 0)
+        goto done;
+
+    result = scan(bs,&w);
+    if(result == 0 && w.errors && !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN))
+        result = -1;
+
+done:
+    ftw_walk_close(&w);
+    winx_free(bs);
+    winx_free(w.visited);
+    winx_free(w.buffer);
+    winx_free(w.level);
+    return result;
+}
+
+/**
+ * @internal
+ * @brief Scans a volume by a scanner
+ * of a particular file system.
+ * @return The list of files, NULL indicates failure.
+ */
+winx_file_info *ftw_walk_scan_disk(ftw_walk_scanner scan,char volume_letter,
+    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data)
+{
+    winx_file_info *filelist = NULL;
+    wchar_t path[] = L"\\??\\A:";
+
+    path[4] = winx_toupper(volume_letter);
+    if(ftw_walk_helper(scan,path,path,flags,fcb,pcb,t,ctx,user_defined_data,&filelist) == (-1) && \
+      !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
+        /* destroy the list */
+        winx_ftw_release(filelist);
+        return NULL;
+    }
+
+    return filelist;
+}
+
+/**
+ * @internal
+ * @brief ftw_walk_scan_disk analog for disk images.
+ * @details Paths of the files look like
+ * \\??\\C:\\images\\fat.img:\\dir\\file.
+ */
+winx_file_info *ftw_walk_scan_image(ftw_walk_scanner scan,wchar_t *path,
+    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data)
+{
+    winx_file_info *filelist = NULL;
+    wchar_t *root;
+
+    root = winx_swprintf(L"%ws:",path);
+    if(root == NULL){
+        etrace("cannot allocate memory for %ws",path);
+        return NULL;
+    }
+    if(ftw_walk_helper(scan,path,root,flags,fcb,pcb,t,ctx,user_defined_data,&filelist) == (-1) && \
+      !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
+        /* destroy the list */
+        winx_ftw_release(filelist);
+        filelist = NULL;
+    }
+
+    winx_free(root);
+    return filelist;
+}
+
+/** @} */
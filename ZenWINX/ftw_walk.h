@@ -0,0 +1,104 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+* Internal structures of the FAT and exFAT scanners.
+*/
+
+#ifndef _FTW_WALK_H_
+#define _FTW_WALK_H_
+
+/*
+* NOTE: All these structures and function prototypes
+* are internal - for ftw_walk.c, ftw_fat.c and ftw_exfat.c
+* files only.
+*/
+
+/* fields of on-disk structures are little-endian */
+#define get_u16(p) ((ULONG)((UCHAR *)(p))[0] | ((ULONG)((UCHAR *)(p))[1] << 8))
+#define get_u32(p) (get_u16(p) | (get_u16((UCHAR *)(p) + 2) << 16))
+#define get_u64(p) ((ULONGLONG)get_u32(p) | ((ULONGLONG)get_u32((UCHAR *)(p) + 4) << 32))
+
+/* enough to cover the boot sector on any volume */
+#define FTW_WALK_BOOT_READ_SIZE 4096
+
+typedef struct _ftw_directory {
+    winx_file_info *f;
+    ULONG cluster;              /* the first cluster, zero for the fixed root of FAT12/16 */
+    ULONGLONG size;             /* zero when the chain defines it */
+    int contiguous;             /* nonzero value indicates that the chain isn't kept in the table */
+} ftw_directory;
+
+typedef struct _ftw_walk {
+    wchar_t *path;              /* native path of the volume or image */
+#if defined(_WIN32)
+    WINX_FILE *f_volume;        /* volume or image handle */
+#else
+    int f_volume;               /* descriptor of the image */
+#endif
+    wchar_t *root;              /* path prepended to paths of files */
+    UCHAR *visited;             /* a bit per cluster, set for directories listed already */
+    char *buffer;               /* contents of the directory being parsed */
+    ULONG buffer_size;
+    ftw_directory *level;       /* directories of the next level */
+    ULONG n_level, max_level;
+    LONGLONG time_bias;         /* local time minus the system time */
+    unsigned long errors;       /* number of directories and entries skipped */
+    int flags;                  /* combination of WINX_FTW_xxx flags */
+    ftw_filter_callback fcb;
+    ftw_progress_callback pcb;
+    ftw_terminator t;
+    winx_ftw_context *ctx;      /* batched progress reporting context, may be NULL */
+    void *user_defined_data;
+    winx_file_info **filelist;
+} ftw_walk;
+
+/*
+* Scans the volume which boot sector is passed in;
+* returns zero for success, -1 for failure and -2
+* for termination requested by the caller.
+*/
+typedef int (*ftw_walk_scanner)(UCHAR *bs,ftw_walk *w);
+
+/*
+* Adds files of a directory to the file list
+* and subdirectories to the next level of the walk;
+* returns the same values as the scanner does.
+*/
+typedef int (*ftw_walk_lister)(ftw_directory *d,void *sp);
+
+int ftw_walk_check_for_termination(ftw_walk *w);
+int ftw_walk_read(ULONGLONG offset,void *buffer,ULONG length,ftw_walk *w);
+int ftw_walk_grow_buffer(char **buffer,ULONG *buffer_size,ULONG size,ULONG used);
+int ftw_walk_prepare(ftw_walk *w,ULONG cluster_size,ULONG clusters);
+wchar_t *ftw_walk_build_path(wchar_t *parent,wchar_t *name);
+winx_file_info *ftw_walk_add_entry(wchar_t *name,wchar_t *path,ftw_walk *w);
+int ftw_walk_report_file(winx_file_info *f,ftw_walk *w);
+int ftw_walk_push_directory(winx_file_info *f,ULONG cluster,
+    ULONGLONG size,int contiguous,ftw_walk *w);
+int ftw_walk_directories(ftw_walk *w,ftw_walk_lister list,void *sp);
+
+winx_file_info *ftw_walk_scan_disk(ftw_walk_scanner scan,char volume_letter,
+    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data);
+winx_file_info *ftw_walk_scan_image(ftw_walk_scanner scan,wchar_t *path,
+    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
+    ftw_terminator t, winx_ftw_context *ctx, void *user_defined_data);
+
+#endif /* _FTW_WALK_H_ */
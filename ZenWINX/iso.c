@@ -0,0 +1,1010 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file iso.c
+ * @brief Read-only access to ISO 9660 images.
+ * @details The image is read as a regular file,
+ * no driver is involved. Joliet names are preferred
+ * when the image has them. The path table gets loaded
+ * once and hashed, so a directory is located without
+ * reading any of its parents. Files are described by
+ * the usual winx_file_info structures, their blockmaps
+ * in logical blocks of the image. Adjacent extents
+ * of a file get merged, so a read of a contiguous
+ * range is a single request straight to the buffer
+ * of the caller.
+ * @addtogroup File
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+/* volume descriptors start at this sector, of 2048 bytes */
+#define ISO_SECTOR_SIZE        2048
+#define ISO_FIRST_DESCRIPTOR   16
+#define ISO_MAX_DESCRIPTORS    64
+
+/* types of volume descriptors */
+#define ISO_VD_PRIMARY         1
+#define ISO_VD_SUPPLEMENTARY   2
+#define ISO_VD_TERMINATOR      255
+
+/* fields of volume descriptors */
+#define ISO_VD_ESCAPES         88
+#define ISO_VD_BLOCK_SIZE      128
+#define ISO_VD_PATH_TABLE_SIZE 132
+#define ISO_VD_PATH_TABLE      140
+#define ISO_VD_ROOT            156
+
+/* fields of directory records */
+#define ISO_DR_LBA             2
+#define ISO_DR_SIZE            10
+#define ISO_DR_TIME            18
+#define ISO_DR_FLAGS           25
+#define ISO_DR_UNIT_SIZE       26
+#define ISO_DR_NAME_LENGTH     32
+#define ISO_DR_NAME            33
+
+/* flags of directory records */
+#define ISO_FLAG_HIDDEN        0x01
+#define ISO_FLAG_DIRECTORY     0x02
+#define ISO_FLAG_MULTI_EXTENT  0x80
+
+/* limits protecting against damaged images */
+#define ISO_MAX_PATH_TABLE     (16 * 1024 * 1024)
+#define ISO_MAX_DIRECTORY_SIZE (64 * 1024 * 1024)
+
+/* directory trees get extracted to this depth at most */
+#define ISO_MAX_DEPTH          64
+
+/* files get extracted in portions of this size */
+#define ISO_EXTRACT_CHUNK      (1024 * 1024)
+
+#define ISO_NONE ((ULONG)-1)
+
+/* internal structures */
+typedef struct _iso_directory {
+    ULONG lba;              /* the first block of the directory */
+    ULONG parent;           /* index of the parent directory */
+    wchar_t *name;
+    ULONG next;             /* the next directory of the same hash chain */
+} iso_directory;
+
+struct _winx_iso {
+    WINX_FILE *f;
+    ULONGLONG size;         /* size of the image, in bytes */
+    ULONG block_size;       /* logical block size, in bytes */
+    int joliet;             /* nonzero value indicates that Joliet names are in use */
+    ULONG root_lba;
+    ULONG root_size;        /* size of the root directory, in bytes */
+    iso_directory *dirs;    /* the path table, the root comes first */
+    ULONG n_dirs;
+    ULONG *hash;            /* heads of hash chains of directories */
+    ULONG hash_mask;
+};
+
+#define get_u16(p) ((ULONG)((UCHAR *)(p))[0] | ((ULONG)((UCHAR *)(p))[1] << 8))
+#define get_u32(p) (get_u16(p) | (get_u16((UCHAR *)(p) + 2) << 16))
+
+/*
+**************************************************************
+*                    Low level routines
+**************************************************************
+*/
+
+/**
+ * @internal
+ * @brief Reads a range of the image.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int read_image(winx_iso *iso,ULONGLONG offset,void *buffer,ULONG length)
+{
+    if(offset > iso->size || length > iso->size - offset){
+        etrace("range %I64u:%u is beyond the image end",offset,length);
+        return (-1);
+    }
+    iso->f->roffset.QuadPart = offset;
+    if(winx_fread(buffer,1,length,iso->f) != length){
+        etrace("cannot read %u bytes at %I64u",length,offset);
+        return (-1);
+    }
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Converts a name of a directory
+ * record or of the path table.
+ * @details Joliet names are big endian UCS-2.
+ * Version suffixes and trailing dots of file
+ * names get removed.
+ * @return The name, NULL indicates failure.
+ */
+static wchar_t *get_name(winx_iso *iso,UCHAR *p,ULONG length)
+{
+    wchar_t *name;
+    ULONG i, n;
+
+    n = iso->joliet ? length / 2 : length;
+    name = winx_tmalloc((n + 1) * sizeof(wchar_t));
+    if(name == NULL){
+        etrace("cannot allocate %u bytes of memory",(n + 1) * sizeof(wchar_t));
+        return NULL;
+    }
+    for(i = 0; i < n; i++){
+        if(iso->joliet)
+            name[i] = (wchar_t)((p[2 * i] << 8) | p[2 * i + 1]);
+        else
+            name[i] = (wchar_t)p[i];
+    }
+    name[n] = 0;
+
+    for(i = 0; i < n; i++){
+        if(name[i] == ';'){
+            name[i] = 0;
+            break;
+        }
+    }
+    n = i;
+    if(n > 1 && name[n - 1] == '.')
+        name[n - 1] = 0;
+    return name;
+}
+
+/**
+ * @internal
+ * @brief Converts a time of a directory record
+ * to the standard time format.
+ * @details Dates before 1980 aren't supported,
+ * zero gets returned for them.
+ */
+static ULONGLONG get_time(UCHAR *p)
+{
+    ULONGLONG time;
+    unsigned short date, t;
+    LONGLONG bias;
+
+    if(p[0] < 80 || p[0] > 80 + 127)
+        return 0;
+    date = (unsigned short)(((p[0] - 80) << 9) | (p[1] << 5) | p[2]);
+    t = (unsigned short)((p[3] << 11) | (p[4] << 5) | (p[5] >> 1));
+    time = winx_dos2time(date,t,(unsigned char)((p[5] & 1) * 100));
+    if(time == 0)
+        return 0;
+
+    /* offset from GMT, in 15 minute intervals */
+    bias = (LONGLONG)(signed char)p[6] * 15 * 60 * 10000000;
+    return (ULONGLONG)((LONGLONG)time - bias);
+}
+
+/**
+ * @internal
+ * @brief Checks whether a name
+ * is acceptable as a part of a path.
+ */
+static int is_valid_name(wchar_t *name)
+{
+    if(name[0] == 0 || wcscmp(name,L".") == 0 || wcscmp(name,L"..") == 0)
+        return 0;
+    return wcspbrk(name,L"\\/:") ? 0 : 1;
+}
+
+/*
+**************************************************************
+*                    The path table
+**************************************************************
+*/
+
+/**
+ * @internal
+ * @brief Calculates a hash of a directory name,
+ * case insensitive.
+ */
+static ULONG get_hash(ULONG parent,wchar_t *name)
+{
+    ULONG h = 2166136261u ^ parent;
+
+    for(; *name; name++){
+        h ^= (ULONG)winx_towupper(*name);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @internal
+ * @brief Locates a child directory
+ * of the directory specified by index.
+ * @return Index of the child, ISO_NONE
+ * if it doesn't exist.
+ */
+static ULONG find_child(winx_iso *iso,ULONG parent,wchar_t *name)
+{
+    ULONG i;
+
+    for(i = iso->hash[get_hash(parent,name) & iso->hash_mask]; i != ISO_NONE; i = iso->dirs[i].next){
+        if(iso->dirs[i].parent == parent && winx_wcsicmp(iso->dirs[i].name,name) == 0)
+            return i;
+    }
+    return ISO_NONE;
+}
+
+/**
+ * @internal
+ * @brief Releases the path table.
+ */
+static void release_path_table(winx_iso *iso)
+{
+    ULONG i;
+
+    for(i = 0; i < iso->n_dirs; i++)
+        winx_free(iso->dirs[i].name);
+    winx_free(iso->dirs);
+    winx_free(iso->hash);
+    iso->dirs = NULL;
+    iso->hash = NULL;
+    iso->n_dirs = 0;
+}
+
+/**
+ * @internal
+ * @brief Loads the little endian
+ * path table and hashes its entries.
+ * @param[in] vd the volume descriptor.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int load_path_table(winx_iso *iso,UCHAR *vd)
+{
+    UCHAR *table, *p;
+    ULONG size, n, i, length, parent;
+
+    size = get_u32(vd + ISO_VD_PATH_TABLE_SIZE);
+    if(size < 10 || size > ISO_MAX_PATH_TABLE){
+        etrace("invalid path table size %u",size);
+        return (-1);
+    }
+    table = winx_tmalloc(size);
+    if(table == NULL){
+        etrace("cannot allocate %u bytes of memory",size);
+        return (-1);
+    }
+    if(read_image(iso,(ULONGLONG)get_u32(vd + ISO_VD_PATH_TABLE) * iso->block_size,table,size) < 0)
+        goto fail;
+
+    /* each entry takes 10 bytes at least */
+    iso->dirs = winx_tmalloc((size / 10) * sizeof(iso_directory));
+    if(iso->dirs == NULL){
+        etrace("cannot allocate %u bytes of memory",(size / 10) * sizeof(iso_directory));
+        goto fail;
+    }
+    for(p = table, n = 0; p + 8 < table + size && p[0]; p += 8 + length + (length & 1)){
+        length = p[0];
+        if(p + 8 + length > table + size)
+            break;
+        parent = get_u16(p + 6);
+        /* parents precede their children, the root is its own parent */
+        if(parent == 0 || parent > n + 1){
+            etrace("path table entry %u is damaged",n + 1);
+            break;
+        }
+        iso->dirs[n].lba = get_u32(p + 2);
+        iso->dirs[n].parent = parent - 1;
+        iso->dirs[n].name = get_name(iso,p + 8,length);
+        if(iso->dirs[n].name == NULL)
+            goto fail;
+        n ++; iso->n_dirs = n;
+    }
+    if(n == 0){
+        etrace("the path table is empty");
+        goto fail;
+    }
+
+    for(iso->hash_mask = 1; iso->hash_mask < n; iso->hash_mask <<= 1);
+    iso->hash = winx_tmalloc(iso->hash_mask * sizeof(ULONG));
+    if(iso->hash == NULL){
+        etrace("cannot allocate %u bytes of memory",iso->hash_mask * sizeof(ULONG));
+        goto fail;
+    }
+    memset(iso->hash,0xff,iso->hash_mask * sizeof(ULONG));
+    iso->hash_mask --;
+    /* the root has no name to look for */
+    for(i = 1; i < n; i++){
+        length = get_hash(iso->dirs[i].parent,iso->dirs[i].name) & iso->hash_mask;
+        iso->dirs[i].next = iso->hash[length];
+        iso->hash[length] = i;
+    }
+    itrace("%u directories found in the path table",n);
+    winx_free(table);
+    return 0;
+
+fail:
+    release_path_table(iso);
+    winx_free(table);
+    return (-1);
+}
+
+/*
+**************************************************************
+*                    Directories
+**************************************************************
+*/
+
+/**
+ * @internal
+ * @brief Reads a directory.
+ * @param[in] lba the first block of the directory.
+ * @param[in] size size of the directory, zero
+ * if its first record defines it.
+ * @param[out] buffer the contents, must be
+ * released by winx_free.
+ * @param[out] length size of the contents.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int read_directory(winx_iso *iso,ULONG lba,ULONG size,UCHAR **buffer,ULONG *length)
+{
+    ULONGLONG offset = (ULONGLONG)lba * iso->block_size;
+    UCHAR *b;
+
+    *buffer = NULL;
+    if(size == 0){
+        /* the first record refers to the directory itself */
+        b = winx_tmalloc(iso->block_size);
+        if(b == NULL){
+            etrace("cannot allocate %u bytes of memory",iso->block_size);
+            return (-1);
+        }
+        if(read_image(iso,offset,b,iso->block_size) < 0){
+            winx_free(b);
+            return (-1);
+        }
+        if(b[0] < ISO_DR_NAME + 1 || b[ISO_DR_NAME_LENGTH] != 1 || b[ISO_DR_NAME] != 0){
+            etrace("directory at block %u is damaged",lba);
+            winx_free(b);
+            return (-1);
+        }
+        size = get_u32(b + ISO_DR_SIZE);
+        winx_free(b);
+    }
+    if(size == 0 || size > ISO_MAX_DIRECTORY_SIZE){
+        etrace("invalid size %u of directory at block %u",size,lba);
+        return (-1);
+    }
+    /* directories occupy whole blocks */
+    size = (size + iso->block_size - 1) / iso->block_size * iso->block_size;
+    b = winx_tmalloc(size);
+    if(b == NULL){
+        etrace("cannot allocate %u bytes of memory",size);
+        return (-1);
+    }
+    if(read_image(iso,offset,b,size) < 0){
+        winx_free(b);
+        return (-1);
+    }
+    *buffer = b;
+    *length = size;
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Appends an extent to the blockmap of a file.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int add_extent(winx_iso *iso,winx_file_info *f,ULONG lba,ULONG size)
+{
+    winx_blockmap *block, *last;
+    ULONGLONG length;
+
+    /* all the extents but the last one take whole blocks */
+    if(f->disp.size % iso->block_size){
+        etrace("%ws: misaligned extent",f->name);
+        return (-1);
+    }
+    length = ((ULONGLONG)size + iso->block_size - 1) / iso->block_size;
+    if(length){
+        last = f->disp.blockmap ? f->disp.blockmap->prev : NULL;
+        if(last && last->lcn + last->length == lba){
+            last->length += length;
+        } else {
+            block = (winx_blockmap *)winx_list_insert((list_entry **)(void *)&f->disp.blockmap,
+                (list_entry *)last,sizeof(winx_blockmap));
+            block->vcn = f->disp.size / iso->block_size;
+            block->lcn = lba;
+            block->length = length;
+            f->disp.fragments ++;
+        }
+        f->disp.clusters += length;
+    }
+    f->disp.size += size;
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Appends a file to the list.
+ * @return The file, NULL indicates failure.
+ */
+static winx_file_info *add_entry(winx_file_info **filelist,wchar_t *name,wchar_t *dir)
+{
+    winx_file_info *f, *last;
+
+    last = *filelist ? (*filelist)->prev : NULL;
+    f = (winx_file_info *)winx_list_insert((list_entry **)(void *)filelist,
+        (list_entry *)last,sizeof(winx_file_info));
+    if(dir[0] && dir[wcslen(dir) - 1] == '\\')
+        f->path = winx_swprintf(L"%ws%ws",dir,name);
+    else
+        f->path = winx_swprintf(L"%ws\\%ws",dir,name);
+    if(f->path == NULL){
+        etrace("cannot allocate memory for %ws",name);
+        winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
+        return NULL;
+    }
+    f->name = name;
+    f->flags = 0;
+    f->user_defined_flags = 0;
+    f->creation_time = 0;
+    f->last_modification_time = 0;
+    f->last_access_time = 0;
+    f->reparse_tag = 0;
+    f->reparse_target = NULL;
+    memset(&f->internal,0,sizeof(winx_file_internal_info));
+    memset(&f->disp,0,sizeof(winx_file_disposition));
+    return f;
+}
+
+/**
+ * @internal
+ * @brief Parses a directory.
+ * @param[in] dir path of the directory,
+ * inside of the image.
+ * @param[in] name name of the file to look for,
+ * NULL forces all the files to be listed.
+ * @return List of files, NULL if the directory
+ * is empty or its parsing failed.
+ */
+static winx_file_info *list_directory(winx_iso *iso,UCHAR *buffer,ULONG size,wchar_t *dir,wchar_t *name)
+{
+    winx_file_info *filelist = NULL, *f = NULL;
+    UCHAR *p, *block_end;
+    ULONG offset, length;
+    wchar_t *s;
+    int continued = 0;
+
+    for(offset = 0; offset < size; offset += iso->block_size){
+        block_end = buffer + offset + iso->block_size;
+        for(p = buffer + offset; p < block_end && p[0]; p += length){
+            length = p[0];
+            if(length < ISO_DR_NAME + 1 || p + length > block_end
+              || ISO_DR_NAME + p[ISO_DR_NAME_LENGTH] > length){
+                etrace("%ws: damaged record at %u skipped",dir,(ULONG)(p - buffer));
+                break;
+            }
+            /* skip references to the directory itself and to its parent */
+            if(p[ISO_DR_NAME_LENGTH] == 1 && p[ISO_DR_NAME] <= 1){
+                continued = 0;
+                continue;
+            }
+            if(p[ISO_DR_UNIT_SIZE]){
+                dtrace("%ws: interleaved file skipped",dir);
+                continued = 0;
+                continue;
+            }
+            s = get_name(iso,p + ISO_DR_NAME,p[ISO_DR_NAME_LENGTH]);
+            if(s == NULL)
+                goto fail;
+            if(!is_valid_name(s)){
+                etrace("%ws: invalid name %ws skipped",dir,s);
+                winx_free(s);
+                f = NULL;
+                continued = 0;
+                continue;
+            }
+            if(continued && f && wcscmp(f->name,s) == 0){
+                /* the next extent of a large file */
+                winx_free(s);
+            } else {
+                if(name && winx_wcsicmp(s,name)){
+                    winx_free(s);
+                    f = NULL;
+                    continued = (p[ISO_DR_FLAGS] & ISO_FLAG_MULTI_EXTENT) ? 1 : 0;
+                    continue;
+                }
+                f = add_entry(&filelist,s,dir);
+                if(f == NULL){
+                    winx_free(s);
+                    goto fail;
+                }
+                f->flags = FILE_ATTRIBUTE_READONLY;
+                if(p[ISO_DR_FLAGS] & ISO_FLAG_DIRECTORY)
+                    f->flags |= FILE_ATTRIBUTE_DIRECTORY;
+                if(p[ISO_DR_FLAGS] & ISO_FLAG_HIDDEN)
+                    f->flags |= FILE_ATTRIBUTE_HIDDEN;
+                f->creation_time = get_time(p + ISO_DR_TIME);
+                f->last_modification_time = f->creation_time;
+                f->last_access_time = f->creation_time;
+            }
+            if(f && add_extent(iso,f,get_u32(p + ISO_DR_LBA),get_u32(p + ISO_DR_SIZE)) < 0){
+                winx_free(f->name);
+                winx_free(f->path);
+                winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+                winx_list_remove((list_entry **)(void *)&filelist,(list_entry *)f);
+                f = NULL;
+            }
+            continued = (p[ISO_DR_FLAGS] & ISO_FLAG_MULTI_EXTENT) ? 1 : 0;
+        }
+    }
+    return filelist;
+
+fail:
+    winx_ftw_release(filelist);
+    return NULL;
+}
+
+/**
+ * @internal
+ * @brief Locates a directory in the path table.
+ * @param[in] path the path inside of the image.
+ * @param[out] n number of path components consumed.
+ * @return Index of the deepest directory found.
+ */
+static ULONG find_directory(winx_iso *iso,wchar_t *path,int *n)
+{
+    wchar_t name[256];
+    ULONG i = 0, child;
+    int j;
+
+    *n = 0;
+    while(*path){
+        while(*path == '\\') path ++;
+        for(j = 0; *path && *path != '\\' && j < 255; j++)
+            name[j] = *path++;
+        name[j] = 0;
+        if(j == 0)
+            break;
+        child = find_child(iso,i,name);
+        if(child == ISO_NONE)
+            break;
+        i = child; (*n) ++;
+    }
+    return i;
+}
+
+/**
+ * @internal
+ * @brief Splits a path into the path
+ * of the parent directory and the name.
+ * @return The name, NULL for the root.
+ */
+static wchar_t *split_path(wchar_t *path)
+{
+    wchar_t *p;
+
+    while(path[0] && path[wcslen(path) - 1] == '\\')
+        path[wcslen(path) - 1] = 0;
+    p = wcsrchr(path,'\\');
+    if(p == NULL)
+        return path[0] ? path : NULL;
+    *p = 0;
+    return p + 1;
+}
+
+/**
+ * @internal
+ * @brief Lists a directory of the image.
+ * @param[in] name name of the file to look for,
+ * NULL forces all the files to be listed.
+ */
+static winx_file_info *list_path(winx_iso *iso,wchar_t *path,wchar_t *name)
+{
+    winx_file_info *filelist;
+    UCHAR *buffer;
+    ULONG i, size;
+    int n, depth = 0;
+    wchar_t *s;
+
+    for(s = path; *s; s++){
+        if(*s != '\\' && (s == path || s[-1] == '\\'))
+            depth ++;
+    }
+    i = find_directory(iso,path,&n);
+    if(n != depth){
+        etrace("%ws not found",path);
+        return NULL;
+    }
+    if(i == 0){
+        if(read_directory(iso,iso->root_lba,iso->root_size,&buffer,&size) < 0)
+            return NULL;
+    } else {
+        if(read_directory(iso,iso->dirs[i].lba,0,&buffer,&size) < 0)
+            return NULL;
+    }
+    filelist = list_directory(iso,buffer,size,path[0] ? path : L"\\",name);
+    winx_free(buffer);
+    return filelist;
+}
+
+/*
+**************************************************************
+*                    Interface routines
+**************************************************************
+*/
+
+/**
+ * @brief Opens an ISO 9660 image.
+ * @param[in] path the native path of the image.
+ * @return The image, NULL indicates failure.
+ * @note Joliet names are preferred to the
+ * primary ones, when the image has them.
+ */
+winx_iso *winx_iso_open(wchar_t *path)
+{
+    winx_iso *iso;
+    UCHAR *vd, *primary = NULL, *joliet = NULL;
+    ULONG i, block_size;
+
+    DbgCheck1(path,NULL);
+
+    iso = winx_tmalloc(sizeof(winx_iso));
+    vd = winx_tmalloc(ISO_SECTOR_SIZE * 3);
+    if(iso == NULL || vd == NULL){
+        etrace("cannot allocate memory for %ws",path);
+        winx_free(iso);
+        winx_free(vd);
+        return NULL;
+    }
+    memset(iso,0,sizeof(winx_iso));
+    iso->f = winx_open_image(path);
+    if(iso->f == NULL)
+        goto fail;
+    iso->size = winx_fsize(iso->f);
+
+    for(i = ISO_FIRST_DESCRIPTOR; i < ISO_FIRST_DESCRIPTOR + ISO_MAX_DESCRIPTORS; i++){
+        if(read_image(iso,(ULONGLONG)i * ISO_SECTOR_SIZE,vd,ISO_SECTOR_SIZE) < 0)
+            break;
+        if(memcmp(vd + 1,"CD001",5))
+            break;
+        if(vd[0] == ISO_VD_TERMINATOR)
+            break;
+        if(vd[0] == ISO_VD_PRIMARY && primary == NULL){
+            primary = vd + ISO_SECTOR_SIZE;
+            memcpy(primary,vd,ISO_SECTOR_SIZE);
+        } else if(vd[0] == ISO_VD_SUPPLEMENTARY && joliet == NULL
+          && vd[ISO_VD_ESCAPES] == '%' && vd[ISO_VD_ESCAPES + 1] == '/'
+          && (vd[ISO_VD_ESCAPES + 2] == '@' || vd[ISO_VD_ESCAPES + 2] == 'C'
+          || vd[ISO_VD_ESCAPES + 2] == 'E')){
+            joliet = vd + ISO_SECTOR_SIZE * 2;
+            memcpy(joliet,vd,ISO_SECTOR_SIZE);
+        }
+    }
+    if(primary == NULL){
+        etrace("%ws is not an ISO 9660 image",path);
+        goto fail;
+    }
+
+    block_size = get_u16(primary + ISO_VD_BLOCK_SIZE);
+    if(block_size != 512 && block_size != 1024 && block_size != 2048){
+        etrace("invalid block size %u",block_size);
+        goto fail;
+    }
+    iso->block_size = block_size;
+
+    if(joliet){
+        iso->joliet = 1;
+        if(load_path_table(iso,joliet) == 0){
+            iso->root_lba = get_u32(joliet + ISO_VD_ROOT + ISO_DR_LBA);
+            iso->root_size = get_u32(joliet + ISO_VD_ROOT + ISO_DR_SIZE);
+        } else {
+            itrace("Joliet names are damaged, primary ones will be used");
+            iso->joliet = 0;
+        }
+    }
+    if(iso->joliet == 0){
+        if(load_path_table(iso,primary) < 0)
+            goto fail;
+        iso->root_lba = get_u32(primary + ISO_VD_ROOT + ISO_DR_LBA);
+        iso->root_size = get_u32(primary + ISO_VD_ROOT + ISO_DR_SIZE);
+    }
+    winx_free(vd);
+    return iso;
+
+fail:
+    winx_iso_close(iso);
+    winx_free(vd);
+    return NULL;
+}
+
+/**
+ * @brief Lists a directory of an ISO 9660 image.
+ * @param[in] path the path of the directory
+ * inside of the image, like \\boot\\fonts.
+ * @return List of files in the order of the
+ * directory, NULL indicates failure or an empty
+ * directory. Paths of the files are relative to the
+ * image root, blockmaps are in logical blocks.
+ * @note The list must be released by winx_ftw_release.
+ */
+winx_file_info *winx_iso_list(winx_iso *iso,wchar_t *path)
+{
+    winx_file_info *filelist;
+    wchar_t *s;
+
+    DbgCheck2(iso,path,NULL);
+
+    s = winx_wcsdup(path);
+    if(s == NULL){
+        etrace("cannot allocate memory for %ws",path);
+        return NULL;
+    }
+    while(s[0] && s[wcslen(s) - 1] == '\\')
+        s[wcslen(s) - 1] = 0;
+    filelist = list_path(iso,s,NULL);
+    winx_free(s);
+    return filelist;
+}
+
+/**
+ * @brief Looks for a file of an ISO 9660 image.
+ * @param[in] path the path of the file
+ * inside of the image.
+ * @return The file, NULL indicates failure.
+ * Directories are described as well, the root
+ * included.
+ * @note The file must be released by winx_ftw_release.
+ */
+winx_file_info *winx_iso_lookup(winx_iso *iso,wchar_t *path)
+{
+    winx_file_info *f = NULL;
+    wchar_t *s, *name;
+
+    DbgCheck2(iso,path,NULL);
+
+    s = winx_wcsdup(path);
+    if(s == NULL){
+        etrace("cannot allocate memory for %ws",path);
+        return NULL;
+    }
+    name = split_path(s);
+    if(name == NULL){
+        name = winx_wcsdup(L"");
+        if(name){
+            f = add_entry(&f,name,L"\\");
+            if(f == NULL){
+                winx_free(name);
+            } else {
+                f->flags = FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_DIRECTORY;
+                (void)add_extent(iso,f,iso->root_lba,iso->root_size);
+            }
+        }
+    } else {
+        f = list_path(iso,name == s ? L"" : s,name);
+        if(f == NULL)
+            etrace("%ws not found",path);
+    }
+    winx_free(s);
+    return f;
+}
+
+/**
+ * @brief Reads a file of an ISO 9660 image.
+ * @param[in] f the file, as delivered by
+ * winx_iso_list or winx_iso_lookup.
+ * @param[in] offset the offset inside of the file.
+ * @param[out] buffer the buffer receiving the data.
+ * @param[in] length number of bytes to read.
+ * @return Number of bytes read, less than
+ * requested at the end of the file or on failure.
+ * @note Each extent of the file gets read by a
+ * single request, straight into the buffer.
+ */
+ULONG winx_iso_read(winx_iso *iso,winx_file_info *f,ULONGLONG offset,void *buffer,ULONG length)
+{
+    winx_blockmap *block;
+    ULONGLONG start, end;
+    ULONG n, done = 0;
+
+    DbgCheck3(iso,f,buffer,0);
+
+    if(offset >= f->disp.size)
+        return 0;
+    if(length > f->disp.size - offset)
+        length = (ULONG)(f->disp.size - offset);
+
+    for(block = f->disp.blockmap; block && done < length; block = block->next){
+        start = block->vcn * iso->block_size;
+        end = start + block->length * iso->block_size;
+        if(offset < end && offset >= start){
+            n = (ULONG)min(end - offset,(ULONGLONG)(length - done));
+            if(read_image(iso,block->lcn * iso->block_size + (offset - start),
+              (char *)buffer + done,n) < 0)
+                break;
+            done += n;
+            offset += n;
+        }
+        if(block->next == f->disp.blockmap) break;
+    }
+    return done;
+}
+
+/**
+ * @internal
+ * @brief Copies a file out of the image.
+ * @return Zero for success, negative
+ * value indicates failure, -2 indicates
+ * termination requested by the caller.
+ */
+static int extract_file(winx_iso *iso,winx_file_info *f,wchar_t *target,
+    char *buffer,ftw_terminator t,void *user_defined_data)
+{
+    WINX_FILE *out;
+    ULONGLONG offset;
+    ULONG n;
+    int result = 0;
+
+    out = winx_fopen(target,"w");
+    if(out == NULL)
+        return (-1);
+    for(offset = 0; offset < f->disp.size; offset += n){
+        if(t && t(user_defined_data)){
+            result = -2;
+            break;
+        }
+        n = (ULONG)min(f->disp.size - offset,(ULONGLONG)ISO_EXTRACT_CHUNK);
+        if(winx_iso_read(iso,f,offset,buffer,n) != n){
+            result = -1;
+            break;
+        }
+        if(winx_fwrite(buffer,1,n,out) != n){
+            etrace("cannot write to %ws",target);
+            result = -1;
+            break;
+        }
+    }
+    winx_fclose(out);
+    return result;
+}
+
+/**
+ * @internal
+ * @brief Copies a file or a directory
+ * tree out of the image.
+ * @details Directories are read by their
+ * records, since names of the path table
+ * may be damaged or even missing.
+ * @param[in,out] visited a bit per block
+ * of the image, set for directories
+ * extracted already.
+ */
+static int extract(winx_iso *iso,winx_file_info *f,wchar_t *target,
+    char *buffer,UCHAR *visited,int depth,ftw_terminator t,void *user_defined_data)
+{
+    winx_file_info *filelist = NULL, *child;
+    UCHAR *directory;
+    ULONG lba, size;
+    wchar_t *path;
+    int result = 0;
+
+    if(!is_directory(f))
+        return extract_file(iso,f,target,buffer,t,user_defined_data);
+
+    if(depth > ISO_MAX_DEPTH || f->disp.blockmap == NULL || \
+      f->disp.blockmap->lcn >= iso->size / iso->block_size){
+        etrace("%ws: directory is damaged",f->path);
+        return (-1);
+    }
+
+    /* damaged images may have a few records referring to the same directory */
+    lba = (ULONG)f->disp.blockmap->lcn;
+    if(visited[lba >> 3] & (1 << (lba & 7))){
+        etrace("%ws: directory extracted already",f->path);
+        return 0;
+    }
+    visited[lba >> 3] |= (UCHAR)(1 << (lba & 7));
+
+    if(winx_create_directory(target) < 0)
+        return (-1);
+    if(read_directory(iso,lba,(ULONG)f->disp.size,&directory,&size) < 0)
+        return (-1);
+    filelist = list_directory(iso,directory,size,f->path,NULL);
+    winx_free(directory);
+    for(child = filelist; child; child = child->next){
+        path = winx_swprintf(L"%ws\\%ws",target,child->name);
+        if(path == NULL){
+            etrace("cannot allocate memory for %ws",child->name);
+            result = -1;
+            break;
+        }
+        result = extract(iso,child,path,buffer,visited,depth + 1,t,user_defined_data);
+        winx_free(path);
+        if(result < 0)
+            break;
+        if(child->next == filelist) break;
+    }
+    winx_ftw_release(filelist);
+    return result;
+}
+
+/**
+ * @brief Copies a file or a directory tree
+ * out of an ISO 9660 image.
+ * @param[in] path the path inside of the image.
+ * @param[in] target the native path of the copy.
+ * @param[in] t the terminator, checked for each
+ * portion of data copied; if it returns a nonzero
+ * value, the copying stops.
+ * @return Zero for success, negative
+ * value indicates failure, -2 indicates
+ * termination requested by the caller.
+ */
+int winx_iso_extract(winx_iso *iso,wchar_t *path,wchar_t *target,
+    ftw_terminator t,void *user_defined_data)
+{
+    winx_file_info *f;
+    char *buffer;
+    UCHAR *visited;
+    ULONG size;
+    int result;
+
+    DbgCheck3(iso,path,target,-1);
+
+    f = winx_iso_lookup(iso,path);
+    if(f == NULL)
+        return (-1);
+    buffer = winx_tmalloc(ISO_EXTRACT_CHUNK);
+    if(buffer == NULL){
+        etrace("cannot allocate %u bytes of memory",ISO_EXTRACT_CHUNK);
+        winx_ftw_release(f);
+        return (-1);
+    }
+    size = (ULONG)((iso->size / iso->block_size + 7) / 8);
+    visited = winx_tmalloc(size);
+    if(visited == NULL){
+        etrace("cannot allocate %u bytes of memory",size);
+        winx_free(buffer);
+        winx_ftw_release(f);
+        return (-1);
+    }
+    memset(visited,0,size);
+    result = extract(iso,f,target,buffer,visited,0,t,user_defined_data);
+    winx_free(visited);
+    winx_free(buffer);
+    winx_ftw_release(f);
+    return result;
+}
+
+/**
+ * @brief Closes an ISO 9660 image.
+ */
+void winx_iso_close(winx_iso *iso)
+{
+    if(iso == NULL)
+        return;
+    release_path_table(iso);
+    if(iso->f)
+        winx_fclose(iso->f);
+    winx_free(iso);
+}
+
+/** @} */
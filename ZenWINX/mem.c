@@ -33,6 +33,29 @@ HANDLE hGlobalHeap = NULL;
 char *reserved_memory = NULL;
 winx_killer killer = default_killer;
 
+/* heap usage counters */
+LONGLONG heap_allocations = 0;
+LONGLONG heap_frees = 0;
+LONGLONG heap_bytes = 0;  /* bytes held in blocks of the global heap */
+LONGLONG heap_peak = 0;   /* the most held since the last winx_reset_heap_peak call */
+
+/**
+ * @internal
+ * @brief Adjusts bytes held in the global
+ * heap and raises the peak they reached.
+ */
+static void heap_account(LONGLONG size)
+{
+    LONGLONG bytes, peak;
+
+    bytes = InterlockedExchangeAdd64(&heap_bytes,size) + size;
+    if(size <= 0) return;
+    do {
+        peak = heap_peak;
+        if(bytes <= peak) break;
+    } while(InterlockedCompareExchange64(&heap_peak,bytes,peak) != peak);
+}
+
 /**
  * @internal
  * @brief Aborts the application in the out of memory condition
@@ -79,14 +102,19 @@ void *winx_heap_alloc(size_t size,int flags)
     
     if(!hGlobalHeap) return NULL;
 
-    if(!(flags & MALLOC_ABORT_ON_FAILURE))
-        return RtlAllocateHeap(hGlobalHeap,0,size);
-    
-    do {
+    if(!(flags & MALLOC_ABORT_ON_FAILURE)){
         p = RtlAllocateHeap(hGlobalHeap,0,size);
-        if(!p) if(!killer(size)) break;
-    } while(!p);
+    } else {
+        do {
+            p = RtlAllocateHeap(hGlobalHeap,0,size);
+            if(!p) if(!killer(size)) break;
+        } while(!p);
+    }
     
+    if(p){
+        (void)InterlockedIncrement64(&heap_allocations);
+        heap_account((LONGLONG)RtlSizeHeap(hGlobalHeap,0,p));
+    }
     return p;
 }
 
@@ -100,8 +128,60 @@ void winx_heap_free(void *addr)
     * Avoid winx_dbg_xxx calls here
     * to avoid recursion.
     */
-    if(hGlobalHeap && addr)
+    if(hGlobalHeap && addr){
+        heap_account(-(LONGLONG)RtlSizeHeap(hGlobalHeap,0,addr));
         (void)RtlFreeHeap(hGlobalHeap,0,addr);
+        (void)InterlockedIncrement64(&heap_frees);
+    }
+}
+
+/**
+ * @brief Resets the peak of bytes held
+ * in the global heap to the current value.
+ * @return The bytes held now.
+ * @note The peak is process-wide, so routines
+ * measuring it concurrently reset it for each other.
+ */
+ULONGLONG winx_reset_heap_peak(void)
+{
+    LONGLONG bytes = heap_bytes;
+
+    (void)InterlockedExchange64(&heap_peak,bytes);
+    return (ULONGLONG)bytes;
+}
+
+/**
+ * @brief Retrieves memory usage statistics.
+ * @details Counts of allocated and released blocks
+ * and bytes held refer to the global heap, memory
+ * usage refers to the entire process.
+ * @return Zero for success, a negative value otherwise.
+ */
+int winx_get_heap_stats(winx_heap_stats *hs)
+{
+    VM_COUNTERS vmc;
+    NTSTATUS status;
+
+    DbgCheck1(hs,-1);
+
+    memset(hs,0,sizeof(winx_heap_stats));
+    hs->allocations = (ULONGLONG)heap_allocations;
+    hs->frees = (ULONGLONG)heap_frees;
+    hs->heap_bytes = (ULONGLONG)heap_bytes;
+    hs->peak_heap_bytes = (ULONGLONG)heap_peak;
+
+    memset(&vmc,0,sizeof(VM_COUNTERS));
+    status = NtQueryInformationProcess(NtCurrentProcess(),
+        ProcessVmCounters,&vmc,sizeof(VM_COUNTERS),NULL);
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot get memory usage of the process");
+        return (-1);
+    }
+    hs->private_bytes = vmc.PagefileUsage;
+    hs->peak_private_bytes = vmc.PeakPagefileUsage;
+    hs->working_set = vmc.WorkingSetSize;
+    hs->peak_working_set = vmc.PeakWorkingSetSize;
+    return 0;
 }
 
 /**
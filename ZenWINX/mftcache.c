@@ -0,0 +1,519 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file mftcache.c
+ * @brief File records cache.
+ * @details The cache keeps file records already
+ * fixed up, in blocks of records sharing a cluster
+ * of the $Mft, so a single read fills all the records
+ * of a block. Blocks are found through a hash table
+ * and dropped in the least recently used order when
+ * the cache grows beyond its size. A single cache
+ * may serve a few volumes and a few scanner threads
+ * at once, since all the accesses are serialized
+ * by a lock. Volume slots are counted by the scans
+ * using them, so a slot is never reused while a
+ * scan holds it; scans finding all the slots busy
+ * read the disk instead.
+ * @addtogroup MftCache
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+/* number of volumes served by a single cache */
+#define MFT_CACHE_VOLUMES 16
+
+/* limits, a block is tracked by 64-bit masks */
+#define MFT_CACHE_MAX_BLOCK_RECORDS 64
+#define MFT_CACHE_MIN_BUCKET_BITS   6
+#define MFT_CACHE_MAX_BUCKET_BITS   20
+
+typedef struct _mft_cache_volume {
+    wchar_t *name;         /* the root path, NULL for free slots */
+    ULONG record_size;     /* file record size, in bytes */
+    ULONG block_records;   /* number of records per block */
+    int users;             /* scans attached to the slot */
+} mft_cache_volume;
+
+typedef struct _mft_cache_block {
+    struct _mft_cache_block *next_in_bucket;
+    struct _mft_cache_block *newer; /* towards the most recently used block */
+    struct _mft_cache_block *older; /* towards the least recently used block */
+    ULONGLONG block;       /* index of the first record divided by block_records */
+    int volume;            /* index of the volume slot */
+    ULONGLONG known;       /* records held by the block */
+    ULONGLONG valid;       /* records in use, the rest is known to be free */
+    ULONG size;            /* bytes taken by the block, including the header */
+    char *records;         /* block_records records follow the header */
+} mft_cache_block;
+
+struct _winx_mft_cache {
+    HANDLE lock;
+    ULONGLONG max_size;    /* the cache never grows beyond */
+    mft_cache_volume volumes[MFT_CACHE_VOLUMES];
+    int next_volume;       /* the next idle slot to be reused */
+    mft_cache_block **buckets;
+    int bucket_bits;
+    mft_cache_block *newest;
+    mft_cache_block *oldest;
+    winx_mft_cache_stats stats;
+};
+
+/**
+ * @internal
+ * @brief Returns the hash bucket of a block.
+ */
+static mft_cache_block **bucket(winx_mft_cache *c,int volume,ULONGLONG block)
+{
+    ULONGLONG h = (block + ((ULONGLONG)volume << 56)) * 0x9E3779B97F4A7C15ULL;
+    return &c->buckets[h >> (64 - c->bucket_bits)];
+}
+
+/**
+ * @internal
+ * @brief Looks for a block.
+ * @return The block, NULL if it isn't cached.
+ */
+static mft_cache_block *find_block(winx_mft_cache *c,int volume,ULONGLONG block)
+{
+    mft_cache_block *b;
+
+    for(b = *bucket(c,volume,block); b; b = b->next_in_bucket){
+        if(b->block == block && b->volume == volume)
+            return b;
+    }
+    return NULL;
+}
+
+/**
+ * @internal
+ * @brief Unlinks a block from the order of use.
+ */
+static void unlink_block(winx_mft_cache *c,mft_cache_block *b)
+{
+    if(b->newer) b->newer->older = b->older;
+    else c->newest = b->older;
+    if(b->older) b->older->newer = b->newer;
+    else c->oldest = b->newer;
+    b->newer = b->older = NULL;
+}
+
+/**
+ * @internal
+ * @brief Links a block as the most recently used.
+ */
+static void link_block(winx_mft_cache *c,mft_cache_block *b)
+{
+    b->newer = NULL;
+    b->older = c->newest;
+    if(c->newest) c->newest->newer = b;
+    c->newest = b;
+    if(c->oldest == NULL) c->oldest = b;
+}
+
+/**
+ * @internal
+ * @brief Marks a block as the most recently used.
+ */
+static void touch_block(winx_mft_cache *c,mft_cache_block *b)
+{
+    if(c->newest == b)
+        return;
+    unlink_block(c,b);
+    link_block(c,b);
+}
+
+/**
+ * @internal
+ * @brief Removes a block from the cache.
+ */
+static void drop_block(winx_mft_cache *c,mft_cache_block *b)
+{
+    mft_cache_block **p;
+
+    for(p = bucket(c,b->volume,b->block); *p; p = &(*p)->next_in_bucket){
+        if(*p == b){
+            *p = b->next_in_bucket;
+            break;
+        }
+    }
+    unlink_block(c,b);
+    c->stats.blocks --;
+    c->stats.size -= b->size;
+    winx_free(b);
+}
+
+/**
+ * @internal
+ * @brief Removes all the blocks of a volume.
+ */
+static void drop_volume(winx_mft_cache *c,int volume)
+{
+    mft_cache_block *b, *older;
+
+    for(b = c->newest; b; b = older){
+        older = b->older;
+        if(b->volume == volume)
+            drop_block(c,b);
+    }
+}
+
+/**
+ * @brief Creates a file records cache.
+ * @param[in] size the most bytes the records
+ * may take, zero selects WINX_MFT_CACHE_DEFAULT_SIZE.
+ * @return The cache, NULL indicates failure.
+ * @note Pass the cache to the scans through the
+ * records field of their context to share it,
+ * then destroy it by winx_destroy_mft_cache
+ * after the last scan completes.
+ */
+winx_mft_cache *winx_create_mft_cache(ULONGLONG size)
+{
+    static LONG id = 0;
+    winx_mft_cache *c;
+    wchar_t name[32];
+    ULONGLONG blocks;
+    size_t n;
+
+    if(size == 0)
+        size = WINX_MFT_CACHE_DEFAULT_SIZE;
+
+    c = winx_tmalloc(sizeof(winx_mft_cache));
+    if(c == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sizeof(winx_mft_cache));
+        return NULL;
+    }
+    memset(c,0,sizeof(winx_mft_cache));
+    c->max_size = size;
+
+    /* about one bucket per block of four kilobytes */
+    blocks = size / 4096;
+    for(c->bucket_bits = MFT_CACHE_MIN_BUCKET_BITS; c->bucket_bits < MFT_CACHE_MAX_BUCKET_BITS; c->bucket_bits++){
+        if(((ULONGLONG)1 << c->bucket_bits) >= blocks) break;
+    }
+    n = (size_t)1 << c->bucket_bits;
+    c->buckets = winx_tmalloc(n * sizeof(mft_cache_block *));
+    if(c->buckets == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            n * sizeof(mft_cache_block *));
+        winx_free(c);
+        return NULL;
+    }
+    memset(c->buckets,0,n * sizeof(mft_cache_block *));
+
+    _snwprintf(name,sizeof(name) / sizeof(wchar_t),
+        L"winx_mft_cache_%u",(ULONG)InterlockedIncrement(&id));
+    name[sizeof(name) / sizeof(wchar_t) - 1] = 0;
+    if(winx_create_lock(name,&c->lock) < 0){
+        etrace("cannot create %ws",name);
+        winx_free(c->buckets);
+        winx_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+/**
+ * @internal
+ * @brief Binds a volume to the cache.
+ * @param[in] c the cache.
+ * @param[in] name the root path of the volume
+ * or of the disk image.
+ * @param[in] record_size the file record size.
+ * @param[in] cluster_size the cluster size.
+ * @param[in] flush nonzero value drops all the records
+ * of the volume kept since its previous scan, unless
+ * another scan of the volume is filling them now.
+ * @param[out] block_records receives the number of
+ * records per block, which start at multiples of it.
+ * @return Index of the volume slot, negative
+ * value indicates failure or that all the slots
+ * are held by other scans.
+ * @note Each slot attached must be released
+ * by mft_cache_detach after the scan.
+ */
+int mft_cache_attach(winx_mft_cache *c,wchar_t *name,ULONG record_size,
+    ULONG cluster_size,int flush,ULONG *block_records)
+{
+    mft_cache_volume *v;
+    ULONG n;
+    int i, slot = -1;
+
+    DbgCheck3(c,name,block_records,-1);
+
+    n = (record_size && cluster_size > record_size) ? cluster_size / record_size : 1;
+    if(n > MFT_CACHE_MAX_BLOCK_RECORDS) n = MFT_CACHE_MAX_BLOCK_RECORDS;
+    *block_records = n;
+
+    if(winx_acquire_lock(c->lock,INFINITE) < 0){
+        etrace("cannot acquire the lock");
+        return (-1);
+    }
+    for(i = 0; i < MFT_CACHE_VOLUMES; i++){
+        v = &c->volumes[i];
+        if(v->name == NULL){
+            if(slot < 0) slot = i;
+            continue;
+        }
+        if(winx_wcsicmp(v->name,name) == 0){
+            if(v->record_size != record_size || v->block_records != n){
+                /* reformatted since the last scan */
+                if(v->users){
+                    etrace("%ws is being scanned with another layout",name);
+                    winx_release_lock(c->lock);
+                    return (-1);
+                }
+                flush = 1;
+            }
+            /* records of a scan in progress are fresh */
+            if(v->users) flush = 0;
+            slot = i;
+            break;
+        }
+    }
+    if(i == MFT_CACHE_VOLUMES && slot < 0){
+        /* reuse an idle slot, in turn */
+        for(i = 0; i < MFT_CACHE_VOLUMES; i++){
+            v = &c->volumes[c->next_volume];
+            c->next_volume = (c->next_volume + 1) % MFT_CACHE_VOLUMES;
+            if(v->users == 0){
+                slot = (int)(v - c->volumes);
+                break;
+            }
+        }
+        if(slot < 0){
+            dtrace("all the slots are busy, %ws gets scanned without the cache",name);
+            winx_release_lock(c->lock);
+            return (-1);
+        }
+        flush = 1;
+    }
+
+    v = &c->volumes[slot];
+    if(v->name == NULL || winx_wcsicmp(v->name,name)){
+        winx_free(v->name);
+        v->name = winx_wcsdup(name);
+        if(v->name == NULL){
+            etrace("cannot allocate memory for %ws",name);
+            drop_volume(c,slot);
+            winx_release_lock(c->lock);
+            return (-1);
+        }
+    }
+    if(flush)
+        drop_volume(c,slot);
+    v->record_size = record_size;
+    v->block_records = n;
+    v->users ++;
+    winx_release_lock(c->lock);
+    return slot;
+}
+
+/**
+ * @internal
+ * @brief Releases a volume slot attached
+ * by mft_cache_attach. The records stay
+ * in the cache for the next scan.
+ */
+void mft_cache_detach(winx_mft_cache *c,int volume)
+{
+    if(c == NULL || volume < 0 || volume >= MFT_CACHE_VOLUMES)
+        return;
+
+    if(winx_acquire_lock(c->lock,INFINITE) < 0){
+        etrace("cannot acquire the lock");
+        return;
+    }
+    if(c->volumes[volume].users > 0)
+        c->volumes[volume].users --;
+    winx_release_lock(c->lock);
+}
+
+/**
+ * @internal
+ * @brief Looks for a file record.
+ * @param[out] record buffer receiving
+ * the record, when it's in use.
+ * @return Positive value indicates a record
+ * in use, negative value indicates a free
+ * record, zero indicates a miss.
+ */
+int mft_cache_lookup(winx_mft_cache *c,int volume,ULONGLONG mft_id,char *record)
+{
+    mft_cache_volume *v;
+    mft_cache_block *b;
+    ULONGLONG bit;
+    int result = 0;
+
+    if(winx_acquire_lock(c->lock,INFINITE) < 0)
+        return 0;
+    v = &c->volumes[volume];
+    b = find_block(c,volume,mft_id / v->block_records);
+    bit = (ULONGLONG)1 << (mft_id % v->block_records);
+    if(b == NULL || !(b->known & bit)){
+        c->stats.misses ++;
+    } else {
+        c->stats.hits ++;
+        touch_block(c,b);
+        if(b->valid & bit){
+            memcpy(record,b->records + (mft_id % v->block_records) * v->record_size,v->record_size);
+            result = 1;
+        } else {
+            result = -1;
+        }
+    }
+    winx_release_lock(c->lock);
+    return result;
+}
+
+/**
+ * @internal
+ * @brief Adds file records to the cache.
+ * @param[in] first the first record.
+ * @param[in] count number of records, all
+ * of them must belong to the same block.
+ * @param[in] records the records, fixed up;
+ * only records in use are taken from there,
+ * so it may be NULL if all of them are free.
+ * @param[in] valid mask of records in use,
+ * the lowest bit corresponds to the first one.
+ */
+void mft_cache_store(winx_mft_cache *c,int volume,ULONGLONG first,
+    ULONG count,char *records,ULONGLONG valid)
+{
+    mft_cache_volume *v;
+    mft_cache_block *b, **p;
+    ULONG i, size, k;
+    ULONGLONG bit;
+
+    if(winx_acquire_lock(c->lock,INFINITE) < 0)
+        return;
+    v = &c->volumes[volume];
+    b = find_block(c,volume,first / v->block_records);
+    if(b == NULL){
+        size = sizeof(mft_cache_block) + v->block_records * v->record_size;
+        if(size > c->max_size)
+            goto done;
+        while(c->oldest && c->stats.size + size > c->max_size){
+            drop_block(c,c->oldest);
+            c->stats.evictions ++;
+        }
+        b = winx_tmalloc(size);
+        if(b == NULL)
+            goto done;
+        memset(b,0,sizeof(mft_cache_block));
+        b->block = first / v->block_records;
+        b->volume = volume;
+        b->size = size;
+        b->records = (char *)(b + 1);
+        p = bucket(c,volume,b->block);
+        b->next_in_bucket = *p;
+        *p = b;
+        link_block(c,b);
+        c->stats.blocks ++;
+        c->stats.size += size;
+    }
+
+    k = (ULONG)(first % v->block_records);
+    for(i = 0; i < count && k + i < v->block_records; i++){
+        bit = (ULONGLONG)1 << (k + i);
+        b->known |= bit;
+        if(valid & ((ULONGLONG)1 << i)){
+            b->valid |= bit;
+            memcpy(b->records + (k + i) * v->record_size,
+                records + i * v->record_size,v->record_size);
+        } else {
+            b->valid &= ~bit;
+        }
+    }
+    touch_block(c,b);
+
+done:
+    winx_release_lock(c->lock);
+}
+
+/**
+ * @internal
+ * @brief Forgets a file record changed on the disk.
+ */
+void mft_cache_invalidate(winx_mft_cache *c,int volume,ULONGLONG mft_id)
+{
+    mft_cache_volume *v;
+    mft_cache_block *b;
+    ULONGLONG bit;
+
+    if(winx_acquire_lock(c->lock,INFINITE) < 0)
+        return;
+    v = &c->volumes[volume];
+    b = find_block(c,volume,mft_id / v->block_records);
+    if(b){
+        bit = (ULONGLONG)1 << (mft_id % v->block_records);
+        b->known &= ~bit;
+        b->valid &= ~bit;
+    }
+    winx_release_lock(c->lock);
+}
+
+/**
+ * @brief Retrieves statistics of the cache.
+ * @details Hits and misses are counted since
+ * the cache creation, over all the volumes.
+ */
+void winx_get_mft_cache_stats(winx_mft_cache *c,winx_mft_cache_stats *s)
+{
+    if(c == NULL || s == NULL)
+        return;
+
+    if(winx_acquire_lock(c->lock,INFINITE) < 0){
+        memset(s,0,sizeof(winx_mft_cache_stats));
+        return;
+    }
+    memcpy(s,&c->stats,sizeof(winx_mft_cache_stats));
+    winx_release_lock(c->lock);
+}
+
+/**
+ * @brief Destroys the file records cache.
+ * @note No scan may use the cache at this time.
+ */
+void winx_destroy_mft_cache(winx_mft_cache *c)
+{
+    mft_cache_block *b, *older;
+    int i;
+
+    if(c == NULL)
+        return;
+
+    for(b = c->newest; b; b = older){
+        older = b->older;
+        winx_free(b);
+    }
+    for(i = 0; i < MFT_CACHE_VOLUMES; i++)
+        winx_free(c->volumes[i].name);
+    winx_free(c->buckets);
+    winx_destroy_lock(c->lock);
+    winx_free(c);
+}
+
+/** @} */
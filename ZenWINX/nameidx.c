@@ -0,0 +1,387 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file nameidx.c
+ * @brief Trigram index of file names.
+ * @details Names are case folded and framed by
+ * marks of the beginning and of the end, so
+ * prefixes and suffixes (extensions) are found
+ * like any other substring. Each trigram of the
+ * framed names is hashed to a bucket holding
+ * an ascending list of blocks of files having
+ * the trigram. A query intersects lists of all
+ * the trigrams of the pattern, then checks names
+ * of the blocks left. Files are grouped to blocks
+ * of a few files to trade the speed of queries
+ * for the memory and for the build time: each
+ * list mentions a block once.
+ *
+ * The lists are stored in two flat arrays, so
+ * the index is saved in snapshots as is.
+ * @addtogroup NameIndex
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+#define NAME_BEGIN 1 /* marks of the framed names */
+#define NAME_END   2
+
+#define NAME_INDEX_MIN_BITS 10
+#define NAME_INDEX_MAX_BITS 20
+
+#define NO_BLOCK ((ULONG)-1)
+
+/**
+ * @internal
+ * @brief Hashes a trigram to a bucket.
+ */
+static ULONG trigram_hash(wchar_t a,wchar_t b,wchar_t c,ULONG bits)
+{
+    ULONGLONG k = (ULONGLONG)a | ((ULONGLONG)b << 16) | ((ULONGLONG)c << 32);
+
+    return (ULONG)((k * 0x9E3779B97F4A7C15) >> (64 - bits));
+}
+
+/**
+ * @internal
+ * @brief Walks trigrams of a framed name.
+ * @details Calls the routine for each bucket
+ * not visited by the same block yet; the last
+ * array keeps the last block of each bucket.
+ */
+static void for_each_trigram(winx_name_index *ni,const wchar_t *name,
+    ULONG block,ULONG *last,void (*fn)(winx_name_index *ni,ULONG h,ULONG block))
+{
+    wchar_t a, b, c;
+    ULONG h;
+
+    if(name == NULL)
+        return;
+    a = NAME_BEGIN;
+    b = winx_towlower(name[0]);
+    if(b == 0)
+        return;
+    for(name ++;; name ++){
+        c = *name ? winx_towlower(*name) : NAME_END;
+        h = trigram_hash(a,b,c,ni->bucket_bits);
+        if(last[h] != block){
+            last[h] = block;
+            fn(ni,h,block);
+        }
+        if(*name == 0)
+            break;
+        a = b, b = c;
+    }
+}
+
+static void count_posting(winx_name_index *ni,ULONG h,ULONG block)
+{
+    ni->offsets[h + 1] ++;
+}
+
+static void add_posting(winx_name_index *ni,ULONG h,ULONG block)
+{
+    ni->postings[ni->offsets[h] ++] = block;
+}
+
+/**
+ * @internal
+ * @brief Allocates an empty index.
+ * @note Used by the snapshot loader too.
+ */
+winx_name_index *name_index_alloc(ULONG bucket_bits,ULONG block_size,
+    ULONGLONG n_files,ULONGLONG n_postings)
+{
+    winx_name_index *ni;
+    size_t n_buckets = (size_t)1 << bucket_bits;
+
+    ni = winx_tmalloc(sizeof(winx_name_index));
+    if(ni == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sizeof(winx_name_index));
+        return NULL;
+    }
+    memset(ni,0,sizeof(winx_name_index));
+    ni->bucket_bits = bucket_bits;
+    ni->block_size = block_size;
+    ni->n_files = n_files;
+    ni->n_postings = n_postings;
+    ni->files = winx_tmalloc((size_t)(n_files * sizeof(winx_file_info *)) + 1);
+    ni->offsets = winx_tmalloc((n_buckets + 1) * sizeof(ULONGLONG));
+    ni->postings = winx_tmalloc((size_t)(n_postings * sizeof(ULONG)) + 1);
+    if(ni->files == NULL || ni->offsets == NULL || ni->postings == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            n_files * sizeof(winx_file_info *) \
+            + (n_buckets + 1) * sizeof(ULONGLONG) \
+            + n_postings * sizeof(ULONG));
+        winx_release_name_index(ni);
+        return NULL;
+    }
+    return ni;
+}
+
+/**
+ * @brief Builds the trigram index of file names.
+ * @param[in] filelist the list of files.
+ * @param[in] block_size the number of files sharing
+ * each entry of the lists, zero selects
+ * WINX_NAME_INDEX_DEFAULT_BLOCK. Larger blocks
+ * save memory and build time, but queries
+ * check more names.
+ * @return The index, NULL indicates failure.
+ * @note The index refers to the list entries,
+ * so it must be rebuilt when the list changes
+ * and released before the list.
+ */
+winx_name_index *winx_build_name_index(winx_file_info *filelist,ULONG block_size)
+{
+    winx_name_index *ni, tmp;
+    winx_file_info *f;
+    ULONGLONG n = 0, i, sum;
+    ULONG bits, *last;
+    size_t n_buckets, h;
+    ULONGLONG time;
+
+    time = winx_xtime();
+    if(block_size == 0)
+        block_size = WINX_NAME_INDEX_DEFAULT_BLOCK;
+    for(f = filelist; f; f = f->next){
+        n ++;
+        if(f->next == filelist) break;
+    }
+    if(n / block_size >= NO_BLOCK){
+        etrace("too many files: %I64u",n);
+        return NULL;
+    }
+
+    /* about a bucket per file, names have much fewer distinct trigrams */
+    for(bits = NAME_INDEX_MIN_BITS; bits < NAME_INDEX_MAX_BITS && ((ULONGLONG)1 << bits) < n; bits++){}
+    n_buckets = (size_t)1 << bits;
+
+    last = winx_tmalloc(n_buckets * sizeof(ULONG));
+    tmp.offsets = winx_tmalloc((n_buckets + 1) * sizeof(ULONGLONG));
+    if(last == NULL || tmp.offsets == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (ULONGLONG)n_buckets * (sizeof(ULONG) + sizeof(ULONGLONG)));
+        winx_free(last);
+        winx_free(tmp.offsets);
+        return NULL;
+    }
+
+    /* count entries of the lists */
+    tmp.bucket_bits = bits;
+    memset(tmp.offsets,0,(n_buckets + 1) * sizeof(ULONGLONG));
+    memset(last,0xFF,n_buckets * sizeof(ULONG));
+    for(f = filelist, i = 0; f; f = f->next, i++){
+        for_each_trigram(&tmp,f->name,(ULONG)(i / block_size),last,count_posting);
+        if(f->next == filelist) break;
+    }
+    for(h = 1; h <= n_buckets; h++)
+        tmp.offsets[h] += tmp.offsets[h - 1];
+    sum = tmp.offsets[n_buckets];
+
+    ni = name_index_alloc(bits,block_size,n,sum);
+    if(ni == NULL){
+        winx_free(last);
+        winx_free(tmp.offsets);
+        return NULL;
+    }
+
+    /* fill the lists, the offsets move to the ends of the lists */
+    memcpy(ni->offsets,tmp.offsets,(n_buckets + 1) * sizeof(ULONGLONG));
+    memset(last,0xFF,n_buckets * sizeof(ULONG));
+    for(f = filelist, i = 0; f; f = f->next, i++){
+        ni->files[i] = f;
+        for_each_trigram(ni,f->name,(ULONG)(i / block_size),last,add_posting);
+        if(f->next == filelist) break;
+    }
+    memcpy(ni->offsets,tmp.offsets,(n_buckets + 1) * sizeof(ULONGLONG));
+
+    winx_free(last);
+    winx_free(tmp.offsets);
+    itrace("%I64u names indexed in %I64u ms, %I64u postings",
+        n,winx_xtime() - time,sum);
+    return ni;
+}
+
+/**
+ * @internal
+ * @brief Checks whether the name matches
+ * the framed and case folded pattern.
+ */
+static int name_matches(const wchar_t *name,const wchar_t *p,size_t length)
+{
+    size_t n, i, j, first = 0, last;
+    int prefix, suffix;
+
+    if(name == NULL)
+        return 0;
+    prefix = (p[0] == NAME_BEGIN);
+    suffix = (p[length - 1] == NAME_END);
+    if(prefix) p ++, length --;
+    if(suffix) length --;
+
+    n = wcslen(name);
+    if(n < length)
+        return 0;
+    last = n - length;
+    if(prefix) last = 0;
+    if(suffix) first = n - length;
+    if(first > last)
+        return 0;
+
+    for(i = first; i <= last; i++){
+        for(j = 0; j < length && winx_towlower(name[i + j]) == p[j]; j++){}
+        if(j == length)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Finds the first entry of the list
+ * which is not less than the block.
+ */
+static ULONGLONG lower_bound(ULONG *postings,ULONGLONG lo,ULONGLONG hi,ULONG block)
+{
+    ULONGLONG mid;
+
+    while(lo < hi){
+        mid = lo + (hi - lo) / 2;
+        if(postings[mid] < block)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * @brief Searches for files by their names.
+ * @param[in] ni the name index.
+ * @param[in] pattern the substring to be found,
+ * case insensitive.
+ * @param[in] flags a combination of WINX_NAME_PREFIX
+ * and WINX_NAME_SUFFIX flags, anchoring the pattern
+ * to the beginning or to the end of the name; both
+ * of them select the names equal to the pattern.
+ * @param[in] cb the callback routine called for each
+ * file found; if it returns a nonzero value,
+ * the search stops.
+ * @param[in] user_defined_data data passed to the callback.
+ * @return The number of files delivered to the callback.
+ * @note Patterns shorter than three characters, the
+ * marks of anchors included, have no trigrams, so
+ * they're matched against all the names.
+ */
+ULONGLONG winx_query_name_index(winx_name_index *ni,const wchar_t *pattern,
+    int flags,name_index_callback cb,void *user_defined_data)
+{
+    wchar_t *p;
+    ULONG h[WINX_NAME_INDEX_MAX_TRIGRAMS];
+    ULONGLONG cur[WINX_NAME_INDEX_MAX_TRIGRAMS];
+    ULONGLONG i, j, k, first, last, block, n_blocks, n = 0;
+    size_t length, m, t, n_lists = 0, shortest = 0;
+    ULONG hash;
+
+    DbgCheck3(ni,pattern,cb,0);
+
+    /* frame and fold the pattern */
+    length = wcslen(pattern);
+    if(length == 0)
+        return 0;
+    p = winx_tmalloc((length + 3) * sizeof(wchar_t));
+    if(p == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            (length + 3) * sizeof(wchar_t));
+        return 0;
+    }
+    m = 0;
+    if(flags & WINX_NAME_PREFIX) p[m++] = NAME_BEGIN;
+    for(i = 0; i < length; i++) p[m++] = winx_towlower(pattern[i]);
+    if(flags & WINX_NAME_SUFFIX) p[m++] = NAME_END;
+    p[m] = 0;
+
+    /* collect distinct lists of the trigrams, up to the limit */
+    for(t = 0; t + 2 < m && n_lists < WINX_NAME_INDEX_MAX_TRIGRAMS; t++){
+        hash = trigram_hash(p[t],p[t + 1],p[t + 2],ni->bucket_bits);
+        for(j = 0; j < n_lists && h[j] != hash; j++){}
+        if(j < n_lists)
+            continue;
+        h[n_lists] = hash;
+        cur[n_lists] = ni->offsets[hash];
+        if(n_lists == 0 || ni->offsets[hash + 1] - ni->offsets[hash] < \
+          ni->offsets[h[shortest] + 1] - ni->offsets[h[shortest]])
+            shortest = n_lists;
+        n_lists ++;
+    }
+
+    n_blocks = (ni->n_files + ni->block_size - 1) / ni->block_size;
+    for(i = 0; ; i++){
+        /* get the next block having all the trigrams */
+        if(n_lists == 0){
+            if(i >= n_blocks) break;
+            block = i;
+        } else {
+            if(i >= ni->offsets[h[shortest] + 1] - ni->offsets[h[shortest]]) break;
+            block = ni->postings[ni->offsets[h[shortest]] + i];
+            for(j = 0; j < n_lists; j++){
+                if(j == shortest) continue;
+                cur[j] = lower_bound(ni->postings,cur[j],ni->offsets[h[j] + 1],(ULONG)block);
+                if(cur[j] == ni->offsets[h[j] + 1] || ni->postings[cur[j]] != block)
+                    break;
+            }
+            if(j < n_lists) continue;
+        }
+
+        /* check the names */
+        first = block * ni->block_size;
+        last = min(first + ni->block_size,ni->n_files);
+        for(k = first; k < last; k++){
+            if(name_matches(ni->files[k]->name,p,m)){
+                n ++;
+                if(cb(ni->files[k],user_defined_data))
+                    goto done;
+            }
+        }
+    }
+
+done:
+    winx_free(p);
+    return n;
+}
+
+/**
+ * @brief Destroys the name index.
+ */
+void winx_release_name_index(winx_name_index *ni)
+{
+    if(ni == NULL)
+        return;
+    winx_free(ni->files);
+    winx_free(ni->offsets);
+    winx_free(ni->postings);
+    winx_free(ni);
+}
+
+/** @} */
@@ -35,7 +35,8 @@
 
 /*
 * NOTE: All these structures and function prototypes
-* are internal - for ftw_ntfs.c file only.
+* are internal - for ftw_ntfs.c, du.c and ntfstest.c
+* files only.
 */
 
 /* extracts low 48 bits of a File Reference Number */
@@ -46,6 +47,35 @@
 #endif
 
 #pragma pack(push, 1)
+typedef struct {
+    UCHAR Jump[3];
+    UCHAR OemId[8];                /* "NTFS    " */
+    USHORT BytesPerSector;
+    UCHAR SectorsPerCluster;       /* values above 0x80 mean 2^(256 - value) */
+    USHORT ReservedSectors;
+    UCHAR Unused1[5];
+    UCHAR MediaDescriptor;
+    USHORT Unused2;
+    USHORT SectorsPerTrack;
+    USHORT NumberOfHeads;
+    ULONG HiddenSectors;
+    ULONG Unused3[2];
+    ULONGLONG TotalSectors;
+    ULONGLONG MftStartLcn;
+    ULONGLONG MftMirrStartLcn;
+    CHAR ClustersPerFileRecord;    /* negative values mean 2^(-value) bytes */
+    UCHAR Unused4[3];
+    CHAR ClustersPerIndexBlock;
+    UCHAR Unused5[3];
+    ULONGLONG VolumeSerialNumber;
+    ULONG Checksum;
+    UCHAR BootCode[426];
+    USHORT EndOfSectorMarker;      /* 0xAA55 */
+} NTFS_BOOT_SECTOR, *PNTFS_BOOT_SECTOR;
+
+/* update sequence arrays protect each 512 bytes of multisector records */
+#define NTFS_USA_STRIDE 512
+
 typedef struct {
     ULONGLONG FileReferenceNumber;
 } NTFS_FILE_RECORD_INPUT_BUFFER, *PNTFS_FILE_RECORD_BUFFER;
@@ -255,6 +285,28 @@ typedef struct {
     UCHAR ReparseData[1];
 } REPARSE_POINT, *PREPARSE_POINT;
 
+/* maximal size of the reparse point data */
+#define REPARSE_POINT_MAX_SIZE (16 * 1024)
+
+/*
+* Reparse data of junctions. Symbolic links
+* have additional ULONG Flags before the names.
+*/
+typedef struct {
+    USHORT SubstituteNameOffset;   /* in bytes, from the start of the names */
+    USHORT SubstituteNameLength;   /* in bytes */
+    USHORT PrintNameOffset;
+    USHORT PrintNameLength;
+} MOUNT_POINT_REPARSE_DATA, *PMOUNT_POINT_REPARSE_DATA;
+
+/* reparse data of files compressed by WOF */
+typedef struct {
+    ULONG Version;
+    ULONG Provider;          /* 1 - WIM, 2 - individual file */
+    ULONG ProviderVersion;
+    ULONG Algorithm;         /* for individual files: 0 - XPRESS4K, 1 - LZX, 2 - XPRESS8K, 3 - XPRESS16K */
+} WOF_REPARSE_DATA, *PWOF_REPARSE_DATA;
+
 /* the following structure may have variable length! */
 typedef struct {
     ATTRIBUTE_TYPE AttributeType;  /* The type of the attribute. */
@@ -0,0 +1,835 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file ntfstest.c
+ * @brief Synthetic NTFS images.
+ * @details Images hold the $Mft only: the boot
+ * sector, the $Mft split into a few extents, its
+ * attribute list and child record, the root and
+ * a tree of files and directories. Data of the files
+ * is never written, so the images stay small, while
+ * their streams get random maps. The scanner runs
+ * on images of growing size and its results get
+ * compared with the files generated. Corrupted
+ * images check that the scanner survives them.
+ * @addtogroup Benchmarks
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+#include "ntfs.h"
+
+#define TEST_SECTOR_SIZE   512
+#define TEST_CLUSTER_SIZE  4096
+#define TEST_RECORD_SIZE   1024
+#define TEST_RECORDS_PER_CLUSTER (TEST_CLUSTER_SIZE / TEST_RECORD_SIZE)
+#define TEST_USA_OFFSET    0x30
+#define TEST_ATTR_OFFSET   0x38
+
+#define TEST_LIST_LCN      1            /* the nonresident attribute list of the $Mft */
+#define TEST_MFT_LCN       2            /* the first extent of the $Mft */
+#define TEST_MFT_CHILD     15           /* the child record of the $Mft */
+#define TEST_MFT_EXTENTS   12           /* at most */
+#define TEST_DATA_CLUSTERS (1 << 24)    /* clusters of the data area, never written */
+#define TEST_MAX_RUNS      24           /* runs of a file at most */
+#define TEST_MAX_RESIDENT  300          /* bytes of resident streams at most */
+#define TEST_NAME_LENGTH   16
+#define TEST_MAX_PATH      128          /* deeper directories get files in the root */
+#define TEST_FIRST_LEVEL   1000         /* files in the smallest image */
+#define TEST_FUZZ_FILES    1000         /* files in corrupted images */
+#define TEST_BUFFER_SIZE   (1024 * 1024)
+
+/* mapping pairs of TEST_MAX_RUNS runs at most */
+#define TEST_PAIRS_SIZE    (TEST_MAX_RUNS * 17 + 1)
+
+#define align8(n) (((n) + 7) & ~7)
+
+typedef struct _test_image {
+    WINX_FILE *f;
+    ULONGLONG position;         /* bytes written so far */
+    winx_rnd_state r;           /* drives the contents */
+    winx_rnd_state m;           /* drives the corruption */
+    int mutate;                 /* nonzero value corrupts the image */
+    int error;                  /* nonzero value indicates a write failure */
+    char *record;               /* the record being built */
+    char *zero;                 /* a cluster of zeros */
+    ULONG offset;               /* where the next attribute goes */
+    USHORT attr_number;         /* the number of the next attribute */
+    ULONGLONG records;          /* records of the $Mft */
+    winx_run mft[TEST_MFT_EXTENTS];
+    ULONG n_mft;
+    ULONGLONG data_lcn;         /* the first cluster of the data area */
+    ULONGLONG total_clusters;
+    int nonresident_list;       /* nonzero value keeps the attribute list of the $Mft out of it */
+    ULONGLONG *dirs;            /* records of the directories created so far */
+    wchar_t **paths;            /* their paths below the root */
+    ULONG n_dirs;
+    ULONGLONG streams;          /* streams expected to be found */
+    ULONGLONG checksum;         /* of the streams expected to be found */
+} test_image;
+
+/*
+**************************************************
+*               Records building
+**************************************************
+*/
+
+/**
+ * @internal
+ * @brief Writes bytes to the image.
+ */
+static void put_bytes(test_image *t,void *buffer,ULONG length)
+{
+    if(t->error)
+        return;
+    if(winx_fwrite(buffer,1,length,t->f) != length){
+        etrace("cannot write %u bytes",length);
+        t->error = 1;
+    }
+    t->position += length;
+}
+
+/**
+ * @internal
+ * @brief Fills the image by zeros up to the offset.
+ */
+static void skip_to(test_image *t,ULONGLONG offset)
+{
+    ULONG n;
+
+    while(!t->error && t->position < offset){
+        n = (ULONG)min(offset - t->position,TEST_CLUSTER_SIZE);
+        put_bytes(t,t->zero,n);
+    }
+}
+
+/**
+ * @internal
+ * @brief Corrupts random bytes of a block,
+ * mostly of its first bytes in use.
+ */
+static void corrupt(test_image *t,char *block,ULONG used,ULONG size)
+{
+    ULONG i, n;
+
+    n = 1 + winx_rnd(&t->m) % 4;
+    for(i = 0; i < n; i++){
+        if(winx_rnd(&t->m) % 4)
+            block[winx_rnd(&t->m) % used] = (char)winx_rnd(&t->m);
+        else
+            block[winx_rnd(&t->m) % size] = (char)winx_rnd(&t->m);
+    }
+}
+
+/**
+ * @internal
+ * @brief Encodes runs as mapping pairs.
+ * @return Length of the pairs, the terminating
+ * zero included.
+ */
+static ULONG put_pairs(UCHAR *p,winx_run *runs,ULONG n)
+{
+    LONGLONG lcn = 0, delta;
+    ULONG i, k, nl, nd, size = 0;
+
+    for(i = 0; i < n; i++){
+        for(nl = 1; nl < 8 && (runs[i].length >> (nl * 8 - 1)); nl++){}
+        nd = 0;
+        if(runs[i].lcn != WINX_RUN_SPARSE){
+            delta = (LONGLONG)runs[i].lcn - lcn;
+            /* zero length offsets mean sparse runs, so keep one byte at least */
+            for(nd = 1; nd < 8 && (delta < -((LONGLONG)1 << (nd * 8 - 1)) || \
+              delta >= ((LONGLONG)1 << (nd * 8 - 1))); nd++){}
+            lcn = runs[i].lcn;
+        }
+        p[size++] = (UCHAR)((nd << 4) | nl);
+        for(k = 0; k < nl; k++)
+            p[size++] = (UCHAR)(runs[i].length >> (k * 8));
+        for(k = 0; k < nd; k++)
+            p[size++] = (UCHAR)(delta >> (k * 8));
+    }
+    p[size++] = 0;
+    return size;
+}
+
+/**
+ * @internal
+ * @brief Starts a new file record.
+ */
+static void begin_record(test_image *t,USHORT flags,ULONGLONG base)
+{
+    FILE_RECORD_HEADER *frh = (FILE_RECORD_HEADER *)t->record;
+
+    memset(t->record,0,TEST_RECORD_SIZE);
+    frh->Ntfs.Type = TAG('F','I','L','E');
+    frh->Ntfs.UsaOffset = TEST_USA_OFFSET;
+    frh->Ntfs.UsaCount = TEST_RECORD_SIZE / NTFS_USA_STRIDE + 1;
+    frh->Ntfs.Usn = 1 + winx_rnd(&t->r);
+    frh->SequenceNumber = 1;
+    frh->LinkCount = 1;
+    frh->AttributeOffset = TEST_ATTR_OFFSET;
+    frh->Flags = flags;
+    frh->BytesAllocated = TEST_RECORD_SIZE;
+    frh->BaseFileRecord = base;
+    t->offset = TEST_ATTR_OFFSET;
+    t->attr_number = 0;
+}
+
+/**
+ * @internal
+ * @brief Appends an attribute to the record.
+ * @return The attribute, which body goes at
+ * the offset stored in the attribute.
+ */
+static PATTRIBUTE add_attribute(test_image *t,ATTRIBUTE_TYPE type,
+    int nonresident,wchar_t *name,ULONG body_length,USHORT *body)
+{
+    PATTRIBUTE pattr = (PATTRIBUTE)(t->record + t->offset);
+    ULONG header, name_length;
+
+    header = nonresident ? sizeof(NONRESIDENT_ATTRIBUTE) - sizeof(ULONGLONG) : sizeof(RESIDENT_ATTRIBUTE);
+    name_length = name ? (ULONG)wcslen(name) : 0;
+    *body = (USHORT)align8(header + name_length * sizeof(wchar_t));
+
+    pattr->AttributeType = type;
+    pattr->Length = align8(*body + body_length);
+    pattr->Nonresident = (BOOLEAN)nonresident;
+    pattr->NameLength = (UCHAR)name_length;
+    pattr->NameOffset = (USHORT)header;
+    pattr->AttributeNumber = t->attr_number ++;
+    if(name_length)
+        memcpy((char *)pattr + header,name,name_length * sizeof(wchar_t));
+    t->offset += pattr->Length;
+    return pattr;
+}
+
+static void add_resident(test_image *t,ATTRIBUTE_TYPE type,
+    wchar_t *name,void *value,ULONG length)
+{
+    PRESIDENT_ATTRIBUTE pr_attr;
+    USHORT body;
+
+    pr_attr = (PRESIDENT_ATTRIBUTE)add_attribute(t,type,0,name,length,&body);
+    pr_attr->ValueLength = length;
+    pr_attr->ValueOffset = body;
+    memcpy((char *)pr_attr + body,value,length);
+}
+
+/**
+ * @internal
+ * @brief Appends a portion of a nonresident attribute.
+ * @param[in] size the size of the attribute, zero
+ * for portions other than the first one.
+ */
+static void add_nonresident(test_image *t,ATTRIBUTE_TYPE type,
+    wchar_t *name,winx_run *runs,ULONG n,ULONGLONG allocated,ULONGLONG size)
+{
+    PNONRESIDENT_ATTRIBUTE pnr_attr;
+    UCHAR pairs[TEST_PAIRS_SIZE];
+    ULONG length;
+    USHORT body;
+
+    length = put_pairs(pairs,runs,n);
+    pnr_attr = (PNONRESIDENT_ATTRIBUTE)add_attribute(t,type,1,name,length,&body);
+    pnr_attr->LowVcn = runs[0].vcn;
+    pnr_attr->HighVcn = runs[n - 1].vcn + runs[n - 1].length - 1;
+    pnr_attr->RunArrayOffset = body;
+    pnr_attr->AllocatedSize = allocated;
+    pnr_attr->DataSize = size;
+    pnr_attr->InitializedSize = size;
+    memcpy((char *)pnr_attr + body,pairs,length);
+}
+
+static void add_standard_information(test_image *t,ULONGLONG mft_id,ULONG attributes)
+{
+    STANDARD_INFORMATION si;
+
+    memset(&si,0,sizeof(STANDARD_INFORMATION));
+    si.CreationTime = 131000000000000000 + mft_id * 10000000;
+    si.ChangeTime = si.LastWriteTime = si.LastAccessTime = si.CreationTime;
+    si.FileAttributes = attributes;
+    add_resident(t,AttributeStandardInformation,NULL,&si,sizeof(STANDARD_INFORMATION));
+}
+
+static void add_file_name(test_image *t,ULONGLONG parent,wchar_t *name,ULONG attributes)
+{
+    UCHAR value[sizeof(FILENAME_ATTRIBUTE) + TEST_NAME_LENGTH * sizeof(wchar_t)];
+    FILENAME_ATTRIBUTE *fn = (FILENAME_ATTRIBUTE *)value;
+    ULONG length = (ULONG)wcslen(name);
+
+    memset(value,0,sizeof(value));
+    fn->DirectoryFileReferenceNumber = parent | ((ULONGLONG)1 << 48);
+    fn->FileAttributes = attributes;
+    fn->NameLength = (UCHAR)length;
+    fn->NameType = FILENAME_WIN32;
+    memcpy(fn->Name,name,length * sizeof(wchar_t));
+    add_resident(t,AttributeFileName,NULL,value,
+        FIELD_OFFSET(FILENAME_ATTRIBUTE,Name) + length * sizeof(wchar_t));
+}
+
+/**
+ * @internal
+ * @brief Writes the record where the $Mft keeps it.
+ * @note Records must be written in ascending order.
+ */
+static void put_record(test_image *t,ULONGLONG mft_id)
+{
+    ULONGLONG vcn, offset;
+    ULONG i;
+
+    vcn = mft_id / TEST_RECORDS_PER_CLUSTER;
+    for(i = 0; i < t->n_mft - 1; i++)
+        if(vcn < t->mft[i].vcn + t->mft[i].length) break;
+    offset = (t->mft[i].lcn + vcn - t->mft[i].vcn) * TEST_CLUSTER_SIZE + \
+        (mft_id % TEST_RECORDS_PER_CLUSTER) * TEST_RECORD_SIZE;
+    skip_to(t,offset);
+    put_bytes(t,t->record,TEST_RECORD_SIZE);
+}
+
+/**
+ * @internal
+ * @brief Completes the record, protects it by
+ * the update sequence array and writes it.
+ */
+static void end_record(test_image *t,ULONGLONG mft_id)
+{
+    FILE_RECORD_HEADER *frh = (FILE_RECORD_HEADER *)t->record;
+    USHORT *usa, *p;
+    ULONG i, damage = 0;
+
+    *(ULONG *)(t->record + t->offset) = 0xffffffff;
+    frh->BytesInUse = t->offset + 8;
+    frh->NextAttributeNumber = t->attr_number;
+
+    /* damage before the protection keeps the record consistent */
+    if(t->mutate && winx_rnd(&t->m) % 16 == 0)
+        damage = 1 + winx_rnd(&t->m) % 2;
+    if(damage == 1)
+        corrupt(t,t->record,frh->BytesInUse,TEST_RECORD_SIZE);
+
+    usa = (USHORT *)(t->record + TEST_USA_OFFSET);
+    usa[0] = (USHORT)(1 + winx_rnd(&t->r) % 0xfffe);
+    for(i = 1; i < TEST_RECORD_SIZE / NTFS_USA_STRIDE + 1; i++){
+        p = (USHORT *)(t->record + i * NTFS_USA_STRIDE - sizeof(USHORT));
+        usa[i] = *p;
+        *p = usa[0];
+    }
+    if(damage == 2)
+        corrupt(t,t->record,TEST_RECORD_SIZE,TEST_RECORD_SIZE);
+    put_record(t,mft_id);
+}
+
+/*
+**************************************************
+*               Images building
+**************************************************
+*/
+
+/**
+ * @internal
+ * @brief Mixes properties of a stream into
+ * its checksum; checksums of streams get summed
+ * up, so the order of the streams doesn't matter.
+ */
+static ULONGLONG stream_checksum(wchar_t *path,ULONGLONG size,
+    ULONGLONG clusters,ULONGLONG fragments)
+{
+    ULONGLONG h = 0xcbf29ce484222325ULL;
+
+    for(; *path; path++) h = (h ^ *path) * 0x100000001b3ULL;
+    h = (h ^ size) * 0x100000001b3ULL;
+    h = (h ^ clusters) * 0x100000001b3ULL;
+    return (h ^ fragments) * 0x100000001b3ULL;
+}
+
+static void expect_stream(test_image *t,wchar_t *path,ULONGLONG size,
+    ULONGLONG clusters,ULONGLONG fragments)
+{
+    t->streams ++;
+    t->checksum += stream_checksum(path,size,clusters,fragments);
+}
+
+/**
+ * @internal
+ * @brief Splits the $Mft into extents with gaps
+ * between them. The first extent covers the child
+ * record, the child record maps all the others.
+ */
+static void plan_mft(test_image *t)
+{
+    ULONGLONG clusters, left, lcn, vcn;
+    ULONG i, n;
+
+    clusters = t->records / TEST_RECORDS_PER_CLUSTER;
+    t->mft[0].length = (TEST_MFT_CHILD + 1) / TEST_RECORDS_PER_CLUSTER + winx_rnd(&t->r) % 4;
+    if(t->mft[0].length > clusters - 1)
+        t->mft[0].length = clusters - 1;
+    left = clusters - t->mft[0].length;
+    n = 1 + winx_rnd(&t->r) % (TEST_MFT_EXTENTS - 1);
+    if(n > left) n = (ULONG)left;
+    for(i = 1; i < n; i++){
+        t->mft[i].length = 1 + winx_rnd30(&t->r) % (left - (n - i));
+        left -= t->mft[i].length;
+    }
+    t->mft[n].length = left;
+    t->n_mft = n + 1;
+
+    lcn = TEST_MFT_LCN, vcn = 0;
+    for(i = 0; i < t->n_mft; i++){
+        t->mft[i].vcn = vcn;
+        t->mft[i].lcn = lcn;
+        vcn += t->mft[i].length;
+        lcn += t->mft[i].length + 1 + winx_rnd(&t->r) % 16;
+    }
+    t->data_lcn = lcn;
+    t->total_clusters = lcn + TEST_DATA_CLUSTERS;
+}
+
+/**
+ * @internal
+ * @brief Appends an entry to the attribute list of the $Mft.
+ * @return Length of the list.
+ */
+static ULONG add_list_entry(char *list,ULONG length,ATTRIBUTE_TYPE type,
+    ULONGLONG vcn,ULONGLONG mft_id,USHORT number)
+{
+    ATTRIBUTE_LIST *entry = (ATTRIBUTE_LIST *)(list + length);
+
+    memset(entry,0,sizeof(ATTRIBUTE_LIST));
+    entry->AttributeType = type;
+    entry->Length = sizeof(ATTRIBUTE_LIST);
+    entry->NameOffset = FIELD_OFFSET(ATTRIBUTE_LIST,AlignmentOrReserved);
+    entry->LowVcn = vcn;
+    entry->FileReferenceNumber = mft_id | ((ULONGLONG)1 << 48);
+    entry->AttributeNumber = number;
+    return length + sizeof(ATTRIBUTE_LIST);
+}
+
+/**
+ * @internal
+ * @brief Writes the boot sector, the attribute list
+ * of the $Mft, its base record, the root and the
+ * child record of the $Mft.
+ * @note Numbers of the attributes of the $Mft
+ * follow the order they get added in.
+ */
+static void put_system_files(test_image *t)
+{
+    NTFS_BOOT_SECTOR *bs;
+    winx_run list_run;
+    char *list;
+    ULONG length = 0;
+    ULONGLONG id, allocated;
+    char index[32];
+
+    /* the boot sector */
+    bs = (NTFS_BOOT_SECTOR *)t->record;
+    memset(t->record,0,TEST_CLUSTER_SIZE);
+    bs->Jump[0] = 0xEB, bs->Jump[1] = 0x52, bs->Jump[2] = 0x90;
+    memcpy(bs->OemId,"NTFS    ",sizeof(bs->OemId));
+    bs->BytesPerSector = TEST_SECTOR_SIZE;
+    bs->SectorsPerCluster = TEST_CLUSTER_SIZE / TEST_SECTOR_SIZE;
+    bs->MediaDescriptor = 0xF8;
+    bs->TotalSectors = t->total_clusters * (TEST_CLUSTER_SIZE / TEST_SECTOR_SIZE);
+    bs->MftStartLcn = TEST_MFT_LCN;
+    bs->MftMirrStartLcn = t->total_clusters / 2;
+    bs->ClustersPerFileRecord = -10; /* 1024 bytes */
+    bs->ClustersPerIndexBlock = 1;
+    bs->VolumeSerialNumber = winx_rnd30(&t->r);
+    bs->EndOfSectorMarker = 0xAA55;
+    if(t->mutate && winx_rnd(&t->m) % 8 == 0)
+        corrupt(t,t->record,sizeof(NTFS_BOOT_SECTOR),sizeof(NTFS_BOOT_SECTOR));
+    put_bytes(t,t->record,TEST_CLUSTER_SIZE);
+
+    /* the attribute list, kept behind the record being built */
+    list = t->record + TEST_RECORD_SIZE;
+    memset(list,0,TEST_CLUSTER_SIZE - TEST_RECORD_SIZE);
+    length = add_list_entry(list,length,AttributeStandardInformation,0,FILE_MFT,0);
+    length = add_list_entry(list,length,AttributeFileName,0,FILE_MFT,1);
+    length = add_list_entry(list,length,AttributeData,0,FILE_MFT,3);
+    length = add_list_entry(list,length,AttributeData,t->mft[1].vcn,TEST_MFT_CHILD,0);
+    if(t->nonresident_list){
+        if(t->mutate && winx_rnd(&t->m) % 8 == 0)
+            corrupt(t,list,length,length);
+        put_bytes(t,list,TEST_CLUSTER_SIZE - TEST_RECORD_SIZE);
+        put_bytes(t,t->zero,TEST_RECORD_SIZE);
+    }
+
+    /* the $Mft */
+    begin_record(t,0x1,0);
+    add_standard_information(t,FILE_MFT,FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM);
+    add_file_name(t,FILE_root,L"$MFT",FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM);
+    if(t->nonresident_list){
+        list_run.vcn = 0, list_run.lcn = TEST_LIST_LCN, list_run.length = 1;
+        add_nonresident(t,AttributeAttributeList,NULL,&list_run,1,TEST_CLUSTER_SIZE,length);
+    } else {
+        add_resident(t,AttributeAttributeList,NULL,list,length);
+    }
+    allocated = (t->mft[t->n_mft - 1].vcn + t->mft[t->n_mft - 1].length) * TEST_CLUSTER_SIZE;
+    add_nonresident(t,AttributeData,NULL,t->mft,1,allocated,t->records * TEST_RECORD_SIZE);
+    end_record(t,FILE_MFT);
+
+    /* system files other than the root are left free */
+    for(id = FILE_MFTMirr; id < TEST_MFT_CHILD; id++){
+        if(id == FILE_root){
+            begin_record(t,0x3,0);
+            add_standard_information(t,id,FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM);
+            add_file_name(t,FILE_root,L".",FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM);
+            memset(index,0,sizeof(index));
+            add_resident(t,AttributeIndexRoot,L"$I30",index,sizeof(index));
+            end_record(t,id);
+        } else {
+            memset(t->record,0,TEST_RECORD_SIZE);
+            put_record(t,id);
+        }
+    }
+
+    /* the child record maps the rest of the $Mft */
+    begin_record(t,0x1,(ULONGLONG)FILE_MFT | ((ULONGLONG)1 << 48));
+    add_nonresident(t,AttributeData,NULL,t->mft + 1,t->n_mft - 1,0,0);
+    end_record(t,TEST_MFT_CHILD);
+}
+
+/**
+ * @internal
+ * @brief Generates random runs of a stream.
+ * @return Number of the runs.
+ */
+static ULONG generate_runs(test_image *t,winx_run *runs)
+{
+    ULONG i, n;
+
+    n = (winx_rnd(&t->r) % 8) ? 1 + winx_rnd(&t->r) % 3 : 1 + winx_rnd(&t->r) % TEST_MAX_RUNS;
+    for(i = 0; i < n; i++){
+        runs[i].vcn = i ? runs[i - 1].vcn + runs[i - 1].length : 0;
+        runs[i].length = 1 + winx_rnd(&t->r) % 64;
+        if(winx_rnd(&t->r) % 16 == 0){
+            runs[i].lcn = WINX_RUN_SPARSE;
+        } else if(i && runs[i - 1].lcn != WINX_RUN_SPARSE && winx_rnd(&t->r) % 4 == 0 && \
+          runs[i - 1].lcn + runs[i - 1].length + runs[i].length <= t->total_clusters){
+            /* splits of a single fragment */
+            runs[i].lcn = runs[i - 1].lcn + runs[i - 1].length;
+        } else {
+            runs[i].lcn = t->data_lcn + winx_rnd30(&t->r) % (TEST_DATA_CLUSTERS - 64);
+        }
+    }
+    return n;
+}
+
+/**
+ * @internal
+ * @brief Writes a record of a file or directory
+ * and counts its streams as expected.
+ */
+static void put_file(test_image *t,ULONGLONG mft_id)
+{
+    winx_run runs[TEST_MAX_RUNS];
+    wchar_t name[TEST_NAME_LENGTH];
+    wchar_t *parent_path, *path, *stream_path;
+    ULONGLONG parent, allocated, size, clusters, fragments, end;
+    ULONG i, n, attributes, length;
+    char value[TEST_MAX_RESIDENT];
+    int directory;
+
+    directory = (winx_rnd(&t->r) % 8 == 0);
+    parent = FILE_root, parent_path = L"";
+    if(t->n_dirs && winx_rnd(&t->r) % 4){
+        i = winx_rnd30(&t->r) % t->n_dirs;
+        if(wcslen(t->paths[i]) < TEST_MAX_PATH)
+            parent = t->dirs[i], parent_path = t->paths[i];
+    }
+    if(directory)
+        _snwprintf(name,TEST_NAME_LENGTH,L"d%I64u",mft_id);
+    else
+        _snwprintf(name,TEST_NAME_LENGTH,L"f%I64u",mft_id);
+    name[TEST_NAME_LENGTH - 1] = 0;
+    path = winx_swprintf(L"%ws\\%ws",parent_path,name);
+    if(path == NULL){
+        etrace("cannot allocate memory for %ws",name);
+        t->error = 1;
+        return;
+    }
+
+    attributes = directory ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_ARCHIVE;
+    memset(value,0,sizeof(value));
+    begin_record(t,directory ? 0x3 : 0x1,0);
+    add_standard_information(t,mft_id,attributes);
+    add_file_name(t,parent,name,attributes);
+
+    if(directory){
+        length = 32 + winx_rnd(&t->r) % 64;
+        add_resident(t,AttributeIndexRoot,L"$I30",value,length);
+        expect_stream(t,path,length,0,0);
+        t->dirs[t->n_dirs] = mft_id;
+        t->paths[t->n_dirs] = path;
+        t->n_dirs ++;
+    } else {
+        if(winx_rnd(&t->r) % 4 == 0){
+            length = winx_rnd(&t->r) % TEST_MAX_RESIDENT;
+            add_resident(t,AttributeData,NULL,value,length);
+            expect_stream(t,path,length,0,0);
+        } else {
+            n = generate_runs(t,runs);
+            clusters = fragments = 0, end = WINX_RUN_SPARSE;
+            for(i = 0; i < n; i++){
+                if(runs[i].lcn == WINX_RUN_SPARSE) continue;
+                if(runs[i].lcn != end) fragments ++;
+                clusters += runs[i].length;
+                end = runs[i].lcn + runs[i].length;
+            }
+            allocated = (runs[n - 1].vcn + runs[n - 1].length) * TEST_CLUSTER_SIZE;
+            size = allocated - winx_rnd(&t->r) % TEST_CLUSTER_SIZE;
+            add_nonresident(t,AttributeData,NULL,runs,n,allocated,size);
+            expect_stream(t,path,size,clusters,fragments);
+        }
+        if(winx_rnd(&t->r) % 16 == 0){
+            length = winx_rnd(&t->r) % (TEST_MAX_RESIDENT / 2);
+            add_resident(t,AttributeData,L"alt",value,length);
+            stream_path = winx_swprintf(L"%ws:alt",path);
+            if(stream_path == NULL){
+                etrace("cannot allocate memory for %ws",path);
+                t->error = 1;
+            } else {
+                expect_stream(t,stream_path,length,0,0);
+                winx_free(stream_path);
+            }
+        }
+        winx_free(path);
+    }
+    end_record(t,mft_id);
+}
+
+/**
+ * @internal
+ * @brief Releases resources of the image
+ * and the memory used to generate it.
+ */
+static void release_image(test_image *t)
+{
+    ULONG i;
+
+    if(t->f) winx_fclose(t->f);
+    if(t->paths){
+        for(i = 0; i < t->n_dirs; i++)
+            winx_free(t->paths[i]);
+    }
+    winx_free(t->paths);
+    winx_free(t->dirs);
+    winx_free(t->record);
+    winx_free(t->zero);
+    t->f = NULL;
+    t->paths = NULL;
+    t->dirs = NULL;
+    t->record = t->zero = NULL;
+    t->n_dirs = 0;
+}
+
+/**
+ * @internal
+ * @brief Generates an image.
+ * @param[in] mutate nonzero value
+ * corrupts the image randomly.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int build_image(wchar_t *path,ULONG files,ULONG seed,
+    int mutate,test_image *t)
+{
+    ULONGLONG id, free_records;
+    ULONG left = files;
+
+    memset(t,0,sizeof(test_image));
+    winx_rnd_init(&t->r,seed);
+    winx_rnd_init(&t->m,~seed);
+    t->mutate = mutate;
+    t->nonresident_list = winx_rnd(&t->r) & 1;
+
+    /* every 17th record is free on average */
+    t->records = FILE_first_user + files + files / 16;
+    t->records = (t->records + TEST_RECORDS_PER_CLUSTER - 1) / TEST_RECORDS_PER_CLUSTER * TEST_RECORDS_PER_CLUSTER;
+    free_records = t->records - FILE_first_user - files;
+
+    t->record = winx_tmalloc(TEST_CLUSTER_SIZE);
+    t->zero = winx_tmalloc(TEST_CLUSTER_SIZE);
+    t->dirs = winx_tmalloc(files * sizeof(ULONGLONG));
+    t->paths = winx_tmalloc(files * sizeof(wchar_t *));
+    if(t->record == NULL || t->zero == NULL || t->dirs == NULL || t->paths == NULL){
+        etrace("cannot allocate memory for %u files",files);
+        release_image(t);
+        return (-1);
+    }
+    memset(t->zero,0,TEST_CLUSTER_SIZE);
+
+    t->f = winx_fbopen(path,"w",TEST_BUFFER_SIZE);
+    if(t->f == NULL){
+        etrace("cannot create %ws",path);
+        release_image(t);
+        return (-1);
+    }
+
+    plan_mft(t);
+    put_system_files(t);
+    for(id = FILE_first_user; id < t->records && !t->error; id++){
+        if(left == 0 || (free_records && winx_rnd(&t->r) % 17 == 0)){
+            /* deleted files leave their records behind */
+            if(winx_rnd(&t->r) % 2){
+                begin_record(t,0x0,0);
+                add_standard_information(t,id,FILE_ATTRIBUTE_ARCHIVE);
+                end_record(t,id);
+            } else {
+                memset(t->record,0,TEST_RECORD_SIZE);
+                put_record(t,id);
+            }
+            free_records --;
+        } else {
+            put_file(t,id);
+            left --;
+        }
+    }
+
+    winx_fclose(t->f);
+    t->f = NULL;
+    if(t->error){
+        release_image(t);
+        return (-1);
+    }
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Counts streams of user files found
+ * by the scan and sums up their checksums.
+ */
+static void sum_streams(winx_file_info *filelist,wchar_t *path,
+    ULONGLONG *streams,ULONGLONG *checksum)
+{
+    winx_file_info *f;
+    size_t length = wcslen(path) + 1; /* the root is the path followed by a colon */
+
+    *streams = *checksum = 0;
+    for(f = filelist; f; f = f->next){
+        if(f->internal.BaseMftId >= FILE_first_user && wcslen(f->path) > length){
+            (*streams) ++;
+            (*checksum) += stream_checksum(f->path + length,
+                f->disp.size,f->disp.clusters,f->disp.fragments);
+        }
+        if(f->next == filelist) break;
+    }
+}
+
+/*
+**************************************************
+*                    The test
+**************************************************
+*/
+
+/**
+ * @brief Scans synthetic NTFS images
+ * and checks the results.
+ * @details Images of growing size get scanned
+ * and each stream found is compared with the one
+ * generated. Then small images get corrupted
+ * randomly, the scan must survive them all.
+ * @param[in] path the native path of the image
+ * file; it gets overwritten by each image and
+ * deleted at the end.
+ * @param[in] files the number of files in the
+ * largest image, each smaller level has ten times
+ * less files, down to a thousand of them.
+ * @param[in] mutations the number of corrupted
+ * images to scan.
+ * @param[in] seed the seed of the generator.
+ * @param[out] t the results.
+ * @return Zero for success, negative
+ * value indicates failure. Mismatches
+ * are counted in the results.
+ */
+int winx_test_ntfs_image(wchar_t *path,ULONG files,ULONG mutations,
+    ULONG seed,winx_ntfs_image_test *t)
+{
+    test_image im;
+    winx_ftw_context ctx;
+    winx_file_info *filelist;
+    ULONGLONG time, streams, checksum;
+    ULONG n, i, level;
+
+    DbgCheck2(path,t,-1);
+
+    memset(t,0,sizeof(winx_ntfs_image_test));
+    winx_bench_init(&t->b);
+    if(files == 0) files = WINX_NTFS_TEST_DEFAULT_FILES;
+
+    for(n = files, level = 1; n / 10 >= TEST_FIRST_LEVEL && \
+      level < WINX_BENCH_LEVELS; n /= 10, level ++){}
+
+    for(level = 0; level < WINX_BENCH_LEVELS && n <= files; level ++, n *= 10){
+        if(build_image(path,n,seed + level,0,&im) < 0)
+            goto fail;
+        memset(&ctx,0,sizeof(winx_ftw_context));
+        time = winx_xtime();
+        filelist = winx_scan_image_ex(path,WINX_FTW_DUMP_FILES,NULL,&ctx,NULL);
+        t->b.time[level] = winx_xtime() - time;
+        memcpy(t->phases[level],ctx.phases,sizeof(ctx.phases));
+        t->b.level[level] = n;
+        t->b.levels ++;
+        if(filelist == NULL){
+            etrace("cannot scan the image of %u files",n);
+            t->b.mismatches ++;
+        } else {
+            sum_streams(filelist,path,&streams,&checksum);
+            winx_ftw_release(filelist);
+            t->b.items[level] = streams;
+            if(streams != im.streams){
+                etrace("the image of %u files: %I64u streams found, %I64u expected",
+                    n,streams,im.streams);
+                t->b.mismatches ++;
+            } else if(checksum != im.checksum){
+                etrace("the image of %u files: streams differ from the expected ones",n);
+                t->b.mismatches ++;
+            }
+        }
+        release_image(&im);
+    }
+
+    /* the scan must fail or succeed, nothing else; partial scans go up to the end */
+    n = min(files,TEST_FUZZ_FILES);
+    for(i = 0; i < mutations; i++){
+        if(build_image(path,n,seed + i,1,&im) < 0)
+            goto fail;
+        memset(&ctx,0,sizeof(winx_ftw_context));
+        filelist = winx_scan_image_ex(path,WINX_FTW_DUMP_FILES | \
+            WINX_FTW_ALLOW_PARTIAL_SCAN,NULL,&ctx,NULL);
+        if(filelist == NULL) t->failures ++;
+        winx_ftw_release(filelist);
+        release_image(&im);
+        t->mutations ++;
+    }
+
+    (void)winx_delete_file(path);
+    return 0;
+
+fail:
+    (void)winx_delete_file(path);
+    return (-1);
+}
+
+/** @} */
@@ -196,6 +196,9 @@ typedef LPOSVERSIONINFOW PRTL_OSVERSIONINFOW;
 #ifndef STATUS_SHARING_VIOLATION
 #define STATUS_SHARING_VIOLATION      ((NTSTATUS)0xC0000043)
 #endif
+#ifndef STATUS_FILE_CORRUPT_ERROR
+#define STATUS_FILE_CORRUPT_ERROR     ((NTSTATUS)0xC0000102)
+#endif
 
 /* DEVICE_OBJECT.Characteristics */
 #define FILE_REMOVABLE_MEDIA            0x00000001
@@ -250,6 +253,20 @@ typedef LPOSVERSIONINFOW PRTL_OSVERSIONINFOW;
 #define FILE_OPEN_REPARSE_POINT         0x00200000
 #endif
 
+/* reparse point tags, not all of them are defined by older SDKs */
+#ifndef IO_REPARSE_TAG_MOUNT_POINT
+#define IO_REPARSE_TAG_MOUNT_POINT      0xA0000003L
+#endif
+#ifndef IO_REPARSE_TAG_SYMLINK
+#define IO_REPARSE_TAG_SYMLINK          0xA000000CL
+#endif
+#ifndef IO_REPARSE_TAG_DEDUP
+#define IO_REPARSE_TAG_DEDUP            0x80000013L
+#endif
+#ifndef IO_REPARSE_TAG_WOF
+#define IO_REPARSE_TAG_WOF              0x80000017L
+#endif
+
 #define FILE_DIRECTORY_FILE             0x00000001
 #define FILE_RESERVE_OPFILTER           0x00100000
 
@@ -1326,6 +1343,20 @@ typedef struct _PROCESS_BASIC_INFORMATION {
 } PROCESS_BASIC_INFORMATION, *PPROCESS_BASIC_INFORMATION;
 #pragma pack(pop)
 
+typedef struct _VM_COUNTERS {
+    SIZE_T PeakVirtualSize;
+    SIZE_T VirtualSize;
+    ULONG PageFaultCount;
+    SIZE_T PeakWorkingSetSize;
+    SIZE_T WorkingSetSize;
+    SIZE_T QuotaPeakPagedPoolUsage;
+    SIZE_T QuotaPagedPoolUsage;
+    SIZE_T QuotaPeakNonPagedPoolUsage;
+    SIZE_T QuotaNonPagedPoolUsage;
+    SIZE_T PagefileUsage;
+    SIZE_T PeakPagefileUsage;
+} VM_COUNTERS, *PVM_COUNTERS;
+
 /*
 * This is the correct definition for the data
 * structure that is passed in to FSCTL_MOVE_FILE.
@@ -1503,6 +1534,7 @@ VOID        NTAPI    RtlInitAnsiString(PANSI_STRING,PCSZ);
 VOID        NTAPI    RtlInitUnicodeString(PUNICODE_STRING,PCWSTR);
 PRTL_USER_PROCESS_PARAMETERS NTAPI RtlNormalizeProcessParams(RTL_USER_PROCESS_PARAMETERS*);
 ULONG       NTAPI    RtlNtStatusToDosError(NTSTATUS);
+SIZE_T      NTAPI    RtlSizeHeap(HANDLE,ULONG,PVOID);
 NTSTATUS    NTAPI    RtlQueryEnvironmentVariable_U(PWSTR,PUNICODE_STRING,PUNICODE_STRING);
 NTSTATUS    NTAPI    RtlQueryRegistryValues(ULONG RelativeTo,PCWSTR Path,PRTL_QUERY_REGISTRY_TABLE QueryTable,PVOID Context,PVOID Environment);
 NTSTATUS    NTAPI    RtlSetEnvironmentVariable(PWSTR,PUNICODE_STRING,PUNICODE_STRING);
@@ -0,0 +1,582 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file partition.c
+ * @brief Partitions of disk images.
+ * @details MBR partitions, logical partitions of
+ * EBR chains and GPT partitions are recognized.
+ * Partitions are numbered as Linux does: primary
+ * MBR partitions by their slots, 1 to 4, logical
+ * ones from 5 on, GPT partitions by their entries.
+ * winx_open_image opens a partition as a regular
+ * file by a path like \\??\\C:\\disk.img#p2, it's how
+ * image scans and mounts get to partitions without
+ * copying them out. winx_fopen keeps such paths
+ * as they are.
+ * @addtogroup File
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+#define MBR_SECTOR_SIZE    512
+#define MBR_ENTRIES        446
+#define MBR_ENTRY_SIZE     16
+#define MBR_SIGNATURE      510
+
+/* MBR partition types */
+#define MBR_TYPE_EXTENDED      0x05
+#define MBR_TYPE_EXTENDED_LBA  0x0F
+#define MBR_TYPE_EXTENDED_LINUX 0x85
+#define MBR_TYPE_GPT           0xEE
+
+#define is_extended(t) ((t) == MBR_TYPE_EXTENDED \
+    || (t) == MBR_TYPE_EXTENDED_LBA || (t) == MBR_TYPE_EXTENDED_LINUX)
+
+/* logical partitions are numbered from this on */
+#define MBR_FIRST_LOGICAL  5
+
+/* the most logical partitions of an EBR chain */
+#define MBR_MAX_LOGICAL    128
+
+/* GPT headers are searched in the second sector of these sizes */
+#define GPT_SECTOR_SIZE_MIN 512
+#define GPT_SECTOR_SIZE_MAX 4096
+
+/* fields of the GPT header */
+#define GPT_HEADER_SIZE    12
+#define GPT_HEADER_CRC     16
+#define GPT_ENTRIES_LBA    72
+#define GPT_ENTRIES        80
+#define GPT_ENTRY_SIZE     84
+#define GPT_ENTRIES_CRC    88
+#define GPT_MIN_HEADER_SIZE 92
+
+/* fields of GPT entries */
+#define GPT_ENTRY_TYPE     0
+#define GPT_ENTRY_FIRST    32
+#define GPT_ENTRY_LAST     40
+#define GPT_ENTRY_NAME     56
+#define GPT_MIN_ENTRY_SIZE 128
+
+/* limits protecting against damaged tables */
+#define GPT_MAX_ENTRIES    4096
+#define GPT_MAX_ENTRY_SIZE 4096
+#define GPT_MAX_TABLE_SIZE (1024 * 1024)
+
+#define get_u16(p) ((ULONG)((UCHAR *)(p))[0] | ((ULONG)((UCHAR *)(p))[1] << 8))
+#define get_u32(p) (get_u16(p) | (get_u16((UCHAR *)(p) + 2) << 16))
+#define get_u64(p) ((ULONGLONG)get_u32(p) | ((ULONGLONG)get_u32((UCHAR *)(p) + 4) << 32))
+
+/**
+ * @internal
+ * @brief Reads a range of the image.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int read_image(WINX_FILE *f,ULONGLONG offset,void *buffer,ULONG length)
+{
+    f->roffset.QuadPart = offset;
+    if(winx_fread(buffer,1,length,f) != length){
+        etrace("cannot read %u bytes at %I64u",length,offset);
+        return (-1);
+    }
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Calculates CRC32 as GPT does.
+ */
+static ULONG crc32(UCHAR *p,ULONG length,ULONG crc)
+{
+    int i;
+
+    crc = ~crc & 0xFFFFFFFF;
+    while(length--){
+        crc ^= *p++;
+        for(i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+    return ~crc & 0xFFFFFFFF;
+}
+
+/**
+ * @internal
+ * @brief Appends a partition to the list.
+ * @details Partitions lying beyond the
+ * end of the image get skipped.
+ * @return The partition, NULL if it
+ * has been skipped.
+ */
+static winx_partition *add_partition(winx_partition **list,int number,
+    ULONGLONG offset,ULONGLONG length,ULONGLONG image_size)
+{
+    winx_partition *p;
+
+    if(length == 0)
+        return NULL;
+    if(offset >= image_size || length > image_size - offset){
+        etrace("partition %u at %I64u of %I64u bytes is beyond the image end",
+            number,offset,length);
+        return NULL;
+    }
+    p = (winx_partition *)winx_list_insert((list_entry **)(void *)list,
+        (list_entry *)(*list ? (*list)->prev : NULL),sizeof(winx_partition));
+    p->number = number;
+    p->offset = offset;
+    p->length = length;
+    p->gpt = 0;
+    p->type = 0;
+    memset(p->type_guid,0,sizeof(p->type_guid));
+    p->name[0] = 0;
+    return p;
+}
+
+/*
+**************************************************************
+*                    GPT
+**************************************************************
+*/
+
+/**
+ * @internal
+ * @brief Checks a GPT header.
+ * @param[in] lba the sector holding the header.
+ * @return Zero for a valid header, negative
+ * value otherwise.
+ */
+static int check_gpt_header(UCHAR *header,ULONG sector_size,ULONGLONG lba)
+{
+    UCHAR copy[GPT_SECTOR_SIZE_MAX];
+    ULONG size, n, entry_size;
+
+    if(memcmp(header,"EFI PART",8))
+        return (-1);
+    size = get_u32(header + GPT_HEADER_SIZE);
+    if(size < GPT_MIN_HEADER_SIZE || size > sector_size){
+        etrace("invalid GPT header size %u",size);
+        return (-1);
+    }
+    memcpy(copy,header,size);
+    memset(copy + GPT_HEADER_CRC,0,4);
+    if(crc32(copy,size,0) != get_u32(header + GPT_HEADER_CRC)){
+        etrace("GPT header at sector %I64u is damaged",lba);
+        return (-1);
+    }
+    if(get_u64(header + 24) != lba){
+        etrace("GPT header at sector %I64u refers to sector %I64u",
+            lba,get_u64(header + 24));
+        return (-1);
+    }
+    n = get_u32(header + GPT_ENTRIES);
+    entry_size = get_u32(header + GPT_ENTRY_SIZE);
+    if(n > GPT_MAX_ENTRIES || entry_size < GPT_MIN_ENTRY_SIZE
+      || entry_size > GPT_MAX_ENTRY_SIZE || entry_size % 8
+      || (ULONGLONG)n * entry_size > GPT_MAX_TABLE_SIZE){
+        etrace("invalid GPT table of %u entries of %u bytes",n,entry_size);
+        return (-1);
+    }
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Reads the GPT partitions described by a header.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int read_gpt_entries(WINX_FILE *f,UCHAR *header,ULONG sector_size,
+    ULONGLONG image_size,winx_partition **list)
+{
+    winx_partition *p;
+    UCHAR *table, *e;
+    ULONG n, entry_size, size, i, j;
+    ULONGLONG first, last;
+
+    n = get_u32(header + GPT_ENTRIES);
+    entry_size = get_u32(header + GPT_ENTRY_SIZE);
+    size = n * entry_size;
+    if(size == 0)
+        return 0;
+    table = winx_tmalloc(size);
+    if(table == NULL){
+        etrace("cannot allocate %u bytes of memory",size);
+        return (-1);
+    }
+    if(read_image(f,get_u64(header + GPT_ENTRIES_LBA) * sector_size,table,size) < 0)
+        goto fail;
+    if(crc32(table,size,0) != get_u32(header + GPT_ENTRIES_CRC)){
+        etrace("GPT entries are damaged");
+        goto fail;
+    }
+    for(i = 0; i < n; i++){
+        e = table + i * entry_size;
+        for(j = 0; j < 16 && e[GPT_ENTRY_TYPE + j] == 0; j++);
+        if(j == 16)
+            continue;
+        first = get_u64(e + GPT_ENTRY_FIRST);
+        last = get_u64(e + GPT_ENTRY_LAST);
+        if(last < first){
+            etrace("GPT entry %u is damaged",i + 1);
+            continue;
+        }
+        if(last - first + 1 > image_size / sector_size){
+            etrace("GPT entry %u is beyond the image end",i + 1);
+            continue;
+        }
+        p = add_partition(list,i + 1,first * sector_size,
+            (last - first + 1) * sector_size,image_size);
+        if(p == NULL)
+            continue;
+        p->gpt = 1;
+        memcpy(p->type_guid,e + GPT_ENTRY_TYPE,16);
+        for(j = 0; j < 36; j++)
+            p->name[j] = (wchar_t)get_u16(e + GPT_ENTRY_NAME + 2 * j);
+        p->name[36] = 0;
+    }
+    winx_free(table);
+    return 0;
+
+fail:
+    winx_free(table);
+    return (-1);
+}
+
+/**
+ * @internal
+ * @brief Reads GPT partitions.
+ * @details The backup header at the end of
+ * the image is used when the primary one
+ * is damaged.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int read_gpt(WINX_FILE *f,ULONGLONG image_size,winx_partition **list)
+{
+    UCHAR *header;
+    ULONG sector_size;
+    ULONGLONG lba;
+    int result = -1;
+
+    header = winx_tmalloc(GPT_SECTOR_SIZE_MAX);
+    if(header == NULL){
+        etrace("cannot allocate %u bytes of memory",GPT_SECTOR_SIZE_MAX);
+        return (-1);
+    }
+    for(sector_size = GPT_SECTOR_SIZE_MIN; sector_size <= GPT_SECTOR_SIZE_MAX; sector_size <<= 1){
+        if(image_size < sector_size * 2)
+            break;
+        if(read_image(f,sector_size,header,sector_size) < 0)
+            break;
+        if(check_gpt_header(header,sector_size,1) == 0){
+            result = read_gpt_entries(f,header,sector_size,image_size,list);
+            if(result == 0)
+                break;
+        } else if(memcmp(header,"EFI PART",8)){
+            continue;
+        }
+        lba = image_size / sector_size - 1;
+        itrace("trying the backup GPT header at sector %I64u",lba);
+        if(read_image(f,lba * sector_size,header,sector_size) == 0
+          && check_gpt_header(header,sector_size,lba) == 0){
+            winx_release_partitions(*list);
+            *list = NULL;
+            result = read_gpt_entries(f,header,sector_size,image_size,list);
+        }
+        break;
+    }
+    winx_free(header);
+    return result;
+}
+
+/*
+**************************************************************
+*                    MBR
+**************************************************************
+*/
+
+/**
+ * @internal
+ * @brief Reads logical partitions of an EBR chain.
+ * @param[in] start the first sector of
+ * the extended partition.
+ * @param[in] length length of the extended
+ * partition, in sectors.
+ */
+static void read_ebr_chain(WINX_FILE *f,ULONGLONG start,ULONGLONG length,
+    ULONGLONG image_size,UCHAR *sector,winx_partition **list)
+{
+    winx_partition *p;
+    ULONGLONG visited[MBR_MAX_LOGICAL];
+    ULONGLONG ebr = start;
+    UCHAR *e;
+    int i, j;
+
+    for(i = 0; i < MBR_MAX_LOGICAL; i++){
+        for(j = 0; j < i; j++){
+            if(visited[j] == ebr){
+                etrace("EBR chain is looped at sector %I64u",ebr);
+                return;
+            }
+        }
+        visited[i] = ebr;
+        if(read_image(f,ebr * MBR_SECTOR_SIZE,sector,MBR_SECTOR_SIZE) < 0)
+            return;
+        if(get_u16(sector + MBR_SIGNATURE) != 0xAA55){
+            etrace("EBR at sector %I64u is damaged",ebr);
+            return;
+        }
+        e = sector + MBR_ENTRIES;
+        if(e[4]){
+            p = add_partition(list,MBR_FIRST_LOGICAL + i,
+                (ebr + get_u32(e + 8)) * MBR_SECTOR_SIZE,
+                (ULONGLONG)get_u32(e + 12) * MBR_SECTOR_SIZE,image_size);
+            if(p) p->type = e[4];
+        }
+        /* the next EBR is relative to the extended partition */
+        e += MBR_ENTRY_SIZE;
+        if(!is_extended(e[4]) || get_u32(e + 8) == 0)
+            return;
+        if(get_u32(e + 8) >= length){
+            etrace("EBR at sector %I64u is damaged",ebr);
+            return;
+        }
+        ebr = start + get_u32(e + 8);
+    }
+    etrace("EBR chain is too long");
+}
+
+/**
+ * @internal
+ * @brief Reads partitions of a disk image.
+ * @return List of partitions, NULL indicates
+ * failure or an image without partitions.
+ */
+static winx_partition *read_partitions(WINX_FILE *f,ULONGLONG image_size)
+{
+    winx_partition *list = NULL, *p;
+    UCHAR *sector, *e;
+    ULONGLONG extended = 0, extended_length = 0;
+    int i;
+
+    sector = winx_tmalloc(MBR_SECTOR_SIZE);
+    if(sector == NULL){
+        etrace("cannot allocate %u bytes of memory",MBR_SECTOR_SIZE);
+        return NULL;
+    }
+    if(image_size < MBR_SECTOR_SIZE || read_image(f,0,sector,MBR_SECTOR_SIZE) < 0)
+        goto done;
+    if(get_u16(sector + MBR_SIGNATURE) != 0xAA55){
+        itrace("no partition table found");
+        goto done;
+    }
+    for(i = 0; i < 4; i++){
+        e = sector + MBR_ENTRIES + i * MBR_ENTRY_SIZE;
+        if(e[4] == MBR_TYPE_GPT){
+            (void)read_gpt(f,image_size,&list);
+            goto done;
+        }
+    }
+    /* a boot sector of a volume has the same signature */
+    for(i = 0; i < 4; i++){
+        e = sector + MBR_ENTRIES + i * MBR_ENTRY_SIZE;
+        if(e[0] & 0x7F){
+            itrace("no valid partition table found");
+            goto done;
+        }
+    }
+    for(i = 0; i < 4; i++){
+        e = sector + MBR_ENTRIES + i * MBR_ENTRY_SIZE;
+        if(e[4] == 0)
+            continue;
+        if(is_extended(e[4])){
+            if(extended == 0){
+                extended = get_u32(e + 8);
+                extended_length = get_u32(e + 12);
+            }
+            continue;
+        }
+        p = add_partition(&list,i + 1,(ULONGLONG)get_u32(e + 8) * MBR_SECTOR_SIZE,
+            (ULONGLONG)get_u32(e + 12) * MBR_SECTOR_SIZE,image_size);
+        if(p) p->type = e[4];
+    }
+    if(extended)
+        read_ebr_chain(f,extended,extended_length,image_size,sector,&list);
+
+done:
+    winx_free(sector);
+    return list;
+}
+
+/**
+ * @internal
+ * @brief Opens a disk image for reading,
+ * virtual disks through their allocation tables.
+ */
+static WINX_FILE *open_disk(const wchar_t *path)
+{
+    if(winx_is_vdisk_path(path))
+        return winx_vdisk_fopen(path);
+    return winx_fopen(path,"r");
+}
+
+/*
+**************************************************************
+*                    Interface routines
+**************************************************************
+*/
+
+/**
+ * @brief Retrieves partitions of a disk image.
+ * @param[in] path the native path of the image.
+ * @return List of partitions in the order of
+ * the table, NULL indicates failure or an image
+ * without partitions. GPT tables are trusted only
+ * when their checksums are valid; the backup table
+ * gets used when the primary one is damaged.
+ * @note The list must be released by
+ * winx_release_partitions.
+ */
+winx_partition *winx_get_partitions(wchar_t *path)
+{
+    winx_partition *list;
+    WINX_FILE *f;
+
+    DbgCheck1(path,NULL);
+
+    f = open_disk(path);
+    if(f == NULL)
+        return NULL;
+    list = read_partitions(f,winx_fsize(f));
+    winx_fclose(f);
+    return list;
+}
+
+/**
+ * @brief Releases a list of partitions.
+ */
+void winx_release_partitions(winx_partition *list)
+{
+    winx_list_destroy((list_entry **)(void *)&list);
+}
+
+/**
+ * @brief Retrieves the partition number
+ * of a path like \\??\\C:\\disk.img#p2.
+ * @return The number, zero if the
+ * path has no partition suffix.
+ */
+int winx_get_partition_number(const wchar_t *path)
+{
+    const wchar_t *s;
+    int n = 0;
+
+    DbgCheck1(path,0);
+
+    s = wcsrchr(path,'#');
+    if(s == NULL || s[1] != 'p' || s[2] == 0)
+        return 0;
+    for(s += 2; *s; s++){
+        if(*s < '0' || *s > '9' || n > 9999)
+            return 0;
+        n = n * 10 + (*s - '0');
+    }
+    return n;
+}
+
+/**
+ * @brief Opens a partition of a disk image for reading.
+ * @param[in] path the native path of the image with
+ * the partition suffix, like \\??\\C:\\disk.img#p2.
+ * @return The partition opened as a regular file,
+ * its offsets and size relative to the partition.
+ * NULL indicates failure.
+ * @note winx_open_image calls it for paths
+ * with the partition suffix.
+ */
+WINX_FILE *winx_open_partition(const wchar_t *path)
+{
+    winx_partition *list, *p;
+    wchar_t *image;
+    WINX_FILE *f;
+    int n;
+
+    DbgCheck1(path,NULL);
+
+    n = winx_get_partition_number(path);
+    image = winx_wcsdup(path);
+    if(image == NULL){
+        etrace("cannot allocate memory for %ws",path);
+        return NULL;
+    }
+    *wcsrchr(image,'#') = 0;
+    f = open_disk(image);
+    if(f == NULL){
+        winx_free(image);
+        return NULL;
+    }
+    list = read_partitions(f,winx_fsize(f));
+    for(p = list; p; p = p->next){
+        if(p->number == n){
+            f->base.QuadPart = p->offset;
+            f->length = p->length;
+            f->roffset.QuadPart = 0;
+            break;
+        }
+        if(p->next == list){
+            p = NULL;
+            break;
+        }
+    }
+    if(p == NULL){
+        etrace("%ws has no partition %u",image,n);
+        winx_fclose(f);
+        f = NULL;
+    }
+    winx_release_partitions(list);
+    winx_free(image);
+    return f;
+}
+
+/**
+ * @brief Opens a volume or a disk image for reading.
+ * @param[in] path the native path of the volume,
+ * like \\??\\C:, or of the image file.
+ * @return The descriptor of the volume or image,
+ * NULL indicates failure.
+ * @details Unlike winx_fopen, a suffix like #p2
+ * selects a partition of the image, see
+ * winx_open_partition, and files named *.vhd
+ * and *.vhdx are read as virtual disks, see
+ * winx_vdisk_open. Scans of images and the
+ * image commands open them this way.
+ */
+WINX_FILE *winx_open_image(const wchar_t *path)
+{
+    DbgCheck1(path,NULL);
+
+    if(winx_get_partition_number(path))
+        return winx_open_partition(path);
+    return open_disk(path);
+}
+
+/** @} */
@@ -0,0 +1,517 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file regions.c
+ * @brief Sets of volume regions.
+ * @details Regions are kept in a red-black tree
+ * ordered by LCN, so adding and subtracting ranges
+ * of clusters takes logarithmic time instead of a
+ * walk through the list winx_add_volume_region
+ * and winx_sub_volume_region do. Regions never
+ * overlap nor touch each other: adjacent ones
+ * get merged, as in the lists. The lists are
+ * still there for compatibility, sets convert
+ * to them and back.
+ * @addtogroup Disks
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+struct _winx_region_set {
+    struct prb_table *tree;     /* regions ordered by LCN */
+    ULONGLONG clusters;         /* clusters in all the regions */
+};
+
+/*
+**************************************************************
+*                    Low level routines
+**************************************************************
+*/
+
+static int compare_regions(const void *prb_a, const void *prb_b, void *prb_param)
+{
+    const winx_volume_region *a = prb_a, *b = prb_b;
+
+    if(a->lcn < b->lcn) return (-1);
+    return (a->lcn == b->lcn) ? 0 : 1;
+}
+
+static void free_region(void *prb_item, void *prb_param)
+{
+    winx_free(prb_item);
+}
+
+/**
+ * @internal
+ * @brief Finds a region by its LCN.
+ * @param[in] lcn the logical cluster number.
+ * @param[in] after nonzero value to find the first
+ * region starting at lcn or after it, zero to find
+ * the last one starting at lcn or before it.
+ * @param[out] t the traverser set on the region.
+ * @return The region, NULL if there is none.
+ */
+static winx_volume_region *lookup(winx_region_set *s,ULONGLONG lcn,
+    int after,struct prb_traverser *t)
+{
+    struct prb_node *node, *found = NULL;
+    winx_volume_region *r;
+
+    for(node = s->tree->prb_root; node; ){
+        r = node->prb_data;
+        if(r->lcn == lcn){
+            found = node;
+            break;
+        }
+        if((r->lcn < lcn) != (after != 0))
+            found = node;
+        node = node->prb_link[r->lcn < lcn];
+    }
+    t->prb_table = s->tree;
+    t->prb_node = found;
+    return found ? found->prb_data : NULL;
+}
+
+/**
+ * @internal
+ * @brief Removes a region from the set.
+ */
+static void remove_region(winx_region_set *s,winx_volume_region *r)
+{
+    s->clusters -= r->length;
+    (void)prb_delete(s->tree,r);
+    winx_free(r);
+}
+
+/**
+ * @internal
+ * @brief Inserts a region to the set.
+ * @note The region must neither overlap
+ * nor touch the regions of the set.
+ */
+static void insert_region(winx_region_set *s,ULONGLONG lcn,ULONGLONG length)
+{
+    winx_volume_region *r;
+
+    r = winx_malloc(sizeof(winx_volume_region));
+    r->next = r->prev = NULL;
+    r->lcn = lcn;
+    r->length = length;
+    (void)prb_insert(s->tree,r);
+    s->clusters += length;
+}
+
+/*
+**************************************************************
+*                    Interface routines
+**************************************************************
+*/
+
+/**
+ * @brief Creates an empty set of volume regions.
+ * @return The set, NULL indicates failure.
+ */
+winx_region_set *winx_create_region_set(void)
+{
+    winx_region_set *s;
+
+    s = winx_malloc(sizeof(winx_region_set));
+    s->tree = prb_create(compare_regions,NULL,NULL);
+    if(s->tree == NULL){
+        etrace("cannot create the tree");
+        winx_free(s);
+        return NULL;
+    }
+    s->clusters = 0;
+    return s;
+}
+
+/**
+ * @brief Destroys a set of volume regions.
+ */
+void winx_destroy_region_set(winx_region_set *s)
+{
+    if(s == NULL)
+        return;
+    prb_destroy(s->tree,free_region);
+    winx_free(s);
+}
+
+/**
+ * @brief Adds a range of clusters to the set.
+ * @param[in] s the set.
+ * @param[in] lcn the logical cluster number
+ * of the range to be added.
+ * @param[in] length size of the range, in clusters.
+ * @details The range may overlap regions of the set,
+ * all of them get merged into one, as well as the
+ * regions it touches.
+ */
+void winx_region_set_add(winx_region_set *s,ULONGLONG lcn,ULONGLONG length)
+{
+    struct prb_traverser t;
+    winx_volume_region *r, *next;
+    ULONGLONG end;
+
+    if(s == NULL || length == 0)
+        return;
+
+    end = lcn + length;
+    r = lookup(s,lcn,0,&t);
+    if(r == NULL || r->lcn + r->length < lcn){
+        /* the range starts a new region */
+        insert_region(s,lcn,length);
+        r = lookup(s,lcn,0,&t);
+    } else if(r->lcn + r->length < end){
+        /* the range extends the region preceding it */
+        s->clusters += end - (r->lcn + r->length);
+        r->length = end - r->lcn;
+    } else {
+        /* the range is inside of the region */
+        return;
+    }
+
+    /* absorb the regions the range reaches */
+    while((next = prb_t_next(&t)) != NULL && next->lcn <= r->lcn + r->length){
+        if(next->lcn + next->length > r->lcn + r->length){
+            s->clusters += next->lcn + next->length - (r->lcn + r->length);
+            r->length = next->lcn + next->length - r->lcn;
+        }
+        remove_region(s,next);
+        (void)lookup(s,r->lcn,0,&t);
+    }
+}
+
+/**
+ * @brief Subtracts a range of clusters from the set.
+ * @param[in] s the set.
+ * @param[in] lcn the logical cluster number
+ * of the range to be subtracted.
+ * @param[in] length size of the range, in clusters.
+ * @details Regions get cut or split where
+ * the range covers them partially.
+ */
+void winx_region_set_sub(winx_region_set *s,ULONGLONG lcn,ULONGLONG length)
+{
+    struct prb_traverser t;
+    winx_volume_region *r;
+    ULONGLONG end, r_end;
+
+    if(s == NULL || length == 0)
+        return;
+
+    end = lcn + length;
+    r = lookup(s,lcn,0,&t);
+    if(r && r->lcn < lcn && r->lcn + r->length > lcn){
+        /* cut the right side of the region preceding the range */
+        r_end = r->lcn + r->length;
+        r->length = lcn - r->lcn;
+        s->clusters -= r_end - lcn;
+        if(r_end > end){
+            /* the range is inside of the region, keep its right side */
+            insert_region(s,end,r_end - end);
+            return;
+        }
+    }
+
+    /* the regions starting inside of the range */
+    while((r = lookup(s,lcn,1,&t)) != NULL && r->lcn < end){
+        r_end = r->lcn + r->length;
+        if(r_end <= end){
+            remove_region(s,r);
+            continue;
+        }
+        /* cut the left side; no region lies between lcn and end, so the order holds */
+        s->clusters -= end - r->lcn;
+        r->lcn = end;
+        r->length = r_end - end;
+        break;
+    }
+}
+
+/**
+ * @brief Finds the region containing a cluster.
+ * @return The region, NULL if the cluster
+ * isn't in the set. The region must not
+ * be changed but through the set.
+ */
+winx_volume_region *winx_region_set_find(winx_region_set *s,ULONGLONG lcn)
+{
+    struct prb_traverser t;
+    winx_volume_region *r;
+
+    DbgCheck1(s,NULL);
+
+    r = lookup(s,lcn,0,&t);
+    if(r && r->lcn + r->length > lcn)
+        return r;
+    return NULL;
+}
+
+/**
+ * @brief Retrieves the number of regions in the set.
+ */
+ULONGLONG winx_region_set_count(winx_region_set *s)
+{
+    DbgCheck1(s,0);
+    return prb_count(s->tree);
+}
+
+/**
+ * @brief Retrieves the number of clusters in the set.
+ */
+ULONGLONG winx_region_set_clusters(winx_region_set *s)
+{
+    DbgCheck1(s,0);
+    return s->clusters;
+}
+
+/**
+ * @brief Builds a set from a list of regions,
+ * like winx_get_free_volume_regions returns.
+ * @return The set, NULL indicates failure.
+ * @note The list remains intact.
+ */
+winx_region_set *winx_region_set_from_list(winx_volume_region *rlist)
+{
+    winx_region_set *s;
+    winx_volume_region *r;
+
+    s = winx_create_region_set();
+    if(s == NULL)
+        return NULL;
+    for(r = rlist; r; r = r->next){
+        winx_region_set_add(s,r->lcn,r->length);
+        if(r->next == rlist) break;
+    }
+    return s;
+}
+
+/**
+ * @brief Converts a set to a list of regions.
+ * @return The list ordered by LCN, to be released
+ * by winx_release_free_volume_regions. NULL is
+ * returned for empty sets.
+ */
+winx_volume_region *winx_region_set_to_list(winx_region_set *s)
+{
+    winx_volume_region *rlist = NULL, *r, *rgn;
+    struct prb_traverser t;
+
+    DbgCheck1(s,NULL);
+
+    for(r = prb_t_first(&t,s->tree); r; r = prb_t_next(&t)){
+        rgn = (winx_volume_region *)winx_list_insert((list_entry **)(void *)&rlist,
+            rlist ? (list_entry *)rlist->prev : NULL,sizeof(winx_volume_region));
+        rgn->lcn = r->lcn;
+        rgn->length = r->length;
+    }
+    return rlist;
+}
+
+/*
+**************************************************************
+*                    Benchmark
+**************************************************************
+*/
+
+/* operations a test makes */
+#define REGION_TEST_ADD 0
+#define REGION_TEST_SUB 1
+
+typedef struct _region_test_op {
+    ULONGLONG lcn;
+    ULONG length;
+    ULONG type;
+} region_test_op;
+
+/**
+ * @internal
+ * @brief Generates operations on regions
+ * of two clusters at every fourth cluster.
+ * @details Subtractions hit the regions,
+ * additions fill the gaps between them, each
+ * gap once at most, so they never overlap the
+ * set, as the lists demand. Gaps filled entirely
+ * merge their neighbours, subtractions cut
+ * or split the regions merged.
+ */
+static void generate_ops(region_test_op *ops,ULONG n_ops,ULONGLONG n,winx_rnd_state *r)
+{
+    ULONGLONG i, gaps = 0;
+    ULONG k;
+
+    for(k = 0; k < n_ops; k++){
+        if((winx_rnd(r) & 1) && gaps < n - 1){
+            /* 7919 is a prime, so gaps don't repeat */
+            i = (gaps++ * 7919) % (n - 1);
+            ops[k].type = REGION_TEST_ADD;
+            ops[k].lcn = i * 4 + 2;
+            ops[k].length = 1 + winx_rnd(r) % 2;
+        } else {
+            i = winx_rnd30(r) % n;
+            ops[k].type = REGION_TEST_SUB;
+            ops[k].lcn = i * 4 + winx_rnd(r) % 2;
+            ops[k].length = (ops[k].lcn & 1) ? 1 : 1 + winx_rnd(r) % 2;
+        }
+    }
+}
+
+/**
+ * @internal
+ * @brief Checks that regions of a set
+ * are ordered, neither overlap nor touch,
+ * and sum up to the clusters counted.
+ * @return Zero if they do.
+ */
+static int check_region_set(winx_region_set *s)
+{
+    struct prb_traverser t;
+    winx_volume_region *r, *prev = NULL;
+    ULONGLONG clusters = 0;
+
+    for(r = prb_t_first(&t,s->tree); r; r = prb_t_next(&t)){
+        if(r->length == 0) return (-1);
+        if(prev && prev->lcn + prev->length >= r->lcn) return (-1);
+        clusters += r->length;
+        prev = r;
+    }
+    return (clusters == s->clusters) ? 0 : (-1);
+}
+
+/**
+ * @internal
+ * @brief Compares a set with a list.
+ * @return Zero if they hold the same regions.
+ */
+static int compare_with_list(winx_region_set *s,winx_volume_region *rlist)
+{
+    struct prb_traverser t;
+    winx_volume_region *r, *l = rlist;
+
+    for(r = prb_t_first(&t,s->tree); r; r = prb_t_next(&t)){
+        if(l == NULL || l->lcn != r->lcn || l->length != r->length)
+            return (-1);
+        l = (l->next == rlist) ? NULL : l->next;
+    }
+    return (l == NULL) ? 0 : (-1);
+}
+
+/**
+ * @brief Compares sets of volume regions with
+ * the lists on random additions and subtractions
+ * and measures how both scale.
+ * @param[in] max_regions the size of the largest set;
+ * sets of 1000, 10000 and so on regions get tested
+ * up to this size.
+ * @param[in] n_ops the number of operations
+ * on each set.
+ * @param[in] seed the seed of the generator.
+ * @param[out] t the results.
+ * @return Zero for success, negative
+ * value indicates failure. Mismatches
+ * are counted in the results.
+ * @note Lists are tested up to the size of
+ * WINX_REGION_TEST_LIST_LIMIT regions, since
+ * each operation walks them from the head.
+ */
+int winx_test_region_set(ULONGLONG max_regions,ULONG n_ops,
+    ULONG seed,winx_region_set_test *t)
+{
+    winx_region_set *s;
+    winx_volume_region *rlist, *r;
+    region_test_op *ops;
+    winx_rnd_state rnd;
+    ULONGLONG n, i, time;
+    ULONG k, level;
+
+    DbgCheck1(t,-1);
+
+    memset(t,0,sizeof(winx_region_set_test));
+    winx_bench_init(&t->b);
+    if(max_regions == 0) max_regions = WINX_REGION_TEST_DEFAULT_REGIONS;
+    if(n_ops == 0) n_ops = WINX_REGION_TEST_DEFAULT_OPS;
+
+    ops = winx_tmalloc(n_ops * sizeof(region_test_op));
+    if(ops == NULL){
+        etrace("cannot allocate %u bytes of memory",n_ops * sizeof(region_test_op));
+        return (-1);
+    }
+    winx_rnd_init(&rnd,seed);
+
+    for(level = 0, n = 1000; level < WINX_BENCH_LEVELS && n <= max_regions; level++, n *= 10){
+        t->b.level[level] = n;
+        t->b.items[level] = n_ops;
+        generate_ops(ops,n_ops,n,&rnd);
+
+        /* regions of two clusters at every fourth cluster */
+        time = winx_xtime();
+        s = winx_create_region_set();
+        if(s == NULL) break;
+        for(i = 0; i < n; i++)
+            winx_region_set_add(s,i * 4,2);
+        t->build_time[level] = winx_xtime() - time;
+
+        time = winx_xtime();
+        for(k = 0; k < n_ops; k++){
+            if(ops[k].type == REGION_TEST_ADD)
+                winx_region_set_add(s,ops[k].lcn,ops[k].length);
+            else
+                winx_region_set_sub(s,ops[k].lcn,ops[k].length);
+        }
+        t->b.time[level] = winx_xtime() - time;
+        if(check_region_set(s) < 0){
+            etrace("set of %I64u regions is broken",n);
+            t->b.mismatches ++;
+        }
+
+        if(n <= WINX_REGION_TEST_LIST_LIMIT){
+            rlist = NULL;
+            for(i = 0; i < n; i++){
+                r = (winx_volume_region *)winx_list_insert((list_entry **)(void *)&rlist,
+                    rlist ? (list_entry *)rlist->prev : NULL,sizeof(winx_volume_region));
+                r->lcn = i * 4;
+                r->length = 2;
+            }
+            time = winx_xtime();
+            for(k = 0; k < n_ops; k++){
+                if(ops[k].type == REGION_TEST_ADD)
+                    rlist = winx_add_volume_region(rlist,ops[k].lcn,ops[k].length);
+                else
+                    rlist = winx_sub_volume_region(rlist,ops[k].lcn,ops[k].length);
+            }
+            t->b.reference_time[level] = winx_xtime() - time;
+            if(compare_with_list(s,rlist) < 0){
+                etrace("set and list of %I64u regions differ",n);
+                t->b.mismatches ++;
+            }
+            winx_release_free_volume_regions(rlist);
+        }
+        t->b.levels = level + 1;
+        winx_destroy_region_set(s);
+    }
+
+    winx_free(ops);
+    return 0;
+}
+
+/** @} */
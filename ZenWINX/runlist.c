@@ -0,0 +1,347 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file runlist.c
+ * @brief NTFS mapping pairs decoding.
+ * @details Each mapping pair starts by a header
+ * byte holding sizes of the run length and of the
+ * LCN offset. Both fields are fetched by unaligned
+ * 64-bit loads, then cut by a table of masks; the
+ * LCN offset is sign extended by a table of sign
+ * bits, so the decoder has no per-byte loops.
+ * Runs are decoded in batches to arrays of
+ * (vcn, lcn, length) triplets.
+ *
+ * The byte by byte decoder used before is kept
+ * as the reference for winx_test_run_decoder,
+ * which compares both decoders on random mapping
+ * pairs and measures their speed.
+ * @addtogroup RunList
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+static const ULONGLONG run_mask[9] = {
+    0x0000000000000000, 0x00000000000000FF, 0x000000000000FFFF,
+    0x0000000000FFFFFF, 0x00000000FFFFFFFF, 0x000000FFFFFFFFFF,
+    0x0000FFFFFFFFFFFF, 0x00FFFFFFFFFFFFFF, 0xFFFFFFFFFFFFFFFF
+};
+
+static const ULONGLONG run_sign[9] = {
+    0x0000000000000000, 0x0000000000000080, 0x0000000000008000,
+    0x0000000000800000, 0x0000000080000000, 0x0000008000000000,
+    0x0000800000000000, 0x0080000000000000, 0x8000000000000000
+};
+
+/**
+ * @internal
+ * @brief Loads 64 bits from any address.
+ * @note The compiler turns it to a single load.
+ */
+static ULONGLONG load64(const unsigned char *p)
+{
+    ULONGLONG v;
+
+    memcpy(&v,p,sizeof(ULONGLONG));
+    return v;
+}
+
+/**
+ * @brief Prepares decoding of a mapping pairs array.
+ * @param[out] d the decoder state.
+ * @param[in] pairs the mapping pairs array.
+ * @param[in] end the end of the attribute holding
+ * the array; the decoder never reads beyond it.
+ * @param[in] low_vcn the first VCN mapped by the array.
+ */
+void winx_run_decoder_init(winx_run_decoder *d,
+    const void *pairs,const void *end,ULONGLONG low_vcn)
+{
+    d->p = (const unsigned char *)pairs;
+    d->end = (const unsigned char *)end;
+    d->vcn = low_vcn;
+    d->lcn = 0;
+    d->corrupted = 0;
+}
+
+/**
+ * @brief Decodes the next batch of runs.
+ * @param[in,out] d the decoder state.
+ * @param[out] runs the array receiving the runs.
+ * Virtual runs get WINX_RUN_SPARSE instead of LCN.
+ * @param[in] n the length of the array.
+ * @return The number of runs decoded, zero
+ * indicates the end of the array. The corrupted
+ * field of the state is set when the array has
+ * been cut by a malformed mapping pair.
+ */
+ULONG winx_decode_runs(winx_run_decoder *d,winx_run *runs,ULONG n)
+{
+    const unsigned char *p = d->p;
+    unsigned char tail[16];
+    ULONGLONG length, delta;
+    ULONG i, n1, n2;
+
+    for(i = 0; i < n; i++){
+        if(p >= d->end || *p == 0)
+            break;
+        n1 = *p & 0xf;
+        n2 = *p >> 4;
+        if(n1 > 8 || n2 > 8 || (ULONG)(d->end - p) < n1 + n2 + 1){
+            d->corrupted = 1;
+            break;
+        }
+        if(d->end - p > 16){
+            length = load64(p + 1);
+            delta = load64(p + 1 + n1);
+        } else {
+            /* the last pairs of the attribute */
+            memset(tail,0,sizeof(tail));
+            memcpy(tail,p + 1,n1 + n2);
+            length = load64(tail);
+            delta = load64(tail + n1);
+        }
+        length &= run_mask[n1];
+        delta = ((delta & run_mask[n2]) ^ run_sign[n2]) - run_sign[n2];
+        runs[i].vcn = d->vcn;
+        runs[i].length = length;
+        if(delta){
+            d->lcn += delta;
+            runs[i].lcn = d->lcn;
+        } else {
+            runs[i].lcn = WINX_RUN_SPARSE;
+        }
+        d->vcn += length;
+        p += n1 + n2 + 1;
+    }
+    d->p = p;
+    return i;
+}
+
+/*
+**************************************************
+*       The reference decoder and the test
+**************************************************
+*/
+
+#define RUN_TEST_STRIDE   4096 /* bytes reserved for each array */
+#define RUN_TEST_MAX_RUNS 200
+#define RUN_TEST_PADDING  32   /* the reference decoder may read that far */
+#define RUN_TEST_BATCH    32
+
+static ULONG RunLength(PUCHAR run)
+{
+    return (*run & 0xf) + ((*run >> 4) & 0xf) + 1;
+}
+
+static LONGLONG RunLCN(PUCHAR run)
+{
+    LONG i;
+    UCHAR n1 = *run & 0xf;
+    UCHAR n2 = (*run >> 4) & 0xf;
+    LONGLONG lcn = (n2 == 0) ? 0 : (LONGLONG)(((signed char *)run)[n1 + n2]);
+
+    for(i = n1 + n2 - 1; i > n1; i--)
+        lcn = (lcn << 8) + run[i];
+    return lcn;
+}
+
+static ULONGLONG RunCount(PUCHAR run)
+{
+    ULONG i;
+    UCHAR n = *run & 0xf;
+    ULONGLONG count = 0;
+
+    for(i = n; i > 0; i--)
+        count = (count << 8) + run[i];
+    return count;
+}
+
+/**
+ * @internal
+ * @brief Decodes runs like the NTFS scanner did.
+ * @details Stops at a pair having fields longer
+ * than 8 bytes, since the new decoder does so.
+ * @return The number of runs decoded.
+ */
+static ULONG reference_decode(PUCHAR run,winx_run *runs,ULONG n)
+{
+    ULONGLONG lcn = 0, vcn = 0, length;
+    ULONG i;
+
+    for(i = 0; *run && i < n; i++){
+        if((*run & 0xf) > 8 || (*run >> 4) > 8)
+            break;
+        lcn += RunLCN(run);
+        length = RunCount(run);
+        runs[i].vcn = vcn;
+        runs[i].lcn = RunLCN(run) ? lcn : WINX_RUN_SPARSE;
+        runs[i].length = length;
+        run += RunLength(run);
+        vcn += length;
+    }
+    return i;
+}
+
+/**
+ * @internal
+ * @brief Fills a field of a mapping pair.
+ * @details Small values prevail, like in
+ * real volumes; full width ones are rare.
+ */
+static ULONG put_random_field(PUCHAR p,ULONG max_size,winx_rnd_state *r)
+{
+    ULONG size, i;
+
+    size = winx_rnd(r) % 16;
+    size = (size < 8) ? 1 + size / 4 : (size < 15) ? 3 + size % 3 : max_size;
+    if(size > max_size)
+        size = max_size;
+    for(i = 0; i < size; i++)
+        p[i] = (UCHAR)winx_rnd(r);
+    return size;
+}
+
+/**
+ * @internal
+ * @brief Generates a random mapping pairs array.
+ * @details One array of sixteen gets a malformed
+ * pair, one run of ten is virtual.
+ */
+static void generate_pairs(PUCHAR p,winx_rnd_state *r)
+{
+    PUCHAR last = p;
+    ULONG n, i, n1, n2;
+
+    n = 1 + winx_rnd(r) % RUN_TEST_MAX_RUNS;
+    for(i = 0; i < n; i++){
+        n1 = put_random_field(p + 1,8,r);
+        if(p[n1] == 0) p[n1] = 1; /* keep the length nonzero */
+        n2 = (winx_rnd(r) % 10 == 0) ? 0 : put_random_field(p + 1 + n1,8,r);
+        p[0] = (UCHAR)((n2 << 4) | n1);
+        if(winx_rnd(r) % n == 0) last = p;
+        p += n1 + n2 + 1;
+    }
+    memset(p,0,RUN_TEST_PADDING);
+    if(winx_rnd(r) % 16 == 0){
+        /* the LCN offset is too long */
+        last[0] = (UCHAR)(0x90 | (last[0] & 0xf));
+    }
+}
+
+/**
+ * @brief Compares the batched decoder of mapping
+ * pairs with the byte by byte one and measures
+ * their speed.
+ * @param[in] n_arrays the number of random
+ * mapping pairs arrays to generate.
+ * @param[in] passes how many times each
+ * decoder decodes all the arrays.
+ * @param[in] seed the seed of the generator.
+ * @param[out] t the results.
+ * @return Zero for success, negative
+ * value indicates failure. Mismatches
+ * are counted in the results.
+ */
+int winx_test_run_decoder(ULONG n_arrays,ULONG passes,
+    ULONG seed,winx_run_decoder_test *t)
+{
+    winx_run_decoder d;
+    winx_run *expected, *runs;
+    winx_rnd_state r;
+    PUCHAR arrays, p;
+    ULONGLONG time, sum = 0;
+    ULONG i, j, k, n, m, pass;
+
+    DbgCheck1(t,-1);
+
+    memset(t,0,sizeof(winx_run_decoder_test));
+    winx_bench_init(&t->b);
+    if(n_arrays == 0) n_arrays = WINX_RUN_TEST_DEFAULT_ARRAYS;
+    if(passes == 0) passes = WINX_RUN_TEST_DEFAULT_PASSES;
+
+    arrays = winx_tmalloc((size_t)n_arrays * RUN_TEST_STRIDE);
+    expected = winx_tmalloc((RUN_TEST_MAX_RUNS + 1) * sizeof(winx_run));
+    runs = winx_tmalloc((RUN_TEST_MAX_RUNS + RUN_TEST_BATCH) * sizeof(winx_run));
+    if(arrays == NULL || expected == NULL || runs == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (ULONGLONG)n_arrays * RUN_TEST_STRIDE);
+        winx_free(arrays);
+        winx_free(expected);
+        winx_free(runs);
+        return (-1);
+    }
+
+    winx_rnd_init(&r,seed);
+    for(i = 0; i < n_arrays; i++)
+        generate_pairs(arrays + (size_t)i * RUN_TEST_STRIDE,&r);
+    t->b.levels = 1;
+    t->b.level[0] = n_arrays;
+
+    /* differential check */
+    for(i = 0; i < n_arrays; i++){
+        p = arrays + (size_t)i * RUN_TEST_STRIDE;
+        n = reference_decode(p,expected,RUN_TEST_MAX_RUNS + 1);
+        winx_run_decoder_init(&d,p,p + RUN_TEST_STRIDE,0);
+        for(m = 0; (k = winx_decode_runs(&d,runs + m,RUN_TEST_BATCH)) != 0; m += k){}
+        if(d.corrupted) t->corrupted ++;
+        t->b.items[0] += m;
+        if(m != n || memcmp(runs,expected,n * sizeof(winx_run)) != 0){
+            etrace("decoders disagree on array %u: %u runs vs %u",i,m,n);
+            t->b.mismatches ++;
+        }
+    }
+
+    /* the byte by byte decoder */
+    time = winx_xtime();
+    for(pass = 0; pass < passes; pass++){
+        for(i = 0; i < n_arrays; i++){
+            n = reference_decode(arrays + (size_t)i * RUN_TEST_STRIDE,
+                expected,RUN_TEST_MAX_RUNS + 1);
+            for(j = 0; j < n; j++) sum += expected[j].lcn;
+        }
+    }
+    t->b.reference_time[0] = winx_xtime() - time;
+
+    /* the batched decoder */
+    time = winx_xtime();
+    for(pass = 0; pass < passes; pass++){
+        for(i = 0; i < n_arrays; i++){
+            p = arrays + (size_t)i * RUN_TEST_STRIDE;
+            winx_run_decoder_init(&d,p,p + RUN_TEST_STRIDE,0);
+            while((k = winx_decode_runs(&d,runs,RUN_TEST_BATCH)) != 0){
+                for(j = 0; j < k; j++) sum -= runs[j].lcn;
+            }
+        }
+    }
+    t->b.time[0] = winx_xtime() - time;
+
+    /* both decoders sum up the same values */
+    if(sum != 0) t->b.mismatches ++;
+
+    winx_free(arrays);
+    winx_free(expected);
+    winx_free(runs);
+    return 0;
+}
+
+/** @} */
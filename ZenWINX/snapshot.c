@@ -0,0 +1,652 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file snapshot.c
+ * @brief Scan results persistence.
+ * @details A snapshot consists of a header followed
+ * by a sequence of sections. Each section starts by
+ * its tag and size, so unknown sections get skipped
+ * on load and new ones may be added freely.
+ * @addtogroup Snapshot
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+#define SNAPSHOT_MAGIC       "NAOHSCAN"
+#define SNAPSHOT_VERSION     1
+#define SNAPSHOT_BUFFER_SIZE (1024 * 1024)
+
+/* section tags */
+#define SNAPSHOT_FILES       1
+#define SNAPSHOT_CLUSTER_MAP 2
+#define SNAPSHOT_MFT_STATE   3
+#define SNAPSHOT_NAME_INDEX  4
+
+typedef struct _snapshot_header {
+    char magic[8];
+    ULONG version;
+    ULONG volume_letter;
+    ULONGLONG bytes_per_cluster;
+    ULONGLONG n_sections;
+} snapshot_header;
+
+typedef struct _snapshot_section {
+    ULONG tag;
+    ULONG reserved;
+    ULONGLONG size; /* excluding the section header */
+} snapshot_section;
+
+typedef struct _snapshot_file {
+    ULONG flags;
+    ULONG name_length;  /* in characters, without terminal zero */
+    ULONG path_length;  /* in characters, without terminal zero */
+    ULONG n_blocks;
+    ULONGLONG BaseMftId;
+    ULONGLONG ParentDirectoryMftId;
+    ULONGLONG creation_time;
+    ULONGLONG last_modification_time;
+    ULONGLONG last_access_time;
+    ULONGLONG clusters;
+    ULONGLONG fragments;
+    ULONG SequenceNumber;
+    ULONG reserved;
+    ULONGLONG size;
+    /* name, path and blocks follow */
+} snapshot_file;
+
+typedef struct _snapshot_block {
+    ULONGLONG vcn;
+    ULONGLONG lcn;
+    ULONGLONG length;
+} snapshot_block;
+
+typedef struct _snapshot_extent {
+    ULONGLONG lcn;
+    ULONGLONG length;
+    ULONGLONG vcn;
+    ULONGLONG file; /* index of the file in the files section */
+} snapshot_extent;
+
+typedef struct _snapshot_name_index {
+    ULONG bucket_bits;
+    ULONG block_size;
+    ULONGLONG n_files;
+    ULONGLONG n_postings;
+    /* offsets and postings follow */
+} snapshot_name_index;
+
+typedef struct _snapshot_reader {
+    char *p;
+    size_t left;
+} snapshot_reader;
+
+/* internal cluster map routines */
+winx_cluster_map *cluster_map_alloc(ULONGLONG n_extents);
+void cluster_map_complete(winx_cluster_map *m);
+
+/* internal name index routines */
+winx_name_index *name_index_alloc(ULONG bucket_bits,ULONG block_size,
+    ULONGLONG n_files,ULONGLONG n_postings);
+
+/*
+**************************************************
+*                    Saving
+**************************************************
+*/
+
+static int snapshot_write(WINX_FILE *f,const void *data,size_t size)
+{
+    if(size == 0)
+        return 0;
+    if(winx_fwrite(data,1,size,f) != size)
+        return (-1);
+    return 0;
+}
+
+static int save_files(WINX_FILE *f,winx_file_info *filelist,ULONGLONG *n_files)
+{
+    snapshot_section s;
+    snapshot_file sf;
+    snapshot_block sb;
+    winx_file_info *file;
+    winx_blockmap *b;
+    ULONGLONG n = 0, size = sizeof(ULONGLONG);
+
+    /* calculate the size of the section */
+    for(file = filelist; file; file = file->next){
+        size += sizeof(snapshot_file);
+        if(file->name) size += wcslen(file->name) * sizeof(wchar_t);
+        if(file->path) size += wcslen(file->path) * sizeof(wchar_t);
+        for(b = file->disp.blockmap; b; b = b->next){
+            size += sizeof(snapshot_block);
+            if(b->next == file->disp.blockmap) break;
+        }
+        n ++;
+        if(file->next == filelist) break;
+    }
+
+    s.tag = SNAPSHOT_FILES;
+    s.reserved = 0;
+    s.size = size;
+    if(snapshot_write(f,&s,sizeof(s)) < 0) return (-1);
+    if(snapshot_write(f,&n,sizeof(n)) < 0) return (-1);
+
+    for(file = filelist; file; file = file->next){
+        memset(&sf,0,sizeof(sf));
+        sf.flags = file->flags;
+        sf.name_length = file->name ? (ULONG)wcslen(file->name) : 0;
+        sf.path_length = file->path ? (ULONG)wcslen(file->path) : 0;
+        for(b = file->disp.blockmap; b; b = b->next){
+            sf.n_blocks ++;
+            if(b->next == file->disp.blockmap) break;
+        }
+        sf.BaseMftId = file->internal.BaseMftId;
+        sf.ParentDirectoryMftId = file->internal.ParentDirectoryMftId;
+        sf.creation_time = file->creation_time;
+        sf.last_modification_time = file->last_modification_time;
+        sf.last_access_time = file->last_access_time;
+        sf.clusters = file->disp.clusters;
+        sf.fragments = file->disp.fragments;
+        sf.SequenceNumber = file->internal.SequenceNumber;
+        sf.size = file->disp.size;
+        if(snapshot_write(f,&sf,sizeof(sf)) < 0) return (-1);
+        if(snapshot_write(f,file->name,sf.name_length * sizeof(wchar_t)) < 0) return (-1);
+        if(snapshot_write(f,file->path,sf.path_length * sizeof(wchar_t)) < 0) return (-1);
+        for(b = file->disp.blockmap; b; b = b->next){
+            sb.vcn = b->vcn;
+            sb.lcn = b->lcn;
+            sb.length = b->length;
+            if(snapshot_write(f,&sb,sizeof(sb)) < 0) return (-1);
+            if(b->next == file->disp.blockmap) break;
+        }
+        if(file->next == filelist) break;
+    }
+
+    *n_files = n;
+    return 0;
+}
+
+static int save_cluster_map(WINX_FILE *f,winx_file_info *filelist,
+    winx_cluster_map *m,ULONGLONG n_files)
+{
+    snapshot_section s;
+    snapshot_extent se;
+    winx_file_info *file;
+    ULONG *saved_flags;
+    ULONGLONG i;
+    int result = 0;
+
+    /*
+    * Files get identified by their indices in the files
+    * section. To avoid a lookup table we temporarily keep
+    * the indices in the user defined flags of the files.
+    */
+    saved_flags = winx_tmalloc((size_t)(n_files * sizeof(ULONG)) + 1);
+    if(saved_flags == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            n_files * sizeof(ULONG));
+        return (-1);
+    }
+    i = 0;
+    for(file = filelist; file; file = file->next){
+        saved_flags[i] = file->user_defined_flags;
+        file->user_defined_flags = (ULONG)i;
+        i ++;
+        if(file->next == filelist) break;
+    }
+
+    s.tag = SNAPSHOT_CLUSTER_MAP;
+    s.reserved = 0;
+    s.size = sizeof(ULONGLONG) + m->n_extents * sizeof(snapshot_extent);
+    if(snapshot_write(f,&s,sizeof(s)) < 0 || \
+      snapshot_write(f,&m->n_extents,sizeof(ULONGLONG)) < 0){
+        result = -1;
+    } else {
+        for(i = 0; i < m->n_extents; i++){
+            se.lcn = m->extents[i].lcn;
+            se.length = m->extents[i].length;
+            se.vcn = m->extents[i].vcn;
+            se.file = m->extents[i].f->user_defined_flags;
+            if(snapshot_write(f,&se,sizeof(se)) < 0){
+                result = -1;
+                break;
+            }
+        }
+    }
+
+    /* restore the user defined flags */
+    i = 0;
+    for(file = filelist; file; file = file->next){
+        file->user_defined_flags = saved_flags[i];
+        i ++;
+        if(file->next == filelist) break;
+    }
+    winx_free(saved_flags);
+    return result;
+}
+
+/* LSNs follow the number of records, then sequence numbers */
+static int save_mft_state(WINX_FILE *f,winx_mft_state *state)
+{
+    snapshot_section s;
+    size_t n = (size_t)state->n_records;
+
+    s.tag = SNAPSHOT_MFT_STATE;
+    s.reserved = 0;
+    s.size = sizeof(ULONGLONG) + state->n_records * (sizeof(ULONGLONG) + sizeof(USHORT));
+    if(snapshot_write(f,&s,sizeof(s)) < 0 || \
+      snapshot_write(f,&state->n_records,sizeof(ULONGLONG)) < 0 || \
+      snapshot_write(f,state->lsn,n * sizeof(ULONGLONG)) < 0 || \
+      snapshot_write(f,state->seq,n * sizeof(USHORT)) < 0)
+        return (-1);
+    return 0;
+}
+
+/* files of the index are in order of the files section */
+static int save_name_index(WINX_FILE *f,winx_name_index *ni)
+{
+    snapshot_section s;
+    snapshot_name_index sn;
+    size_t n_offsets = ((size_t)1 << ni->bucket_bits) + 1;
+
+    s.tag = SNAPSHOT_NAME_INDEX;
+    s.reserved = 0;
+    s.size = sizeof(sn) + n_offsets * sizeof(ULONGLONG) + ni->n_postings * sizeof(ULONG);
+    sn.bucket_bits = ni->bucket_bits;
+    sn.block_size = ni->block_size;
+    sn.n_files = ni->n_files;
+    sn.n_postings = ni->n_postings;
+    if(snapshot_write(f,&s,sizeof(s)) < 0 || \
+      snapshot_write(f,&sn,sizeof(sn)) < 0 || \
+      snapshot_write(f,ni->offsets,n_offsets * sizeof(ULONGLONG)) < 0 || \
+      snapshot_write(f,ni->postings,(size_t)(ni->n_postings * sizeof(ULONG))) < 0)
+        return (-1);
+    return 0;
+}
+
+/**
+ * @brief Saves scan results to a file.
+ * @param[in] filename the native path of the file.
+ * @param[in] r the scan results; the cluster
+ * map, the name index and headers of the file
+ * records are saved too when they're present.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+int winx_save_scan_results(const wchar_t *filename,winx_scan_results *r)
+{
+    WINX_FILE *f;
+    snapshot_header h;
+    ULONGLONG n_files = 0;
+    int result;
+
+    DbgCheck2(filename,r,-1);
+
+    f = winx_fbopen(filename,"w",SNAPSHOT_BUFFER_SIZE);
+    if(f == NULL)
+        return (-1);
+
+    memset(&h,0,sizeof(h));
+    memcpy(h.magic,SNAPSHOT_MAGIC,sizeof(h.magic));
+    h.version = SNAPSHOT_VERSION;
+    h.volume_letter = (ULONG)(unsigned char)r->volume_letter;
+    h.bytes_per_cluster = r->bytes_per_cluster;
+    h.n_sections = 1;
+    if(r->cmap) h.n_sections ++;
+    if(r->mft) h.n_sections ++;
+    if(r->names) h.n_sections ++;
+
+    result = snapshot_write(f,&h,sizeof(h));
+    if(result == 0)
+        result = save_files(f,r->filelist,&n_files);
+    if(result == 0 && r->cmap)
+        result = save_cluster_map(f,r->filelist,r->cmap,n_files);
+    if(result == 0 && r->mft)
+        result = save_mft_state(f,r->mft);
+    if(result == 0 && r->names)
+        result = save_name_index(f,r->names);
+    if(result < 0)
+        etrace("cannot write %ws",filename);
+
+    winx_fclose(f);
+    return result;
+}
+
+/*
+**************************************************
+*                    Loading
+**************************************************
+*/
+
+static int snapshot_read(snapshot_reader *rd,void *data,size_t size)
+{
+    if(size > rd->left){
+        etrace("unexpected end of snapshot");
+        return (-1);
+    }
+    if(data) memcpy(data,rd->p,size);
+    rd->p += size;
+    rd->left -= size;
+    return 0;
+}
+
+static wchar_t *snapshot_read_string(snapshot_reader *rd,ULONG length)
+{
+    wchar_t *s;
+
+    if(length == 0)
+        return NULL;
+    s = winx_tmalloc((length + 1) * sizeof(wchar_t));
+    if(s == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            (length + 1) * sizeof(wchar_t));
+        return NULL;
+    }
+    if(snapshot_read(rd,s,length * sizeof(wchar_t)) < 0){
+        winx_free(s);
+        return NULL;
+    }
+    s[length] = 0;
+    return s;
+}
+
+static int load_files(snapshot_reader *rd,winx_scan_results *r,
+    winx_file_info ***files,ULONGLONG *n_files)
+{
+    snapshot_file sf;
+    snapshot_block sb;
+    winx_file_info *f;
+    winx_blockmap *b;
+    ULONGLONG n, i;
+    ULONG j;
+
+    if(snapshot_read(rd,&n,sizeof(n)) < 0)
+        return (-1);
+    if(n > rd->left / sizeof(snapshot_file)){
+        etrace("invalid number of files: %I64u",n);
+        return (-1);
+    }
+
+    *files = winx_tmalloc((size_t)(n * sizeof(winx_file_info *)) + 1);
+    if(*files == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            n * sizeof(winx_file_info *));
+        return (-1);
+    }
+    *n_files = n;
+
+    for(i = 0; i < n; i++){
+        if(snapshot_read(rd,&sf,sizeof(sf)) < 0)
+            return (-1);
+        f = (winx_file_info *)winx_list_insert((list_entry **)(void *)&r->filelist,
+            r->filelist ? (list_entry *)r->filelist->prev : NULL,sizeof(winx_file_info));
+        f->name = f->path = NULL;
+        f->reparse_tag = 0;
+        f->reparse_target = NULL;
+        f->user_defined_flags = 0;
+        f->disp.blockmap = NULL;
+        (*files)[i] = f;
+
+        f->flags = sf.flags;
+        f->internal.BaseMftId = sf.BaseMftId;
+        f->internal.ParentDirectoryMftId = sf.ParentDirectoryMftId;
+        f->internal.SequenceNumber = sf.SequenceNumber;
+        f->creation_time = sf.creation_time;
+        f->last_modification_time = sf.last_modification_time;
+        f->last_access_time = sf.last_access_time;
+        f->disp.clusters = sf.clusters;
+        f->disp.fragments = sf.fragments;
+        f->disp.size = sf.size;
+
+        f->name = snapshot_read_string(rd,sf.name_length);
+        if(f->name == NULL && sf.name_length) return (-1);
+        f->path = snapshot_read_string(rd,sf.path_length);
+        if(f->path == NULL && sf.path_length) return (-1);
+
+        for(j = 0; j < sf.n_blocks; j++){
+            if(snapshot_read(rd,&sb,sizeof(sb)) < 0)
+                return (-1);
+            b = (winx_blockmap *)winx_list_insert((list_entry **)(void *)&f->disp.blockmap,
+                f->disp.blockmap ? (list_entry *)f->disp.blockmap->prev : NULL,
+                sizeof(winx_blockmap));
+            b->vcn = sb.vcn;
+            b->lcn = sb.lcn;
+            b->length = sb.length;
+        }
+    }
+    return 0;
+}
+
+static int load_cluster_map(snapshot_reader *rd,winx_scan_results *r,
+    winx_file_info **files,ULONGLONG n_files)
+{
+    snapshot_extent se;
+    ULONGLONG n, i;
+
+    if(snapshot_read(rd,&n,sizeof(n)) < 0)
+        return (-1);
+    if(n > rd->left / sizeof(snapshot_extent)){
+        etrace("invalid number of extents: %I64u",n);
+        return (-1);
+    }
+
+    r->cmap = cluster_map_alloc(n);
+    if(r->cmap == NULL)
+        return (-1);
+
+    for(i = 0; i < n; i++){
+        (void)snapshot_read(rd,&se,sizeof(se));
+        if(se.file >= n_files){
+            etrace("invalid file index: %I64u",se.file);
+            return (-1);
+        }
+        r->cmap->extents[i].lcn = se.lcn;
+        r->cmap->extents[i].length = se.length;
+        r->cmap->extents[i].vcn = se.vcn;
+        r->cmap->extents[i].f = files[se.file];
+    }
+    cluster_map_complete(r->cmap);
+    return 0;
+}
+
+static int load_mft_state(snapshot_reader *rd,winx_scan_results *r)
+{
+    ULONGLONG n;
+
+    if(snapshot_read(rd,&n,sizeof(n)) < 0)
+        return (-1);
+    if(n > rd->left / (sizeof(ULONGLONG) + sizeof(USHORT))){
+        etrace("invalid number of file records: %I64u",n);
+        return (-1);
+    }
+
+    r->mft = winx_tmalloc(sizeof(winx_mft_state));
+    if(r->mft == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sizeof(winx_mft_state));
+        return (-1);
+    }
+    memset(r->mft,0,sizeof(winx_mft_state));
+    r->mft->lsn = winx_tmalloc((size_t)(n * sizeof(ULONGLONG)) + 1);
+    r->mft->seq = winx_tmalloc((size_t)(n * sizeof(USHORT)) + 1);
+    if(r->mft->lsn == NULL || r->mft->seq == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            n * (sizeof(ULONGLONG) + sizeof(USHORT)));
+        return (-1);
+    }
+    (void)snapshot_read(rd,r->mft->lsn,(size_t)(n * sizeof(ULONGLONG)));
+    (void)snapshot_read(rd,r->mft->seq,(size_t)(n * sizeof(USHORT)));
+    r->mft->n_records = n;
+    return 0;
+}
+
+static int load_name_index(snapshot_reader *rd,winx_scan_results *r,
+    winx_file_info **files,ULONGLONG n_files)
+{
+    snapshot_name_index sn;
+    size_t n_offsets;
+    ULONGLONG i;
+
+    if(snapshot_read(rd,&sn,sizeof(sn)) < 0)
+        return (-1);
+    if(sn.n_files != n_files || sn.bucket_bits > 30 || sn.block_size == 0){
+        etrace("invalid name index");
+        return (-1);
+    }
+    n_offsets = ((size_t)1 << sn.bucket_bits) + 1;
+    if(n_offsets > rd->left / sizeof(ULONGLONG) || \
+      sn.n_postings > (rd->left - n_offsets * sizeof(ULONGLONG)) / sizeof(ULONG)){
+        etrace("invalid name index size");
+        return (-1);
+    }
+
+    r->names = name_index_alloc(sn.bucket_bits,sn.block_size,sn.n_files,sn.n_postings);
+    if(r->names == NULL)
+        return (-1);
+    (void)snapshot_read(rd,r->names->offsets,n_offsets * sizeof(ULONGLONG));
+    (void)snapshot_read(rd,r->names->postings,(size_t)(sn.n_postings * sizeof(ULONG)));
+    for(i = 0; i < n_files; i++)
+        r->names->files[i] = files[i];
+
+    /* the lists must stay inside the array */
+    for(i = 1; i < n_offsets; i++){
+        if(r->names->offsets[i] < r->names->offsets[i - 1] || \
+          r->names->offsets[i] > sn.n_postings){
+            etrace("invalid name index offsets");
+            return (-1);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Loads scan results saved
+ * by winx_save_scan_results.
+ * @param[in] filename the native path of the file.
+ * @param[out] r the scan results.
+ * @return Zero for success, negative
+ * value indicates failure.
+ * @note Release the results by
+ * winx_release_scan_results.
+ */
+int winx_load_scan_results(const wchar_t *filename,winx_scan_results *r)
+{
+    snapshot_reader rd, section_rd;
+    snapshot_header h;
+    snapshot_section s;
+    winx_file_info **files = NULL;
+    ULONGLONG n_files = 0, i;
+    void *contents;
+    size_t size;
+    int result = 0;
+
+    DbgCheck2(filename,r,-1);
+
+    memset(r,0,sizeof(winx_scan_results));
+
+    contents = winx_get_file_contents(filename,&size);
+    if(contents == NULL)
+        return (-1);
+
+    rd.p = contents;
+    rd.left = size;
+    if(snapshot_read(&rd,&h,sizeof(h)) < 0 || \
+      memcmp(h.magic,SNAPSHOT_MAGIC,sizeof(h.magic)) || \
+      h.version != SNAPSHOT_VERSION){
+        etrace("%ws: unsupported format",filename);
+        winx_release_file_contents(contents);
+        return (-1);
+    }
+    r->volume_letter = (char)h.volume_letter;
+    r->bytes_per_cluster = h.bytes_per_cluster;
+
+    for(i = 0; i < h.n_sections && result == 0; i++){
+        if(snapshot_read(&rd,&s,sizeof(s)) < 0 || s.size > rd.left){
+            result = -1;
+            break;
+        }
+        section_rd.p = rd.p;
+        section_rd.left = (size_t)s.size;
+        (void)snapshot_read(&rd,NULL,(size_t)s.size);
+        switch(s.tag){
+        case SNAPSHOT_FILES:
+            if(files != NULL){
+                result = -1;
+                break;
+            }
+            result = load_files(&section_rd,r,&files,&n_files);
+            break;
+        case SNAPSHOT_CLUSTER_MAP:
+            if(files == NULL || r->cmap != NULL){
+                result = -1;
+                break;
+            }
+            result = load_cluster_map(&section_rd,r,files,n_files);
+            break;
+        case SNAPSHOT_MFT_STATE:
+            if(r->mft != NULL){
+                result = -1;
+                break;
+            }
+            result = load_mft_state(&section_rd,r);
+            break;
+        case SNAPSHOT_NAME_INDEX:
+            if(files == NULL || r->names != NULL){
+                result = -1;
+                break;
+            }
+            result = load_name_index(&section_rd,r,files,n_files);
+            break;
+        default:
+            itrace("unknown section %u skipped",s.tag);
+            break;
+        }
+    }
+
+    winx_free(files);
+    winx_release_file_contents(contents);
+    if(result < 0){
+        etrace("%ws: snapshot is corrupted",filename);
+        winx_release_scan_results(r);
+    }
+    return result;
+}
+
+/**
+ * @brief Releases scan results.
+ * @details Destroys the cluster map, the indices, headers
+ * of the file records and the list of files, if any.
+ */
+void winx_release_scan_results(winx_scan_results *r)
+{
+    if(r == NULL)
+        return;
+
+    winx_release_cluster_map(r->cmap);
+    winx_release_time_index(r->times);
+    winx_release_name_index(r->names);
+    winx_release_mft_state(r->mft);
+    winx_ftw_release(r->filelist);
+    memset(r,0,sizeof(winx_scan_results));
+}
+
+/** @} */
@@ -0,0 +1,119 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file sort.c
+ * @brief Sorting.
+ * @details Arrays get sorted by 64-bit keys
+ * through LSD radix sort by 8-bit digits.
+ * Keys are taken relative to the least one
+ * and digits equal in all the keys are skipped,
+ * so sorting of 10 millions of items takes
+ * a few passes over the memory.
+ * @addtogroup Sort
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+/**
+ * @internal
+ * @brief Retrieves the key of an item.
+ */
+static ULONGLONG get_key(char *item,size_t key_offset,int flags)
+{
+    if(flags & WINX_SORT_POINTERS)
+        item = *(char **)item;
+    if(flags & WINX_SORT_ULONG)
+        return *(ULONG *)(item + key_offset);
+    return *(ULONGLONG *)(item + key_offset);
+}
+
+/**
+ * @brief Sorts an array by a 64-bit or 32-bit key.
+ * @param[in,out] items the array to be sorted.
+ * @param[in] n number of items.
+ * @param[in] item_size size of each item, in bytes.
+ * @param[in] key_offset offset of the key in the item
+ * or, for arrays of pointers, in the structure pointed to.
+ * @param[in] flags combination of WINX_SORT_xxx flags.
+ * @return Zero for success, negative
+ * value indicates failure.
+ * @note The sort is stable, so sorting by a few
+ * keys from the least significant one gives
+ * the lexicographic order.
+ */
+int winx_radix_sort(void *items,ULONGLONG n,size_t item_size,size_t key_offset,int flags)
+{
+    char *tmp, *src, *dst, *swap;
+    ULONGLONG count[256];
+    ULONGLONG i, sum, c, key, min_key, max_key = 0;
+    int shift;
+
+    DbgCheck1(items || n == 0,-1);
+
+    if(n < 2)
+        return 0;
+
+    min_key = get_key((char *)items,key_offset,flags);
+    for(i = 1; i < n; i++){
+        key = get_key((char *)items + i * item_size,key_offset,flags);
+        if(key < min_key) min_key = key;
+    }
+    for(i = 0; i < n; i++)
+        max_key |= get_key((char *)items + i * item_size,key_offset,flags) - min_key;
+    if(max_key == 0)
+        return 0; /* all the keys are equal */
+
+    tmp = winx_tmalloc((size_t)(n * item_size));
+    if(tmp == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            n * item_size);
+        return (-1);
+    }
+
+#define digit(x) (((get_key(x,key_offset,flags) - min_key) >> shift) & 0xFF)
+
+    src = (char *)items, dst = tmp;
+    for(shift = 0; shift < 64 && (max_key >> shift); shift += 8){
+        memset(count,0,sizeof(count));
+        for(i = 0; i < n; i++)
+            count[digit(src + i * item_size)] ++;
+        if(count[digit(src)] == n)
+            continue; /* all the keys have the same digit */
+        for(i = 0, sum = 0; i < 256; i++){
+            c = count[i]; count[i] = sum; sum += c;
+        }
+        for(i = 0; i < n; i++){
+            memcpy(dst + count[digit(src + i * item_size)] ++ * item_size,
+                src + i * item_size,item_size);
+        }
+        swap = src; src = dst; dst = swap;
+    }
+
+#undef digit
+
+    if(src != (char *)items)
+        memcpy(items,src,(size_t)(n * item_size));
+    winx_free(tmp);
+    return 0;
+}
+
+/** @} */
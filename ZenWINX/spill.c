@@ -0,0 +1,770 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file spill.c
+ * @brief External sort for the bounded-memory scan.
+ * @details Files found by the scanner are collected in
+ * a buffer which gets sorted by the parent directory id
+ * and written to a scratch file (a run) whenever it's full.
+ * The runs are merged then into a single file where all
+ * children of each directory are stored contiguously. A
+ * sparse index of the merged file allows to find children
+ * of any directory, so the tree gets walked from the root
+ * directory keeping in memory just the current path.
+ * @addtogroup File
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+/* the minimal memory limit, in bytes */
+#define SPILL_MIN_MEMORY      (4 * 1024 * 1024)
+/* size of buffers for sequential i/o, in bytes */
+#define SPILL_IO_BUFFER_SIZE  (64 * 1024)
+/* distance between the sparse index entries, in bytes */
+#define SPILL_INDEX_STRIDE    (64 * 1024)
+/* maximal length of paths produced by the walk, in characters */
+#define SPILL_MAX_PATH        32768
+/*
+* maximal length of names, in characters: NTFS file
+* and stream names take up to 255 characters each,
+* joined by a colon and followed by the attribute
+* name like :$LOGGED_UTILITY_STREAM
+*/
+#define SPILL_MAX_NAME        (255 + 1 + 255 + 32)
+
+#define FILE_root 5
+
+int ftw_batch_update(winx_ftw_context *ctx,void *user_defined_data);
+
+typedef struct _spill_record {
+    ULONGLONG parent_id;
+    ULONGLONG mft_id;
+    ULONGLONG creation_time;
+    ULONGLONG last_modification_time;
+    ULONGLONG last_access_time;
+    ULONGLONG clusters;
+    ULONGLONG fragments;
+    ULONG flags;
+    ULONG name_length;  /* in characters, the name follows */
+} spill_record;
+
+/* records are aligned on 8 bytes boundary */
+#define spill_record_size(name_length) \
+    (sizeof(spill_record) + (((name_length) * sizeof(wchar_t) + 7) & ~7))
+#define SPILL_MAX_RECORD spill_record_size(SPILL_MAX_NAME)
+
+typedef struct _spill_run {
+    struct _spill_run *next;
+    struct _spill_run *prev;
+    ULONG id;              /* the scratch file number */
+} spill_run;
+
+typedef struct _spill_index_entry {
+    ULONGLONG parent_id;   /* the directory */
+    ULONGLONG offset;      /* offset of its first child in the merged file */
+} spill_index_entry;
+
+typedef struct _spill_reader {
+    WINX_FILE *f;
+    char *buffer;
+    ULONG size;            /* size of the buffer */
+    ULONG length;          /* amount of valid data in the buffer */
+    ULONG pos;             /* the current position in the buffer */
+    ULONGLONG offset;      /* file offset of the buffer */
+    ULONGLONG file_size;
+    char record[SPILL_MAX_RECORD]; /* the current record */
+} spill_reader;
+
+typedef struct _spill {
+    wchar_t *scratch_path;
+    ULONGLONG memory_limit;
+    char *buffer;          /* records collected in memory */
+    ULONG buffer_size;
+    ULONG buffer_used;
+    ULONG *offsets;        /* offsets of the records in the buffer */
+    ULONG max_records;
+    ULONG n_records;
+    spill_run *runs;       /* runs waiting for the merge */
+    ULONG n_runs;
+    ULONG next_id;         /* number of the next scratch file */
+    ULONG merged_id;       /* number of the merged file */
+    spill_index_entry *index;
+    ULONGLONG index_length;
+    ULONGLONG records;     /* total number of records spilled */
+} spill;
+
+/*
+**************************************************
+*                Common routines
+**************************************************
+*/
+
+static wchar_t *spill_file_name(spill *s,ULONG id)
+{
+    wchar_t *name;
+
+    name = winx_swprintf(L"%ws\\~winx%08x.tmp",s->scratch_path,id);
+    if(name == NULL)
+        etrace("cannot allocate memory for the scratch file name");
+    return name;
+}
+
+static WINX_FILE *spill_open(spill *s,ULONG id,const char *mode,int buffer_size)
+{
+    WINX_FILE *f;
+    wchar_t *name;
+
+    name = spill_file_name(s,id);
+    if(name == NULL)
+        return NULL;
+    f = winx_fbopen(name,mode,buffer_size);
+    if(f == NULL)
+        etrace("cannot open %ws",name);
+    winx_free(name);
+    return f;
+}
+
+static void spill_delete(spill *s,ULONG id)
+{
+    wchar_t *name;
+
+    name = spill_file_name(s,id);
+    if(name){
+        (void)winx_delete_file(name);
+        winx_free(name);
+    }
+}
+
+static int spill_compare(spill_record *r1,spill_record *r2)
+{
+    if(r1->parent_id != r2->parent_id)
+        return (r1->parent_id < r2->parent_id) ? -1 : 1;
+    if(r1->mft_id != r2->mft_id)
+        return (r1->mft_id < r2->mft_id) ? -1 : 1;
+    return 0;
+}
+
+/*
+**************************************************
+*               Records collection
+**************************************************
+*/
+
+#define buffer_record(s,i) ((spill_record *)((s)->buffer + (s)->offsets[i]))
+
+static void sift_down(spill *s,ULONG i,ULONG n)
+{
+    ULONG child, tmp;
+
+    for(;;){
+        child = 2 * i + 1;
+        if(child >= n) break;
+        if(child + 1 < n && spill_compare(buffer_record(s,child),
+          buffer_record(s,child + 1)) < 0) child ++;
+        if(spill_compare(buffer_record(s,i),buffer_record(s,child)) >= 0) break;
+        tmp = s->offsets[i]; s->offsets[i] = s->offsets[child]; s->offsets[child] = tmp;
+        i = child;
+    }
+}
+
+/**
+ * @brief Sorts the collected records and writes them to a new run.
+ * @details Uses heap sort since it needs no extra memory.
+ */
+static int flush_run(spill *s)
+{
+    WINX_FILE *f;
+    spill_record *r;
+    spill_run *run;
+    ULONG i, tmp;
+
+    if(s->n_records == 0)
+        return 0;
+
+    for(i = s->n_records / 2; i > 0; i--)
+        sift_down(s,i - 1,s->n_records);
+    for(i = s->n_records - 1; i > 0; i--){
+        tmp = s->offsets[0]; s->offsets[0] = s->offsets[i]; s->offsets[i] = tmp;
+        sift_down(s,0,i);
+    }
+
+    f = spill_open(s,s->next_id,"w",SPILL_IO_BUFFER_SIZE);
+    if(f == NULL)
+        return (-1);
+    for(i = 0; i < s->n_records; i++){
+        r = buffer_record(s,i);
+        if(winx_fwrite(r,1,spill_record_size(r->name_length),f) != \
+          spill_record_size(r->name_length)){
+            etrace("cannot write to the scratch file");
+            winx_fclose(f);
+            spill_delete(s,s->next_id);
+            return (-1);
+        }
+    }
+    winx_fclose(f);
+
+    run = (spill_run *)winx_list_insert((list_entry **)(void *)&s->runs,
+        s->runs ? (list_entry *)s->runs->prev : NULL,sizeof(spill_run));
+    run->id = s->next_id ++;
+    s->n_runs ++;
+
+    s->n_records = 0;
+    s->buffer_used = 0;
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Prepares the external sort.
+ * @param[in] scratch_path the native path of
+ * a directory to keep the scratch files in.
+ * @param[in] memory_limit the amount of memory
+ * allowed to use, in bytes.
+ */
+spill *spill_create(wchar_t *scratch_path,ULONGLONG memory_limit)
+{
+    spill *s;
+    ULONGLONG size;
+
+    if(memory_limit < SPILL_MIN_MEMORY)
+        memory_limit = SPILL_MIN_MEMORY;
+
+    s = winx_tmalloc(sizeof(spill));
+    if(s == NULL){
+        etrace("cannot allocate %u bytes of memory",sizeof(spill));
+        return NULL;
+    }
+    memset(s,0,sizeof(spill));
+    s->memory_limit = memory_limit;
+
+    s->scratch_path = winx_wcsdup(scratch_path);
+    if(s->scratch_path == NULL){
+        etrace("cannot allocate memory for the scratch path");
+        winx_free(s);
+        return NULL;
+    }
+
+    /* a half of the memory for records, an eighth for their offsets */
+    size = memory_limit / 2;
+    if(size > 0x7fffffff) size = 0x7fffffff;
+    s->buffer_size = (ULONG)size;
+    s->max_records = (ULONG)(size / 4 / sizeof(ULONG));
+    s->buffer = winx_tmalloc(s->buffer_size);
+    s->offsets = winx_tmalloc(s->max_records * sizeof(ULONG));
+    if(s->buffer == NULL || s->offsets == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            s->buffer_size + s->max_records * sizeof(ULONG));
+        winx_free(s->buffer);
+        winx_free(s->offsets);
+        winx_free(s->scratch_path);
+        winx_free(s);
+        return NULL;
+    }
+    itrace("memory limit is %I64u bytes",memory_limit);
+    return s;
+}
+
+/**
+ * @internal
+ * @brief Adds a file to the external sort.
+ * @return Zero for success, a negative value otherwise.
+ */
+int spill_add(spill *s,winx_file_info *f)
+{
+    spill_record *r;
+    ULONG length, size;
+
+    if(f->name == NULL)
+        return 0;
+
+    length = (ULONG)wcslen(f->name);
+    if(length > SPILL_MAX_NAME){
+        etrace("%ws is longer than %u characters, cut",f->name,SPILL_MAX_NAME);
+        length = SPILL_MAX_NAME;
+    }
+    size = (ULONG)spill_record_size(length);
+
+    if(s->buffer_used + size > s->buffer_size || s->n_records == s->max_records){
+        if(flush_run(s) < 0)
+            return (-1);
+    }
+
+    s->offsets[s->n_records ++] = s->buffer_used;
+    r = (spill_record *)(s->buffer + s->buffer_used);
+    memset(r,0,size);
+    r->parent_id = f->internal.ParentDirectoryMftId;
+    r->mft_id = f->internal.BaseMftId;
+    r->creation_time = f->creation_time;
+    r->last_modification_time = f->last_modification_time;
+    r->last_access_time = f->last_access_time;
+    r->clusters = f->disp.clusters;
+    r->fragments = f->disp.fragments;
+    r->flags = f->flags;
+    r->name_length = length;
+    memcpy(r + 1,f->name,length * sizeof(wchar_t));
+    s->buffer_used += size;
+    s->records ++;
+    return 0;
+}
+
+/*
+**************************************************
+*                   Readers
+**************************************************
+*/
+
+static int reader_open(spill *s,spill_reader *r,ULONG id,ULONG buffer_size)
+{
+    r->f = spill_open(s,id,"r",0);
+    if(r->f == NULL)
+        return (-1);
+    r->buffer = winx_tmalloc(buffer_size);
+    if(r->buffer == NULL){
+        etrace("cannot allocate %u bytes of memory",buffer_size);
+        winx_fclose(r->f);
+        r->f = NULL;
+        return (-1);
+    }
+    r->size = buffer_size;
+    r->length = r->pos = 0;
+    r->offset = 0;
+    r->file_size = winx_fsize(r->f);
+    return 0;
+}
+
+static void reader_close(spill_reader *r)
+{
+    if(r->f) winx_fclose(r->f);
+    winx_free(r->buffer);
+    r->f = NULL;
+    r->buffer = NULL;
+}
+
+static void reader_seek(spill_reader *r,ULONGLONG offset)
+{
+    if(offset >= r->offset && offset <= r->offset + r->length){
+        r->pos = (ULONG)(offset - r->offset);
+    } else {
+        r->offset = offset;
+        r->length = r->pos = 0;
+    }
+}
+
+static int reader_get(spill_reader *r,char *data,ULONG size)
+{
+    ULONG n;
+
+    while(size){
+        if(r->pos == r->length){
+            r->offset += r->length;
+            r->length = r->pos = 0;
+            if(r->offset >= r->file_size)
+                return (-1);
+            n = (ULONG)min(r->size,r->file_size - r->offset);
+            r->f->roffset.QuadPart = r->offset;
+            r->length = (ULONG)winx_fread(r->buffer,1,n,r->f);
+            if(r->length == 0)
+                return (-1);
+        }
+        n = min(size,r->length - r->pos);
+        memcpy(data,r->buffer + r->pos,n);
+        r->pos += n;
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads the next record into r->record.
+ * @return Zero for success, -1 at the end of file.
+ */
+static int reader_next(spill_reader *r)
+{
+    spill_record *rec = (spill_record *)r->record;
+
+    if(reader_get(r,r->record,sizeof(spill_record)) < 0)
+        return (-1);
+    if(rec->name_length > SPILL_MAX_NAME){
+        etrace("scratch file is corrupted");
+        return (-1);
+    }
+    return reader_get(r,r->record + sizeof(spill_record),
+        (ULONG)spill_record_size(rec->name_length) - sizeof(spill_record));
+}
+
+#define reader_position(r) ((r)->offset + (r)->pos)
+
+/*
+**************************************************
+*                  Runs merging
+**************************************************
+*/
+
+static void heap_sift_down(spill_reader **h,ULONG i,ULONG n)
+{
+    spill_reader *tmp;
+    ULONG child;
+
+    for(;;){
+        child = 2 * i + 1;
+        if(child >= n) break;
+        if(child + 1 < n && spill_compare((spill_record *)h[child + 1]->record,
+          (spill_record *)h[child]->record) < 0) child ++;
+        if(spill_compare((spill_record *)h[i]->record,
+          (spill_record *)h[child]->record) <= 0) break;
+        tmp = h[i]; h[i] = h[child]; h[child] = tmp;
+        i = child;
+    }
+}
+
+/**
+ * @brief Merges up to n first runs into a new one.
+ * @param[in] final nonzero value indicates the last
+ * pass; the sparse index gets built during it.
+ */
+static int merge_runs(spill *s,ULONG n,int final,winx_ftw_context *ctx,void *user_defined_data)
+{
+    spill_reader *readers, **heap;
+    spill_run *run;
+    spill_record *r;
+    WINX_FILE *f;
+    ULONGLONG offset = 0, next_index = 0;
+    ULONGLONG last_parent = (ULONGLONG)(-1);
+    ULONGLONG max_index = 0;
+    ULONG i, k = 0, size, buffer_size;
+    int result = -1;
+
+    readers = winx_tmalloc(n * sizeof(spill_reader));
+    heap = winx_tmalloc(n * sizeof(spill_reader *));
+    if(readers == NULL || heap == NULL){
+        etrace("cannot allocate memory for %u readers",n);
+        winx_free(readers);
+        winx_free(heap);
+        return (-1);
+    }
+    memset(readers,0,n * sizeof(spill_reader));
+
+    /* a quarter of the memory for the read buffers */
+    buffer_size = (ULONG)(s->memory_limit / 4 / n);
+    if(buffer_size > SPILL_IO_BUFFER_SIZE * 16)
+        buffer_size = SPILL_IO_BUFFER_SIZE * 16;
+
+    for(i = 0, run = s->runs; i < n; i++, run = run->next){
+        if(reader_open(s,&readers[i],run->id,buffer_size) < 0)
+            goto done;
+        max_index += readers[i].file_size;
+        if(reader_next(&readers[i]) == 0)
+            heap[k++] = &readers[i];
+    }
+
+    if(final){
+        max_index = max_index / SPILL_INDEX_STRIDE + 2;
+        s->index = winx_tmalloc((size_t)(max_index * sizeof(spill_index_entry)));
+        if(s->index == NULL){
+            etrace("cannot allocate %I64u bytes of memory",
+                max_index * sizeof(spill_index_entry));
+            goto done;
+        }
+        s->index_length = 0;
+    }
+
+    f = spill_open(s,s->next_id,"w",SPILL_IO_BUFFER_SIZE);
+    if(f == NULL)
+        goto done;
+
+    for(i = k / 2; i > 0; i--)
+        heap_sift_down(heap,i - 1,k);
+    while(k){
+        r = (spill_record *)heap[0]->record;
+        size = (ULONG)spill_record_size(r->name_length);
+        if(final && r->parent_id != last_parent){
+            if(offset >= next_index && s->index_length < max_index){
+                s->index[s->index_length].parent_id = r->parent_id;
+                s->index[s->index_length].offset = offset;
+                s->index_length ++;
+                next_index = offset + SPILL_INDEX_STRIDE;
+            }
+            last_parent = r->parent_id;
+        }
+        if(winx_fwrite(r,1,size,f) != size){
+            etrace("cannot write to the scratch file");
+            winx_fclose(f);
+            spill_delete(s,s->next_id);
+            goto done;
+        }
+        offset += size;
+        if(reader_next(heap[0]) < 0)
+            heap[0] = heap[--k];
+        heap_sift_down(heap,0,k);
+        if(ctx){
+            if(ftw_batch_update(ctx,user_defined_data)){
+                winx_fclose(f);
+                spill_delete(s,s->next_id);
+                result = -2;
+                goto done;
+            }
+        }
+    }
+    winx_fclose(f);
+
+    /* replace the merged runs by the new one */
+    for(i = 0; i < n; i++){
+        reader_close(&readers[i]);
+        spill_delete(s,s->runs->id);
+        winx_list_remove((list_entry **)(void *)&s->runs,(list_entry *)s->runs);
+    }
+    s->n_runs -= n;
+    run = (spill_run *)winx_list_insert((list_entry **)(void *)&s->runs,
+        s->runs ? (list_entry *)s->runs->prev : NULL,sizeof(spill_run));
+    run->id = s->next_id ++;
+    s->n_runs ++;
+    result = 0;
+
+done:
+    for(i = 0; i < n; i++)
+        reader_close(&readers[i]);
+    winx_free(readers);
+    winx_free(heap);
+    return result;
+}
+
+/*
+**************************************************
+*                 Directory walk
+**************************************************
+*/
+
+typedef struct _spill_frame {
+    ULONGLONG mft_id;       /* the directory */
+    ULONGLONG offset;       /* offset of the next child in the merged file */
+    ULONGLONG last_dir;     /* the last subdirectory visited */
+    ULONG path_length;      /* length of the directory path */
+} spill_frame;
+
+/**
+ * @brief Finds the first child of a directory in the merged file.
+ * @return The offset, (ULONGLONG)(-1) if the directory has no children.
+ */
+static ULONGLONG find_children(spill *s,spill_reader *r,ULONGLONG mft_id)
+{
+    spill_record *rec = (spill_record *)r->record;
+    ULONGLONG lo = 0, hi = s->index_length, mid;
+    ULONGLONG offset;
+
+    /* find the last index entry not above the directory */
+    while(lo < hi){
+        mid = lo + (hi - lo) / 2;
+        if(s->index[mid].parent_id <= mft_id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    offset = lo ? s->index[lo - 1].offset : 0;
+
+    /* scan the rest sequentially */
+    reader_seek(r,offset);
+    for(;;){
+        offset = reader_position(r);
+        if(reader_next(r) < 0) break;
+        if(rec->parent_id == mft_id) return offset;
+        if(rec->parent_id > mft_id) break;
+    }
+    return (ULONGLONG)(-1);
+}
+
+static int walk(spill *s,wchar_t *root,ftw_filter_callback fcb,
+    winx_ftw_context *ctx,void *user_defined_data)
+{
+    spill_reader r;
+    spill_record *rec = (spill_record *)r.record;
+    spill_frame *stack, *top;
+    ULONG depth = 0, max_depth = SPILL_MAX_PATH / 2;
+    ULONGLONG offset, mft_id, files = 0;
+    winx_file_info f;
+    wchar_t *path;
+    ULONG length;
+    int skip_children, result = 0;
+
+    memset(&r,0,sizeof(spill_reader));
+    stack = winx_tmalloc(max_depth * sizeof(spill_frame));
+    path = winx_tmalloc(SPILL_MAX_PATH * sizeof(wchar_t));
+    if(stack == NULL || path == NULL || reader_open(s,&r,s->runs->id,SPILL_IO_BUFFER_SIZE / 4) < 0){
+        etrace("cannot prepare the directory walk");
+        winx_free(stack);
+        winx_free(path);
+        return (-1);
+    }
+
+    length = (ULONG)wcslen(root);
+    if(length >= SPILL_MAX_PATH) length = SPILL_MAX_PATH - 1;
+    wcsncpy(path,root,length);
+    path[length] = 0;
+
+    offset = find_children(s,&r,FILE_root);
+    if(offset != (ULONGLONG)(-1)){
+        stack[0].mft_id = FILE_root;
+        stack[0].offset = offset;
+        stack[0].last_dir = FILE_root;
+        stack[0].path_length = length;
+        depth = 1;
+    }
+
+    while(depth){
+        top = &stack[depth - 1];
+        reader_seek(&r,top->offset);
+        if(reader_next(&r) < 0 || rec->parent_id != top->mft_id){
+            depth --;
+            continue;
+        }
+        top->offset = reader_position(&r);
+        if(rec->mft_id == top->mft_id){
+            files ++; /* the root directory refers to itself */
+            continue;
+        }
+
+        /* build the path */
+        length = top->path_length + 1 + rec->name_length;
+        if(length >= SPILL_MAX_PATH){
+            etrace("path is too long, %I64u file skipped",rec->mft_id);
+            continue;
+        }
+        path[top->path_length] = '\\';
+        memcpy(path + top->path_length + 1,rec + 1,rec->name_length * sizeof(wchar_t));
+        path[length] = 0;
+
+        /* call the filter callback */
+        memset(&f,0,sizeof(winx_file_info));
+        f.name = path + top->path_length + 1;
+        f.path = path;
+        f.flags = rec->flags;
+        f.disp.clusters = rec->clusters;
+        f.disp.fragments = rec->fragments;
+        f.internal.BaseMftId = rec->mft_id;
+        f.internal.ParentDirectoryMftId = rec->parent_id;
+        f.creation_time = rec->creation_time;
+        f.last_modification_time = rec->last_modification_time;
+        f.last_access_time = rec->last_access_time;
+        skip_children = fcb ? fcb(&f,user_defined_data) : 0;
+        files ++;
+        if(ctx){
+            if(ftw_batch_update(ctx,user_defined_data)){
+                result = -2;
+                break;
+            }
+        }
+
+        /*
+        * Visit subdirectories, but not reparse points. Directory
+        * streams share the same name, so visit each one once.
+        */
+        if(!(rec->flags & FILE_ATTRIBUTE_DIRECTORY) || skip_children || \
+          (rec->flags & FILE_ATTRIBUTE_REPARSE_POINT) || wcschr(f.name,':') || \
+          rec->mft_id == top->last_dir || depth == max_depth)
+            continue;
+        /* the search reuses the current record */
+        mft_id = top->last_dir = rec->mft_id;
+        offset = find_children(s,&r,mft_id);
+        if(offset == (ULONGLONG)(-1))
+            continue;
+        stack[depth].mft_id = mft_id;
+        stack[depth].offset = offset;
+        stack[depth].last_dir = mft_id;
+        stack[depth].path_length = length;
+        depth ++;
+    }
+
+    if(result == 0 && files < s->records)
+        itrace("%I64u orphaned streams skipped",s->records - files);
+    reader_close(&r);
+    winx_free(stack);
+    winx_free(path);
+    return result;
+}
+
+/**
+ * @internal
+ * @brief Sorts the files collected and walks
+ * the directory tree calling the filter callback
+ * for each file.
+ * @param[in] root the path of the root directory,
+ * without the trailing backslash.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller.
+ */
+int spill_walk(spill *s,wchar_t *root,ftw_filter_callback fcb,
+    winx_ftw_context *ctx,void *user_defined_data)
+{
+    ULONG max_runs;
+    int result;
+
+    if(flush_run(s) < 0)
+        return (-1);
+    if(s->n_runs == 0)
+        return 0;
+
+    /* the records buffer is not needed anymore */
+    winx_free(s->buffer);
+    winx_free(s->offsets);
+    s->buffer = NULL;
+    s->offsets = NULL;
+
+    /* merge the runs, up to the number the memory allows at once */
+    max_runs = (ULONG)(s->memory_limit / 4 / SPILL_IO_BUFFER_SIZE);
+    if(max_runs < 2) max_runs = 2;
+    itrace("%u runs to be merged, up to %u at once",s->n_runs,max_runs);
+    while(s->n_runs > max_runs){
+        result = merge_runs(s,max_runs,0,ctx,user_defined_data);
+        if(result < 0) return result;
+    }
+    result = merge_runs(s,s->n_runs,1,ctx,user_defined_data);
+    if(result < 0) return result;
+    itrace("%I64u index entries built",s->index_length);
+
+    return walk(s,root,fcb,ctx,user_defined_data);
+}
+
+/**
+ * @internal
+ * @brief Deletes the scratch files
+ * and releases the resources.
+ */
+void spill_destroy(spill *s)
+{
+    spill_run *run;
+
+    if(s == NULL)
+        return;
+
+    for(run = s->runs; run; run = run->next){
+        spill_delete(s,run->id);
+        if(run->next == s->runs) break;
+    }
+    winx_list_destroy((list_entry **)(void *)&s->runs);
+    winx_free(s->buffer);
+    winx_free(s->offsets);
+    winx_free(s->index);
+    winx_free(s->scratch_path);
+    winx_free(s);
+}
+
+/** @} */
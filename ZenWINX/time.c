@@ -199,6 +199,89 @@ int winx_get_system_time(winx_time *t)
     return 0;
 }
 
+/**
+ * @brief Retrieves the current system time
+ * in the format of file times.
+ * @return The number of 100-nanosecond intervals
+ * since January 1, 1601. Zero indicates failure.
+ */
+ULONGLONG winx_get_system_time_raw(void)
+{
+    LARGE_INTEGER SystemTime;
+    NTSTATUS status;
+    
+    status = NtQuerySystemTime(&SystemTime);
+    if(status != STATUS_SUCCESS){
+        strace(status,"NtQuerySystemTime failed");
+        return 0;
+    }
+    return (ULONGLONG)SystemTime.QuadPart;
+}
+
+/**
+ * @brief Retrieves the difference between
+ * the local time and the system time.
+ * @return The local time minus the system time,
+ * in 100-nanosecond intervals. Zero indicates
+ * failure as well as the UTC time zone.
+ */
+LONGLONG winx_get_time_bias(void)
+{
+    LARGE_INTEGER SystemTime;
+    LARGE_INTEGER LocalTime;
+    NTSTATUS status;
+    
+    status = NtQuerySystemTime(&SystemTime);
+    if(status != STATUS_SUCCESS){
+        strace(status,"NtQuerySystemTime failed");
+        return 0;
+    }
+    status = RtlSystemTimeToLocalTime(&SystemTime,&LocalTime);
+    if(status != STATUS_SUCCESS){
+        strace(status,"RtlSystemTimeToLocalTime failed");
+        return 0;
+    }
+    return LocalTime.QuadPart - SystemTime.QuadPart;
+}
+
+/**
+ * @brief Converts MS-DOS date and time
+ * to the format of file times.
+ * @param[in] date the date, as FAT keeps it:
+ * years since 1980, month and day.
+ * @param[in] time the time, in two-second units.
+ * @param[in] centiseconds additional 10-millisecond
+ * units, in range [0..199].
+ * @return The number of 100-nanosecond intervals
+ * since January 1, 1601, in the same time zone
+ * as the date. Zero indicates an invalid date.
+ * @note Doesn't use the system calls, so it works
+ * for dates of all the file systems, images included.
+ */
+ULONGLONG winx_dos2time(unsigned short date,unsigned short time,unsigned char centiseconds)
+{
+    ULONGLONG days, seconds;
+    unsigned int y, m, d, era, yoe, doy;
+
+    y = 1980 + (date >> 9);
+    m = (date >> 5) & 0xF;
+    d = date & 0x1F;
+    if(m < 1 || m > 12 || d < 1)
+        return 0;
+
+    /* days since March 1 of the year zero, counting years from March */
+    if(m <= 2) y --;
+    era = y / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    days = (ULONGLONG)era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    /* January 1, 1601 comes four eras and 306 days later */
+    days -= 4 * 146097 + 306;
+
+    seconds = days * 86400 + (time >> 11) * 3600 + ((time >> 5) & 0x3F) * 60 + (time & 0x1F) * 2;
+    return seconds * 10000000 + (ULONGLONG)centiseconds * 100000;
+}
+
 /**
  * @brief Retrieves the current local time
  * in a human understandable format.
@@ -0,0 +1,155 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file timeidx.c
+ * @brief Time index of files.
+ * @details The index holds two arrays of all the
+ * streams, sorted by the last modification time
+ * and by the creation time. Each entry keeps its
+ * time next to the file pointer, so the binary
+ * search never touches the list of files. A range
+ * query costs O(log n + k) for k streams found.
+ * @addtogroup TimeIndex
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+/**
+ * @brief Builds the time index of files.
+ * @param[in] filelist the list of files.
+ * @return The index, NULL indicates failure.
+ * @note The index refers to the list entries,
+ * so it must be rebuilt when the list changes
+ * and released before the list.
+ */
+winx_time_index *winx_build_time_index(winx_file_info *filelist)
+{
+    winx_time_index *ti;
+    winx_file_info *f;
+    ULONGLONG n = 0, i;
+    ULONGLONG time;
+
+    time = winx_xtime();
+    for(f = filelist; f; f = f->next){
+        n ++;
+        if(f->next == filelist) break;
+    }
+
+    ti = winx_tmalloc(sizeof(winx_time_index));
+    if(ti == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sizeof(winx_time_index));
+        return NULL;
+    }
+    ti->n_files = n;
+    ti->by_mtime = ti->by_ctime = NULL;
+    if(n){
+        ti->by_mtime = winx_tmalloc((size_t)(n * sizeof(winx_time_entry)));
+        ti->by_ctime = winx_tmalloc((size_t)(n * sizeof(winx_time_entry)));
+        if(ti->by_mtime == NULL || ti->by_ctime == NULL){
+            etrace("cannot allocate %I64u bytes of memory",
+                n * sizeof(winx_time_entry) * 2);
+            winx_release_time_index(ti);
+            return NULL;
+        }
+    }
+
+    for(f = filelist, i = 0; f; f = f->next){
+        ti->by_mtime[i].time = f->last_modification_time;
+        ti->by_mtime[i].f = f;
+        ti->by_ctime[i].time = f->creation_time;
+        ti->by_ctime[i].f = f;
+        i ++;
+        if(f->next == filelist) break;
+    }
+
+    if(winx_radix_sort(ti->by_mtime,n,sizeof(winx_time_entry),
+      FIELD_OFFSET(winx_time_entry,time),0) < 0 || \
+      winx_radix_sort(ti->by_ctime,n,sizeof(winx_time_entry),
+      FIELD_OFFSET(winx_time_entry,time),0) < 0){
+        winx_release_time_index(ti);
+        return NULL;
+    }
+
+    itrace("%I64u files indexed by time in %I64u ms",
+        n,winx_xtime() - time);
+    return ti;
+}
+
+/**
+ * @brief Retrieves files having times in a range.
+ * @param[in] ti the time index.
+ * @param[in] key WINX_TIME_MODIFIED or WINX_TIME_CREATED.
+ * @param[in] from the beginning of the range.
+ * @param[in] to the end of the range, inclusive.
+ * Both are in 100-nanosecond intervals since
+ * January 1, 1601, like times of the files.
+ * @param[in] cb the callback routine called for each
+ * file found, in ascending order of time; if it
+ * returns a nonzero value, the query stops.
+ * @param[in] user_defined_data data passed to the callback.
+ * @return The number of files delivered to the callback.
+ */
+ULONGLONG winx_query_time_index(winx_time_index *ti,int key,
+    ULONGLONG from,ULONGLONG to,time_index_callback cb,
+    void *user_defined_data)
+{
+    winx_time_entry *e;
+    ULONGLONG lo, hi, mid, n = 0;
+
+    DbgCheck2(ti,cb,0);
+
+    if(from > to || ti->n_files == 0)
+        return 0;
+    e = (key == WINX_TIME_CREATED) ? ti->by_ctime : ti->by_mtime;
+
+    /* find the first entry not older than from */
+    lo = 0, hi = ti->n_files;
+    while(lo < hi){
+        mid = lo + (hi - lo) / 2;
+        if(e[mid].time < from)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for(; lo < ti->n_files && e[lo].time <= to; lo++){
+        n ++;
+        if(cb(&e[lo],user_defined_data))
+            break;
+    }
+    return n;
+}
+
+/**
+ * @brief Destroys the time index.
+ */
+void winx_release_time_index(winx_time_index *ti)
+{
+    if(ti == NULL)
+        return;
+    winx_free(ti->by_mtime);
+    winx_free(ti->by_ctime);
+    winx_free(ti);
+}
+
+/** @} */
@@ -0,0 +1,840 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2018 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file vdisk.c
+ * @brief Virtual disks, VHD and VHDX.
+ * @details Fixed and dynamic VHD and VHDX files are
+ * read at any virtual offset. Block allocation tables
+ * aren't loaded entirely, they're read in pages kept
+ * in a small cache, as are sector bitmaps of dynamic
+ * VHD. Blocks never written read as zeroes. Data get
+ * read straight into the buffer of the caller.
+ * winx_open_image opens files named *.vhd and *.vhdx
+ * as virtual disks, so the image scans and partitions
+ * accept them as they are.
+ * @note Differencing disks and VHDX files with a log
+ * to be replayed aren't supported.
+ * @addtogroup File
+ * @{
+ */
+
+#include "prec.h"
+#include "zenwinx.h"
+
+/* types of virtual disks */
+#define VDISK_VHD_FIXED    0
+#define VDISK_VHD_DYNAMIC  1
+#define VDISK_VHDX         2
+
+/* VHD footer and dynamic header */
+#define VHD_FOOTER_SIZE        512
+#define VHD_FOOTER_DATA_OFFSET 16
+#define VHD_FOOTER_SIZE_FIELD  48
+#define VHD_FOOTER_TYPE        60
+#define VHD_FOOTER_CHECKSUM    64
+#define VHD_HEADER_SIZE        1024
+#define VHD_HEADER_BAT_OFFSET  16
+#define VHD_HEADER_BAT_ENTRIES 28
+#define VHD_HEADER_BLOCK_SIZE  32
+#define VHD_HEADER_CHECKSUM    36
+#define VHD_SECTOR_SIZE        512
+#define VHD_TYPE_FIXED         2
+#define VHD_TYPE_DYNAMIC       3
+#define VHD_TYPE_DIFFERENCING  4
+#define VHD_UNALLOCATED        0xFFFFFFFF
+
+/* VHDX structures */
+#define VHDX_HEADER_1          (64 * 1024)
+#define VHDX_HEADER_2          (128 * 1024)
+#define VHDX_HEADER_SIZE       4096
+#define VHDX_REGIONS_1         (192 * 1024)
+#define VHDX_REGIONS_2         (256 * 1024)
+#define VHDX_REGIONS_SIZE      (64 * 1024)
+#define VHDX_MAX_REGIONS       2047
+#define VHDX_METADATA_SIZE     (64 * 1024)
+#define VHDX_MAX_METADATA      2047
+#define VHDX_HAS_PARENT        0x2
+#define VHDX_REQUIRED          0x1
+#define VHDX_METADATA_REQUIRED 0x4
+#define VHDX_CHUNK_SIZE        ((ULONGLONG)1 << 23)
+
+/* states of VHDX payload blocks */
+#define VHDX_BLOCK_STATE_MASK  0x7
+#define VHDX_BLOCK_FULLY_PRESENT 6
+
+/* blocks of virtual disks take this size at most */
+#define VDISK_MAX_BLOCK_SIZE   (256 * 1024 * 1024)
+
+/* allocation tables are cached in pages */
+#define VDISK_BAT_PAGE_SIZE    4096
+#define VDISK_BAT_PAGES        64
+
+/* sector bitmaps of dynamic VHD kept in memory */
+#define VDISK_BITMAPS          16
+
+#define VDISK_NONE ((ULONGLONG)-1)
+
+/* internal structures */
+typedef struct _vdisk_page {
+    ULONGLONG index;            /* the page or the block cached, VDISK_NONE for free slots */
+    UCHAR *data;
+} vdisk_page;
+
+struct _winx_vdisk {
+    WINX_FILE *f;               /* the container */
+    int type;                   /* one of VDISK_xxx */
+    ULONGLONG size;             /* the virtual size, in bytes */
+    ULONGLONG file_size;        /* size of the container, in bytes */
+    ULONG block_size;           /* in bytes */
+    ULONGLONG bat_offset;       /* offset of the allocation table in the container */
+    ULONGLONG bat_size;         /* size of the allocation table, in bytes */
+    ULONG bitmap_size;          /* size of sector bitmaps of dynamic VHD, in bytes */
+    ULONG chunk_ratio;          /* number of VHDX payload blocks per sector bitmap block */
+    vdisk_page bat[VDISK_BAT_PAGES];
+    vdisk_page bitmaps[VDISK_BITMAPS];
+    ULONGLONG hits;             /* allocation table entries found in the cache */
+    ULONGLONG misses;           /* allocation table pages read */
+};
+
+#define get_u16(p) ((ULONG)((UCHAR *)(p))[0] | ((ULONG)((UCHAR *)(p))[1] << 8))
+#define get_u32(p) (get_u16(p) | (get_u16((UCHAR *)(p) + 2) << 16))
+#define get_u64(p) ((ULONGLONG)get_u32(p) | ((ULONGLONG)get_u32((UCHAR *)(p) + 4) << 32))
+
+#define get_be32(p) (((ULONG)((UCHAR *)(p))[0] << 24) | ((ULONG)((UCHAR *)(p))[1] << 16) \
+    | ((ULONG)((UCHAR *)(p))[2] << 8) | (ULONG)((UCHAR *)(p))[3])
+#define get_be64(p) (((ULONGLONG)get_be32(p) << 32) | (ULONGLONG)get_be32((UCHAR *)(p) + 4))
+
+/* GUIDs of VHDX regions and metadata items, as they are on disk */
+static UCHAR bat_guid[16] = {
+    0x66,0x77,0xC2,0x2D,0x23,0xF6,0x00,0x42,0x9D,0x64,0x11,0x5E,0x9B,0xFD,0x4A,0x08
+};
+static UCHAR metadata_guid[16] = {
+    0x06,0xA2,0x7C,0x8B,0x90,0x47,0x9A,0x4B,0xB8,0xFE,0x57,0x5F,0x05,0x0F,0x88,0x6E
+};
+static UCHAR file_parameters_guid[16] = {
+    0x37,0x67,0xA1,0xCA,0x36,0xFA,0x43,0x4D,0xB3,0xB6,0x33,0xF0,0xAA,0x44,0xE7,0x6B
+};
+static UCHAR virtual_disk_size_guid[16] = {
+    0x24,0x42,0xA5,0x2F,0x1B,0xCD,0x76,0x48,0xB2,0x11,0x5D,0xBE,0xD8,0x3B,0xF4,0xB8
+};
+static UCHAR logical_sector_size_guid[16] = {
+    0x1D,0xBF,0x41,0x81,0x6F,0xA9,0x09,0x47,0xBA,0x47,0xF2,0x33,0xA8,0xFA,0xAB,0x5F
+};
+
+/*
+**************************************************************
+*                    Low level routines
+**************************************************************
+*/
+
+/**
+ * @internal
+ * @brief Reads a range of the container.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int read_container(winx_vdisk *v,ULONGLONG offset,void *buffer,ULONG length)
+{
+    if(offset > v->file_size || length > v->file_size - offset){
+        etrace("range %I64u:%u is beyond the file end",offset,length);
+        return (-1);
+    }
+    v->f->roffset.QuadPart = offset;
+    if(winx_fread(buffer,1,length,v->f) != length){
+        etrace("cannot read %u bytes at %I64u",length,offset);
+        return (-1);
+    }
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Calculates CRC32C of a VHDX structure.
+ * @details The checksum field, which follows
+ * the signature, is taken as zero.
+ */
+static ULONG crc32c(UCHAR *p,ULONG length)
+{
+    ULONG crc = 0xFFFFFFFF;
+    ULONG k;
+    int i;
+
+    for(k = 0; k < length; k++){
+        crc ^= (k >= 4 && k < 8) ? 0 : p[k];
+        for(i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+    }
+    return ~crc & 0xFFFFFFFF;
+}
+
+/**
+ * @internal
+ * @brief Checks a checksum of VHD structures.
+ */
+static int is_valid_vhd_checksum(UCHAR *p,ULONG length,ULONG field)
+{
+    ULONG i, sum = 0;
+
+    for(i = 0; i < length; i++){
+        if(i < field || i >= field + 4)
+            sum += p[i];
+    }
+    return ((~sum & 0xFFFFFFFF) == get_be32(p + field)) ? 1 : 0;
+}
+
+/**
+ * @internal
+ * @brief Checks whether the block size
+ * is a power of two within limits.
+ */
+static int is_valid_block_size(ULONG block_size)
+{
+    if(block_size < VHD_SECTOR_SIZE || block_size > VDISK_MAX_BLOCK_SIZE)
+        return 0;
+    return (block_size & (block_size - 1)) ? 0 : 1;
+}
+
+/*
+**************************************************************
+*                    The cache
+**************************************************************
+*/
+
+/**
+ * @internal
+ * @brief Retrieves an entry of the allocation table.
+ * @param[in] i index of the entry.
+ * @param[out] entry the entry.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int get_bat_entry(winx_vdisk *v,ULONGLONG i,ULONGLONG *entry)
+{
+    ULONG entry_size = (v->type == VDISK_VHDX) ? 8 : 4;
+    ULONGLONG offset, page;
+    vdisk_page *slot;
+    ULONG length;
+
+    offset = i * entry_size;
+    if(offset + entry_size > v->bat_size){
+        etrace("block %I64u is beyond the allocation table",i);
+        return (-1);
+    }
+    page = offset / VDISK_BAT_PAGE_SIZE;
+    slot = &v->bat[page % VDISK_BAT_PAGES];
+    if(slot->index != page){
+        if(slot->data == NULL){
+            slot->data = winx_tmalloc(VDISK_BAT_PAGE_SIZE);
+            if(slot->data == NULL){
+                etrace("cannot allocate %u bytes of memory",VDISK_BAT_PAGE_SIZE);
+                return (-1);
+            }
+        }
+        length = (ULONG)min(v->bat_size - page * VDISK_BAT_PAGE_SIZE,
+            (ULONGLONG)VDISK_BAT_PAGE_SIZE);
+        slot->index = VDISK_NONE;
+        if(read_container(v,v->bat_offset + page * VDISK_BAT_PAGE_SIZE,slot->data,length) < 0)
+            return (-1);
+        slot->index = page;
+        v->misses ++;
+    } else {
+        v->hits ++;
+    }
+    offset -= page * VDISK_BAT_PAGE_SIZE;
+    if(v->type == VDISK_VHDX)
+        *entry = get_u64(slot->data + offset);
+    else
+        *entry = get_be32(slot->data + offset);
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Retrieves the sector bitmap
+ * of a block of a dynamic VHD.
+ * @param[in] sector the first sector of the block.
+ * @return The bitmap, NULL indicates failure.
+ */
+static UCHAR *get_bitmap(winx_vdisk *v,ULONGLONG block,ULONGLONG sector)
+{
+    vdisk_page *slot;
+
+    slot = &v->bitmaps[block % VDISK_BITMAPS];
+    if(slot->index == block)
+        return slot->data;
+    if(slot->data == NULL){
+        slot->data = winx_tmalloc(v->bitmap_size);
+        if(slot->data == NULL){
+            etrace("cannot allocate %u bytes of memory",v->bitmap_size);
+            return NULL;
+        }
+    }
+    slot->index = VDISK_NONE;
+    if(read_container(v,sector * VHD_SECTOR_SIZE,slot->data,v->bitmap_size) < 0)
+        return NULL;
+    slot->index = block;
+    return slot->data;
+}
+
+/*
+**************************************************************
+*                    VHD
+**************************************************************
+*/
+
+/**
+ * @internal
+ * @brief Opens a VHD file.
+ * @param[in] footer the last sector of the file.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int open_vhd(winx_vdisk *v,UCHAR *footer)
+{
+    UCHAR header[VHD_HEADER_SIZE];
+    ULONGLONG offset;
+    ULONG type, entries;
+
+    if(!is_valid_vhd_checksum(footer,VHD_FOOTER_SIZE,VHD_FOOTER_CHECKSUM)){
+        /* dynamic disks keep a copy at the start */
+        if(read_container(v,0,footer,VHD_FOOTER_SIZE) < 0)
+            return (-1);
+        if(memcmp(footer,"conectix",8) || !is_valid_vhd_checksum(footer,
+          VHD_FOOTER_SIZE,VHD_FOOTER_CHECKSUM)){
+            etrace("VHD footer is damaged");
+            return (-1);
+        }
+        itrace("VHD footer is damaged, its copy will be used");
+    }
+    type = get_be32(footer + VHD_FOOTER_TYPE);
+    v->size = get_be64(footer + VHD_FOOTER_SIZE_FIELD);
+
+    if(type == VHD_TYPE_FIXED){
+        if(v->size > v->file_size - VHD_FOOTER_SIZE){
+            etrace("VHD is shorter than its virtual size");
+            return (-1);
+        }
+        v->type = VDISK_VHD_FIXED;
+        return 0;
+    }
+    if(type == VHD_TYPE_DIFFERENCING){
+        etrace("differencing VHD is not supported");
+        return (-1);
+    }
+    if(type != VHD_TYPE_DYNAMIC){
+        etrace("VHD of type %u is not supported",type);
+        return (-1);
+    }
+
+    offset = get_be64(footer + VHD_FOOTER_DATA_OFFSET);
+    if(read_container(v,offset,header,VHD_HEADER_SIZE) < 0)
+        return (-1);
+    if(memcmp(header,"cxsparse",8) || !is_valid_vhd_checksum(header,
+      VHD_HEADER_SIZE,VHD_HEADER_CHECKSUM)){
+        etrace("VHD header is damaged");
+        return (-1);
+    }
+    v->block_size = get_be32(header + VHD_HEADER_BLOCK_SIZE);
+    if(!is_valid_block_size(v->block_size)){
+        etrace("invalid VHD block size %u",v->block_size);
+        return (-1);
+    }
+    entries = get_be32(header + VHD_HEADER_BAT_ENTRIES);
+    if(entries < (v->size + v->block_size - 1) / v->block_size){
+        etrace("VHD allocation table is too short");
+        return (-1);
+    }
+    v->bat_offset = get_be64(header + VHD_HEADER_BAT_OFFSET);
+    v->bat_size = (ULONGLONG)entries * 4;
+    /* a bit per sector, padded to a whole sector */
+    v->bitmap_size = (v->block_size / VHD_SECTOR_SIZE / 8 + VHD_SECTOR_SIZE - 1)
+        / VHD_SECTOR_SIZE * VHD_SECTOR_SIZE;
+    v->type = VDISK_VHD_DYNAMIC;
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Reads a part of a block of a dynamic VHD.
+ * @details Sectors marked in the bitmap are read
+ * by runs, the others read as zeroes.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int read_vhd_block(winx_vdisk *v,ULONGLONG block,ULONG offset,char *buffer,ULONG length)
+{
+    ULONGLONG entry, data;
+    UCHAR *bitmap;
+    ULONG first, last, s, n;
+    int present;
+
+    if(get_bat_entry(v,block,&entry) < 0)
+        return (-1);
+    if(entry == VHD_UNALLOCATED){
+        memset(buffer,0,length);
+        return 0;
+    }
+    bitmap = get_bitmap(v,block,entry);
+    if(bitmap == NULL)
+        return (-1);
+    data = entry * VHD_SECTOR_SIZE + v->bitmap_size;
+
+    first = offset / VHD_SECTOR_SIZE;
+    last = (offset + length - 1) / VHD_SECTOR_SIZE;
+    while(first <= last){
+        present = (bitmap[first >> 3] >> (7 - (first & 7))) & 1;
+        for(s = first + 1; s <= last; s++){
+            if(((bitmap[s >> 3] >> (7 - (s & 7))) & 1) != present)
+                break;
+        }
+        /* bytes of the run within the range requested */
+        n = (ULONG)min((ULONGLONG)s * VHD_SECTOR_SIZE - offset,(ULONGLONG)length);
+        if(present){
+            if(read_container(v,data + offset,buffer,n) < 0)
+                return (-1);
+        } else {
+            memset(buffer,0,n);
+        }
+        buffer += n;
+        offset += n;
+        length -= n;
+        first = s;
+    }
+    return 0;
+}
+
+/*
+**************************************************************
+*                    VHDX
+**************************************************************
+*/
+
+/**
+ * @internal
+ * @brief Reads the current VHDX header.
+ * @details The valid header with the
+ * greater sequence number is the current one.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int read_vhdx_header(winx_vdisk *v,UCHAR *buffer)
+{
+    UCHAR *header;
+    ULONGLONG sequence = 0;
+    int i, found = 0;
+
+    header = buffer + VHDX_HEADER_SIZE;
+    for(i = 0; i < 2; i++){
+        if(read_container(v,i ? VHDX_HEADER_2 : VHDX_HEADER_1,header,VHDX_HEADER_SIZE) < 0)
+            continue;
+        if(memcmp(header,"head",4))
+            continue;
+        if(crc32c(header,VHDX_HEADER_SIZE) != get_u32(header + 4)){
+            etrace("VHDX header %u is damaged",i + 1);
+            continue;
+        }
+        if(!found || get_u64(header + 8) > sequence){
+            sequence = get_u64(header + 8);
+            memcpy(buffer,header,VHDX_HEADER_SIZE);
+            found = 1;
+        }
+    }
+    if(!found){
+        etrace("VHDX headers are damaged");
+        return (-1);
+    }
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Locates the allocation table
+ * and the metadata of a VHDX file.
+ * @param[out] metadata offset of the metadata region.
+ * @param[out] metadata_size size of the metadata region.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int read_vhdx_regions(winx_vdisk *v,UCHAR *buffer,
+    ULONGLONG *metadata,ULONG *metadata_size)
+{
+    UCHAR *entry;
+    ULONG i, count;
+    int found = 0;
+
+    for(i = 0; i < 2 && !found; i++){
+        if(read_container(v,i ? VHDX_REGIONS_2 : VHDX_REGIONS_1,buffer,VHDX_REGIONS_SIZE) < 0)
+            continue;
+        if(memcmp(buffer,"regi",4) || crc32c(buffer,VHDX_REGIONS_SIZE) != get_u32(buffer + 4)){
+            etrace("VHDX region table %u is damaged",i + 1);
+            continue;
+        }
+        found = 1;
+    }
+    if(!found) return (-1);
+
+    count = get_u32(buffer + 8);
+    if(count > VHDX_MAX_REGIONS){
+        etrace("too many VHDX regions: %u",count);
+        return (-1);
+    }
+    v->bat_size = 0; *metadata_size = 0;
+    for(i = 0; i < count; i++){
+        entry = buffer + 16 + i * 32;
+        if(!memcmp(entry,bat_guid,16)){
+            v->bat_offset = get_u64(entry + 16);
+            v->bat_size = get_u32(entry + 24);
+        } else if(!memcmp(entry,metadata_guid,16)){
+            *metadata = get_u64(entry + 16);
+            *metadata_size = get_u32(entry + 24);
+        } else if(get_u32(entry + 28) & VHDX_REQUIRED){
+            etrace("unknown VHDX region is required");
+            return (-1);
+        }
+    }
+    if(v->bat_size == 0 || *metadata_size < VHDX_METADATA_SIZE){
+        etrace("VHDX allocation table or metadata not found");
+        return (-1);
+    }
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Reads an item of VHDX metadata.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int read_vhdx_item(winx_vdisk *v,UCHAR *entry,ULONGLONG metadata,
+    ULONG metadata_size,void *value,ULONG length)
+{
+    ULONG offset = get_u32(entry + 16);
+
+    if(get_u32(entry + 20) < length || offset > metadata_size
+      || length > metadata_size - offset){
+        etrace("VHDX metadata item is out of the region");
+        return (-1);
+    }
+    return read_container(v,metadata + offset,value,length);
+}
+
+/**
+ * @internal
+ * @brief Opens a VHDX file.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int open_vhdx(winx_vdisk *v)
+{
+    UCHAR *buffer, *entry, value[8];
+    ULONGLONG metadata = 0, payload;
+    ULONG metadata_size, sector_size = 0;
+    ULONG i, count, flags = 0;
+    int result = -1;
+
+    /* fits the region table, and the headers as well */
+    buffer = winx_tmalloc(VHDX_REGIONS_SIZE);
+    if(buffer == NULL){
+        etrace("cannot allocate %u bytes of memory",VHDX_REGIONS_SIZE);
+        return (-1);
+    }
+
+    if(read_vhdx_header(v,buffer) < 0)
+        goto done;
+    /* the log must be replayed before reading */
+    for(i = 0; i < 16; i++) if(buffer[48 + i]) break;
+    if(i < 16){
+        etrace("VHDX has a log to be replayed, it is not supported");
+        goto done;
+    }
+
+    if(read_vhdx_regions(v,buffer,&metadata,&metadata_size) < 0)
+        goto done;
+    if(read_container(v,metadata,buffer,VHDX_METADATA_SIZE) < 0)
+        goto done;
+    if(memcmp(buffer,"metadata",8)){
+        etrace("VHDX metadata is damaged");
+        goto done;
+    }
+    count = get_u16(buffer + 10);
+    if(count > VHDX_MAX_METADATA){
+        etrace("too many VHDX metadata items: %u",count);
+        goto done;
+    }
+    v->size = 0; v->block_size = 0;
+    for(i = 0; i < count; i++){
+        entry = buffer + 32 + i * 32;
+        if(!memcmp(entry,file_parameters_guid,16)){
+            if(read_vhdx_item(v,entry,metadata,metadata_size,value,8) < 0)
+                goto done;
+            v->block_size = get_u32(value);
+            flags = get_u32(value + 4);
+        } else if(!memcmp(entry,virtual_disk_size_guid,16)){
+            if(read_vhdx_item(v,entry,metadata,metadata_size,value,8) < 0)
+                goto done;
+            v->size = get_u64(value);
+        } else if(!memcmp(entry,logical_sector_size_guid,16)){
+            if(read_vhdx_item(v,entry,metadata,metadata_size,value,4) < 0)
+                goto done;
+            sector_size = get_u32(value);
+        } else if(get_u32(entry + 24) & VHDX_METADATA_REQUIRED){
+            etrace("unknown VHDX metadata item is required");
+            goto done;
+        }
+    }
+    if(flags & VHDX_HAS_PARENT){
+        etrace("differencing VHDX is not supported");
+        goto done;
+    }
+    if(!is_valid_block_size(v->block_size) || v->block_size < 1024 * 1024
+      || (sector_size != 512 && sector_size != 4096) || v->size == 0){
+        etrace("invalid VHDX parameters: block %u, sector %u",v->block_size,sector_size);
+        goto done;
+    }
+
+    /* a sector bitmap block follows each chunk of payload blocks */
+    v->chunk_ratio = (ULONG)(VHDX_CHUNK_SIZE * sector_size / v->block_size);
+    payload = (v->size + v->block_size - 1) / v->block_size;
+    if((payload + (payload - 1) / v->chunk_ratio) * 8 > v->bat_size){
+        etrace("VHDX allocation table is too short");
+        goto done;
+    }
+    v->type = VDISK_VHDX;
+    result = 0;
+
+done:
+    winx_free(buffer);
+    return result;
+}
+
+/**
+ * @internal
+ * @brief Reads a part of a VHDX block.
+ * @return Zero for success, negative
+ * value indicates failure.
+ */
+static int read_vhdx_block(winx_vdisk *v,ULONGLONG block,ULONG offset,char *buffer,ULONG length)
+{
+    ULONGLONG entry;
+
+    if(get_bat_entry(v,block + block / v->chunk_ratio,&entry) < 0)
+        return (-1);
+    if((entry & VHDX_BLOCK_STATE_MASK) != VHDX_BLOCK_FULLY_PRESENT){
+        /* not present, zeroed or unmapped */
+        memset(buffer,0,length);
+        return 0;
+    }
+    return read_container(v,(entry >> 20) * 1024 * 1024 + offset,buffer,length);
+}
+
+/*
+**************************************************************
+*                    Interface routines
+**************************************************************
+*/
+
+/**
+ * @brief Checks whether a path refers
+ * to a virtual disk, by its extension.
+ * @return Nonzero for .vhd and .vhdx files.
+ */
+int winx_is_vdisk_path(const wchar_t *path)
+{
+    const wchar_t *ext;
+
+    DbgCheck1(path,0);
+
+    ext = wcsrchr(path,'.');
+    if(ext == NULL || wcschr(ext,'\\'))
+        return 0;
+    return (!_wcsicmp(ext,L".vhd") || !_wcsicmp(ext,L".vhdx")) ? 1 : 0;
+}
+
+/**
+ * @brief Opens a virtual disk.
+ * @param[in] f the container, opened for reading.
+ * On success it belongs to the virtual disk and
+ * gets closed by winx_vdisk_close.
+ * @return The virtual disk, NULL
+ * indicates failure.
+ */
+winx_vdisk *winx_vdisk_open(WINX_FILE *f)
+{
+    winx_vdisk *v;
+    UCHAR sector[VHD_FOOTER_SIZE];
+    int i, result = -1;
+
+    DbgCheck1(f,NULL);
+
+    v = winx_tmalloc(sizeof(winx_vdisk));
+    if(v == NULL){
+        etrace("cannot allocate %u bytes of memory",sizeof(winx_vdisk));
+        return NULL;
+    }
+    memset(v,0,sizeof(winx_vdisk));
+    for(i = 0; i < VDISK_BAT_PAGES; i++)
+        v->bat[i].index = VDISK_NONE;
+    for(i = 0; i < VDISK_BITMAPS; i++)
+        v->bitmaps[i].index = VDISK_NONE;
+    v->f = f;
+    v->file_size = winx_fsize(f);
+
+    if(v->file_size >= VHD_FOOTER_SIZE){
+        if(read_container(v,v->file_size - VHD_FOOTER_SIZE,sector,VHD_FOOTER_SIZE) >= 0
+          && !memcmp(sector,"conectix",8)){
+            result = open_vhd(v,sector);
+        } else if(read_container(v,0,sector,VHD_FOOTER_SIZE) >= 0){
+            if(!memcmp(sector,"vhdxfile",8))
+                result = open_vhdx(v);
+            else if(!memcmp(sector,"conectix",8))
+                result = open_vhd(v,sector);
+            else
+                etrace("neither VHD nor VHDX");
+        }
+    }
+    if(result < 0){
+        v->f = NULL;
+        winx_vdisk_close(v);
+        return NULL;
+    }
+    itrace("%s, %I64u bytes, block size %u",
+        v->type == VDISK_VHDX ? "VHDX" : (v->type == VDISK_VHD_FIXED
+        ? "fixed VHD" : "dynamic VHD"),v->size,v->block_size);
+    return v;
+}
+
+/**
+ * @brief Opens a virtual disk file for reading.
+ * @param[in] path the native path of the file.
+ * @return A descriptor reading the virtual disk
+ * at its own offsets, winx_fread and winx_fsize
+ * work on it as on a raw image. NULL indicates
+ * failure.
+ */
+WINX_FILE *winx_vdisk_fopen(const wchar_t *path)
+{
+    WINX_FILE *f;
+    winx_vdisk *v;
+
+    DbgCheck1(path,NULL);
+
+    f = winx_fopen(path,"r");
+    if(f == NULL)
+        return NULL;
+    v = winx_vdisk_open(f);
+    if(v == NULL){
+        etrace("cannot open %ws as a virtual disk",path);
+        winx_fclose(f);
+        return NULL;
+    }
+    f = (WINX_FILE *)winx_tmalloc(sizeof(WINX_FILE));
+    if(f == NULL){
+        mtrace();
+        winx_vdisk_close(v);
+        return NULL;
+    }
+    memset(f,0,sizeof(WINX_FILE));
+    f->vdisk = v;
+    return f;
+}
+
+/**
+ * @brief Retrieves the virtual size, in bytes.
+ */
+ULONGLONG winx_vdisk_size(winx_vdisk *v)
+{
+    DbgCheck1(v,0);
+    return v->size;
+}
+
+/**
+ * @brief Checks whether the virtual disk
+ * is stored as it is at the container start,
+ * like fixed VHD are.
+ */
+int winx_vdisk_is_fixed(winx_vdisk *v)
+{
+    DbgCheck1(v,0);
+    return (v->type == VDISK_VHD_FIXED) ? 1 : 0;
+}
+
+/**
+ * @brief Reads a virtual disk.
+ * @param[in] v the virtual disk.
+ * @param[in] offset the virtual offset, in bytes.
+ * @param[out] buffer the buffer receiving data.
+ * @param[in] length number of bytes to be read.
+ * @return Number of bytes read, it's less
+ * than requested at the end of the disk
+ * or when the container cannot be read.
+ */
+ULONG winx_vdisk_read(winx_vdisk *v,ULONGLONG offset,void *buffer,ULONG length)
+{
+    ULONGLONG block;
+    ULONG done, n, block_offset;
+    int result;
+
+    DbgCheck2(v,buffer,0);
+
+    if(offset >= v->size)
+        return 0;
+    if(length > v->size - offset)
+        length = (ULONG)(v->size - offset);
+
+    if(v->type == VDISK_VHD_FIXED)
+        return (read_container(v,offset,buffer,length) < 0) ? 0 : length;
+
+    for(done = 0; done < length; done += n){
+        block = (offset + done) / v->block_size;
+        block_offset = (ULONG)((offset + done) % v->block_size);
+        n = min(length - done,v->block_size - block_offset);
+        if(v->type == VDISK_VHDX)
+            result = read_vhdx_block(v,block,block_offset,(char *)buffer + done,n);
+        else
+            result = read_vhd_block(v,block,block_offset,(char *)buffer + done,n);
+        if(result < 0) break;
+    }
+    return done;
+}
+
+/**
+ * @brief Closes a virtual disk
+ * and its container.
+ */
+void winx_vdisk_close(winx_vdisk *v)
+{
+    int i;
+
+    if(v == NULL)
+        return;
+
+    if(v->hits || v->misses){
+        dtrace("allocation table cache: %I64u hits, %I64u misses",
+            v->hits,v->misses);
+    }
+    for(i = 0; i < VDISK_BAT_PAGES; i++)
+        winx_free(v->bat[i].data);
+    for(i = 0; i < VDISK_BITMAPS; i++)
+        winx_free(v->bitmaps[i].data);
+    winx_fclose(v->f);
+    winx_free(v);
+}
+
+/** @} */
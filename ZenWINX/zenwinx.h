@@ -121,6 +121,9 @@ typedef struct _WINX_FILE {
     size_t io_buffer_size;    /* size of the buffer, in bytes */
     size_t io_buffer_offset;  /* the current offset inside io_buffer */
     LARGE_INTEGER wboffset;   /* offset for write requests in the buffered mode */
+    LARGE_INTEGER base;       /* offset of the partition opened, zero for regular files */
+    ULONGLONG length;         /* size of the partition opened, zero for regular files */
+    struct _winx_vdisk *vdisk; /* the virtual disk opened, NULL for regular files */
 } WINX_FILE, *PWINX_FILE;
 
 #define winx_fileno(f) ((f)->hFile)
@@ -148,6 +151,7 @@ void winx_release_file_contents(void *contents);
 #define WINX_FTW_DUMP_FILES             0x2 /* fill winx_file_disposition structures */
 #define WINX_FTW_ALLOW_PARTIAL_SCAN     0x4 /* admit partially gathered information */
 #define WINX_FTW_SKIP_RESIDENT_STREAMS  0x8 /* skip files of zero length and files located inside MFT */
+#define WINX_FTW_SKIP_PATHS             0x10 /* leave paths empty, the NTFS scanner only */
 
 #define is_readonly(f)            ((f)->flags & FILE_ATTRIBUTE_READONLY)
 #define is_hidden(f)              ((f)->flags & FILE_ATTRIBUTE_HIDDEN)
@@ -180,11 +184,13 @@ typedef struct _winx_file_disposition {
     ULONGLONG clusters;                /* total number of clusters belonging to the file */
     ULONGLONG fragments;               /* total number of file fragments, not blocks */
     winx_blockmap *blockmap;           /* map of the blocks */
+    ULONGLONG size;                    /* logical size of the stream, in bytes */
 } winx_file_disposition;
 
 typedef struct _winx_file_internal_info {
     ULONGLONG BaseMftId;
     ULONGLONG ParentDirectoryMftId;
+    ULONG SequenceNumber;         /* number of times the MFT record has been reused */
 } winx_file_internal_info;
 
 /*
@@ -203,17 +209,104 @@ typedef struct _winx_file_info {
     ULONGLONG creation_time;           /* the file creation time */
     ULONGLONG last_modification_time;  /* the time of the last file modification */
     ULONGLONG last_access_time;        /* the time of the last file access */
+    unsigned long reparse_tag;         /* the reparse point tag, zero for regular files */
+    wchar_t *reparse_target;           /* target of symbolic links and junctions, WOF compression method, NULL otherwise */
 } winx_file_info;
 
 typedef int  (*ftw_filter_callback)(winx_file_info *f,void *user_defined_data);
 typedef void (*ftw_progress_callback)(winx_file_info *f,void *user_defined_data);
 typedef int  (*ftw_terminator)(void *user_defined_data);
 
+/*
+* Progress counters delivered in batches
+* by winx_ftw_ex and winx_scan_disk_ex.
+*/
+typedef struct _winx_ftw_progress {
+    ULONGLONG records;     /* number of mft records or directory entries processed */
+    ULONGLONG bytes_read;  /* number of bytes read from the disk */
+    ULONGLONG files;       /* number of files and streams found */
+    ULONGLONG time;        /* time elapsed since the scan start, in milliseconds */
+    ULONGLONG child_records;     /* child mft records read for attribute lists */
+    ULONGLONG child_hits;        /* child mft records found in memory instead */
+    ULONGLONG max_child_records; /* the most child records read for a single file */
+    ULONGLONG record_hits;       /* records found in the record cache */
+    ULONGLONG record_misses;     /* records the record cache had to read from the disk */
+} winx_ftw_progress;
+
+typedef int (*ftw_batch_callback)(winx_ftw_progress *p,void *user_defined_data);
+
+/*
+* Statistics of a single scan phase. On NTFS the scan
+* consists of the records scan and the paths building,
+* on other file systems the records scan phase only.
+*/
+#define WINX_FTW_PHASE_SCAN  0
+#define WINX_FTW_PHASE_PATHS 1
+#define WINX_FTW_PHASES      2
+
+typedef struct _winx_ftw_phase {
+    ULONGLONG time;        /* in milliseconds */
+    ULONGLONG items;       /* records scanned or paths built */
+    ULONGLONG bytes_read;
+    ULONGLONG allocations; /* number of memory blocks allocated */
+    ULONGLONG peak_memory; /* the most bytes held in the global heap rose above their number at the phase start */
+} winx_ftw_phase;
+
+/* default batch granularity */
+#define WINX_FTW_BATCH_RECORDS 4096
+#define WINX_FTW_BATCH_MSEC    250
+
+struct _winx_mft_cache;
+
+typedef struct _winx_ftw_context {
+    ftw_batch_callback bcb;      /* called once per batch; if it returns a nonzero value the scan terminates */
+    unsigned long batch_records; /* deliver progress every N records, zero selects WINX_FTW_BATCH_RECORDS */
+    unsigned long batch_msec;    /* or every T milliseconds, zero selects WINX_FTW_BATCH_MSEC */
+    winx_ftw_progress progress;  /* counters gathered so far, maintained by the scan */
+    struct _winx_mft_cache *records; /* file records cache shared by scans, NULL selects a private one */
+    /* internal fields, initialized by the scan */
+    ULONGLONG start_time;        /* winx_xtime() at the scan start */
+    ULONGLONG next_records;      /* records counter value triggering the next batch */
+    ULONGLONG next_time;         /* time triggering the next batch */
+    unsigned long ticks;         /* number of updates since the last clock check */
+    int terminated;              /* nonzero value indicates that the callback requested termination */
+    struct _winx_frag_stats *frag; /* fragmentation statistics to be gathered, may be NULL */
+    winx_ftw_phase phases[WINX_FTW_PHASES]; /* statistics of the scan phases, maintained by the scan */
+    ULONGLONG bytes_per_cluster; /* cluster size of the volume or image scanned, set by the scan */
+    int phase;                   /* the phase in progress, negative if none */
+    ULONGLONG phase_memory;      /* bytes held in the global heap at the phase start */
+} winx_ftw_context;
+
 winx_file_info *winx_ftw(wchar_t *path, int flags,
         ftw_filter_callback fcb, ftw_progress_callback pcb, ftw_terminator t,void *user_defined_data);
+winx_file_info *winx_ftw_ex(wchar_t *path, int flags,
+        ftw_filter_callback fcb, winx_ftw_context *ctx, void *user_defined_data);
 
 winx_file_info *winx_scan_disk(char volume_letter, int flags,
         ftw_filter_callback fcb,ftw_progress_callback pcb, ftw_terminator t,void *user_defined_data);
+winx_file_info *winx_scan_disk_ex(char volume_letter, int flags,
+        ftw_filter_callback fcb, winx_ftw_context *ctx, void *user_defined_data);
+winx_file_info *winx_scan_image_ex(wchar_t *path, int flags,
+        ftw_filter_callback fcb, winx_ftw_context *ctx, void *user_defined_data);
+int winx_scan_disk_bounded(char volume_letter, int flags,
+        ULONGLONG memory_limit, wchar_t *scratch_path,
+        ftw_filter_callback fcb, winx_ftw_context *ctx, void *user_defined_data);
+
+/*
+* Headers of the file records of a disk image,
+* kept to refresh its scan incrementally.
+*/
+typedef struct _winx_mft_state {
+    ULONGLONG n_records;         /* number of file records */
+    ULONGLONG *lsn;              /* LSN of the last change of each record, zero for free records */
+    unsigned short *seq;         /* sequence number of each record, zero for free records */
+    ULONGLONG changed_records;   /* number of base records parsed again by the last refresh */
+} winx_mft_state;
+
+struct _winx_scan_results;
+int winx_refresh_image_scan(wchar_t *path, int flags,
+        struct _winx_scan_results *r, winx_ftw_context *ctx, void *user_defined_data);
+void winx_release_mft_state(winx_mft_state *s);
 
 void winx_ftw_release(winx_file_info *filelist);
 #define winx_scan_disk_release(f) winx_ftw_release(f)
@@ -229,8 +322,203 @@ NTSTATUS winx_defrag_fopen(winx_file_info *f,int action,HANDLE *phandle);
 void winx_defrag_fclose(HANDLE h);
 #endif
 
+/* bench.c */
+#define WINX_BENCH_LEVELS  5
+#define WINX_BENCH_SKIPPED ((ULONGLONG)-1)
+
+typedef struct _winx_rnd_state {
+    ULONG seed;
+} winx_rnd_state;
+
+typedef struct _winx_bench {
+    ULONG levels;                                  /* number of levels tested */
+    ULONGLONG level[WINX_BENCH_LEVELS];            /* the parameter varying between the levels */
+    ULONGLONG items[WINX_BENCH_LEVELS];            /* items processed on each level */
+    ULONGLONG reference_time[WINX_BENCH_LEVELS];   /* time taken by the former routine, in milliseconds, WINX_BENCH_SKIPPED if not measured */
+    ULONGLONG time[WINX_BENCH_LEVELS];             /* time taken by the new routine, in milliseconds */
+    ULONGLONG mismatches;                          /* inputs the routines disagree on */
+} winx_bench;
+
+void winx_rnd_init(winx_rnd_state *r,ULONG seed);
+ULONG winx_rnd(winx_rnd_state *r);
+ULONG winx_rnd30(winx_rnd_state *r);
+void winx_bench_init(winx_bench *b);
+
+/* catalog.c */
+#define WINX_CATALOG_DEFAULT_THREADS 8
+
+typedef struct _winx_volume_scan {
+    char volume_letter;         /* the volume letter, zero for disk images */
+    wchar_t *path;              /* the native path of the disk image, NULL for volumes */
+    winx_file_info *filelist;   /* the files found */
+    ULONGLONG files;            /* number of entries in the list */
+    ULONGLONG bytes_per_cluster;
+    winx_ftw_progress progress; /* counters of the scan */
+    int result;                 /* zero for success, -1 for failure, -2 for termination */
+} winx_volume_scan;
+
+typedef struct _winx_catalog {
+    int n_volumes;
+    winx_volume_scan *volumes;
+    ULONGLONG files;            /* files found on all the volumes */
+    ULONGLONG time;             /* time the scan took, in milliseconds */
+} winx_catalog;
+
+typedef int (*catalog_callback)(winx_volume_scan *v,winx_file_info *f,void *user_defined_data);
+
+int winx_catalog_add_volume(winx_catalog *c,char volume_letter);
+int winx_catalog_add_image(winx_catalog *c,wchar_t *path);
+int winx_scan_catalog(winx_catalog *c,int flags,int n_threads,
+    struct _winx_mft_cache *records,ftw_terminator t,void *user_defined_data);
+ULONGLONG winx_walk_catalog(winx_catalog *c,catalog_callback cb,void *user_defined_data);
+void winx_release_catalog(winx_catalog *c);
+
+/* cmap.c */
+typedef struct _winx_cluster_extent {
+    ULONGLONG lcn;       /* the first cluster of the block */
+    ULONGLONG length;    /* size of the block, in clusters */
+    ULONGLONG vcn;       /* the virtual cluster number of the block */
+    ULONGLONG max_end;   /* the largest lcn + length of this and all the preceding blocks */
+    winx_file_info *f;   /* the file owning the block */
+} winx_cluster_extent;
+
+typedef struct _winx_cluster_map {
+    ULONGLONG n_extents;
+    winx_cluster_extent *extents; /* sorted by lcn */
+} winx_cluster_map;
+
+typedef int (*cluster_map_callback)(winx_cluster_extent *e,void *user_defined_data);
+
+winx_cluster_map *winx_build_cluster_map(winx_file_info *filelist);
+ULONGLONG winx_query_cluster_map(winx_cluster_map *m,
+    ULONGLONG lcn,ULONGLONG length,
+    cluster_map_callback cb,void *user_defined_data);
+void winx_release_cluster_map(winx_cluster_map *m);
+
+/* diff.c */
+#define WINX_CHANGE_ADDED     0x1
+#define WINX_CHANGE_DELETED   0x2
+#define WINX_CHANGE_RENAMED   0x4   /* renamed or moved to another directory */
+#define WINX_CHANGE_RESIZED   0x8   /* size or number of clusters changed */
+#define WINX_CHANGE_RETIMED   0x10  /* creation or modification time changed */
+#define WINX_CHANGE_RELOCATED 0x20  /* map of the blocks changed */
+
+typedef struct _winx_scan_change {
+    int changes;                /* a combination of WINX_CHANGE_xxx flags */
+    winx_file_info *old_file;   /* NULL for added streams */
+    winx_file_info *new_file;   /* NULL for deleted streams */
+} winx_scan_change;
+
+typedef int (*winx_scan_diff_callback)(winx_scan_change *c,void *user_defined_data);
+
+int winx_diff_scan_results(struct _winx_scan_results *old_results,
+    struct _winx_scan_results *new_results,winx_scan_diff_callback cb,
+    void *user_defined_data);
+
+/* du.c */
+#define WINX_DU_DEFAULT_TOP 20
+
+typedef struct _winx_du_dir {
+    winx_file_info *f;          /* a stream of the directory, NULL for the missing root */
+    ULONGLONG parent;           /* index of the parent directory, zero for the root */
+    ULONGLONG depth;            /* zero for the root */
+    ULONGLONG direct_clusters;  /* clusters of the files and of the directory itself */
+    ULONGLONG direct_files;
+    ULONGLONG total_clusters;   /* clusters of the entire subtree */
+    ULONGLONG total_files;
+} winx_du_dir;
+
+typedef struct _winx_du_results {
+    ULONGLONG n_dirs;
+    winx_du_dir *dirs;          /* the root goes first */
+    ULONGLONG files;
+    ULONGLONG clusters;
+    ULONGLONG orphans;          /* entries attached to the root since their parents are missing */
+} winx_du_results;
+
+int winx_du_aggregate(winx_file_info *filelist,winx_du_results *r);
+int winx_du_top(winx_du_results *r,ULONGLONG max_depth,ULONGLONG *top,int n_top);
+wchar_t *winx_du_path(winx_du_results *r,ULONGLONG i,wchar_t *root);
+void winx_du_release(winx_du_results *r);
+
+/* dupes.c */
+#define WINX_DUPES_PARTIAL_SIZE    (64 * 1024) /* size of heads and tails hashed first */
+#define WINX_DUPES_DEFAULT_THREADS 4
+
+typedef struct _winx_dupes_group {
+    ULONGLONG size;             /* size of each file, in bytes */
+    ULONGLONG n_files;          /* number of identical files */
+    winx_file_info **files;     /* the files, valid during the callback only */
+    ULONGLONG wasted;           /* bytes taken by all the copies but one */
+} winx_dupes_group;
+
+typedef struct _winx_dupes_stats {
+    ULONGLONG files;            /* files taking part in the search */
+    ULONGLONG same_size;        /* files having companions of the same size */
+    ULONGLONG same_partial_hash;/* files having companions of the same heads and tails */
+    ULONGLONG hashed_entirely;  /* files read entirely */
+    ULONGLONG bytes_read;
+    ULONGLONG groups;           /* groups of duplicates found */
+    ULONGLONG duplicates;       /* files in the groups except one per group */
+    ULONGLONG wasted;           /* total bytes taken by the duplicates */
+} winx_dupes_stats;
+
+typedef int (*winx_dupes_callback)(winx_dupes_group *g,void *user_defined_data);
+
+int winx_find_duplicates(wchar_t *path,ULONGLONG bytes_per_cluster,
+    winx_file_info *filelist,ULONGLONG min_size,int n_threads,
+    winx_dupes_callback cb,ftw_terminator t,void *user_defined_data,
+    winx_dupes_stats *stats);
+
+/* frag.c */
+#define WINX_FRAG_BUCKETS     16 /* 1, 2, 3-4, 5-8, ..., more than 2^14 */
+#define WINX_FRAG_DEFAULT_TOP 10
+#define WINX_FRAG_MAX_TOP     64
+
+typedef struct _winx_frag_file {
+    ULONGLONG fragments;
+    ULONGLONG clusters;
+    winx_file_info *f;
+} winx_frag_file;
+
+/*
+* Fragmentation statistics gathered
+* by winx_scan_disk_ex on the fly.
+*/
+typedef struct _winx_frag_stats {
+    int top_n;                      /* length of the list of the most fragmented files, zero selects WINX_FRAG_DEFAULT_TOP */
+    int n_top;                      /* number of entries in the list */
+    winx_frag_file top[WINX_FRAG_MAX_TOP]; /* the most fragmented files, sort them by winx_frag_stats_sort */
+    ULONGLONG bytes_per_cluster;
+    ULONGLONG files;                /* number of files having at least one cluster */
+    ULONGLONG fragmented_files;
+    ULONGLONG fragments;
+    ULONGLONG clusters;
+    ULONGLONG fragmented_clusters;
+    ULONGLONG histogram[WINX_FRAG_BUCKETS]; /* files by number of fragments */
+    /* free space summary, filled by winx_get_free_space_stats */
+    ULONGLONG free_regions;
+    ULONGLONG free_clusters;
+    ULONGLONG largest_free_region;
+    ULONGLONG free_histogram[WINX_FRAG_BUCKETS]; /* free regions by length in clusters */
+} winx_frag_stats;
+
+int winx_get_free_space_stats(char volume_letter,winx_frag_stats *fs);
+void winx_frag_stats_sort(winx_frag_stats *fs);
+
 /* ftw_ntfs.c */
 /* int64.c */
+/* iso.c */
+typedef struct _winx_iso winx_iso;
+
+winx_iso *winx_iso_open(wchar_t *path);
+winx_file_info *winx_iso_list(winx_iso *iso,wchar_t *path);
+winx_file_info *winx_iso_lookup(winx_iso *iso,wchar_t *path);
+ULONG winx_iso_read(winx_iso *iso,winx_file_info *f,ULONGLONG offset,void *buffer,ULONG length);
+int winx_iso_extract(winx_iso *iso,wchar_t *path,wchar_t *target,
+    ftw_terminator t,void *user_defined_data);
+void winx_iso_close(winx_iso *iso);
+
 /* keyboard.c */
 int winx_kb_init(void);
 int winx_kb_open(void);
@@ -290,6 +578,37 @@ void winx_heap_free(void *addr);
 typedef int (*winx_killer)(size_t n);
 void winx_set_killer(winx_killer k);
 
+typedef struct _winx_heap_stats {
+    ULONGLONG allocations;        /* number of blocks allocated so far */
+    ULONGLONG frees;              /* number of blocks released so far */
+    ULONGLONG heap_bytes;         /* bytes held in blocks of the global heap */
+    ULONGLONG peak_heap_bytes;    /* the most held since the last winx_reset_heap_peak call */
+    ULONGLONG private_bytes;      /* memory committed by the process, in bytes */
+    ULONGLONG peak_private_bytes; /* the most ever committed since the process start */
+    ULONGLONG working_set;        /* resident memory of the process, in bytes */
+    ULONGLONG peak_working_set;   /* the most ever resident since the process start */
+} winx_heap_stats;
+
+int winx_get_heap_stats(winx_heap_stats *hs);
+ULONGLONG winx_reset_heap_peak(void);
+
+/* mftcache.c */
+#define WINX_MFT_CACHE_DEFAULT_SIZE (16 * 1024 * 1024)
+
+typedef struct _winx_mft_cache_stats {
+    ULONGLONG hits;       /* records found in memory */
+    ULONGLONG misses;     /* records read from the disk */
+    ULONGLONG evictions;  /* blocks dropped to free space */
+    ULONGLONG blocks;     /* blocks held now */
+    ULONGLONG size;       /* bytes held now */
+} winx_mft_cache_stats;
+
+typedef struct _winx_mft_cache winx_mft_cache;
+
+winx_mft_cache *winx_create_mft_cache(ULONGLONG size);
+void winx_get_mft_cache_stats(winx_mft_cache *c,winx_mft_cache_stats *s);
+void winx_destroy_mft_cache(winx_mft_cache *c);
+
 /* misc.c */
 void winx_sleep(int msec);
 
@@ -320,6 +639,63 @@ int winx_open_mutex(wchar_t *name,HANDLE *phandle);
 int winx_release_mutex(HANDLE h);
 void winx_destroy_mutex(HANDLE h);
 
+/* nameidx.c */
+#define WINX_NAME_PREFIX 0x1 /* the name starts by the pattern */
+#define WINX_NAME_SUFFIX 0x2 /* the name ends by the pattern */
+
+#define WINX_NAME_INDEX_DEFAULT_BLOCK 4
+#define WINX_NAME_INDEX_MAX_TRIGRAMS  16 /* trigrams of a pattern intersected at most */
+
+typedef struct _winx_name_index {
+    ULONG bucket_bits;         /* trigrams are hashed to 2^bucket_bits lists */
+    ULONG block_size;          /* files sharing each entry of the lists */
+    ULONGLONG n_files;
+    winx_file_info **files;    /* in order of the list of files */
+    ULONGLONG *offsets;        /* 2^bucket_bits + 1 offsets of the lists */
+    ULONGLONG n_postings;
+    ULONG *postings;           /* ascending numbers of blocks in each list */
+} winx_name_index;
+
+typedef int (*name_index_callback)(winx_file_info *f,void *user_defined_data);
+
+winx_name_index *winx_build_name_index(winx_file_info *filelist,ULONG block_size);
+ULONGLONG winx_query_name_index(winx_name_index *ni,const wchar_t *pattern,
+    int flags,name_index_callback cb,void *user_defined_data);
+void winx_release_name_index(winx_name_index *ni);
+
+/* ntfstest.c */
+#define WINX_NTFS_TEST_DEFAULT_FILES     100000
+#define WINX_NTFS_TEST_DEFAULT_MUTATIONS 100
+
+typedef struct _winx_ntfs_image_test {
+    winx_bench b;                                               /* levels: files in each image, streams found; no reference */
+    winx_ftw_phase phases[WINX_BENCH_LEVELS][WINX_FTW_PHASES];  /* statistics of the scan phases on each level */
+    ULONG mutations;                                            /* corrupted images scanned */
+    ULONG failures;                                             /* of them, scans which failed cleanly */
+} winx_ntfs_image_test;
+
+int winx_test_ntfs_image(wchar_t *path,ULONG files,ULONG mutations,
+    ULONG seed,winx_ntfs_image_test *t);
+
+/* partition.c */
+typedef struct _winx_partition {
+    struct _winx_partition *next;
+    struct _winx_partition *prev;
+    int number;                 /* N of image.img#pN */
+    ULONGLONG offset;           /* in bytes */
+    ULONGLONG length;           /* in bytes */
+    int gpt;                    /* nonzero value indicates a GPT partition */
+    unsigned char type;         /* MBR partition type, zero for GPT */
+    unsigned char type_guid[16];/* GPT partition type, zeroes for MBR */
+    wchar_t name[37];           /* GPT partition name, empty for MBR */
+} winx_partition;
+
+winx_partition *winx_get_partitions(wchar_t *path);
+void winx_release_partitions(winx_partition *list);
+int winx_get_partition_number(const wchar_t *path);
+WINX_FILE *winx_open_partition(const wchar_t *path);
+WINX_FILE *winx_open_image(const wchar_t *path);
+
 /* path.c */
 void winx_path_remove_extension(wchar_t *path);
 void winx_path_remove_filename(wchar_t *path);
@@ -357,6 +733,57 @@ int winx_bootex_check(const wchar_t *command);
 int winx_bootex_register(const wchar_t *command);
 int winx_bootex_unregister(const wchar_t *command);
 
+/* runlist.c */
+#define WINX_RUN_SPARSE ((ULONGLONG)-1) /* LCN of virtual runs */
+#define WINX_RUN_TEST_DEFAULT_ARRAYS 1024
+#define WINX_RUN_TEST_DEFAULT_PASSES 64
+
+typedef struct _winx_run {
+    ULONGLONG vcn;
+    ULONGLONG lcn;
+    ULONGLONG length;
+} winx_run;
+
+typedef struct _winx_run_decoder {
+    const unsigned char *p;     /* the next mapping pair */
+    const unsigned char *end;   /* the end of the attribute */
+    ULONGLONG vcn;              /* VCN of the next run */
+    ULONGLONG lcn;              /* LCN of the last run which is not virtual */
+    int corrupted;              /* nonzero if a malformed mapping pair has been found */
+} winx_run_decoder;
+
+typedef struct _winx_run_decoder_test {
+    winx_bench b;               /* a single level: arrays decoded, runs in them */
+    ULONGLONG corrupted;        /* arrays cut by malformed pairs */
+} winx_run_decoder_test;
+
+void winx_run_decoder_init(winx_run_decoder *d,
+    const void *pairs,const void *end,ULONGLONG low_vcn);
+ULONG winx_decode_runs(winx_run_decoder *d,winx_run *runs,ULONG n);
+int winx_test_run_decoder(ULONG n_arrays,ULONG passes,
+    ULONG seed,winx_run_decoder_test *t);
+
+/* snapshot.c */
+typedef struct _winx_scan_results {
+    char volume_letter;
+    ULONGLONG bytes_per_cluster;
+    winx_file_info *filelist;
+    winx_cluster_map *cmap;       /* optional */
+    winx_mft_state *mft;          /* optional, set by winx_refresh_image_scan */
+    struct _winx_time_index *times; /* optional, never saved */
+    winx_name_index *names;       /* optional */
+} winx_scan_results;
+
+int winx_save_scan_results(const wchar_t *filename,winx_scan_results *r);
+int winx_load_scan_results(const wchar_t *filename,winx_scan_results *r);
+void winx_release_scan_results(winx_scan_results *r);
+
+/* sort.c */
+#define WINX_SORT_POINTERS 0x1 /* items are pointers, keys lie in the structures pointed to */
+#define WINX_SORT_ULONG    0x2 /* keys are 32-bit */
+
+int winx_radix_sort(void *items,ULONGLONG n,size_t item_size,size_t key_offset,int flags);
+
 /* stdio.c */
 #ifdef _NTNDK_H_
 int winx_putch(int ch);
@@ -462,8 +889,45 @@ typedef struct _winx_time {
 } winx_time;
 
 int winx_get_system_time(winx_time *t);
+ULONGLONG winx_get_system_time_raw(void);
+LONGLONG winx_get_time_bias(void);
+ULONGLONG winx_dos2time(unsigned short date,unsigned short time,unsigned char centiseconds);
 int winx_get_local_time(winx_time *t);
 
+/* timeidx.c */
+#define WINX_TIME_MODIFIED 0
+#define WINX_TIME_CREATED  1
+
+typedef struct _winx_time_entry {
+    ULONGLONG time;      /* the time of the file, copied for the search */
+    winx_file_info *f;
+} winx_time_entry;
+
+typedef struct _winx_time_index {
+    ULONGLONG n_files;
+    winx_time_entry *by_mtime; /* sorted by last modification time */
+    winx_time_entry *by_ctime; /* sorted by creation time */
+} winx_time_index;
+
+typedef int (*time_index_callback)(winx_time_entry *e,void *user_defined_data);
+
+winx_time_index *winx_build_time_index(winx_file_info *filelist);
+ULONGLONG winx_query_time_index(winx_time_index *ti,int key,
+    ULONGLONG from,ULONGLONG to,time_index_callback cb,
+    void *user_defined_data);
+void winx_release_time_index(winx_time_index *ti);
+
+/* vdisk.c */
+typedef struct _winx_vdisk winx_vdisk;
+
+int winx_is_vdisk_path(const wchar_t *path);
+winx_vdisk *winx_vdisk_open(WINX_FILE *f);
+WINX_FILE *winx_vdisk_fopen(const wchar_t *path);
+ULONGLONG winx_vdisk_size(winx_vdisk *v);
+int winx_vdisk_is_fixed(winx_vdisk *v);
+ULONG winx_vdisk_read(winx_vdisk *v,ULONGLONG offset,void *buffer,ULONG length);
+void winx_vdisk_close(winx_vdisk *v);
+
 /* volume.c */
 #define DRIVE_ASSIGNED_BY_SUBST_COMMAND 1200
 int winx_get_drive_type(char letter);
@@ -535,6 +999,66 @@ winx_volume_region *winx_sub_volume_region(winx_volume_region *rlist,
         ULONGLONG lcn,ULONGLONG length);
 void winx_release_free_volume_regions(winx_volume_region *rlist);
 
+#define WINX_FREE_REGION_TEST_DEFAULT_CLUSTERS (64 * 1024 * 1024)
+#define WINX_FREE_REGION_TEST_DEFAULT_PASSES   4
+
+typedef struct _winx_free_region_test {
+    ULONGLONG clusters;         /* clusters in each bitmap */
+    winx_bench b;               /* levels: mean length of runs of free and used clusters, free regions found */
+} winx_free_region_test;
+
+int winx_test_free_region_scan(ULONGLONG clusters,ULONG passes,
+    ULONG seed,winx_free_region_test *t);
+
+/* fsprobe.c */
+#define WINX_FS_UNKNOWN 0
+#define WINX_FS_NTFS    1
+#define WINX_FS_FAT12   2
+#define WINX_FS_FAT16   3
+#define WINX_FS_FAT32   4
+#define WINX_FS_EXFAT   5
+#define WINX_FS_ISO9660 6
+#define WINX_FS_UDF     7
+#define WINX_FS_REFS    8
+
+typedef struct _winx_fs_probe {
+    int type;                              /* one of WINX_FS_xxx */
+    char fs_name[MAX_FS_NAME_LENGTH + 1];  /* file system name, as winx_get_volume_information reports it */
+    ULONGLONG total_bytes;                 /* size of the file system, in bytes */
+    ULONGLONG total_clusters;              /* total number of clusters */
+    ULONGLONG bytes_per_cluster;           /* cluster size, in bytes */
+    ULONG sectors_per_cluster;             /* number of sectors in each cluster */
+    ULONG bytes_per_sector;                /* sector size, in bytes */
+    ULONGLONG serial_number;               /* the volume serial number, zero if none */
+} winx_fs_probe;
+
+int winx_probe_file_system(wchar_t *path,winx_fs_probe *p);
+
+/* regions.c */
+typedef struct _winx_region_set winx_region_set;
+
+winx_region_set *winx_create_region_set(void);
+void winx_destroy_region_set(winx_region_set *s);
+void winx_region_set_add(winx_region_set *s,ULONGLONG lcn,ULONGLONG length);
+void winx_region_set_sub(winx_region_set *s,ULONGLONG lcn,ULONGLONG length);
+winx_volume_region *winx_region_set_find(winx_region_set *s,ULONGLONG lcn);
+ULONGLONG winx_region_set_count(winx_region_set *s);
+ULONGLONG winx_region_set_clusters(winx_region_set *s);
+winx_region_set *winx_region_set_from_list(winx_volume_region *rlist);
+winx_volume_region *winx_region_set_to_list(winx_region_set *s);
+
+#define WINX_REGION_TEST_DEFAULT_REGIONS 1000000
+#define WINX_REGION_TEST_DEFAULT_OPS     10000
+#define WINX_REGION_TEST_LIST_LIMIT      100000
+
+typedef struct _winx_region_set_test {
+    winx_bench b;                                  /* levels: regions in each set initially, operations on it; lists are the reference */
+    ULONGLONG build_time[WINX_BENCH_LEVELS];       /* time taken to build the set, in milliseconds */
+} winx_region_set_test;
+
+int winx_test_region_set(ULONGLONG max_regions,ULONG n_ops,
+    ULONG seed,winx_region_set_test *t);
+
 /* zenwinx.c */
 int winx_init_library(void);
 void winx_unload_library(void);
@@ -101,28 +101,114 @@ static struct winx_command cmd_shutdown =
 };
 
 /* ls */
-static int ls_filter(winx_file_info* f, void* data)
+static int ls_progress(winx_ftw_progress* p, void* data)
 {
-	return 0;
+	/* called once per batch, abort on Pause/Break */
+	return (winx_breakhit(0) == 0) ? 1 : 0;
 }
 
-static void ls_progress(winx_file_info* f, void* data)
+/* splits IMAGE:\PATH into the native path of the image and the path inside of it */
+static wchar_t* split_image_path(char* arg, wchar_t** inner)
 {
-	if (is_directory(f))
-		winx_printf(" [%S]", f->name);
-	else
-		winx_printf(" %S", f->name);
+	wchar_t* image;
+	char* p;
+
+	*inner = NULL;
+	p = strlen(arg) > 2 ? strchr(arg + 2, ':') : NULL;
+	if (!p)
+		return NULL;
+	*p = 0;
+	image = winx_swprintf(L"\\??\\%S", arg);
+	*p = ':';
+	*inner = winx_swprintf(L"%S", p + 1);
+	if (!image || !*inner)
+	{
+		winx_free(image);
+		winx_free(*inner);
+		*inner = NULL;
+		return NULL;
+	}
+	return image;
+}
+
+/* other images get scanned, files of the directory are picked from the results */
+static int ls_scanned_image(wchar_t* image, wchar_t* inner)
+{
+	winx_file_info* list;
+	winx_file_info* f;
+	winx_ftw_context ctx = { 0 };
+	wchar_t* dir;
+	wchar_t* s;
+	size_t length;
+
+	dir = winx_swprintf(L"%s:%s", image, inner);
+	if (!dir)
+		return (-1);
+	while (dir[0] && dir[wcslen(dir) - 1] == '\\')
+		dir[wcslen(dir) - 1] = 0;
+	length = wcslen(dir);
+
+	ctx.bcb = ls_progress;
+	list = winx_scan_image_ex(image, 0, NULL, &ctx, NULL);
+	if (!list)
+	{
+		winx_printf("error cannot read %S\n", image);
+		winx_free(dir);
+		return (-1);
+	}
+	for (f = list; f; f = f->next)
+	{
+		s = f->path ? wcsrchr(f->path, '\\') : NULL;
+		if (s && (size_t)(s - f->path) == length && _wcsnicmp(f->path, dir, length) == 0
+			&& wcscmp(f->name, L".") && !wcschr(f->name, ':'))
+		{
+			if (is_directory(f))
+				winx_printf(" [%S]", f->name);
+			else
+				winx_printf(" %S", f->name);
+		}
+		if (f->next == list)
+			break;
+	}
+	winx_printf("\n");
+	winx_ftw_release(list);
+	winx_free(dir);
+	return 0;
 }
 
-static int ls_terminator(void* data)
+static int ls_image(wchar_t* image, wchar_t* inner)
 {
+	winx_iso* iso;
+	winx_file_info* list;
+	winx_file_info* f;
+
+	iso = winx_iso_open(image);
+	if (!iso)
+		return ls_scanned_image(image, inner);
+	list = winx_iso_list(iso, inner);
+	for (f = list; f; f = f->next)
+	{
+		if (is_directory(f))
+			winx_printf(" [%S]", f->name);
+		else
+			winx_printf(" %S", f->name);
+		if (f->next == list)
+			break;
+	}
+	winx_printf("\n");
+	winx_ftw_release(list);
+	winx_iso_close(iso);
 	return 0;
 }
 
 static int cmd_ls_func(int argc, char** argv)
 {
+	int rc;
 	wchar_t* path;
+	wchar_t* inner;
 	winx_file_info* list;
+	winx_file_info* f;
+	winx_ftw_context ctx = { 0 };
 
 	if (argc < 2)
 	{
@@ -138,6 +224,14 @@ static int cmd_ls_func(int argc, char** argv)
 		}
 		return 0;
 	}
+	path = split_image_path(argv[1], &inner);
+	if (path)
+	{
+		rc = ls_image(path, inner);
+		winx_free(inner);
+		winx_free(path);
+		return rc;
+	}
 	path = winx_swprintf(L"\\??\\%S", argv[1]);
 	if (!path)
 	{
@@ -145,7 +239,18 @@ static int cmd_ls_func(int argc, char** argv)
 		return (-1);
 	}
 
-	list = winx_ftw(path, 0, ls_filter, ls_progress, ls_terminator, NULL);
+	ctx.bcb = ls_progress;
+	list = winx_ftw_ex(path, 0, NULL, &ctx, NULL);
+	/* the list head is the last entry found */
+	for (f = list ? list->prev : NULL; f; f = f->prev)
+	{
+		if (is_directory(f))
+			winx_printf(" [%S]", f->name);
+		else
+			winx_printf(" %S", f->name);
+		if (f == list)
+			break;
+	}
 	winx_printf("\n");
 	winx_ftw_release(list);
 	winx_free(path);
@@ -158,7 +263,58 @@ static struct winx_command cmd_ls =
 	.next = 0,
 	.name = "ls",
 	.func = cmd_ls_func,
-	.help = "ls PATH\nList files.",
+	.help = "ls PATH|IMAGE:\\PATH\nList files, directories of ISO, VHD, VHDX and disk images are listed without a mount.\nIMAGE#pN refers to partition N of a disk image.",
+};
+
+/* extract */
+static int extract_terminator(void* data)
+{
+	return (winx_breakhit(0) == 0) ? 1 : 0;
+}
+
+static int cmd_extract_func(int argc, char** argv)
+{
+	int rc;
+	winx_iso* iso;
+	wchar_t* image;
+	wchar_t* inner;
+	wchar_t* target;
+
+	if (argc < 3)
+		return 0;
+	image = split_image_path(argv[1], &inner);
+	if (!image)
+	{
+		winx_printf("error invalid path %s\n", argv[1]);
+		return (-1);
+	}
+	iso = winx_iso_open(image);
+	if (!iso)
+	{
+		winx_printf("error cannot open %S\n", image);
+		winx_free(inner);
+		winx_free(image);
+		return (-1);
+	}
+	target = winx_swprintf(L"\\??\\%S", argv[2]);
+	rc = target ? winx_iso_extract(iso, inner, target, extract_terminator, NULL) : (-1);
+	if (rc == -2)
+		winx_printf("terminated\n");
+	else if (rc < 0)
+		winx_printf("error cannot extract %S\n", inner);
+	winx_free(target);
+	winx_iso_close(iso);
+	winx_free(inner);
+	winx_free(image);
+	return rc;
+}
+
+static struct winx_command cmd_extract =
+{
+	.next = 0,
+	.name = "extract",
+	.func = cmd_extract_func,
+	.help = "extract IMAGE:\\PATH TARGET\nCopy a file or a directory out of an ISO image.",
 };
 
 /* call */
@@ -259,6 +415,7 @@ static struct winx_command cmd_del =
 static int cmd_mount_func(int argc, char** argv)
 {
 	int i, status;
+	int partition = 0;
 	wchar_t letter = 0;
 	wchar_t* path = NULL;
 	if (argc < 2)
@@ -267,12 +424,20 @@ static int cmd_mount_func(int argc, char** argv)
 	{
 		if (strncmp(argv[i], "-d=", 3) == 0)
 			letter = argv[i][3];
+		else if (strncmp(argv[i], "-p=", 3) == 0)
+			partition = atoi(argv[i] + 3);
 		else
 			path = winx_swprintf(L"\\??\\%S", argv[i]);
 	}
 	if (!path)
 		return -1;
-	status = naoh_imdisk_mount(path, letter);
+	/* FILE#pN is the same as -p=N FILE */
+	if (winx_get_partition_number(path))
+	{
+		partition = winx_get_partition_number(path);
+		*wcsrchr(path, '#') = 0;
+	}
+	status = naoh_imdisk_mount(path, letter, partition);
 	winx_free(path);
 	return status;
 }
@@ -282,12 +447,1334 @@ static struct winx_command cmd_mount =
 	.next = 0,
 	.name = "mount",
 	.func = cmd_mount_func,
-	.help = "mount [-d=X] FILE\nMount ISO|IMG file.",
+	.help = "mount [-d=X] [-p=N] FILE\nMount ISO|IMG|VHD file, -p=N mounts its partition N.",
+};
+
+/* part */
+static void part_print_fs(wchar_t* path)
+{
+	winx_fs_probe fs;
+	char* suffixes[] = { "B", "KB", "MB", "GB", "TB", "PB" };
+	char* names[] = { "?", "NTFS", "FAT12", "FAT16", "FAT32", "exFAT", "ISO9660", "UDF", "ReFS" };
+
+	if (winx_probe_file_system(path, &fs) < 0 || fs.type == WINX_FS_UNKNOWN)
+	{
+		winx_printf("    FS=?\n");
+		return;
+	}
+	winx_printf("    FS=%s CLUSTER=%s", names[fs.type],
+		winx_get_human_size(fs.bytes_per_cluster, suffixes, 1024));
+	winx_printf(" SIZE=%s\n", winx_get_human_size(fs.total_bytes, suffixes, 1024));
+}
+
+static int cmd_part_func(int argc, char** argv)
+{
+	wchar_t* path;
+	wchar_t* ppath;
+	winx_partition* list;
+	winx_partition* p;
+	char* suffixes[] = { "B", "KB", "MB", "GB", "TB", "PB" };
+
+	if (argc < 2)
+		return 0;
+	path = winx_swprintf(L"\\??\\%S", argv[1]);
+	if (!path)
+		return (-1);
+	list = winx_get_partitions(path);
+	for (p = list; p; p = p->next)
+	{
+		if (p->gpt)
+			winx_printf("#p%d OFFSET=%I64u SIZE=%s GPT [%S]\n", p->number, p->offset,
+				winx_get_human_size(p->length, suffixes, 1024), p->name);
+		else
+			winx_printf("#p%d OFFSET=%I64u SIZE=%s TYPE=0x%02x\n", p->number, p->offset,
+				winx_get_human_size(p->length, suffixes, 1024), p->type);
+		ppath = winx_swprintf(L"%s#p%d", path, p->number);
+		if (ppath)
+		{
+			part_print_fs(ppath);
+			winx_free(ppath);
+		}
+		if (p->next == list)
+			break;
+	}
+	if (!list)
+	{
+		/* images of a single volume */
+		winx_printf("no partitions found\n");
+		part_print_fs(path);
+	}
+	winx_release_partitions(list);
+	winx_free(path);
+	return 0;
+}
+
+static struct winx_command cmd_part =
+{
+	.next = 0,
+	.name = "part",
+	.func = cmd_part_func,
+	.help = "part FILE\nList partitions of a disk image and their file systems, FILE#pN refers to partition N.",
+};
+
+/* frag */
+static void frag_print_histogram(const char* title, ULONGLONG* histogram)
+{
+	int i;
+	ULONGLONG lo, hi;
+	winx_printf("%s:\n", title);
+	for (i = 0; i < WINX_FRAG_BUCKETS; i++)
+	{
+		if (histogram[i] == 0)
+			continue;
+		hi = (ULONGLONG)1 << i;
+		lo = (hi >> 1) + 1;
+		if (i == 0)
+			winx_printf("  %20s %I64u\n", "1", histogram[i]);
+		else if (i == WINX_FRAG_BUCKETS - 1)
+			winx_printf("  %9I64u and more %I64u\n", lo, histogram[i]);
+		else if (lo == hi)
+			winx_printf("  %20I64u %I64u\n", hi, histogram[i]);
+		else
+			winx_printf("  %9I64u - %8I64u %I64u\n", lo, hi, histogram[i]);
+	}
+}
+
+static int cmd_frag_func(int argc, char** argv)
+{
+	int i;
+	char letter = 0;
+	winx_frag_stats fs = { 0 };
+	winx_ftw_context ctx = { 0 };
+	winx_file_info* list;
+	ULONGLONG bpc;
+	char* suffixes[] = { "B", "KB", "MB", "GB", "TB", "PB" };
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "-n=", 3) == 0)
+			fs.top_n = atoi(argv[i] + 3);
+		else
+			letter = argv[i][0];
+	}
+	if (!letter)
+	{
+		winx_printf("error invalid volume\n");
+		return (-1);
+	}
+
+	ctx.bcb = ls_progress;
+	ctx.frag = &fs;
+	list = winx_scan_disk_ex(letter, WINX_FTW_DUMP_FILES | WINX_FTW_SKIP_RESIDENT_STREAMS,
+		NULL, &ctx, NULL);
+	if (ctx.terminated)
+	{
+		winx_printf("terminated\n");
+		winx_scan_disk_release(list);
+		return (-2);
+	}
+	winx_frag_stats_sort(&fs);
+	bpc = fs.bytes_per_cluster;
+
+	winx_printf("files: %I64u, fragmented: %I64u (%I64u%%)\n", fs.files, fs.fragmented_files,
+		fs.files ? fs.fragmented_files * 100 / fs.files : 0);
+	winx_printf("fragments: %I64u, %I64u.%02I64u per file\n", fs.fragments,
+		fs.files ? fs.fragments / fs.files : 0, fs.files ? fs.fragments * 100 / fs.files % 100 : 0);
+	winx_printf("used space: %s\n", winx_get_human_size(fs.clusters * bpc, suffixes, 1024));
+	winx_printf("fragmented space: %s (%I64u%%)\n", winx_get_human_size(fs.fragmented_clusters * bpc, suffixes, 1024),
+		fs.clusters ? fs.fragmented_clusters * 100 / fs.clusters : 0);
+	frag_print_histogram("files by fragments", fs.histogram);
+
+	if (fs.n_top)
+		winx_printf("most fragmented files:\n");
+	for (i = 0; i < fs.n_top; i++)
+	{
+		winx_printf("  %10I64u %10s %S\n", fs.top[i].fragments,
+			winx_get_human_size(fs.top[i].clusters * bpc, suffixes, 1024), fs.top[i].f->path);
+	}
+
+	winx_printf("free space: %s in %I64u regions\n",
+		winx_get_human_size(fs.free_clusters * bpc, suffixes, 1024), fs.free_regions);
+	winx_printf("largest free region: %s\n",
+		winx_get_human_size(fs.largest_free_region * bpc, suffixes, 1024));
+	frag_print_histogram("free regions by clusters", fs.free_histogram);
+
+	winx_scan_disk_release(list);
+	return 0;
+}
+
+static struct winx_command cmd_frag =
+{
+	.next = 0,
+	.name = "frag",
+	.func = cmd_frag_func,
+	.help = "frag [-n=N] X:\nShow fragmentation report of the volume.",
+};
+
+/* scan results shared by the queries */
+static winx_scan_results scan_cache;
+/* file records shared by all the scans of the session */
+static winx_mft_cache* record_cache;
+
+static int naoh_scan_volume(char letter)
+{
+	winx_ftw_context ctx = { 0 };
+	winx_volume_information v;
+
+	letter = winx_toupper(letter);
+	if (scan_cache.filelist && scan_cache.volume_letter == letter)
+		return 0;
+	winx_release_scan_results(&scan_cache);
+
+	if (winx_get_volume_information(letter, &v) < 0)
+	{
+		winx_printf("error invalid volume\n");
+		return (-1);
+	}
+	ctx.bcb = ls_progress;
+	ctx.records = record_cache;
+	/* resident streams stay, queries by names and times need them */
+	scan_cache.filelist = winx_scan_disk_ex(letter, WINX_FTW_DUMP_FILES, NULL, &ctx, NULL);
+	if (ctx.terminated || !scan_cache.filelist)
+	{
+		winx_printf("error cannot scan %c:\n", letter);
+		winx_release_scan_results(&scan_cache);
+		return (-1);
+	}
+	scan_cache.volume_letter = letter;
+	scan_cache.bytes_per_cluster = v.bytes_per_cluster;
+	scan_cache.cmap = winx_build_cluster_map(scan_cache.filelist);
+	if (!scan_cache.cmap)
+	{
+		winx_printf("error cannot build cluster map\n");
+		winx_release_scan_results(&scan_cache);
+		return (-1);
+	}
+	return 0;
+}
+
+/* scan */
+static int cmd_scan_func(int argc, char** argv)
+{
+	int i;
+	char letter = 0;
+	wchar_t* path = NULL;
+	int status;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "-o=", 3) == 0)
+			path = winx_swprintf(L"\\??\\%S", argv[i] + 3);
+		else
+			letter = argv[i][0];
+	}
+	if (!letter)
+	{
+		winx_free(path);
+		return 0;
+	}
+
+	/* always rescan */
+	winx_release_scan_results(&scan_cache);
+	status = naoh_scan_volume(letter);
+	if (status == 0 && path)
+		status = winx_save_scan_results(path, &scan_cache);
+	if (status == 0)
+		winx_printf("%I64u extents indexed\n", scan_cache.cmap->n_extents);
+	winx_free(path);
+	return status;
+}
+
+static struct winx_command cmd_scan =
+{
+	.next = 0,
+	.name = "scan",
+	.func = cmd_scan_func,
+	.help = "scan [-o=FILE] X:\nScan the volume and keep the results for queries.",
+};
+
+/* load */
+static int cmd_load_func(int argc, char** argv)
+{
+	wchar_t* path;
+	int status;
+
+	if (argc < 2)
+		return 0;
+	path = winx_swprintf(L"\\??\\%S", argv[1]);
+	if (!path)
+		return (-1);
+
+	winx_release_scan_results(&scan_cache);
+	status = winx_load_scan_results(path, &scan_cache);
+	winx_free(path);
+	if (status == 0 && !scan_cache.cmap)
+	{
+		scan_cache.cmap = winx_build_cluster_map(scan_cache.filelist);
+		if (!scan_cache.cmap)
+		{
+			winx_release_scan_results(&scan_cache);
+			status = -1;
+		}
+	}
+	if (status < 0)
+		winx_printf("error cannot load %s\n", argv[1]);
+	return status;
+}
+
+static struct winx_command cmd_load =
+{
+	.next = 0,
+	.name = "load",
+	.func = cmd_load_func,
+	.help = "load FILE\nLoad scan results saved by the scan command.",
+};
+
+/* whoowns */
+struct whoowns_range
+{
+	ULONGLONG next;
+	ULONGLONG end;
+	ULONG extents;
+	int aborted;
+};
+
+static int whoowns_callback(winx_cluster_extent* e, void* data)
+{
+	struct whoowns_range* r = data;
+	if (e->lcn > r->next)
+		winx_printf("%I64u-%I64u free or system\n", r->next, e->lcn - 1);
+	winx_printf("%I64u-%I64u VCN %I64u %S\n", e->lcn, e->lcn + e->length - 1, e->vcn, e->f->path);
+	if (e->lcn + e->length > r->next)
+		r->next = e->lcn + e->length;
+	/* polling the keyboard per extent would dominate the query */
+	if (++r->extents % 64 == 0 && winx_breakhit(0) == 0)
+		r->aborted = 1;
+	return r->aborted;
+}
+
+static int cmd_whoowns_func(int argc, char** argv)
+{
+	int i;
+	char* range = NULL;
+	char* dash;
+	ULONGLONG lcn, last;
+	struct whoowns_range r;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (argv[i][0] && argv[i][1] == ':')
+		{
+			if (naoh_scan_volume(argv[i][0]) < 0)
+				return (-1);
+		}
+		else
+			range = argv[i];
+	}
+	if (!range)
+		return 0;
+	if (!scan_cache.cmap)
+	{
+		winx_printf("error no scan results, use scan or load first\n");
+		return (-1);
+	}
+
+	lcn = last = _atoi64(range);
+	dash = strchr(range, '-');
+	if (dash)
+		last = _atoi64(dash + 1);
+	if (last < lcn)
+	{
+		winx_printf("error invalid range\n");
+		return (-1);
+	}
+
+	r.next = lcn;
+	r.end = last + 1;
+	r.extents = 0;
+	r.aborted = 0;
+	if (winx_query_cluster_map(scan_cache.cmap, lcn, last - lcn + 1, whoowns_callback, &r) == 0)
+		winx_printf("%I64u-%I64u free or system\n", lcn, last);
+	else if (!r.aborted && r.next < r.end)
+		winx_printf("%I64u-%I64u free or system\n", r.next, last);
+	return 0;
+}
+
+static struct winx_command cmd_whoowns =
+{
+	.next = 0,
+	.name = "whoowns",
+	.func = cmd_whoowns_func,
+	.help = "whoowns [X:] LCN[-LCN]\nShow files owning the clusters.",
+};
+
+/* bench */
+static void bench_print_phase(const char* name, winx_ftw_phase* p)
+{
+	ULONGLONG ms = p->time ? p->time : 1;
+	char* suffixes[] = { "B", "KB", "MB", "GB", "TB", "PB" };
+
+	winx_printf("  %-6s %8I64u ms %10I64u items %10I64u/s", name, p->time, p->items, p->items * 1000 / ms);
+	winx_printf(" %10s/s", winx_get_human_size(p->bytes_read * 1000 / ms, suffixes, 1024));
+	winx_printf(" %10I64u allocs", p->allocations);
+	winx_printf(" peak +%s\n", winx_get_human_size(p->peak_memory, suffixes, 1024));
+}
+
+static int cmd_bench_func(int argc, char** argv)
+{
+	int i;
+	wchar_t* path;
+	wchar_t* scratch = NULL;
+	ULONGLONG limit = 0;
+	winx_file_info* list;
+	winx_ftw_context ctx;
+	int status = 0;
+
+	for (i = 1; i < argc && status == 0; i++)
+	{
+		if (strncmp(argv[i], "-m=", 3) == 0)
+		{
+			limit = (ULONGLONG)_atoi64(argv[i] + 3) * 1024 * 1024;
+			continue;
+		}
+		if (strncmp(argv[i], "-t=", 3) == 0)
+		{
+			winx_free(scratch);
+			scratch = winx_swprintf(L"\\??\\%S", argv[i] + 3);
+			if (!scratch)
+				status = -1;
+			continue;
+		}
+		memset(&ctx, 0, sizeof(ctx));
+		ctx.bcb = ls_progress;
+		ctx.records = record_cache;
+		list = NULL;
+		if (argv[i][0] && argv[i][1] == ':' && argv[i][2] == 0)
+		{
+			if (limit)
+			{
+				/* scratch files on the volume measured would skew the results */
+				if (!scratch || winx_toupper((char)scratch[4]) == winx_toupper(argv[i][0]))
+				{
+					winx_printf("error -m needs -t=DIR on another volume than %s\n", argv[i]);
+					status = -1;
+					continue;
+				}
+				status = winx_scan_disk_bounded(argv[i][0], 0, limit, scratch, NULL, &ctx, NULL);
+			}
+			else
+				list = winx_scan_disk_ex(argv[i][0], WINX_FTW_DUMP_FILES, NULL, &ctx, NULL);
+		}
+		else
+		{
+			path = winx_swprintf(L"\\??\\%S", argv[i]);
+			if (!path)
+			{
+				status = -1;
+				continue;
+			}
+			list = winx_scan_image_ex(path, WINX_FTW_DUMP_FILES, NULL, &ctx, NULL);
+			winx_free(path);
+		}
+		winx_printf("%s: %I64u records, %I64u files in %I64u ms\n", argv[i],
+			ctx.progress.records, ctx.progress.files, ctx.progress.time);
+		bench_print_phase("scan", &ctx.phases[WINX_FTW_PHASE_SCAN]);
+		bench_print_phase("paths", &ctx.phases[WINX_FTW_PHASE_PATHS]);
+		if (ctx.progress.child_records || ctx.progress.child_hits)
+			winx_printf("child records: %I64u read, %I64u cached, up to %I64u per file\n",
+				ctx.progress.child_records, ctx.progress.child_hits, ctx.progress.max_child_records);
+		if (ctx.progress.record_hits || ctx.progress.record_misses)
+			winx_printf("record cache: %I64u hits, %I64u misses\n",
+				ctx.progress.record_hits, ctx.progress.record_misses);
+		winx_ftw_release(list);
+		if (ctx.terminated)
+			status = -2;
+	}
+	winx_free(scratch);
+	return status;
+}
+
+static struct winx_command cmd_bench =
+{
+	.next = 0,
+	.name = "bench",
+	.func = cmd_bench_func,
+	.help = "bench [-m=MB -t=DIR] X:|IMAGE ...\nMeasure scanner throughput on volumes or NTFS, FAT and exFAT images.\n"
+		"-m scans volumes within MB megabytes of memory, keeping temporary files in DIR on another volume.",
+};
+
+/* reparse */
+static const char* reparse_tag_name(unsigned long tag)
+{
+	switch (tag)
+	{
+	case IO_REPARSE_TAG_MOUNT_POINT:
+		return "junction";
+	case IO_REPARSE_TAG_SYMLINK:
+		return "symlink";
+	case IO_REPARSE_TAG_DEDUP:
+		return "dedup";
+	case IO_REPARSE_TAG_WOF:
+		return "wof";
+	}
+	return NULL;
+}
+
+static int cmd_reparse_func(int argc, char** argv)
+{
+	winx_file_info* list;
+	winx_file_info* f;
+	winx_ftw_context ctx = { 0 };
+	const char* name;
+	ULONGLONG n = 0;
+
+	if (argc < 2 || !argv[1][0] || argv[1][1] != ':')
+		return 0;
+
+	ctx.bcb = ls_progress;
+	list = winx_scan_disk_ex(argv[1][0], 0, NULL, &ctx, NULL);
+	for (f = list; f; f = f->next)
+	{
+		/* skip named streams, the reparse data stream among them */
+		if (f->reparse_tag && f->path && !wcschr(f->name, ':'))
+		{
+			name = reparse_tag_name(f->reparse_tag);
+			if (name)
+				winx_printf("%-8s %S", name, f->path);
+			else
+				winx_printf("%08x %S", f->reparse_tag, f->path);
+			if (f->reparse_target)
+				winx_printf(" -> %S", f->reparse_target);
+			winx_printf("\n");
+			n++;
+			if (winx_breakhit(0) == 0)
+				break;
+		}
+		if (f->next == list)
+			break;
+	}
+	winx_printf("%I64u reparse points found\n", n);
+	winx_ftw_release(list);
+	return ctx.terminated ? (-2) : 0;
+}
+
+static struct winx_command cmd_reparse =
+{
+	.next = 0,
+	.name = "reparse",
+	.func = cmd_reparse_func,
+	.help = "reparse X:\nList reparse points with their targets: junctions, symbolic links, dedup and WOF files.",
+};
+
+/* scandiff */
+struct scandiff_counts
+{
+	ULONGLONG added;
+	ULONGLONG deleted;
+	ULONGLONG changed;
+};
+
+/* loads a volume scan, a snapshot saved by the scan command or an NTFS, FAT or exFAT image */
+static int scandiff_load(const char* arg, winx_scan_results* r)
+{
+	winx_ftw_context ctx = { 0 };
+	wchar_t* path;
+
+	memset(r, 0, sizeof(winx_scan_results));
+	ctx.bcb = ls_progress;
+	if (arg[0] && arg[1] == ':' && arg[2] == 0)
+	{
+		r->volume_letter = winx_toupper(arg[0]);
+		r->filelist = winx_scan_disk_ex(arg[0], WINX_FTW_DUMP_FILES, NULL, &ctx, NULL);
+	}
+	else
+	{
+		path = winx_swprintf(L"\\??\\%S", arg);
+		if (!path)
+			return (-1);
+		if (winx_load_scan_results(path, r) < 0)
+			r->filelist = winx_scan_image_ex(path, WINX_FTW_DUMP_FILES, NULL, &ctx, NULL);
+		winx_free(path);
+	}
+	if (ctx.terminated || !r->filelist)
+	{
+		winx_printf("error cannot scan %s\n", arg);
+		winx_release_scan_results(r);
+		return ctx.terminated ? (-2) : (-1);
+	}
+	return 0;
+}
+
+static int scandiff_callback(winx_scan_change* c, void* data)
+{
+	struct scandiff_counts* counts = data;
+	winx_file_info* f = c->new_file ? c->new_file : c->old_file;
+
+	if (c->changes & WINX_CHANGE_ADDED)
+	{
+		winx_printf("+      %S\n", f->path ? f->path : f->name);
+		counts->added++;
+	}
+	else if (c->changes & WINX_CHANGE_DELETED)
+	{
+		winx_printf("-      %S\n", f->path ? f->path : f->name);
+		counts->deleted++;
+	}
+	else
+	{
+		winx_printf("~ %c%c%c%c %S",
+			(c->changes & WINX_CHANGE_RENAMED) ? 'N' : '.',
+			(c->changes & WINX_CHANGE_RESIZED) ? 'S' : '.',
+			(c->changes & WINX_CHANGE_RETIMED) ? 'T' : '.',
+			(c->changes & WINX_CHANGE_RELOCATED) ? 'L' : '.',
+			f->path ? f->path : f->name);
+		if (c->changes & WINX_CHANGE_RENAMED)
+			winx_printf(" (was %S)", c->old_file->path ? c->old_file->path : c->old_file->name);
+		winx_printf("\n");
+		counts->changed++;
+	}
+	return (winx_breakhit(0) == 0) ? 1 : 0;
+}
+
+static int cmd_scandiff_func(int argc, char** argv)
+{
+	winx_scan_results old_results, new_results;
+	struct scandiff_counts counts = { 0 };
+	int status;
+
+	if (argc < 3)
+		return 0;
+	status = scandiff_load(argv[1], &old_results);
+	if (status < 0)
+		return status;
+	status = scandiff_load(argv[2], &new_results);
+	if (status < 0)
+	{
+		winx_release_scan_results(&old_results);
+		return status;
+	}
+
+	status = winx_diff_scan_results(&old_results, &new_results, scandiff_callback, &counts);
+	if (status < 0)
+		winx_printf("error cannot compare %s and %s\n", argv[1], argv[2]);
+	else
+		winx_printf("%I64u added, %I64u deleted, %I64u changed\n",
+			counts.added, counts.deleted, counts.changed);
+	winx_release_scan_results(&old_results);
+	winx_release_scan_results(&new_results);
+	return status;
+}
+
+static struct winx_command cmd_scandiff =
+{
+	.next = 0,
+	.name = "scandiff",
+	.func = cmd_scandiff_func,
+	.help = "scandiff OLD NEW\nCompare two scans of an NTFS volume, each given as X:, a file saved by scan -o or an image.\n"
+		"Changed streams are marked with N (renamed or moved), S (resized), T (retimed), L (relocated).",
+};
+
+/* rescan */
+static int cmd_rescan_func(int argc, char** argv)
+{
+	winx_ftw_context ctx = { 0 };
+	wchar_t* path;
+	wchar_t* file = NULL;
+	int status;
+
+	if (argc < 2)
+		return 0;
+	path = winx_swprintf(L"\\??\\%S", argv[1]);
+	if (!path)
+		return (-1);
+	if (argc > 2)
+	{
+		file = winx_swprintf(L"\\??\\%S", argv[2]);
+		if (!file)
+		{
+			winx_free(path);
+			return (-1);
+		}
+		/* a missing file means the first scan */
+		winx_release_scan_results(&scan_cache);
+		if (winx_load_scan_results(file, &scan_cache) < 0)
+			memset(&scan_cache, 0, sizeof(scan_cache));
+	}
+	else if (!scan_cache.mft)
+		winx_release_scan_results(&scan_cache);
+
+	ctx.bcb = ls_progress;
+	ctx.records = record_cache;
+	status = winx_refresh_image_scan(path, WINX_FTW_DUMP_FILES, &scan_cache, &ctx, NULL);
+	if (status == 0)
+	{
+		scan_cache.volume_letter = 0;
+		scan_cache.cmap = winx_build_cluster_map(scan_cache.filelist);
+		if (!scan_cache.cmap)
+			status = -1;
+	}
+	if (status == 0 && file)
+		status = winx_save_scan_results(file, &scan_cache);
+	if (status == 0)
+		winx_printf("%I64u records, %I64u changed, %I64u ms\n", scan_cache.mft->n_records,
+			scan_cache.mft->changed_records, ctx.progress.time);
+	else
+	{
+		winx_printf("error cannot scan %s\n", argv[1]);
+		winx_release_scan_results(&scan_cache);
+	}
+	winx_free(path);
+	winx_free(file);
+	return status;
+}
+
+static struct winx_command cmd_rescan =
+{
+	.next = 0,
+	.name = "rescan",
+	.func = cmd_rescan_func,
+	.help = "rescan IMAGE [FILE]\nRefresh the scan of an NTFS image and keep the results for queries.\n"
+		"Only file records changed since the last refresh are parsed again; FILE keeps the results between sessions.",
+};
+
+/* dupes */
+static int dupes_callback(winx_dupes_group* g, void* data)
+{
+	char* suffixes[] = { "B", "KB", "MB", "GB", "TB", "PB" };
+	ULONGLONG i;
+
+	winx_printf("%I64u files of %I64u bytes,", g->n_files, g->size);
+	winx_printf(" %s wasted:\n", winx_get_human_size(g->wasted, suffixes, 1024));
+	for (i = 0; i < g->n_files; i++)
+		winx_printf("  %S\n", g->files[i]->path);
+	return (winx_breakhit(0) == 0) ? 1 : 0;
+}
+
+static int dupes_terminator(void* data)
+{
+	return (winx_breakhit(0) == 0) ? 1 : 0;
+}
+
+static int cmd_dupes_func(int argc, char** argv)
+{
+	char* suffixes[] = { "B", "KB", "MB", "GB", "TB", "PB" };
+	winx_ftw_context ctx = { 0 };
+	winx_dupes_stats stats;
+	winx_file_info* list;
+	wchar_t* path = NULL;
+	ULONGLONG min_size = 1;
+	int n_threads = 0;
+	int i, status;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "-t=", 3) == 0)
+			n_threads = atoi(argv[i] + 3);
+		else if (strncmp(argv[i], "-m=", 3) == 0)
+			min_size = (ULONGLONG)_atoi64(argv[i] + 3);
+		else if (!path)
+		{
+			if (argv[i][0] && argv[i][1] == ':' && argv[i][2] == 0)
+				path = winx_swprintf(L"\\??\\%c:", argv[i][0]);
+			else
+				path = winx_swprintf(L"\\??\\%S", argv[i]);
+			if (!path)
+				return (-1);
+		}
+	}
+	if (!path)
+		return 0;
+
+	ctx.bcb = ls_progress;
+	if (path[5] == ':' && path[6] == 0)
+		list = winx_scan_disk_ex((char)path[4], WINX_FTW_DUMP_FILES | WINX_FTW_SKIP_RESIDENT_STREAMS, NULL, &ctx, NULL);
+	else
+		list = winx_scan_image_ex(path, WINX_FTW_DUMP_FILES | WINX_FTW_SKIP_RESIDENT_STREAMS, NULL, &ctx, NULL);
+	if (ctx.terminated || !list || !ctx.bytes_per_cluster)
+	{
+		winx_printf("error cannot scan %S\n", path);
+		winx_ftw_release(list);
+		winx_free(path);
+		return ctx.terminated ? (-2) : (-1);
+	}
+
+	status = winx_find_duplicates(path, ctx.bytes_per_cluster, list, min_size, n_threads,
+		dupes_callback, dupes_terminator, NULL, &stats);
+	if (status == 0)
+	{
+		winx_printf("%I64u files compared, %I64u of the same size, %I64u read entirely\n",
+			stats.files, stats.same_size, stats.hashed_entirely);
+		winx_printf("%I64u groups, %I64u duplicates,", stats.groups, stats.duplicates);
+		winx_printf(" %s wasted,", winx_get_human_size(stats.wasted, suffixes, 1024));
+		winx_printf(" %s read\n", winx_get_human_size(stats.bytes_read, suffixes, 1024));
+	}
+	winx_ftw_release(list);
+	winx_free(path);
+	return status;
+}
+
+static struct winx_command cmd_dupes =
+{
+	.next = 0,
+	.name = "dupes",
+	.func = cmd_dupes_func,
+	.help = "dupes [-t=N] [-m=SIZE] X:|IMAGE\nFind duplicate files on the volume or disk image.\n"
+		"-t reads files by N threads, -m skips files smaller than SIZE bytes.",
+};
+
+/* du */
+static int cmd_du_func(int argc, char** argv)
+{
+	char* suffixes[] = { "B", "KB", "MB", "GB", "TB", "PB" };
+	winx_ftw_context ctx = { 0 };
+	winx_du_results r;
+	winx_file_info* list;
+	ULONGLONG top[256];
+	ULONGLONG max_depth = 1;
+	wchar_t* root = NULL;
+	wchar_t* path;
+	int n_top = WINX_DU_DEFAULT_TOP;
+	int i, n;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "-d=", 3) == 0)
+			max_depth = (ULONGLONG)_atoi64(argv[i] + 3);
+		else if (strncmp(argv[i], "-n=", 3) == 0)
+			n_top = atoi(argv[i] + 3);
+		else if (!root)
+		{
+			root = winx_swprintf(L"%S", argv[i]);
+			if (!root)
+				return (-1);
+		}
+	}
+	if (!root)
+		return 0;
+	if (n_top <= 0 || n_top > (int)(sizeof(top) / sizeof(top[0])))
+		n_top = (int)(sizeof(top) / sizeof(top[0]));
+
+	ctx.bcb = ls_progress;
+	if (root[0] && root[1] == ':' && root[2] == 0)
+		list = winx_scan_disk_ex((char)root[0], WINX_FTW_DUMP_FILES | WINX_FTW_SKIP_PATHS, NULL, &ctx, NULL);
+	else
+	{
+		path = winx_swprintf(L"\\??\\%ws", root);
+		list = path ? winx_scan_image_ex(path, WINX_FTW_DUMP_FILES | WINX_FTW_SKIP_PATHS, NULL, &ctx, NULL) : NULL;
+		winx_free(path);
+	}
+	if (ctx.terminated || !list || winx_du_aggregate(list, &r) < 0)
+	{
+		winx_printf("error cannot scan %S\n", root);
+		winx_ftw_release(list);
+		winx_free(root);
+		return ctx.terminated ? (-2) : (-1);
+	}
+
+	winx_printf("%I64u files in %I64u directories,", r.files, r.n_dirs);
+	winx_printf(" %s used\n", winx_get_human_size(r.clusters * ctx.bytes_per_cluster, suffixes, 1024));
+	winx_printf("%10s %10s %10s\n", "TOTAL", "DIRECT", "FILES");
+	n = winx_du_top(&r, max_depth, top, n_top);
+	for (i = 0; i < n; i++)
+	{
+		winx_printf("%10s", winx_get_human_size(r.dirs[top[i]].total_clusters * ctx.bytes_per_cluster, suffixes, 1024));
+		winx_printf(" %10s", winx_get_human_size(r.dirs[top[i]].direct_clusters * ctx.bytes_per_cluster, suffixes, 1024));
+		path = winx_du_path(&r, top[i], root);
+		winx_printf(" %10I64u %S\n", r.dirs[top[i]].total_files, path ? path : L"?");
+		winx_free(path);
+		if (winx_breakhit(0) == 0)
+			break;
+	}
+	winx_du_release(&r);
+	winx_ftw_release(list);
+	winx_free(root);
+	return 0;
+}
+
+static struct winx_command cmd_du =
+{
+	.next = 0,
+	.name = "du",
+	.func = cmd_du_func,
+	.help = "du [-d=DEPTH] [-n=TOP] X:|IMAGE\nShow the largest directories of the NTFS volume or image.\n"
+		"-d limits the depth of the directories shown, 1 by default, -n limits their number.",
+};
+
+/* runbench, freebench, regionbench */
+static void bench_options(int argc, char** argv, const char* size_option, ULONGLONG* size,
+	const char* count_option, ULONG* count, ULONG* seed)
+{
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], size_option, 3) == 0)
+			*size = (ULONGLONG)_atoi64(argv[i] + 3);
+		else if (strncmp(argv[i], count_option, 3) == 0)
+			*count = (ULONG)atoi(argv[i] + 3);
+		else if (strncmp(argv[i], "-s=", 3) == 0)
+			*seed = (ULONG)atoi(argv[i] + 3);
+	}
+}
+
+static int bench_report(winx_bench* b, const char* level_name, const char* items_name,
+	const char* reference_name, const char* new_name)
+{
+	ULONG i;
+
+	winx_printf("%10s %12s %12s %12s\n", level_name, items_name, reference_name, new_name);
+	for (i = 0; i < b->levels; i++)
+	{
+		winx_printf("%10I64u %12I64u ", b->level[i], b->items[i]);
+		if (b->reference_time[i] == WINX_BENCH_SKIPPED)
+			winx_printf("%12s", "skipped");
+		else
+			winx_printf("%9I64u ms", b->reference_time[i]);
+		winx_printf(" %9I64u ms\n", b->time[i]);
+	}
+	if (b->mismatches)
+	{
+		winx_printf("error %I64u mismatches\n", b->mismatches);
+		return (-1);
+	}
+	winx_printf("no mismatches\n");
+	return 0;
+}
+
+/* runbench */
+static int cmd_runbench_func(int argc, char** argv)
+{
+	winx_run_decoder_test t;
+	ULONGLONG n_arrays = 0;
+	ULONG passes = 0, seed = 1;
+
+	bench_options(argc, argv, "-n=", &n_arrays, "-p=", &passes, &seed);
+	if (winx_test_run_decoder((ULONG)n_arrays, passes, seed, &t) < 0)
+	{
+		winx_printf("error cannot allocate memory\n");
+		return (-1);
+	}
+	winx_printf("%I64u malformed arrays\n", t.corrupted);
+	return bench_report(&t.b, "arrays", "runs", "byte by byte", "batched");
+}
+
+static struct winx_command cmd_runbench =
+{
+	.next = 0,
+	.name = "runbench",
+	.func = cmd_runbench_func,
+	.help = "runbench [-n=ARRAYS] [-p=PASSES] [-s=SEED]\nCompare NTFS run list decoders on random mapping pairs.",
+};
+
+/* freebench */
+static int cmd_freebench_func(int argc, char** argv)
+{
+	winx_free_region_test t;
+	ULONGLONG clusters = 0;
+	ULONG passes = 0, seed = 1;
+
+	bench_options(argc, argv, "-c=", &clusters, "-p=", &passes, &seed);
+	if (winx_test_free_region_scan(clusters, passes, seed, &t) < 0)
+	{
+		winx_printf("error cannot allocate memory\n");
+		return (-1);
+	}
+	winx_printf("%I64u clusters per bitmap\n", t.clusters);
+	return bench_report(&t.b, "mean run", "regions", "bit by bit", "word");
+}
+
+static struct winx_command cmd_freebench =
+{
+	.next = 0,
+	.name = "freebench",
+	.func = cmd_freebench_func,
+	.help = "freebench [-c=CLUSTERS] [-p=PASSES] [-s=SEED]\nCompare free region extraction from volume bitmaps of varying fragmentation.",
+};
+
+/* regionbench */
+static int cmd_regionbench_func(int argc, char** argv)
+{
+	winx_region_set_test t;
+	ULONGLONG regions = 0;
+	ULONG ops = 0, seed = 1;
+	ULONG i;
+
+	bench_options(argc, argv, "-n=", &regions, "-o=", &ops, &seed);
+	if (winx_test_region_set(regions, ops, seed, &t) < 0)
+	{
+		winx_printf("error cannot allocate memory\n");
+		return (-1);
+	}
+	winx_printf("sets built in");
+	for (i = 0; i < t.b.levels; i++)
+		winx_printf(" %I64u ms", t.build_time[i]);
+	winx_printf("\n");
+	return bench_report(&t.b, "regions", "operations", "list", "tree");
+}
+
+static struct winx_command cmd_regionbench =
+{
+	.next = 0,
+	.name = "regionbench",
+	.func = cmd_regionbench_func,
+	.help = "regionbench [-n=REGIONS] [-o=OPS] [-s=SEED]\nCompare volume region sets with region lists on sets of up to 10M regions.",
+};
+
+/* ntfsbench */
+static int cmd_ntfsbench_func(int argc, char** argv)
+{
+	winx_ntfs_image_test t;
+	ULONGLONG files = 0;
+	ULONG mutations = WINX_NTFS_TEST_DEFAULT_MUTATIONS, seed = 1;
+	wchar_t* path;
+	ULONG i;
+	int status;
+
+	if (argc < 2 || argv[argc - 1][0] == '-')
+		return 0;
+	path = winx_swprintf(L"\\??\\%S", argv[argc - 1]);
+	if (!path)
+		return (-1);
+
+	bench_options(argc - 1, argv, "-n=", &files, "-f=", &mutations, &seed);
+	status = winx_test_ntfs_image(path, (ULONG)files, mutations, seed, &t);
+	winx_free(path);
+	if (status < 0)
+	{
+		winx_printf("error cannot generate images in %s\n", argv[argc - 1]);
+		return (-1);
+	}
+	for (i = 0; i < t.b.levels; i++)
+	{
+		winx_printf("%I64u files:\n", t.b.level[i]);
+		bench_print_phase("scan", &t.phases[i][WINX_FTW_PHASE_SCAN]);
+		bench_print_phase("paths", &t.phases[i][WINX_FTW_PHASE_PATHS]);
+	}
+	winx_printf("%u corrupted images scanned, %u of them rejected\n", t.mutations, t.failures);
+	return bench_report(&t.b, "files", "streams", "-", "scan");
+}
+
+static struct winx_command cmd_ntfsbench =
+{
+	.next = 0,
+	.name = "ntfsbench",
+	.func = cmd_ntfsbench_func,
+	.help = "ntfsbench [-n=FILES] [-f=IMAGES] [-s=SEED] IMAGE\nScan synthetic NTFS images of up to FILES files written to IMAGE, then corrupted ones.\n"
+		"-f sets the number of corrupted images, the image file gets deleted at the end.",
+};
+
+/* changed, older */
+static int time_query_callback(winx_time_entry* e, void* data)
+{
+	winx_printf("%S\n", e->f->path);
+	return (winx_breakhit(0) == 0) ? 1 : 0;
+}
+
+static int naoh_time_query(int argc, char** argv, int older)
+{
+	int i;
+	int key = WINX_TIME_MODIFIED;
+	char* age_string = NULL;
+	ULONGLONG age, now, n;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-c") == 0)
+			key = WINX_TIME_CREATED;
+		else if (argv[i][0] && argv[i][1] == ':' && argv[i][2] == 0)
+		{
+			if (naoh_scan_volume(argv[i][0]) < 0)
+				return (-1);
+		}
+		else
+			age_string = argv[i];
+	}
+	if (!age_string)
+		return 0;
+	if (!scan_cache.filelist)
+	{
+		winx_printf("error no scan results, use scan or load first\n");
+		return (-1);
+	}
+	if (!scan_cache.times)
+	{
+		scan_cache.times = winx_build_time_index(scan_cache.filelist);
+		if (!scan_cache.times)
+		{
+			winx_printf("error cannot build time index\n");
+			return (-1);
+		}
+	}
+
+	/* file times are in 100-nanosecond intervals */
+	age = winx_str2time(age_string) * 10000000;
+	now = winx_get_system_time_raw();
+	if (age > now)
+		age = now;
+	if (older)
+		n = winx_query_time_index(scan_cache.times, key, 0, now - age, time_query_callback, NULL);
+	else
+		n = winx_query_time_index(scan_cache.times, key, now - age, (ULONGLONG)-1, time_query_callback, NULL);
+	winx_printf("%I64u files\n", n);
+	return 0;
+}
+
+static int cmd_changed_func(int argc, char** argv)
+{
+	return naoh_time_query(argc, argv, 0);
+}
+
+static struct winx_command cmd_changed =
+{
+	.next = 0,
+	.name = "changed",
+	.func = cmd_changed_func,
+	.help = "changed [-c] [X:] AGE\nShow files modified within AGE, like 12h or 2d6h.\n"
+		"-c uses the creation time instead.",
+};
+
+static int cmd_older_func(int argc, char** argv)
+{
+	return naoh_time_query(argc, argv, 1);
+}
+
+static struct winx_command cmd_older =
+{
+	.next = 0,
+	.name = "older",
+	.func = cmd_older_func,
+	.help = "older [-c] [X:] AGE\nShow files not modified for AGE, like 30d or 1y.\n"
+		"-c uses the creation time instead.",
+};
+
+/* index */
+static int cmd_index_func(int argc, char** argv)
+{
+	int i;
+	ULONG block_size = 0;
+	wchar_t* path = NULL;
+	int status = 0;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "-b=", 3) == 0)
+			block_size = (ULONG)atoi(argv[i] + 3);
+		else if (strncmp(argv[i], "-o=", 3) == 0)
+		{
+			winx_free(path);
+			path = winx_swprintf(L"\\??\\%S", argv[i] + 3);
+		}
+		else if (argv[i][0] && argv[i][1] == ':' && argv[i][2] == 0)
+		{
+			if (naoh_scan_volume(argv[i][0]) < 0)
+			{
+				winx_free(path);
+				return (-1);
+			}
+		}
+		else
+		{
+			winx_printf("error invalid volume %s\n", argv[i]);
+			winx_printf("usage: index [-b=BLOCK] [-o=FILE] [X:]\n");
+			winx_free(path);
+			return (-1);
+		}
+	}
+	if (!scan_cache.filelist)
+	{
+		winx_printf("error no scan results, use scan or load first\n");
+		winx_free(path);
+		return (-1);
+	}
+
+	winx_release_name_index(scan_cache.names);
+	scan_cache.names = winx_build_name_index(scan_cache.filelist, block_size);
+	if (!scan_cache.names)
+	{
+		winx_printf("error cannot build name index\n");
+		status = -1;
+	}
+	else
+	{
+		winx_printf("%I64u names, %I64u postings\n", scan_cache.names->n_files, scan_cache.names->n_postings);
+		if (path)
+			status = winx_save_scan_results(path, &scan_cache);
+	}
+	winx_free(path);
+	return status;
+}
+
+static struct winx_command cmd_index =
+{
+	.next = 0,
+	.name = "index",
+	.func = cmd_index_func,
+	.help = "index [-b=BLOCK] [-o=FILE] [X:]\nIndex names of the scanned files and optionally save the results.\n"
+		"-b groups BLOCK files per index entry, larger blocks take less memory.",
+};
+
+/* find */
+static int find_callback(winx_file_info* f, void* data)
+{
+	winx_printf("%S\n", f->path ? f->path : f->name);
+	return (winx_breakhit(0) == 0) ? 1 : 0;
+}
+
+static int cmd_find_func(int argc, char** argv)
+{
+	int i;
+	int flags = 0;
+	char* pattern = NULL;
+	wchar_t* w;
+	ULONGLONG n, time;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-p") == 0)
+			flags |= WINX_NAME_PREFIX;
+		else if (strcmp(argv[i], "-s") == 0)
+			flags |= WINX_NAME_SUFFIX;
+		else if (argv[i][0] && argv[i][1] == ':' && argv[i][2] == 0)
+		{
+			if (naoh_scan_volume(argv[i][0]) < 0)
+				return (-1);
+		}
+		else
+			pattern = argv[i];
+	}
+	if (!pattern)
+		return 0;
+	if (!scan_cache.filelist)
+	{
+		winx_printf("error no scan results, use scan or load first\n");
+		return (-1);
+	}
+	if (!scan_cache.names)
+	{
+		scan_cache.names = winx_build_name_index(scan_cache.filelist, 0);
+		if (!scan_cache.names)
+		{
+			winx_printf("error cannot build name index\n");
+			return (-1);
+		}
+	}
+
+	w = winx_swprintf(L"%S", pattern);
+	if (!w)
+		return (-1);
+	time = winx_xtime();
+	n = winx_query_name_index(scan_cache.names, w, flags, find_callback, NULL);
+	winx_printf("%I64u files, %I64u ms\n", n, winx_xtime() - time);
+	winx_free(w);
+	return 0;
+}
+
+static struct winx_command cmd_find =
+{
+	.next = 0,
+	.name = "find",
+	.func = cmd_find_func,
+	.help = "find [-p] [-s] [X:] PATTERN\nFind scanned files by a part of the name, case insensitive.\n"
+		"-p matches the beginning of the name, -s matches the end, like -s .txt",
+};
+
+/* scanall */
+static int cmd_scanall_func(int argc, char** argv)
+{
+	winx_volume_information info;
+	winx_catalog c = { 0 };
+	winx_volume_scan* v;
+	wchar_t* path;
+	int n_threads = 0;
+	int i, status = 0, given = 0;
+	char vol;
+
+	for (i = 1; i < argc && status == 0; i++)
+	{
+		if (strncmp(argv[i], "-t=", 3) == 0)
+			n_threads = atoi(argv[i] + 3);
+		else if (argv[i][0] && argv[i][1] == ':' && argv[i][2] == 0)
+		{
+			status = winx_catalog_add_volume(&c, argv[i][0]);
+			given = 1;
+		}
+		else
+		{
+			path = winx_swprintf(L"\\??\\%S", argv[i]);
+			if (!path)
+				status = -1;
+			else
+				status = winx_catalog_add_image(&c, path);
+			winx_free(path);
+			given = 1;
+		}
+	}
+	/* all the volumes by default */
+	for (vol = 'A'; vol <= 'Z' && status == 0 && !given; vol++)
+	{
+		if (winx_get_volume_information(vol, &info) == 0)
+			status = winx_catalog_add_volume(&c, vol);
+	}
+	if (status < 0)
+	{
+		winx_release_catalog(&c);
+		return (-1);
+	}
+
+	status = winx_scan_catalog(&c, WINX_FTW_DUMP_FILES | WINX_FTW_SKIP_RESIDENT_STREAMS,
+		n_threads, record_cache, dupes_terminator, NULL);
+	for (i = 0; i < c.n_volumes; i++)
+	{
+		v = &c.volumes[i];
+		if (v->path)
+			winx_printf("%S: ", v->path + 4);
+		else
+			winx_printf("%c: ", v->volume_letter);
+		if (v->result == 0)
+			winx_printf("%I64u files, %I64u records in %I64u ms\n",
+				v->files, v->progress.records, v->progress.time);
+		else
+			winx_printf("%s\n", v->result == -2 ? "terminated" : "error cannot scan");
+	}
+	winx_printf("%I64u files on %d volumes in %I64u ms\n", c.files, c.n_volumes, c.time);
+	winx_release_catalog(&c);
+	return status;
+}
+
+static struct winx_command cmd_scanall =
+{
+	.next = 0,
+	.name = "scanall",
+	.func = cmd_scanall_func,
+	.help = "scanall [-t=N] [X: ...|IMAGE ...]\nScan a few volumes or disk images at once, all the volumes by default.\n"
+		"-t scans up to N volumes at a time.",
 };
 
 void
 naoh_cmd_init(void)
 {
+	record_cache = winx_create_mft_cache(0);
+	winx_command_register(&cmd_extract);
+	winx_command_register(&cmd_part);
+	winx_command_register(&cmd_scanall);
+	winx_command_register(&cmd_index);
+	winx_command_register(&cmd_find);
+	winx_command_register(&cmd_changed);
+	winx_command_register(&cmd_older);
+	winx_command_register(&cmd_runbench);
+	winx_command_register(&cmd_freebench);
+	winx_command_register(&cmd_regionbench);
+	winx_command_register(&cmd_ntfsbench);
+	winx_command_register(&cmd_du);
+	winx_command_register(&cmd_dupes);
+	winx_command_register(&cmd_rescan);
+	winx_command_register(&cmd_scandiff);
+	winx_command_register(&cmd_reparse);
+	winx_command_register(&cmd_bench);
+	winx_command_register(&cmd_whoowns);
+	winx_command_register(&cmd_load);
+	winx_command_register(&cmd_scan);
+	winx_command_register(&cmd_frag);
 	winx_command_register(&cmd_shutdown);
 	winx_command_register(&cmd_reboot);
 	winx_command_register(&cmd_exit);
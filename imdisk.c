@@ -67,21 +67,54 @@ ImdiskMount(PCWSTR FileName,
 	return Status;
 }
 
-int naoh_imdisk_mount(wchar_t* file_name, wchar_t drive_letter)
+int naoh_imdisk_mount(wchar_t* file_name, wchar_t drive_letter, int partition)
 {
 	WINX_FILE* file;
 	LARGE_INTEGER offset, length;
 	size_t name_len = wcslen(file_name);
 	MEDIA_TYPE type = FixedMedia;
-	file = winx_fopen(file_name, "r");
+	winx_partition* list;
+	winx_partition* p;
+	file = winx_open_image(file_name);
 	if (!file)
 	{
 		winx_printf("file open failed\n");
 		return -1;
 	}
+	if (file->vdisk && !winx_vdisk_is_fixed(file->vdisk))
+	{
+		/* ImDisk reads raw images only, dynamic disks are read by ls and scans */
+		winx_printf("dynamic virtual disks cannot be mounted\n");
+		winx_fclose(file);
+		return -1;
+	}
 	offset.QuadPart = 0;
 	length.QuadPart = winx_fsize(file);
 	winx_fclose(file);
+	if (partition)
+	{
+		/* mount a single partition of a disk image */
+		list = winx_get_partitions(file_name);
+		for (p = list; p; p = p->next)
+		{
+			if (p->number == partition)
+				break;
+			if (p->next == list)
+			{
+				p = NULL;
+				break;
+			}
+		}
+		if (!p)
+		{
+			winx_printf("partition %d not found\n", partition);
+			winx_release_partitions(list);
+			return -1;
+		}
+		offset.QuadPart = p->offset;
+		length.QuadPart = p->length;
+		winx_release_partitions(list);
+	}
 	if (name_len > 4 && _wcsnicmp(L".iso", &file_name[name_len - 4], 4) == 0)
 		type = RemovableMedia;
 	return ImdiskMount(file_name, offset, length, type, drive_letter);
@@ -10,6 +10,6 @@ void naoh_shell(void);
 int naoh_script(const char* filename);
 void naoh_cmd_init(void);
 
-int naoh_imdisk_mount(wchar_t* file_name, wchar_t drive_letter);;
+int naoh_imdisk_mount(wchar_t* file_name, wchar_t drive_letter, int partition);
 
 #endif